@@ -0,0 +1,87 @@
+#pragma once
+
+#include <limits>
+#include <algorithm>
+#include <glm/glm.hpp>
+
+// plain axis aligned box, no GL state attached
+struct AABB {
+	glm::vec3 small, big;
+
+	AABB();
+	AABB(const glm::vec3 &small, const glm::vec3 &big);
+
+	bool Empty() const;
+	bool InBox(const glm::vec3 &position) const;
+	bool Overlap(const AABB &box) const;
+	void Merge(const AABB &box);
+	void Merge(const glm::vec3 &position);
+	glm::vec3 Center() const;
+	glm::vec3 Extent() const;
+	float SurfaceArea() const;
+	AABB Transform(const glm::mat4 &transform) const;
+};
+
+AABB::AABB():
+	small(std::numeric_limits<float>::max()),
+	big(-std::numeric_limits<float>::max()) {
+}
+
+AABB::AABB(const glm::vec3 &small, const glm::vec3 &big):
+	small(small),
+	big(big) {
+}
+
+bool AABB::Empty() const {
+	return small.x > big.x || small.y > big.y || small.z > big.z;
+}
+
+bool AABB::InBox(const glm::vec3 &position) const {
+	return small.x <= position.x && position.x <= big.x &&
+	       small.y <= position.y && position.y <= big.y &&
+	       small.z <= position.z && position.z <= big.z;
+}
+
+bool AABB::Overlap(const AABB &box) const {
+	return small.x <= box.big.x && box.small.x <= big.x &&
+	       small.y <= box.big.y && box.small.y <= big.y &&
+	       small.z <= box.big.z && box.small.z <= big.z;
+}
+
+void AABB::Merge(const AABB &box) {
+	small = glm::min(small, box.small);
+	big = glm::max(big, box.big);
+}
+
+void AABB::Merge(const glm::vec3 &position) {
+	small = glm::min(small, position);
+	big = glm::max(big, position);
+}
+
+glm::vec3 AABB::Center() const {
+	return (small + big) * 0.5f;
+}
+
+glm::vec3 AABB::Extent() const {
+	return (big - small) * 0.5f;
+}
+
+float AABB::SurfaceArea() const {
+	if (Empty()) return 0;
+	glm::vec3 d = big - small;
+	return 2 * (d.x * d.y + d.y * d.z + d.z * d.x);
+}
+
+AABB AABB::Transform(const glm::mat4 &transform) const {
+	// Arvo's method: project the extent on the absolute rotation part
+	using namespace glm;
+	vec3 center = vec3(transform * vec4(Center(), 1));
+	vec3 extent = Extent();
+	vec3 new_extent;
+	for (int i = 0; i < 3; i++) {
+		new_extent[i] = std::fabs(transform[0][i]) * extent.x +
+		                std::fabs(transform[1][i]) * extent.y +
+		                std::fabs(transform[2][i]) * extent.z;
+	}
+	return AABB(center - new_extent, center + new_extent);
+}
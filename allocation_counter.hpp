@@ -0,0 +1,107 @@
+#pragma once
+
+#include <new>
+#include <atomic>
+#include <cstdlib>
+#include <cstdint>
+#include <cstddef>
+
+// Counts every operator new of the program, in all and on the calling
+// thread, so that a frame can check it allocated nothing. It replaces the
+// global operator new and delete, so only one translation unit of a
+// program may include it: main.cpp, through application.hpp in DEBUG
+// builds, and headless.cpp.
+class AllocationCounter {
+public:
+	AllocationCounter() = delete;
+
+	static uint64_t total();
+	static uint64_t thread();
+	static void Count();
+
+private:
+	static std::atomic<uint64_t> total_;
+	// plain, so that reading it in operator new cannot allocate
+	static thread_local uint64_t thread_;
+};
+
+std::atomic<uint64_t> AllocationCounter::total_(0);
+thread_local uint64_t AllocationCounter::thread_ = 0;
+
+uint64_t AllocationCounter::total() {
+	return total_.load(std::memory_order_relaxed);
+}
+
+uint64_t AllocationCounter::thread() {
+	return thread_;
+}
+
+void AllocationCounter::Count() {
+	total_.fetch_add(1, std::memory_order_relaxed);
+	thread_++;
+}
+
+void *operator new(size_t size) {
+	AllocationCounter::Count();
+	void *memory = std::malloc(size ? size : 1);
+	if (!memory) throw std::bad_alloc();
+	return memory;
+}
+
+void *operator new[](size_t size) {
+	return operator new(size);
+}
+
+void *operator new(size_t size, const std::nothrow_t &) noexcept {
+	AllocationCounter::Count();
+	return std::malloc(size ? size : 1);
+}
+
+void *operator new[](size_t size, const std::nothrow_t &) noexcept {
+	return operator new(size, std::nothrow);
+}
+
+void *operator new(size_t size, std::align_val_t alignment) {
+	AllocationCounter::Count();
+	// aligned_alloc wants a multiple of the alignment
+	size_t align = (size_t)alignment;
+	void *memory = std::aligned_alloc(align, ((size ? size : 1) + align - 1) / align * align);
+	if (!memory) throw std::bad_alloc();
+	return memory;
+}
+
+void *operator new[](size_t size, std::align_val_t alignment) {
+	return operator new(size, alignment);
+}
+
+void operator delete(void *memory) noexcept {
+	std::free(memory);
+}
+
+void operator delete[](void *memory) noexcept {
+	std::free(memory);
+}
+
+void operator delete(void *memory, size_t) noexcept {
+	std::free(memory);
+}
+
+void operator delete[](void *memory, size_t) noexcept {
+	std::free(memory);
+}
+
+void operator delete(void *memory, std::align_val_t) noexcept {
+	std::free(memory);
+}
+
+void operator delete[](void *memory, std::align_val_t) noexcept {
+	std::free(memory);
+}
+
+void operator delete(void *memory, size_t, std::align_val_t) noexcept {
+	std::free(memory);
+}
+
+void operator delete[](void *memory, size_t, std::align_val_t) noexcept {
+	std::free(memory);
+}
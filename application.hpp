@@ -7,6 +7,11 @@
 #endif
 
 #include <algorithm>
+#include <cmath>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
 
 #include <glad/glad.h>
 #include <GLFW/glfw3.h>
@@ -15,19 +20,68 @@
 
 #include "skybox.hpp"
 #include "world.hpp"
-#include "car.hpp"
+#include "instance_batch.hpp"
+#include "gpu_culler.hpp"
+#include "hiz_buffer.hpp"
+#include "simulation.hpp"
+#include "path_service.hpp"
+#include "asset_loader.hpp"
+#include "triple_buffer.hpp"
+#include "frame_arena.hpp"
+// shader.hpp defines DEBUG
+#ifdef DEBUG
+#include "allocation_counter.hpp"
+#endif
 
 // Please always use shared to run this program 
 
 class Application {
 private:
 	int width = 800, height = 600;
+	// the simulation advances in fixed steps, and a slow frame runs at most
+	// max_sim_steps of them before it lets the simulation fall behind
+	float sim_rate = 120.0f;
+	int max_sim_steps = 8;
 	GLFWwindow* window;
 
 	Skybox *skybox_ptr;
+	City *city_ptr;
+	// The simulation steps on its own thread and publishes a FrameState
+	// after every round of steps; the render loop draws the latest one a
+	// step behind, blending its two steps, with camera_ptr, a copy of the
+	// simulation's camera. Anything else that reads the simulation takes
+	// simulation_mutex.
+	Simulation *simulation_ptr;
+	std::thread simulation_thread;
+	std::atomic<bool> simulating;
+	std::mutex simulation_mutex;
+	TripleBuffer<FrameState> *frames_ptr;
 	Camera* camera_ptr;
+	// owned by the simulation
 	Car *car_ptr;
+	// what the window saw since the simulation last looked
+	std::mutex input_mutex;
+	Controls controls;
+	double turn_alpha, turn_beta;
 	World *world_ptr;
+	// transient data of the frame being drawn, reset at the start of each
+	FrameArena *frame_arena_ptr;
+	InstanceBatch *car_batch_ptr;
+	// only when compute shaders are available, see GLExtensions
+	GpuCuller *world_gpu_ptr, *car_gpu_ptr;
+	HiZBuffer *hiz_ptr;
+	uint32_t traffic_count = 256;
+	PathService *paths_ptr;
+	uint32_t crowd_count = 50000;
+	// pedestrians further from the camera are not drawn at all
+	float crowd_draw_distance = 3.0f;
+#ifdef DEBUG
+	// frames drawn after the first warm_up_frames should not allocate; they
+	// are reported at most once in as many
+	const uint32_t warm_up_frames = 120;
+	uint32_t quiet_frames = 0;
+	uint64_t frame_allocations = 0;
+#endif
 
 	const std::vector<std::string> skybox_urls = {
 		"resources/skybox/left.jpg", "resources/skybox/right.jpg",
@@ -35,6 +89,10 @@ private:
   		"resources/skybox/front.jpg", "resources/skybox/back.jpg"
 	};
 
+	const std::string pvs_path = "resources/models/world/world.pvs";
+	// and .sdf, .nav for the city
+	const std::string cache_prefix = "resources/models/world/world";
+
 	static bool keys_pressed[1024];
 
 	static void CursorPosCallback(GLFWwindow *window, double x, double y);
@@ -42,11 +100,16 @@ private:
 	static void ProcessInput(GLFWwindow *window);
 	static void FramebufferSizeCallback(GLFWwindow *window, int width, int height);
 	static void KeyCallback(GLFWwindow *window, int key, int scancode, int action, int mode);
+	// the window opens on the first Run, not when shared is constructed
+	void OpenWindow();
+	// the simulation thread
+	void Simulate();
 
 public:
 	static Application shared;
 	Application();
 	void Run();
+	void set_sim_rate(float rate, int max_steps);
 
 };
 
@@ -60,9 +123,10 @@ void Application::CursorPosCallback(GLFWwindow *window, double x, double y) {
 	double new_x = x / shared.width - 0.5;
 	double new_y = y / shared.height - 0.5;
 	if (entered) {
-		shared.camera_ptr->Rotate(mouse_x - new_x, mouse_y - new_y);
-		shared.car_ptr->Rotate(mouse_x - new_x);
-		shared.car_ptr->CameraAccompany();
+		// turned by the simulation thread before its next step
+		std::lock_guard<std::mutex> lock(shared.input_mutex);
+		shared.turn_alpha += mouse_x - new_x;
+		shared.turn_beta += mouse_y - new_y;
 	}
 	mouse_x = new_x;
 	mouse_y = new_y;
@@ -73,7 +137,6 @@ void Application::FramebufferSizeCallback(GLFWwindow *window, int width, int hei
 	glViewport(0, 0, width, height);
 	shared.width = width;
 	shared.height = height;
-	shared.camera_ptr->set_width_height_ratio(1.0f * width / height);
 }
 
 void Application::KeyCallback(GLFWwindow *window, int key, int scancode, int action, int mode) {
@@ -81,37 +144,98 @@ void Application::KeyCallback(GLFWwindow *window, int key, int scancode, int act
         glfwSetWindowShouldClose(window, GL_TRUE);
     else
     	keys_pressed[key] = action != GLFW_RELEASE;
+#ifdef DEBUG
+	// once per press, the benchmark takes a while
+	if (key == GLFW_KEY_R && action == GLFW_PRESS)
+		BenchmarkRaycasts(shared.city_ptr->scene(), shared.camera_ptr->position());
+	if (key == GLFW_KEY_N && action == GLFW_PRESS)
+		BenchmarkPaths(*shared.paths_ptr, shared.city_ptr->nav_mesh());
+#endif
 }
 
 void Application::ProcessInput(GLFWwindow *window) {
-	static float current_time, last_time;
-	current_time = glfwGetTime();
-	float delta_time = current_time - last_time;
-	last_time = current_time;
-	if (keys_pressed[GLFW_KEY_W]) 
-       	shared.car_ptr->Move(MoveDirectionType::FRONT, delta_time);
-    if (keys_pressed[GLFW_KEY_S])
-       	shared.car_ptr->Move(MoveDirectionType::BACK, delta_time);
-    if (keys_pressed[GLFW_KEY_A])
-       	shared.car_ptr->Move(MoveDirectionType::LEFT, delta_time);
-    if (keys_pressed[GLFW_KEY_D])
-       	shared.car_ptr->Move(MoveDirectionType::RIGHT, delta_time);
-
 #ifdef DEBUG
 	if (keys_pressed[GLFW_KEY_SPACE]) {
+		std::lock_guard<std::mutex> lock(shared.simulation_mutex);
 		shared.car_ptr->ShowPosition();
 	}
+	if (keys_pressed[GLFW_KEY_C]) {
+		std::lock_guard<std::mutex> lock(shared.simulation_mutex);
+		// the GPU path culls and draws on its own, past the draw lists, the
+		// occlusion queries and the instance batch, which then count nothing
+		if (shared.world_gpu_ptr) {
+			const GpuCullingStats &world = shared.world_gpu_ptr->stats(), &cars = shared.car_gpu_ptr->stats();
+			std::cout << "[gpu culling] " << world.meshes + cars.meshes << " meshes in "
+			          << world.dispatches + cars.dispatches << " dispatches, "
+			          << world.draw_calls + cars.draw_calls << " draw calls" << std::endl;
+		} else {
+			const CullingStats &stats = shared.world_ptr->culling_stats();
+			std::cout << "[culling] meshes drawn " << stats.drawn_meshes << " culled " << stats.culled_meshes
+			          << ", triangles drawn " << stats.drawn_triangles << " culled " << stats.culled_triangles << std::endl;
+			const OcclusionStats &occlusion = shared.world_ptr->occlusion_stats();
+			std::cout << "[occlusion] drawn " << occlusion.drawn_visible << " conditional " << occlusion.drawn_conditional
+			          << ", queries issued " << occlusion.queries_issued << " in flight " << occlusion.queries_in_flight << std::endl;
+			const DrawStats &draws = shared.world_ptr->draw_stats();
+			std::cout << "[draw list] items " << draws.items << " in " << draws.lists << " lists, recorded in " << draws.record_ms
+			          << " ms, draws " << draws.draws << ", program binds " << draws.program_binds << " texture binds " << draws.texture_binds << std::endl;
+			const InstanceStats &instances = shared.car_batch_ptr->stats();
+			std::cout << "[instancing] cars drawn " << instances.drawn_instances << " culled " << instances.culled_instances
+			          << " in " << instances.draw_calls << " draw calls" << std::endl;
+		}
+		const ArenaStats &arena = shared.frame_arena_ptr->stats();
+		std::cout << "[frame] " << shared.frame_allocations << " allocations, arena used " << arena.used << " bytes, peak "
+		          << arena.peak << ", " << arena.overflows << " overflows" << std::endl;
+		const BroadphaseStats &broadphase = shared.simulation_ptr->collision_world().stats();
+		std::cout << "[broadphase] box pairs " << broadphase.all_pairs << ", tested " << broadphase.candidate_pairs
+		          << ", contacts " << broadphase.contacts << " ground " << broadphase.supports << std::endl;
+		const TrafficStats &traffic = shared.simulation_ptr->traffic().stats();
+		std::cout << "[traffic] " << traffic.vehicles << " vehicles, " << traffic.braking << " braking "
+		          << traffic.turning << " turning, updated in " << traffic.update_ms << " ms" << std::endl;
+		const CrowdStats &crowd = shared.simulation_ptr->crowd().stats();
+		std::cout << "[crowd] " << crowd.agents << " pedestrians, " << crowd.overlapping << " overlapping, "
+		          << crowd.blocked << " blocked, " << crowd.errands << " on errands, updated in " << crowd.update_ms << " ms"
+		          << std::endl;
+		PathStats paths = shared.paths_ptr->stats();
+		const NavMesh &nav_mesh = shared.city_ptr->nav_mesh();
+		std::cout << "[paths] " << nav_mesh.size() << " nodes in " << nav_mesh.region_count() << " regions, "
+		          << paths.completed << " of " << paths.requests << " answered, " << paths.failed << " failed, "
+		          << paths.cache_hits << " corridor cache hits" << std::endl;
+		glm::vec3 gradient;
+		float clearance = shared.city_ptr->sdf().Distance(shared.camera_ptr->position(), gradient);
+		std::cout << "[sdf] camera clearance " << clearance << " away along (" << gradient.x << ", "
+		          << gradient.y << ", " << gradient.z << ")" << std::endl;
+	}
 #endif
 }
 
+void Application::set_sim_rate(float rate, int max_steps) {
+	sim_rate = rate;
+	max_sim_steps = max_steps;
+}
+
 Application::Application() {
-	using namespace glm;
+	window = nullptr;
+	simulating = false;
+	frames_ptr = nullptr;
+	frame_arena_ptr = nullptr;
+	turn_alpha = turn_beta = 0;
+	world_gpu_ptr = car_gpu_ptr = nullptr;
+	hiz_ptr = nullptr;
+}
+
+void Application::OpenWindow() {
 	glfwInit();
-	glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
-	glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
+	// ask for 4.5 for gpu driven culling, and settle for 3.3
+	glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
+	glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 5);
 	glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
 
 	window = glfwCreateWindow(width, height, "Anti-vice City", nullptr, nullptr);
+	if (!window) {
+		glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
+		glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
+		window = glfwCreateWindow(width, height, "Anti-vice City", nullptr, nullptr);
+	}
 	glfwMakeContextCurrent(window);
 	glfwSetCursorPosCallback(window, CursorPosCallback);
 	glfwSetFramebufferSizeCallback(window, FramebufferSizeCallback);
@@ -126,44 +250,171 @@ void Application::Run() {
 	using namespace glm;
 	using namespace std;
 
-	camera_ptr = new Camera(glm::vec3(0, 0, 3), 0, 0, 1.0f * width / height);
-
-	Shader *skybox_shader_ptr = new Shader("shaders/skybox.vs", "shaders/skybox.fs");
-	skybox_ptr = new Skybox(skybox_urls, *skybox_shader_ptr, *camera_ptr);
+	OpenWindow();
+	GLExtensions::shared.Load();
+
+	// all at once, the reads and decodes of each overlapping with the rest
+	AssetLoader loader;
+	Model *world_model_ptr, *car_model_ptr;
+	uint32_t skybox_texture;
+	Shader *skybox_shader_ptr, *world_shader_ptr, *proxy_shader_ptr, *car_instanced_shader_ptr;
+	Shader *cull_shader_ptr, *compact_shader_ptr, *hiz_shader_ptr, *gpu_draw_shader_ptr;
+	loader.Spawn(LoadModelAsync(loader, "resources/models/world", "world.obj", false), world_model_ptr);
+	loader.Spawn(LoadModelAsync(loader, "resources/models/car", "tank_tigher.obj", true), car_model_ptr);
+	loader.Spawn(LoadCubeMapAsync(loader, skybox_urls), skybox_texture);
+	loader.Spawn(LoadShaderAsync(loader, "shaders/skybox.vs", "shaders/skybox.fs"), skybox_shader_ptr);
+	loader.Spawn(LoadShaderAsync(loader, "shaders/world.vs", "shaders/world.fs"), world_shader_ptr);
+	loader.Spawn(LoadShaderAsync(loader, "shaders/proxy.vs", "shaders/proxy.fs"), proxy_shader_ptr);
+	loader.Spawn(LoadShaderAsync(loader, "shaders/car_instanced.vs", "shaders/car_instanced.fs"), car_instanced_shader_ptr);
+	if (GLExtensions::shared.compute) {
+		loader.Spawn(LoadShaderAsync(loader, "shaders/cull.cs"), cull_shader_ptr);
+		loader.Spawn(LoadShaderAsync(loader, "shaders/compact.cs"), compact_shader_ptr);
+		loader.Spawn(LoadShaderAsync(loader, "shaders/hiz.cs"), hiz_shader_ptr);
+		loader.Spawn(LoadShaderAsync(loader, "shaders/gpu_draw.vs", "shaders/gpu_draw.fs"), gpu_draw_shader_ptr);
+	}
+	loader.Finish();
+
+	city_ptr = new City(*world_model_ptr, cache_prefix);
+	simulation_ptr = new Simulation(*city_ptr, *car_model_ptr, vec3(8.31, 8.01, 4.88), traffic_count, crowd_count);
+	camera_ptr = new Camera(simulation_ptr->camera());
+	camera_ptr->set_width_height_ratio(1.0f * width / height);
+	car_ptr = &simulation_ptr->car();
+	paths_ptr = &simulation_ptr->paths();
+	FrameState first(simulation_ptr->camera());
+	simulation_ptr->Capture(first, crowd_draw_distance);
+	first.time = std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	first.step = 1.0 / sim_rate;
+	frames_ptr = new TripleBuffer<FrameState>(first);
+
+	skybox_ptr = new Skybox(skybox_texture, *skybox_shader_ptr, *camera_ptr);
+	world_ptr = new World(*world_model_ptr, *world_shader_ptr, *proxy_shader_ptr, *camera_ptr);
+	frame_arena_ptr = new FrameArena(1 << 20);
+
+	// baked once and cached next to the model
+	Pvs *pvs_ptr = new Pvs();
+	if (!pvs_ptr->Load(pvs_path, world_model_ptr->Key(world_ptr->model_matrix()))) {
+		pvs_ptr->Bake(*world_model_ptr, world_ptr->model_matrix(), Car::DrivableRegions(), Car::DrivableFrame());
+		pvs_ptr->Save(pvs_path);
+	}
+	world_ptr->set_pvs(pvs_ptr);
 
-	Model *world_model_ptr = new Model("resources/models/world", "world.obj", false);
-	Shader *world_shader_ptr = new Shader("shaders/world.vs", "shaders/world.fs");
-	world_ptr = new World(*world_model_ptr, *world_shader_ptr, *camera_ptr);
+	car_batch_ptr = new InstanceBatch(*car_model_ptr, *car_instanced_shader_ptr, *camera_ptr);
+	// no pedestrian model yet: a shrunk, tinted car stands in for one
+	const glm::mat4 pedestrian_proxy = glm::scale(glm::rotate(glm::mat4(1), (float)M_PI / 2, glm::vec3(1, 0, 0)), glm::vec3(0.00005f));
+	const glm::vec3 pedestrian_tint(0.9f, 0.6f, 0.3f);
 
-	Model *car_model_ptr = new Model("resources/models/car", "tank_tigher.obj", true);
-	Shader *car_shader_ptr = new Shader("shaders/car.vs", "shaders/car.fs");
-	car_ptr = new Car(*car_model_ptr, *car_shader_ptr, *camera_ptr, vec3(8.31, 8.01, 4.88));
-	// car_ptr = new Car(*car_model_ptr, *car_shader_ptr, *camera_ptr, vec3(8.31, 8.01, 3.18));
+	if (GLExtensions::shared.compute) {
+		world_gpu_ptr = new GpuCuller(*world_model_ptr, *cull_shader_ptr, *compact_shader_ptr, *gpu_draw_shader_ptr, *camera_ptr);
+		car_gpu_ptr = new GpuCuller(*car_model_ptr, *cull_shader_ptr, *compact_shader_ptr, *gpu_draw_shader_ptr, *camera_ptr, traffic_count + 1);
+		hiz_ptr = new HiZBuffer(*hiz_shader_ptr);
+	}
 
-	float last_time = 0.0f, current_time = 0.0f;
+	simulating = true;
+	simulation_thread = std::thread(&Application::Simulate, this);
 	while (!glfwWindowShouldClose(window)) {
 		ProcessInput(window);
+		{
+			std::lock_guard<std::mutex> lock(input_mutex);
+			controls = { keys_pressed[GLFW_KEY_W], keys_pressed[GLFW_KEY_S], keys_pressed[GLFW_KEY_A], keys_pressed[GLFW_KEY_D] };
+		}
+
+#ifdef DEBUG
+		uint64_t allocations = AllocationCounter::thread();
+#endif
+		frame_arena_ptr->Reset();
+		// the newest the simulation finished, or the last one again
+		frames_ptr->Acquire();
+		const FrameState &frame = frames_ptr->front();
+		// a step behind the simulation, so that the two steps of the frame
+		// span the moment drawn
+		double now = std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+		float blend = (float)std::min(std::max((now - frame.time) / frame.step, 0.0), 1.0);
+		*camera_ptr = frame.camera;
+		camera_ptr->set_position(glm::mix(frame.previous_camera_position, frame.camera.position(), blend));
+		camera_ptr->set_width_height_ratio(1.0f * width / height);
 
 		glClearColor(0, 0, 0, 0);
 		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
 		skybox_ptr->Draw();
-		world_ptr->Draw();
-		car_ptr->Draw();
-
-		current_time = glfwGetTime();
-		float delta_time = current_time - last_time;
-		last_time = current_time;
-		car_ptr->Update(delta_time);
-
-
-		if (car_model_ptr->Conflict(*world_model_ptr, car_ptr->model_matrix(), world_ptr->model_matrix())) {
-			car_ptr->Disable();
+		if (world_gpu_ptr) {
+			world_gpu_ptr->Clear();
+			world_gpu_ptr->Add(world_ptr->model_matrix());
+			world_gpu_ptr->Draw(hiz_ptr);
+			car_gpu_ptr->Clear();
+			car_gpu_ptr->Add(Blend(frame.previous_car, frame.car, blend));
+			for (uint32_t i = 0; i < frame.traffic.size(); i++)
+				car_gpu_ptr->Add(Blend(frame.previous_traffic[i], frame.traffic[i], blend));
+			for (uint32_t i = 0; i < frame.pedestrians.size(); i++)
+				car_gpu_ptr->Add(Blend(frame.previous_pedestrians[i], frame.pedestrians[i], blend) * pedestrian_proxy, pedestrian_tint);
+			car_gpu_ptr->Draw(hiz_ptr);
 		} else {
-			car_ptr->Enable();
+			world_ptr->Draw(*frame_arena_ptr);
+
+			// every vehicle goes through the batch, the player's car included
+			car_batch_ptr->Clear();
+			car_batch_ptr->Add(Blend(frame.previous_car, frame.car, blend));
+			for (uint32_t i = 0; i < frame.traffic.size(); i++)
+				car_batch_ptr->Add(Blend(frame.previous_traffic[i], frame.traffic[i], blend));
+			for (uint32_t i = 0; i < frame.pedestrians.size(); i++)
+				car_batch_ptr->Add(Blend(frame.previous_pedestrians[i], frame.pedestrians[i], blend) * pedestrian_proxy, pedestrian_tint);
+			car_batch_ptr->Draw();
+		}
+
+		// depth of this frame occludes the next one
+		if (hiz_ptr) hiz_ptr->Build(width, height);
+#ifdef DEBUG
+		// on this thread only, the simulation and the workers allocate as they like
+		frame_allocations = AllocationCounter::thread() - allocations;
+		if (++quiet_frames > warm_up_frames && frame_allocations > 0) {
+			std::cerr << "[allocations] a steady frame allocated " << frame_allocations << " times" << std::endl;
+			quiet_frames = 0;
 		}
+#endif
 
 		glfwSwapBuffers(window);
 		glfwPollEvents();
 	}
+	simulating = false;
+	simulation_thread.join();
+}
+
+void Application::Simulate() {
+	using namespace std::chrono;
+	const double step = 1.0 / sim_rate;
+	steady_clock::time_point last_time = steady_clock::now();
+	double accumulator = 0;
+	while (simulating) {
+		steady_clock::time_point current_time = steady_clock::now();
+		accumulator += duration<double>(current_time - last_time).count();
+		last_time = current_time;
+		Controls step_controls;
+		double alpha, beta;
+		{
+			std::lock_guard<std::mutex> lock(input_mutex);
+			step_controls = controls;
+			alpha = turn_alpha;
+			beta = turn_beta;
+			turn_alpha = turn_beta = 0;
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(simulation_mutex);
+			simulation_ptr->camera().Rotate(alpha, beta);
+			car_ptr->Rotate(alpha);
+			for (int i = 0; i < max_sim_steps && accumulator >= step; i++) {
+				simulation_ptr->Step(step, step_controls);
+				accumulator -= step;
+			}
+			// whatever the cap left over is dropped, not carried into the next round
+			accumulator = std::fmod(accumulator, step);
+			FrameState &frame = frames_ptr->back();
+			simulation_ptr->Capture(frame, crowd_draw_distance);
+			// the last step stands for the clock but what is left over
+			frame.time = duration<double>(current_time.time_since_epoch()).count() - accumulator;
+			frame.step = step;
+		}
+		frames_ptr->Publish();
+		std::this_thread::sleep_for(duration<double>(step - accumulator));
+	}
 }
\ No newline at end of file
@@ -0,0 +1,539 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <optional>
+#include <exception>
+#include <coroutine>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+#include <utility>
+#include <cstdint>
+
+#include "file_manager.hpp"
+#include "job_system.hpp"
+#ifndef HEADLESS
+#include "opengl_util.hpp"
+#include "shader.hpp"
+#include "model.hpp"
+#endif
+
+// What Task<T> and Task<void> share. The waiter is the coroutine awaiting
+// the task, or the promise itself once the task is done, so whichever of
+// the two comes second carries on.
+class TaskPromiseBase {
+public:
+	struct FinalAwaiter {
+		TaskPromiseBase *promise;
+
+		bool await_ready() const noexcept;
+		std::coroutine_handle<> await_suspend(std::coroutine_handle<>) noexcept;
+		void await_resume() const noexcept;
+	};
+
+	TaskPromiseBase();
+	std::suspend_never initial_suspend() const noexcept;
+	FinalAwaiter final_suspend() noexcept;
+	void unhandled_exception();
+
+	bool done() const;
+	// false when the task is done already and waiter should not suspend
+	bool Await(std::coroutine_handle<> waiter);
+	void Rethrow() const;
+
+private:
+	std::atomic<void *> waiter_;
+	std::exception_ptr exception_;
+};
+
+template <typename T>
+class TaskValue {
+public:
+	void return_value(T value);
+	T Take();
+
+private:
+	std::optional<T> value_;
+};
+
+template <>
+class TaskValue<void> {
+public:
+	void return_void();
+	void Take();
+};
+
+// A coroutine that starts at once and runs until its first suspension on
+// the caller's thread. Awaiting it resumes the awaiter with its result, on
+// whichever thread finished it. A task has to be done before it is
+// destroyed, so one that is not awaited goes to AssetLoader::Spawn.
+template <typename T>
+class Task {
+public:
+	struct promise_type: TaskPromiseBase, TaskValue<T> {
+		Task get_return_object();
+	};
+
+	struct Awaiter {
+		std::coroutine_handle<promise_type> handle;
+
+		bool await_ready() const;
+		bool await_suspend(std::coroutine_handle<> waiter);
+		T await_resume();
+	};
+
+	Task() = delete;
+	Task(const Task &) = delete;
+	Task(Task &&other);
+	Task &operator=(Task &&other);
+	~Task();
+
+	bool done() const;
+	Awaiter operator co_await() const;
+
+private:
+	explicit Task(std::coroutine_handle<promise_type> handle);
+
+	std::coroutine_handle<promise_type> handle_;
+};
+
+// every task awaited, so none is left running when one of them throws;
+// the first exception is then rethrown
+template <typename T> Task<std::vector<T> > WhenAll(std::vector<Task<T> > tasks);
+
+// Runs loading coroutines. A coroutine moves between threads by awaiting:
+// after Read and OnJobs it carries on as a job of the shared JobSystem,
+// after OnGlThread on the thread that made the loader, the next time that
+// thread calls Pump. Load code reads top to bottom, read, decode, upload,
+// and every load in flight overlaps with the others. Spawn, Pump and
+// Finish belong to the GL thread.
+class AssetLoader {
+public:
+	struct JobHop {
+		AssetLoader *loader;
+		std::coroutine_handle<> handle;
+
+		bool await_ready() const;
+		void await_suspend(std::coroutine_handle<> waiter);
+		void await_resume() const;
+		// the job
+		void operator()() const;
+	};
+
+	struct FileRead {
+		AssetLoader *loader;
+		std::string path;
+		std::coroutine_handle<> handle;
+		mutable std::string contents;
+		mutable std::exception_ptr error;
+
+		bool await_ready() const;
+		void await_suspend(std::coroutine_handle<> waiter);
+		std::string await_resume();
+		void operator()() const;
+	};
+
+	struct GlHop {
+		AssetLoader *loader;
+
+		// no hop when already on it
+		bool await_ready() const;
+		void await_suspend(std::coroutine_handle<> waiter) const;
+		void await_resume() const;
+	};
+
+	AssetLoader();
+	AssetLoader(const AssetLoader &) = delete;
+	// lets what is still loading finish, it refers to the loader
+	virtual ~AssetLoader();
+
+	JobHop OnJobs();
+	// the file's contents, read as a job
+	FileRead Read(const std::string &path);
+	GlHop OnGlThread();
+
+	// runs task to its end; what it throws comes out of Pump or Finish
+	void Spawn(Task<void> task);
+	// and stores what it returns in result, which has to outlive it
+	template <typename T> void Spawn(Task<T> task, T &result);
+	uint32_t pending() const;
+	// resumes what waits for the GL thread, once a frame say
+	void Pump();
+	// until everything spawned is done, helping with the jobs meanwhile
+	void Finish();
+
+private:
+	std::thread::id gl_thread_;
+	// the hops in flight; a job touches it after its coroutine moved on
+	JobCounter jobs_;
+	std::mutex mutex_;
+	std::condition_variable wake_;
+	std::vector<std::coroutine_handle<> > gl_queue_;
+	std::vector<Task<void> > roots_;
+	// spawned and not done, only touched on the GL thread
+	uint32_t running_;
+	std::exception_ptr error_;
+
+	Task<void> Root(Task<void> task);
+	template <typename T> static Task<void> Store(Task<T> task, T &result);
+	void Resume();
+	void Settle();
+};
+
+#ifndef HEADLESS
+// Coroutine counterparts of the blocking loaders, to be spawned on an
+// AssetLoader. Arguments are taken by value: a coroutine outlives the
+// temporaries of its caller.
+Task<uint32_t> LoadTextureAsync(AssetLoader &loader, std::string url);
+Task<uint32_t> LoadCubeMapAsync(AssetLoader &loader, std::vector<std::string> urls);
+Task<Shader *> LoadShaderAsync(AssetLoader &loader, std::string vs_path, std::string fs_path);
+Task<Shader *> LoadShaderAsync(AssetLoader &loader, std::string cs_path);
+Task<Model *> LoadModelAsync(AssetLoader &loader, std::string path, std::string file, bool single_bounding_box);
+#endif
+
+bool TaskPromiseBase::FinalAwaiter::await_ready() const noexcept {
+	return false;
+}
+
+std::coroutine_handle<> TaskPromiseBase::FinalAwaiter::await_suspend(std::coroutine_handle<>) noexcept {
+	// the frame may be destroyed as soon as this is seen, so it comes last
+	void *waiter = promise->waiter_.exchange(promise, std::memory_order_acq_rel);
+	return waiter ? std::coroutine_handle<>::from_address(waiter) : std::noop_coroutine();
+}
+
+void TaskPromiseBase::FinalAwaiter::await_resume() const noexcept {}
+
+TaskPromiseBase::TaskPromiseBase(): waiter_(nullptr) {}
+
+std::suspend_never TaskPromiseBase::initial_suspend() const noexcept {
+	return {};
+}
+
+TaskPromiseBase::FinalAwaiter TaskPromiseBase::final_suspend() noexcept {
+	return { this };
+}
+
+void TaskPromiseBase::unhandled_exception() {
+	exception_ = std::current_exception();
+}
+
+bool TaskPromiseBase::done() const {
+	return waiter_.load(std::memory_order_acquire) == this;
+}
+
+bool TaskPromiseBase::Await(std::coroutine_handle<> waiter) {
+	void *expected = nullptr;
+	return waiter_.compare_exchange_strong(expected, waiter.address(), std::memory_order_acq_rel, std::memory_order_acquire);
+}
+
+void TaskPromiseBase::Rethrow() const {
+	if (exception_) std::rethrow_exception(exception_);
+}
+
+template <typename T>
+void TaskValue<T>::return_value(T value) {
+	value_ = std::move(value);
+}
+
+template <typename T>
+T TaskValue<T>::Take() {
+	return std::move(*value_);
+}
+
+void TaskValue<void>::return_void() {}
+
+void TaskValue<void>::Take() {}
+
+template <typename T>
+Task<T> Task<T>::promise_type::get_return_object() {
+	return Task(std::coroutine_handle<promise_type>::from_promise(*this));
+}
+
+template <typename T>
+bool Task<T>::Awaiter::await_ready() const {
+	return handle.promise().done();
+}
+
+template <typename T>
+bool Task<T>::Awaiter::await_suspend(std::coroutine_handle<> waiter) {
+	return handle.promise().Await(waiter);
+}
+
+template <typename T>
+T Task<T>::Awaiter::await_resume() {
+	handle.promise().Rethrow();
+	return handle.promise().Take();
+}
+
+template <typename T>
+Task<T>::Task(std::coroutine_handle<promise_type> handle): handle_(handle) {}
+
+template <typename T>
+Task<T>::Task(Task &&other): handle_(other.handle_) {
+	other.handle_ = nullptr;
+}
+
+template <typename T>
+Task<T> &Task<T>::operator=(Task &&other) {
+	std::swap(handle_, other.handle_);
+	return *this;
+}
+
+template <typename T>
+Task<T>::~Task() {
+	if (handle_) handle_.destroy();
+}
+
+template <typename T>
+bool Task<T>::done() const {
+	return handle_.promise().done();
+}
+
+template <typename T>
+typename Task<T>::Awaiter Task<T>::operator co_await() const {
+	return { handle_ };
+}
+
+template <typename T>
+Task<std::vector<T> > WhenAll(std::vector<Task<T> > tasks) {
+	std::vector<T> results;
+	std::exception_ptr error;
+	for (Task<T> &task : tasks) {
+		try {
+			results.push_back(co_await task);
+		} catch (...) {
+			if (!error) error = std::current_exception();
+		}
+	}
+	if (error) std::rethrow_exception(error);
+	co_return results;
+}
+
+bool AssetLoader::JobHop::await_ready() const {
+	return false;
+}
+
+void AssetLoader::JobHop::await_suspend(std::coroutine_handle<> waiter) {
+	handle = waiter;
+	// this may be resumed, and the hop gone, before Run returns
+	JobSystem::Shared().Run(*this, loader->jobs_);
+}
+
+void AssetLoader::JobHop::await_resume() const {}
+
+void AssetLoader::JobHop::operator()() const {
+	std::coroutine_handle<> waiter = handle;
+	waiter.resume();
+}
+
+bool AssetLoader::FileRead::await_ready() const {
+	return false;
+}
+
+void AssetLoader::FileRead::await_suspend(std::coroutine_handle<> waiter) {
+	handle = waiter;
+	JobSystem::Shared().Run(*this, loader->jobs_);
+}
+
+std::string AssetLoader::FileRead::await_resume() {
+	if (error) std::rethrow_exception(error);
+	return std::move(contents);
+}
+
+void AssetLoader::FileRead::operator()() const {
+	try {
+		contents = FileManager::shared.FileContentAt(path);
+	} catch (...) {
+		error = std::current_exception();
+	}
+	std::coroutine_handle<> waiter = handle;
+	waiter.resume();
+}
+
+bool AssetLoader::GlHop::await_ready() const {
+	return std::this_thread::get_id() == loader->gl_thread_;
+}
+
+void AssetLoader::GlHop::await_suspend(std::coroutine_handle<> waiter) const {
+	// the GL thread may resume the waiter, and free this hop, once it is queued
+	AssetLoader *target = loader;
+	{
+		std::lock_guard<std::mutex> lock(target->mutex_);
+		target->gl_queue_.push_back(waiter);
+	}
+	target->wake_.notify_one();
+}
+
+void AssetLoader::GlHop::await_resume() const {}
+
+AssetLoader::AssetLoader():
+	gl_thread_(std::this_thread::get_id()),
+	running_(0) {}
+
+AssetLoader::~AssetLoader() {
+	Settle();
+	JobSystem::Shared().Wait(jobs_);
+}
+
+AssetLoader::JobHop AssetLoader::OnJobs() {
+	return { this, nullptr };
+}
+
+AssetLoader::FileRead AssetLoader::Read(const std::string &path) {
+	return { this, path, nullptr, std::string(), nullptr };
+}
+
+AssetLoader::GlHop AssetLoader::OnGlThread() {
+	return { this };
+}
+
+uint32_t AssetLoader::pending() const {
+	return running_;
+}
+
+void AssetLoader::Spawn(Task<void> task) {
+	running_++;
+	roots_.push_back(Root(std::move(task)));
+}
+
+template <typename T>
+void AssetLoader::Spawn(Task<T> task, T &result) {
+	Spawn(Store(std::move(task), result));
+}
+
+Task<void> AssetLoader::Root(Task<void> task) {
+	std::exception_ptr error;
+	try {
+		co_await task;
+	} catch (...) {
+		error = std::current_exception();
+	}
+	// ends on the GL thread, so a root is done when Resume gets past it
+	co_await OnGlThread();
+	if (error && !error_) error_ = error;
+	running_--;
+}
+
+template <typename T>
+Task<void> AssetLoader::Store(Task<T> task, T &result) {
+	result = co_await task;
+}
+
+void AssetLoader::Resume() {
+	std::vector<std::coroutine_handle<> > ready;
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		ready.swap(gl_queue_);
+	}
+	for (std::coroutine_handle<> handle : ready)
+		handle.resume();
+	roots_.erase(std::remove_if(roots_.begin(), roots_.end(), [](const Task<void> &root) { return root.done(); }),
+	             roots_.end());
+}
+
+void AssetLoader::Settle() {
+	while (running_ > 0) {
+		Resume();
+		// this thread is a worker too
+		if (running_ > 0 && !JobSystem::Shared().RunOne()) {
+			std::unique_lock<std::mutex> lock(mutex_);
+			wake_.wait_for(lock, std::chrono::milliseconds(1), [this]() { return !gl_queue_.empty(); });
+		}
+	}
+}
+
+void AssetLoader::Pump() {
+	Resume();
+	if (!error_) return;
+	std::exception_ptr error = error_;
+	error_ = nullptr;
+	std::rethrow_exception(error);
+}
+
+void AssetLoader::Finish() {
+	Settle();
+	Pump();
+}
+
+#ifndef HEADLESS
+Task<uint32_t> LoadTextureAsync(AssetLoader &loader, std::string url) {
+	url = TextureUrl(url);
+	// the cache is the GL thread's
+	co_await loader.OnGlThread();
+	if (TextureCache().count(url)) co_return TextureCache()[url];
+	std::string file = co_await loader.Read(url);
+	int w, h, comp;
+	unsigned char *image = stbi_load_from_memory((const unsigned char *)file.data(), file.size(), &w, &h, &comp, 0);
+	if (image == nullptr) throw LoadPictureError(url);
+	co_await loader.OnGlThread();
+	co_return UploadTexture(url, image, w, h, comp);
+}
+
+Task<CubeFace> DecodeCubeFace(AssetLoader &loader, std::string url, bool flipped) {
+	std::string file = co_await loader.Read(url);
+	CubeFace face;
+	face.data = stbi_load_from_memory((const unsigned char *)file.data(), file.size(), &face.width, &face.height, &face.channels, 0);
+	if (face.data == nullptr) throw LoadPictureError(url);
+	if (flipped) FilpImageDataDiagonally(face.data, face.width, face.height, face.channels);
+	co_return face;
+}
+
+Task<uint32_t> LoadCubeMapAsync(AssetLoader &loader, std::vector<std::string> urls) {
+	std::vector<Task<CubeFace> > decoding;
+	for (uint32_t i = 0; i < urls.size(); i++)
+		decoding.push_back(DecodeCubeFace(loader, urls[i], CubeFaceFlipped(i)));
+	// not WhenAll, the faces that did decode are freed on failure
+	std::vector<CubeFace> faces;
+	std::exception_ptr error;
+	for (Task<CubeFace> &face : decoding) {
+		try {
+			faces.push_back(co_await face);
+		} catch (...) {
+			if (!error) error = std::current_exception();
+		}
+	}
+	if (error) {
+		for (const CubeFace &face : faces)
+			stbi_image_free(face.data);
+		std::rethrow_exception(error);
+	}
+	co_await loader.OnGlThread();
+	co_return UploadCubeMap(faces);
+}
+
+Task<Shader *> LoadShaderAsync(AssetLoader &loader, std::string vs_path, std::string fs_path) {
+	ShaderSource vs = { vs_path, co_await loader.Read(vs_path) };
+	ShaderSource fs = { fs_path, co_await loader.Read(fs_path) };
+	co_await loader.OnGlThread();
+	co_return new Shader(vs, fs);
+}
+
+Task<Shader *> LoadShaderAsync(AssetLoader &loader, std::string cs_path) {
+	ShaderSource cs = { cs_path, co_await loader.Read(cs_path) };
+	co_await loader.OnGlThread();
+	co_return new Shader(cs);
+}
+
+Task<Model *> LoadModelAsync(AssetLoader &loader, std::string path, std::string file, bool single_bounding_box) {
+	// the import and the hulls as a job, the textures decoded alongside
+	co_await loader.OnJobs();
+	Model *model = new Model(path, file, single_bounding_box, false);
+	std::vector<Task<uint32_t> > textures;
+	for (const std::string &url : model->texture_urls())
+		textures.push_back(LoadTextureAsync(loader, url));
+	try {
+		co_await WhenAll(std::move(textures));
+	} catch (...) {
+		delete model;
+		throw;
+	}
+	// the textures are in the cache by now, Upload finds them there
+	co_await loader.OnGlThread();
+	model->Upload();
+	co_return model;
+}
+#endif
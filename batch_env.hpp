@@ -0,0 +1,200 @@
+#pragma once
+
+#include <vector>
+#include <chrono>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+#include <glm/glm.hpp>
+
+#include "model.hpp"
+#include "camera.hpp"
+#include "car.hpp"
+#include "collision_world.hpp"
+#include "triangle_bvh.hpp"
+#include "simulation.hpp"
+#include "job_system.hpp"
+
+struct BatchStats {
+	uint64_t batches, steps;
+	double step_ms;
+};
+
+// Many independent drives through one city, for tuning and training. The
+// city's ground, triangles and collision are shared read only; each
+// environment owns just its car, camera and car body. Step advances every
+// environment by one step in lockstep, in chunks run as jobs, reading
+// kActionSize floats per environment and writing kObservationSize. Traffic
+// and the crowd are left out.
+class BatchEnv {
+public:
+	// throttle, strafe and steer, each in [-1, 1]
+	static const uint32_t kActionSize = 3;
+	// distances to the scene around the car, evenly spread from its front
+	static const uint32_t kSensors = 8;
+	// position, cosine and sine of the heading, 1 when blocked this step,
+	// then the sensors as fractions of kSensorRange
+	static const uint32_t kObservationSize = 6 + kSensors;
+	static constexpr float kSensorRange = 2.0f;
+	// radians per second at full steer
+	static constexpr float kTurnRate = 2.0f;
+
+	BatchEnv() = delete;
+	BatchEnv(const City &city, const Model &car_model, uint32_t count, float step = 1.0f / 120);
+	virtual ~BatchEnv();
+
+	uint32_t size() const;
+	void Reset(uint32_t env, const glm::vec3 &position, double alpha);
+	// size() * kActionSize actions in, size() * kObservationSize observations out
+	void Step(const float *actions, float *observations);
+	// of every environment without stepping, e.g. right after Reset
+	void Observe(float *observations) const;
+	// one step of one car, as every environment takes it and as the network
+	// server and its predicting clients do; true when the car ended blocked
+	static bool Drive(Car &car, CollisionWorld &collision, uint32_t body, const float *action, float time);
+	const Car &car(uint32_t env) const;
+	BatchStats stats() const;
+
+private:
+	static const uint32_t kChunk = 64;
+
+	struct Env {
+		Camera *camera;
+		Car *car;
+		CollisionWorld *collision;
+		uint32_t body;
+		bool blocked;
+	};
+
+	const City &city_;
+	float step_;
+	std::vector<Env> envs_;
+	uint64_t batches_;
+	double step_seconds_;
+
+	void StepEnv(uint32_t env, const float *action);
+	void ObserveEnv(uint32_t env, float *observation) const;
+};
+
+constexpr float BatchEnv::kSensorRange;
+constexpr float BatchEnv::kTurnRate;
+
+BatchEnv::BatchEnv(const City &city, const Model &car_model, uint32_t count, float step):
+	city_(city),
+	step_(step),
+	batches_(0),
+	step_seconds_(0) {
+	for (uint32_t i = 0; i < count; i++) {
+		Env env;
+		env.camera = new Camera(glm::vec3(0, 0, 3), 0, 0, 1);
+		env.car = new Car(car_model, *env.camera, glm::vec3(0, 0, 0));
+		env.car->set_ground(&city_.ground());
+		env.car->set_scene(&city_.scene());
+		env.collision = new CollisionWorld(city_.collision());
+		env.body = env.collision->AddBody(car_model, env.car->model_matrix());
+		env.car->set_collision(env.collision, env.body);
+		env.blocked = false;
+		envs_.push_back(env);
+	}
+}
+
+BatchEnv::~BatchEnv() {
+	for (Env &env : envs_) {
+		delete env.car;
+		delete env.collision;
+		delete env.camera;
+	}
+}
+
+uint32_t BatchEnv::size() const {
+	return envs_.size();
+}
+
+const Car &BatchEnv::car(uint32_t env) const {
+	return *envs_[env].car;
+}
+
+BatchStats BatchEnv::stats() const {
+	BatchStats stats = { batches_, batches_ * envs_.size(), batches_ ? step_seconds_ * 1000 / batches_ : 0 };
+	return stats;
+}
+
+void BatchEnv::Reset(uint32_t env, const glm::vec3 &position, double alpha) {
+	Env &e = envs_[env];
+	e.car->Place(position, alpha);
+	e.collision->MoveBody(e.body, e.car->model_matrix());
+	e.blocked = false;
+}
+
+void BatchEnv::Step(const float *actions, float *observations) {
+	auto start = std::chrono::steady_clock::now();
+	JobSystem::Shared().ParallelFor(envs_.size(), kChunk, [this, actions, observations](uint32_t begin, uint32_t end) {
+		for (uint32_t i = begin; i < end; i++) {
+			StepEnv(i, actions + i * kActionSize);
+			ObserveEnv(i, observations + i * kObservationSize);
+		}
+	});
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+	step_seconds_ += elapsed.count();
+	batches_++;
+}
+
+void BatchEnv::Observe(float *observations) const {
+	for (uint32_t i = 0; i < envs_.size(); i++)
+		ObserveEnv(i, observations + i * kObservationSize);
+}
+
+void BatchEnv::StepEnv(uint32_t env, const float *action) {
+	Env &e = envs_[env];
+	e.blocked = Drive(*e.car, *e.collision, e.body, action, step_);
+}
+
+bool BatchEnv::Drive(Car &car, CollisionWorld &collision, uint32_t body, const float *action, float time) {
+	float throttle = glm::clamp(action[0], -1.0f, 1.0f);
+	float strafe = glm::clamp(action[1], -1.0f, 1.0f);
+	float steer = glm::clamp(action[2], -1.0f, 1.0f);
+
+	car.SaveState();
+	if (steer != 0)
+		car.Rotate(steer * kTurnRate * time);
+	if (throttle > 0)
+		car.Move(MoveDirectionType::FRONT, throttle * time);
+	else if (throttle < 0)
+		car.Move(MoveDirectionType::BACK, -throttle * time);
+	if (strafe > 0)
+		car.Move(MoveDirectionType::RIGHT, strafe * time);
+	else if (strafe < 0)
+		car.Move(MoveDirectionType::LEFT, -strafe * time);
+	car.Update(time);
+
+	collision.MoveBody(body, car.model_matrix());
+	bool blocked = collision.Conflict(body);
+	if (blocked)
+		car.Depenetrate(collision.contacts());
+	return blocked;
+}
+
+void BatchEnv::ObserveEnv(uint32_t env, float *observation) const {
+	const Env &e = envs_[env];
+	const glm::vec3 &position = e.car->position();
+	double alpha = e.car->alpha();
+	observation[0] = position.x;
+	observation[1] = position.y;
+	observation[2] = position.z;
+	observation[3] = cos(alpha);
+	observation[4] = sin(alpha);
+	observation[5] = e.blocked ? 1 : 0;
+
+	// all at once, a little above the ground so that the road is not in the way
+	glm::vec3 origins[kSensors], directions[kSensors];
+	for (uint32_t i = 0; i < kSensors; i++) {
+		double angle = alpha + 2 * M_PI * i / kSensors;
+		origins[i] = position + glm::vec3(0, 0, 0.02f);
+		directions[i] = glm::vec3(cos(angle), sin(angle), 0);
+	}
+	RayHit hits[kSensors];
+	city_.scene().RaycastPacket(origins, directions, kSensors, kSensorRange, hits);
+	for (uint32_t i = 0; i < kSensors; i++)
+		observation[6 + i] = hits[i].hit ? hits[i].t / kSensorRange : 1;
+}
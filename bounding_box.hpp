@@ -3,13 +3,17 @@
 #include <string>
 #include <vector>
 #include <algorithm>
+#include <cstdint>
 
 #ifdef DEBUG
 #include <iostream>
 #endif
 
+#ifndef HEADLESS
 #include "opengl_util.hpp"
+#endif
 #include "mesh.hpp"
+#include "aabb.hpp"
 
 // AABB BoundingBox
 class BoundingBox
@@ -18,8 +22,7 @@ private:
 	glm::vec3 big, small;
 	uint32_t vao, vbo, ebo;
 	glm::vec3 vertices[8];
-	const GLushort indices[24] = { 0, 1, 0, 2, 0, 4, 1, 3, 1, 5, 2, 3, 2, 6, 3, 7, 4, 5, 4, 6, 5, 7, 6 ,7 };
-	float GetVolumn() const;
+	const uint16_t indices[24] = { 0, 1, 0, 2, 0, 4, 1, 3, 1, 5, 2, 3, 2, 6, 3, 7, 4, 5, 4, 6, 5, 7, 6 ,7 };
 
 public:
 	BoundingBox(const Mesh &mesh);
@@ -27,41 +30,14 @@ public:
 	virtual ~BoundingBox();
 
 	bool InBox(glm::vec3 position) const;
+	AABB aabb() const;
+#ifndef HEADLESS
 	void InitDraw();
 	void Draw() const;
+#endif
 	void Merge(const BoundingBox &);
-
-	bool Conflict(const BoundingBox &box, glm::mat4 transform_from_b_to_a, glm::mat4 transform_from_a_to_b) const;
 };
 
-bool BoundingBox::Conflict(const BoundingBox &box, glm::mat4 transform_from_b_to_a, glm::mat4 transform_from_a_to_b) const {
-	const float bound = 0.006;
-	if (box.GetVolumn() > bound) {
-		return false;
-	}
-
-	using namespace glm;
-	for (vec3 vertex: box.vertices) {
-		vertex = transform_from_b_to_a * vec4(vertex, 1);
-		if (this->InBox(vertex)) {
-// #ifdef DEBUG
-// 			std::cout << this->GetVolumn() << std::endl;
-// #endif
-			return true;
-		}
-	}
-	for (vec3 vertex: vertices) {
-		vertex = transform_from_a_to_b * vec4(vertex, 1);
-		if (box.InBox(vertex)) {
-// #ifdef DEBUG
-// 			std::cout << box.GetVolumn() << std::endl;
-// #endif
-			return true;
-		}
-	}
-	return false;
-}
-
 BoundingBox::~BoundingBox()
 {
 	//
@@ -114,13 +90,8 @@ bool BoundingBox::InBox(glm::vec3 position) const {
            small.z <= position.z && position.z <= big.z;
 }
 
-float BoundingBox::GetVolumn() const
-{
-	float dx = this->big.x - this->small.x;
-	float dy = this->big.y - this->small.y;
-	float dz = this->big.z - this->small.z;
-
-	return dx * dy * dz;
+AABB BoundingBox::aabb() const {
+	return AABB(small, big);
 }
 
 void BoundingBox::Merge(const BoundingBox & box)
@@ -133,7 +104,7 @@ void BoundingBox::Merge(const BoundingBox & box)
 	this->big.z = std::max(this->big.z, box.big.z);
 }
 
-#ifdef DEBUG
+#if defined(DEBUG) && !defined(HEADLESS)
 
 void BoundingBox::InitDraw()
 {
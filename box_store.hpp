@@ -0,0 +1,309 @@
+#pragma once
+
+#include <vector>
+#include <limits>
+#include <cstdint>
+#include <cstddef>
+#include <new>
+
+#include <glm/glm.hpp>
+
+// the SIMD kernels are built for their own instruction set whatever the
+// build targets, so that all of them can be checked against each other;
+// the masks use the best one the build targets
+#if defined(__x86_64__) || defined(__i386__)
+#define BOX_STORE_X86
+#include <immintrin.h>
+#endif
+
+#include "aabb.hpp"
+
+template <typename T, size_t kAlignment>
+struct AlignedAllocator {
+	typedef T value_type;
+	template <typename U> struct rebind { typedef AlignedAllocator<U, kAlignment> other; };
+
+	AlignedAllocator() {}
+	template <typename U> AlignedAllocator(const AlignedAllocator<U, kAlignment> &) {}
+
+	T *allocate(size_t n) {
+		// the offset back to the real block is kept right before the aligned one
+		char *raw = static_cast<char *>(::operator new(n * sizeof(T) + kAlignment + sizeof(void *)));
+		uintptr_t aligned = (reinterpret_cast<uintptr_t>(raw) + sizeof(void *) + kAlignment - 1) & ~(uintptr_t)(kAlignment - 1);
+		reinterpret_cast<void **>(aligned)[-1] = raw;
+		return reinterpret_cast<T *>(aligned);
+	}
+	void deallocate(T *p, size_t) {
+		::operator delete(reinterpret_cast<void **>(p)[-1]);
+	}
+};
+
+template <typename T, typename U, size_t A>
+bool operator==(const AlignedAllocator<T, A> &, const AlignedAllocator<U, A> &) { return true; }
+template <typename T, typename U, size_t A>
+bool operator!=(const AlignedAllocator<T, A> &, const AlignedAllocator<U, A> &) { return false; }
+
+// Boxes as structure of arrays, padded to whole blocks of eight with empty
+// boxes so that the kernels never need a tail loop. One block is tested per
+// AVX instruction, or per two SSE ones; every kernel keeps the exact
+// semantics of AABB::InBox and AABB::Overlap (closed intervals).
+class BoxStore {
+public:
+	static const uint32_t kLanes = 8;
+
+	enum class Kernel {
+		SCALAR, SSE, AVX
+	};
+	// what the masks below use, picked by the build
+	static Kernel Default();
+	// whether this build and cpu can run it
+	static bool Supported(Kernel kernel);
+
+	BoxStore();
+	BoxStore(const std::vector<AABB> &boxes);
+
+	void Clear();
+	uint32_t Add(const AABB &box);
+	void Set(uint32_t index, const AABB &box);
+	AABB Get(uint32_t index) const;
+	uint32_t size() const;
+
+	// bit i set when box block * 8 + i contains the point / overlaps the box
+	uint32_t ContainsMask(uint32_t block, const glm::vec3 &position) const;
+	uint32_t OverlapMask(uint32_t block, const AABB &box) const;
+	// with the given kernel, which has to be Supported
+	uint32_t ContainsMask(uint32_t block, const glm::vec3 &position, Kernel kernel) const;
+	uint32_t OverlapMask(uint32_t block, const AABB &box, Kernel kernel) const;
+
+	// visit(index) for every box that passes
+	template <typename Visitor> void Contains(const glm::vec3 &position, Visitor visit) const;
+	template <typename Visitor> void Overlap(const AABB &box, Visitor visit) const;
+	bool AnyContains(const glm::vec3 &position) const;
+
+private:
+	typedef std::vector<float, AlignedAllocator<float, 32> > Lane;
+	Lane small_x_, small_y_, small_z_, big_x_, big_y_, big_z_;
+	uint32_t size_;
+
+	uint32_t ContainsMaskScalar(uint32_t block, const glm::vec3 &position) const;
+	uint32_t OverlapMaskScalar(uint32_t block, const AABB &box) const;
+#ifdef BOX_STORE_X86
+	__attribute__((target("sse2"))) uint32_t ContainsMaskSse(uint32_t block, const glm::vec3 &position) const;
+	__attribute__((target("sse2"))) uint32_t OverlapMaskSse(uint32_t block, const AABB &box) const;
+	__attribute__((target("avx"))) uint32_t ContainsMaskAvx(uint32_t block, const glm::vec3 &position) const;
+	__attribute__((target("avx"))) uint32_t OverlapMaskAvx(uint32_t block, const AABB &box) const;
+#endif
+	template <typename Visitor> static void VisitMask(uint32_t block, uint32_t mask, uint32_t size, Visitor &visit);
+};
+
+BoxStore::BoxStore(): size_(0) {
+}
+
+BoxStore::BoxStore(const std::vector<AABB> &boxes): size_(0) {
+	for (const AABB &box : boxes)
+		Add(box);
+}
+
+void BoxStore::Clear() {
+	small_x_.clear(); small_y_.clear(); small_z_.clear();
+	big_x_.clear(); big_y_.clear(); big_z_.clear();
+	size_ = 0;
+}
+
+uint32_t BoxStore::size() const {
+	return size_;
+}
+
+uint32_t BoxStore::Add(const AABB &box) {
+	if (size_ % kLanes == 0) {
+		// a new block of empty boxes, which fail every test
+		const float inf = std::numeric_limits<float>::max();
+		small_x_.resize(size_ + kLanes, inf); small_y_.resize(size_ + kLanes, inf); small_z_.resize(size_ + kLanes, inf);
+		big_x_.resize(size_ + kLanes, -inf); big_y_.resize(size_ + kLanes, -inf); big_z_.resize(size_ + kLanes, -inf);
+	}
+	Set(size_, box);
+	return size_++;
+}
+
+void BoxStore::Set(uint32_t index, const AABB &box) {
+	small_x_[index] = box.small.x; small_y_[index] = box.small.y; small_z_[index] = box.small.z;
+	big_x_[index] = box.big.x; big_y_[index] = box.big.y; big_z_[index] = box.big.z;
+}
+
+AABB BoxStore::Get(uint32_t index) const {
+	return AABB(glm::vec3(small_x_[index], small_y_[index], small_z_[index]),
+	            glm::vec3(big_x_[index], big_y_[index], big_z_[index]));
+}
+
+BoxStore::Kernel BoxStore::Default() {
+#if defined(__AVX__)
+	return Kernel::AVX;
+#elif defined(__SSE2__)
+	return Kernel::SSE;
+#else
+	return Kernel::SCALAR;
+#endif
+}
+
+bool BoxStore::Supported(Kernel kernel) {
+#ifdef BOX_STORE_X86
+	if (kernel == Kernel::AVX) return __builtin_cpu_supports("avx");
+	if (kernel == Kernel::SSE) return __builtin_cpu_supports("sse2");
+	return true;
+#else
+	return kernel == Kernel::SCALAR;
+#endif
+}
+
+uint32_t BoxStore::ContainsMask(uint32_t block, const glm::vec3 &p) const {
+#if defined(__AVX__)
+	return ContainsMaskAvx(block, p);
+#elif defined(__SSE2__)
+	return ContainsMaskSse(block, p);
+#else
+	return ContainsMaskScalar(block, p);
+#endif
+}
+
+uint32_t BoxStore::OverlapMask(uint32_t block, const AABB &box) const {
+#if defined(__AVX__)
+	return OverlapMaskAvx(block, box);
+#elif defined(__SSE2__)
+	return OverlapMaskSse(block, box);
+#else
+	return OverlapMaskScalar(block, box);
+#endif
+}
+
+uint32_t BoxStore::ContainsMask(uint32_t block, const glm::vec3 &p, Kernel kernel) const {
+#ifdef BOX_STORE_X86
+	if (kernel == Kernel::AVX) return ContainsMaskAvx(block, p);
+	if (kernel == Kernel::SSE) return ContainsMaskSse(block, p);
+#endif
+	return ContainsMaskScalar(block, p);
+}
+
+uint32_t BoxStore::OverlapMask(uint32_t block, const AABB &box, Kernel kernel) const {
+#ifdef BOX_STORE_X86
+	if (kernel == Kernel::AVX) return OverlapMaskAvx(block, box);
+	if (kernel == Kernel::SSE) return OverlapMaskSse(block, box);
+#endif
+	return OverlapMaskScalar(block, box);
+}
+
+uint32_t BoxStore::ContainsMaskScalar(uint32_t block, const glm::vec3 &p) const {
+	uint32_t i = block * kLanes;
+	uint32_t mask = 0;
+	for (uint32_t lane = 0; lane < kLanes; lane++) {
+		uint32_t j = i + lane;
+		if (small_x_[j] <= p.x && p.x <= big_x_[j] &&
+		    small_y_[j] <= p.y && p.y <= big_y_[j] &&
+		    small_z_[j] <= p.z && p.z <= big_z_[j])
+			mask |= 1u << lane;
+	}
+	return mask;
+}
+
+uint32_t BoxStore::OverlapMaskScalar(uint32_t block, const AABB &box) const {
+	uint32_t i = block * kLanes;
+	uint32_t mask = 0;
+	for (uint32_t lane = 0; lane < kLanes; lane++) {
+		uint32_t j = i + lane;
+		if (small_x_[j] <= box.big.x && box.small.x <= big_x_[j] &&
+		    small_y_[j] <= box.big.y && box.small.y <= big_y_[j] &&
+		    small_z_[j] <= box.big.z && box.small.z <= big_z_[j])
+			mask |= 1u << lane;
+	}
+	return mask;
+}
+
+#ifdef BOX_STORE_X86
+__attribute__((target("sse2")))
+uint32_t BoxStore::ContainsMaskSse(uint32_t block, const glm::vec3 &p) const {
+	uint32_t i = block * kLanes;
+	__m128 x = _mm_set1_ps(p.x), y = _mm_set1_ps(p.y), z = _mm_set1_ps(p.z);
+	uint32_t mask = 0;
+	for (uint32_t half = 0; half < kLanes; half += 4) {
+		uint32_t j = i + half;
+		__m128 in = _mm_and_ps(
+			_mm_and_ps(
+				_mm_and_ps(_mm_cmple_ps(_mm_load_ps(&small_x_[j]), x), _mm_cmple_ps(x, _mm_load_ps(&big_x_[j]))),
+				_mm_and_ps(_mm_cmple_ps(_mm_load_ps(&small_y_[j]), y), _mm_cmple_ps(y, _mm_load_ps(&big_y_[j])))),
+			_mm_and_ps(_mm_cmple_ps(_mm_load_ps(&small_z_[j]), z), _mm_cmple_ps(z, _mm_load_ps(&big_z_[j]))));
+		mask |= _mm_movemask_ps(in) << half;
+	}
+	return mask;
+}
+
+__attribute__((target("sse2")))
+uint32_t BoxStore::OverlapMaskSse(uint32_t block, const AABB &box) const {
+	uint32_t i = block * kLanes;
+	__m128 sx = _mm_set1_ps(box.small.x), sy = _mm_set1_ps(box.small.y), sz = _mm_set1_ps(box.small.z);
+	__m128 bx = _mm_set1_ps(box.big.x), by = _mm_set1_ps(box.big.y), bz = _mm_set1_ps(box.big.z);
+	uint32_t mask = 0;
+	for (uint32_t half = 0; half < kLanes; half += 4) {
+		uint32_t j = i + half;
+		__m128 hit = _mm_and_ps(
+			_mm_and_ps(
+				_mm_and_ps(_mm_cmple_ps(_mm_load_ps(&small_x_[j]), bx), _mm_cmple_ps(sx, _mm_load_ps(&big_x_[j]))),
+				_mm_and_ps(_mm_cmple_ps(_mm_load_ps(&small_y_[j]), by), _mm_cmple_ps(sy, _mm_load_ps(&big_y_[j])))),
+			_mm_and_ps(_mm_cmple_ps(_mm_load_ps(&small_z_[j]), bz), _mm_cmple_ps(sz, _mm_load_ps(&big_z_[j]))));
+		mask |= _mm_movemask_ps(hit) << half;
+	}
+	return mask;
+}
+
+__attribute__((target("avx")))
+uint32_t BoxStore::ContainsMaskAvx(uint32_t block, const glm::vec3 &p) const {
+	uint32_t i = block * kLanes;
+	__m256 x = _mm256_set1_ps(p.x), y = _mm256_set1_ps(p.y), z = _mm256_set1_ps(p.z);
+	__m256 in = _mm256_and_ps(
+		_mm256_and_ps(
+			_mm256_and_ps(_mm256_cmp_ps(_mm256_load_ps(&small_x_[i]), x, _CMP_LE_OQ), _mm256_cmp_ps(x, _mm256_load_ps(&big_x_[i]), _CMP_LE_OQ)),
+			_mm256_and_ps(_mm256_cmp_ps(_mm256_load_ps(&small_y_[i]), y, _CMP_LE_OQ), _mm256_cmp_ps(y, _mm256_load_ps(&big_y_[i]), _CMP_LE_OQ))),
+		_mm256_and_ps(_mm256_cmp_ps(_mm256_load_ps(&small_z_[i]), z, _CMP_LE_OQ), _mm256_cmp_ps(z, _mm256_load_ps(&big_z_[i]), _CMP_LE_OQ)));
+	return _mm256_movemask_ps(in);
+}
+
+__attribute__((target("avx")))
+uint32_t BoxStore::OverlapMaskAvx(uint32_t block, const AABB &box) const {
+	uint32_t i = block * kLanes;
+	__m256 sx = _mm256_set1_ps(box.small.x), sy = _mm256_set1_ps(box.small.y), sz = _mm256_set1_ps(box.small.z);
+	__m256 bx = _mm256_set1_ps(box.big.x), by = _mm256_set1_ps(box.big.y), bz = _mm256_set1_ps(box.big.z);
+	__m256 hit = _mm256_and_ps(
+		_mm256_and_ps(
+			_mm256_and_ps(_mm256_cmp_ps(_mm256_load_ps(&small_x_[i]), bx, _CMP_LE_OQ), _mm256_cmp_ps(sx, _mm256_load_ps(&big_x_[i]), _CMP_LE_OQ)),
+			_mm256_and_ps(_mm256_cmp_ps(_mm256_load_ps(&small_y_[i]), by, _CMP_LE_OQ), _mm256_cmp_ps(sy, _mm256_load_ps(&big_y_[i]), _CMP_LE_OQ))),
+		_mm256_and_ps(_mm256_cmp_ps(_mm256_load_ps(&small_z_[i]), bz, _CMP_LE_OQ), _mm256_cmp_ps(sz, _mm256_load_ps(&big_z_[i]), _CMP_LE_OQ)));
+	return _mm256_movemask_ps(hit);
+}
+#endif
+
+template <typename Visitor>
+void BoxStore::VisitMask(uint32_t block, uint32_t mask, uint32_t size, Visitor &visit) {
+	for (uint32_t lane = 0; mask; lane++, mask >>= 1) {
+		uint32_t index = block * kLanes + lane;
+		if ((mask & 1) && index < size) visit(index);
+	}
+}
+
+template <typename Visitor>
+void BoxStore::Contains(const glm::vec3 &position, Visitor visit) const {
+	uint32_t blocks = (size_ + kLanes - 1) / kLanes;
+	for (uint32_t block = 0; block < blocks; block++)
+		VisitMask(block, ContainsMask(block, position), size_, visit);
+}
+
+template <typename Visitor>
+void BoxStore::Overlap(const AABB &box, Visitor visit) const {
+	uint32_t blocks = (size_ + kLanes - 1) / kLanes;
+	for (uint32_t block = 0; block < blocks; block++)
+		VisitMask(block, OverlapMask(block, box), size_, visit);
+}
+
+bool BoxStore::AnyContains(const glm::vec3 &position) const {
+	uint32_t blocks = (size_ + kLanes - 1) / kLanes;
+	for (uint32_t block = 0; block < blocks; block++)
+		if (ContainsMask(block, position)) return true;
+	return false;
+}
@@ -0,0 +1,322 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+
+#include "aabb.hpp"
+#include "frustum.hpp"
+#include "job_system.hpp"
+
+// bounding volume hierarchy over boxes, built with binned SAH
+class Bvh {
+public:
+	Bvh();
+	void Build(const std::vector<AABB> &boxes);
+	bool empty() const;
+	const AABB &bounds() const;
+
+	// visit(index) is called once for every box that passes the test
+	template <typename Visitor> void Query(const Frustum &frustum, Visitor visit) const;
+	template <typename Visitor> void Query(const AABB &box, Visitor visit) const;
+	// visit(index, t_max) returns t_max, shortened when it found a closer hit
+	template <typename Visitor> void Raycast(const glm::vec3 &origin, const glm::vec3 &direction, float t_max, Visitor visit) const;
+
+	struct Node {
+		AABB box;
+		// interior: left and right children; leaf: count > 0 indices from first
+		uint32_t left, right, first, count;
+	};
+	// for converting into other layouts, node 0 is the root
+	const std::vector<Node> &nodes() const;
+	const std::vector<uint32_t> &indices() const;
+
+private:
+	static const uint32_t kBins = 12;
+	static const uint32_t kMaxLeafSize = 4;
+	static const uint32_t kParallelThreshold = 1024;
+	static const int kMaxDepth = 40;
+
+	std::vector<Node> nodes_;
+	std::vector<uint32_t> indices_;
+	std::vector<AABB> boxes_;
+	std::vector<glm::vec3> centroids_;
+
+	uint32_t BuildNode(std::vector<Node> &nodes, uint32_t begin, uint32_t end, int depth, int spawn_depth);
+	uint32_t Split(const AABB &box, uint32_t begin, uint32_t end, bool force_median);
+	static void Splice(std::vector<Node> &nodes, const std::vector<Node> &sub_nodes);
+	static bool RayHitsBox(const AABB &box, const glm::vec3 &origin, const glm::vec3 &inv_direction, float t_max, float &t_enter);
+};
+
+Bvh::Bvh() {
+}
+
+bool Bvh::empty() const {
+	return nodes_.empty();
+}
+
+const AABB &Bvh::bounds() const {
+	return nodes_[0].box;
+}
+
+const std::vector<Bvh::Node> &Bvh::nodes() const {
+	return nodes_;
+}
+
+const std::vector<uint32_t> &Bvh::indices() const {
+	return indices_;
+}
+
+void Bvh::Build(const std::vector<AABB> &boxes) {
+	boxes_ = boxes;
+	nodes_.clear();
+	indices_.resize(boxes.size());
+	centroids_.resize(boxes.size());
+	for (uint32_t i = 0; i < boxes.size(); i++) {
+		indices_[i] = i;
+		centroids_[i] = boxes[i].Center();
+	}
+	if (boxes.empty()) return;
+
+	// a few more halves than threads, so stealing evens out uneven splits
+	uint32_t threads = JobSystem::Shared().size();
+	int spawn_depth = 0;
+	while (threads > 1 && (1u << spawn_depth) < 4 * threads) spawn_depth++;
+
+	nodes_.reserve(2 * boxes.size());
+	BuildNode(nodes_, 0, boxes.size(), 0, spawn_depth);
+}
+
+uint32_t Bvh::BuildNode(std::vector<Node> &nodes, uint32_t begin, uint32_t end, int depth, int spawn_depth) {
+	uint32_t index = nodes.size();
+	nodes.push_back(Node());
+
+	AABB box;
+	for (uint32_t i = begin; i < end; i++)
+		box.Merge(boxes_[indices_[i]]);
+	nodes[index].box = box;
+
+	// past kMaxDepth the tree is forced to balance so traversal stacks stay bounded
+	uint32_t mid = Split(box, begin, end, depth >= kMaxDepth);
+	if (mid == begin || mid == end) {
+		nodes[index].first = begin;
+		nodes[index].count = end - begin;
+		nodes[index].left = nodes[index].right = 0;
+		return index;
+	}
+	nodes[index].count = 0;
+
+	if (spawn_depth > 0 && end - begin >= kParallelThreshold) {
+		// the right half is built into its own array as a job and spliced
+		// behind the left half once both are done
+		std::vector<Node> right_nodes;
+		auto build_right = [this, &right_nodes, mid, end, depth, spawn_depth]() {
+			BuildNode(right_nodes, mid, end, depth + 1, spawn_depth - 1);
+		};
+		JobCounter counter;
+		JobSystem::Shared().Run(build_right, counter);
+		uint32_t left = BuildNode(nodes, begin, mid, depth + 1, spawn_depth - 1);
+		JobSystem::Shared().Wait(counter);
+		uint32_t right = nodes.size();
+		Splice(nodes, right_nodes);
+		nodes[index].left = left;
+		nodes[index].right = right;
+	} else {
+		uint32_t left = BuildNode(nodes, begin, mid, depth + 1, 0);
+		uint32_t right = BuildNode(nodes, mid, end, depth + 1, 0);
+		nodes[index].left = left;
+		nodes[index].right = right;
+	}
+	return index;
+}
+
+void Bvh::Splice(std::vector<Node> &nodes, const std::vector<Node> &sub_nodes) {
+	uint32_t offset = nodes.size();
+	for (Node node : sub_nodes) {
+		if (node.count == 0) {
+			node.left += offset;
+			node.right += offset;
+		}
+		nodes.push_back(node);
+	}
+}
+
+// partitions indices_[begin, end) and returns the split point,
+// begin or end when the range should become a leaf
+uint32_t Bvh::Split(const AABB &box, uint32_t begin, uint32_t end, bool force_median) {
+	uint32_t count = end - begin;
+	if (count <= 1) return end;
+
+	AABB centroid_box;
+	for (uint32_t i = begin; i < end; i++)
+		centroid_box.Merge(centroids_[indices_[i]]);
+
+	float best_cost = count;
+	int best_axis = -1;
+	uint32_t best_bin = 0;
+
+	for (int axis = 0; axis < 3; axis++) {
+		float lo = centroid_box.small[axis], hi = centroid_box.big[axis];
+		if (hi - lo <= 0) continue;
+		float scale = kBins / (hi - lo);
+
+		AABB bin_boxes[kBins];
+		uint32_t bin_counts[kBins] = {};
+		for (uint32_t i = begin; i < end; i++) {
+			uint32_t b = std::min(kBins - 1, (uint32_t)((centroids_[indices_[i]][axis] - lo) * scale));
+			bin_counts[b]++;
+			bin_boxes[b].Merge(boxes_[indices_[i]]);
+		}
+
+		// sweep from the right to get suffix areas, then from the left
+		float right_area[kBins];
+		uint32_t right_count[kBins];
+		AABB acc;
+		uint32_t acc_count = 0;
+		for (int b = kBins - 1; b > 0; b--) {
+			acc.Merge(bin_boxes[b]);
+			acc_count += bin_counts[b];
+			right_area[b] = acc.SurfaceArea();
+			right_count[b] = acc_count;
+		}
+		acc = AABB();
+		acc_count = 0;
+		float parent_area = std::max(box.SurfaceArea(), 1e-20f);
+		for (uint32_t b = 0; b < kBins - 1; b++) {
+			acc.Merge(bin_boxes[b]);
+			acc_count += bin_counts[b];
+			if (acc_count == 0 || right_count[b + 1] == 0) continue;
+			float cost = 0.125f + (acc.SurfaceArea() * acc_count + right_area[b + 1] * right_count[b + 1]) / parent_area;
+			if (cost < best_cost) {
+				best_cost = cost;
+				best_axis = axis;
+				best_bin = b;
+			}
+		}
+	}
+
+	auto first = indices_.begin() + begin, last = indices_.begin() + end;
+
+	if (best_axis < 0 || force_median) {
+		if (count <= kMaxLeafSize) return end;
+		// no useful SAH split, fall back to the median of the widest axis
+		glm::vec3 d = centroid_box.big - centroid_box.small;
+		int axis = d.x > d.y ? (d.x > d.z ? 0 : 2) : (d.y > d.z ? 1 : 2);
+		auto middle = first + count / 2;
+		const std::vector<glm::vec3> &centroids = centroids_;
+		std::nth_element(first, middle, last, [&centroids, axis](uint32_t a, uint32_t b) {
+			return centroids[a][axis] < centroids[b][axis];
+		});
+		return begin + count / 2;
+	}
+
+	float lo = centroid_box.small[best_axis];
+	float scale = kBins / (centroid_box.big[best_axis] - lo);
+	const std::vector<glm::vec3> &centroids = centroids_;
+	auto middle = std::partition(first, last, [&centroids, best_axis, best_bin, lo, scale](uint32_t i) {
+		return std::min(kBins - 1, (uint32_t)((centroids[i][best_axis] - lo) * scale)) <= best_bin;
+	});
+	return begin + (middle - first);
+}
+
+template <typename Visitor>
+void Bvh::Query(const Frustum &frustum, Visitor visit) const {
+	if (nodes_.empty()) return;
+	// the second member marks subtrees already known to be fully inside
+	std::pair<uint32_t, bool> stack[64];
+	int top = 0;
+	stack[top++] = std::make_pair(0u, false);
+	while (top > 0) {
+		std::pair<uint32_t, bool> entry = stack[--top];
+		const Node &node = nodes_[entry.first];
+		bool inside = entry.second;
+		if (!inside) {
+			FrustumTestType type = frustum.Test(node.box);
+			if (type == FrustumTestType::OUTSIDE) continue;
+			inside = type == FrustumTestType::INSIDE;
+		}
+		if (node.count > 0) {
+			for (uint32_t i = 0; i < node.count; i++) {
+				uint32_t index = indices_[node.first + i];
+				if (inside || frustum.Intersects(boxes_[index]))
+					visit(index);
+			}
+		} else {
+			stack[top++] = std::make_pair(node.right, inside);
+			stack[top++] = std::make_pair(node.left, inside);
+		}
+	}
+}
+
+template <typename Visitor>
+void Bvh::Query(const AABB &box, Visitor visit) const {
+	if (nodes_.empty()) return;
+	uint32_t stack[64];
+	int top = 0;
+	stack[top++] = 0;
+	while (top > 0) {
+		const Node &node = nodes_[stack[--top]];
+		if (!node.box.Overlap(box)) continue;
+		if (node.count > 0) {
+			for (uint32_t i = 0; i < node.count; i++) {
+				uint32_t index = indices_[node.first + i];
+				if (boxes_[index].Overlap(box))
+					visit(index);
+			}
+		} else {
+			stack[top++] = node.right;
+			stack[top++] = node.left;
+		}
+	}
+}
+
+bool Bvh::RayHitsBox(const AABB &box, const glm::vec3 &origin, const glm::vec3 &inv_direction, float t_max, float &t_enter) {
+	float t0 = 0, t1 = t_max;
+	for (int i = 0; i < 3; i++) {
+		float t_near = (box.small[i] - origin[i]) * inv_direction[i];
+		float t_far = (box.big[i] - origin[i]) * inv_direction[i];
+		if (t_near > t_far) std::swap(t_near, t_far);
+		t0 = t_near > t0 ? t_near : t0;
+		t1 = t_far < t1 ? t_far : t1;
+		if (t0 > t1) return false;
+	}
+	t_enter = t0;
+	return true;
+}
+
+template <typename Visitor>
+void Bvh::Raycast(const glm::vec3 &origin, const glm::vec3 &direction, float t_max, Visitor visit) const {
+	if (nodes_.empty()) return;
+	glm::vec3 inv_direction(1.0f / direction.x, 1.0f / direction.y, 1.0f / direction.z);
+	uint32_t stack[64];
+	int top = 0;
+	stack[top++] = 0;
+	float t_enter;
+	while (top > 0) {
+		const Node &node = nodes_[stack[--top]];
+		if (!RayHitsBox(node.box, origin, inv_direction, t_max, t_enter)) continue;
+		if (node.count > 0) {
+			for (uint32_t i = 0; i < node.count; i++)
+				t_max = visit(indices_[node.first + i], t_max);
+			continue;
+		}
+		// visit the nearer child first so that the far one is usually pruned
+		const Node &left = nodes_[node.left], &right = nodes_[node.right];
+		float t_left, t_right;
+		bool hit_left = RayHitsBox(left.box, origin, inv_direction, t_max, t_left);
+		bool hit_right = RayHitsBox(right.box, origin, inv_direction, t_max, t_right);
+		if (hit_left && hit_right) {
+			if (t_left <= t_right) {
+				stack[top++] = node.right;
+				stack[top++] = node.left;
+			} else {
+				stack[top++] = node.left;
+				stack[top++] = node.right;
+			}
+		} else if (hit_left) {
+			stack[top++] = node.left;
+		} else if (hit_right) {
+			stack[top++] = node.right;
+		}
+	}
+}
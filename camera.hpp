@@ -21,7 +21,7 @@ public:
 	glm::mat4 GetProjectionMatrix() const;
 
 private:
-	const glm::vec3 up_ = glm::vec3(0, 0, 1);
+	glm::vec3 up_ = glm::vec3(0, 0, 1);
 	glm::vec3 position_;
 	double alpha_, beta_, width_height_ratio_;
 	glm::vec3 front() const;
@@ -2,6 +2,9 @@
 
 #include "model.hpp"
 #include "camera.hpp"
+#include "height_field.hpp"
+#include "triangle_bvh.hpp"
+#include "collision_world.hpp"
 
 #ifdef DEBUG
 #include <set>
@@ -15,7 +18,6 @@ private:
 	// const glm::vec3 front_ = glm::vec3(1, 0, 0);
 	glm::vec3 front_;
 	const Model &model_;
-	const Shader &shader_;
 	Camera &camera_;
 	glm::vec3 position_;
 
@@ -24,139 +26,277 @@ private:
 #endif
 
 	double alpha_;
-	bool motion_;
 	float z_velocity_;
 	bool fall_;
 	const float gravity_ = 1.0f;
+	// highest ledge the car drives up without falling first
+	const float step_ = 0.05f;
+	const HeightField *ground_;
+	// the camera boom is pulled in where it would pass through this
+	const TriangleBvh *scene_;
+	const float boom_length_ = 0.3f;
+	const float boom_radius_ = 0.02f;
+	// moves stop at the first contact with the world and slide along it
+	CollisionWorld *collision_;
+	uint32_t body_;
+	static const int kMaxSlides = 3;
+	// per step, so that a deep overlap does not teleport the car
+	static constexpr float kMaxPush = 0.02f;
+
+	void Slide(glm::vec3 motion);
+
+	// the state at the start of the last simulation step, and the blend of
+	// the two that is drawn
+	glm::vec3 previous_position_, render_position_;
+	double previous_alpha_, render_alpha_;
 
 public:
 	Car() = delete;
-	Car(const Model &model, const Shader &shader, Camera &camera_ptr, glm::vec3);
-	void Draw() const;
+	Car(const Model &model, Camera &camera_ptr, glm::vec3);
+#ifndef HEADLESS
+	void Draw(const Shader &shader) const;
+#endif
 	void Move(MoveDirectionType, float time);
 	glm::mat4 model_matrix() const;
+	const glm::vec3 &position() const;
+	double alpha() const;
+	// of a car at position, turned by alpha about the up axis
+	static glm::mat4 Matrix(const glm::vec3 &position, double alpha);
+	// where the car is drawn, between the last two simulation steps
+	glm::mat4 render_matrix() const;
 
 	void CameraAccompany();
 	void Rotate(double delta_alpha);
-	void Enable();
-	void Disable();
+	// at rest at position, heading alpha, with nothing to interpolate from
+	void Place(const glm::vec3 &position, double alpha);
+	// out of the blocking contacts of a CollisionWorld::Conflict call
+	void Depenetrate(const std::vector<Contact> &contacts);
 
 
+	// call before every simulation step
+	void SaveState();
 	void Update(float time);
+	// blend of the last two steps, 0 is the previous one; moves the camera
+	void Interpolate(float blend);
 	// void ResetVelocity();
-	void ConflictZ();
+	void set_ground(const HeightField *ground);
+	void set_scene(const TriangleBvh *scene);
+	void set_collision(CollisionWorld *collision, uint32_t body);
+
+	// hand placed drivable boxes, in the frame DrivableFrame() maps world space to
+	static const std::vector<AABB> &DrivableRegions();
+	static glm::mat4 DrivableFrame();
 
 #ifdef DEBUG
 	void ShowPosition();
 #endif
 };
 
-glm::mat4 Car::model_matrix() const {
+constexpr float Car::kMaxPush;
+
+glm::mat4 Car::Matrix(const glm::vec3 &position, double alpha) {
 	using namespace glm;
 	mat4 model(1);
 	model = rotate(model, (float)M_PI / 2, vec3(1, 0, 0));
 	model = scale(model, vec3(0.0002, 0.0002, 0.0002));
-	model = rotate(model, (float)this->alpha_, vec3(0, 1, 0));
-	model = translate(mat4(1), position_) * model;
+	model = rotate(model, (float)alpha, vec3(0, 1, 0));
+	model = translate(mat4(1), position) * model;
 
 	// std::cout << position_.x << " " << position_.y << " " << position_.z << std::endl;
 
 	return model;
 }
 
-Car::Car(const Model &model, const Shader &shader, Camera &camera, glm::vec3 position):
+glm::mat4 Car::model_matrix() const {
+	return Matrix(position_, alpha_);
+}
+
+const glm::vec3 &Car::position() const {
+	return position_;
+}
+
+double Car::alpha() const {
+	return alpha_;
+}
+
+glm::mat4 Car::render_matrix() const {
+	return Matrix(render_position_, render_alpha_);
+}
+
+Car::Car(const Model &model, Camera &camera, glm::vec3 position):
 	fall_(true),
 	alpha_(0.0),
 	z_velocity_(0.0f),
-	motion_(true),
 	model_(model),
-	shader_(shader),
 	camera_(camera),
-	position_(position) {
+	position_(position),
+	ground_(nullptr),
+	scene_(nullptr),
+	collision_(nullptr),
+	body_(0),
+	previous_position_(position),
+	render_position_(position),
+	previous_alpha_(0.0),
+	render_alpha_(0.0) {
+	front_ = glm::vec3(cos(alpha_), sin(alpha_), 0);
 	CameraAccompany();
 }
 
-void Car::Draw() const {
+#ifndef HEADLESS
+void Car::Draw(const Shader &shader) const {
 	using namespace glm;
-	shader_.Use();
-	shader_.SetUniform<mat4>("model", model_matrix());
-	shader_.SetUniform<mat4>("view", camera_.GetViewMatrix());
-	shader_.SetUniform<mat4>("projection", camera_.GetProjectionMatrix());
+	shader.Use();
+	shader.SetUniform<mat4>("model", render_matrix());
+	shader.SetUniform<mat4>("view", camera_.GetViewMatrix());
+	shader.SetUniform<mat4>("projection", camera_.GetProjectionMatrix());
 		
-	shader_.SetUniform<vec3>("light.position", vec3(200, 200, 500));
-	shader_.SetUniform<vec3>("light.ambient", vec3(0.6, 0.6, 0.6));
-	shader_.SetUniform<vec3>("light.diffuse", vec3(1, 1, 1));
-	shader_.SetUniform<vec3>("light.specular", vec3(1, 1, 1));
+	shader.SetUniform<vec3>("light.position", vec3(200, 200, 500));
+	shader.SetUniform<vec3>("light.ambient", vec3(0.6, 0.6, 0.6));
+	shader.SetUniform<vec3>("light.diffuse", vec3(1, 1, 1));
+	shader.SetUniform<vec3>("light.specular", vec3(1, 1, 1));
 
-	shader_.SetUniform<vec3>("view_position", camera_.position());
-	shader_.SetUniform<float>("material.shininess", 32);
+	shader.SetUniform<vec3>("view_position", camera_.position());
+	shader.SetUniform<float>("material.shininess", 32);
 
-	model_.Draw(shader_);
+	model_.Draw(shader);
 }
+#endif
 
 void Car::CameraAccompany() {
 	// double x = position_.x, y = position_.y, z = position_.z;
 	// camera_.set_position(position_ + glm::vec3(-0.2, 0, 0.1));
-	camera_.set_position(position_ - 0.3f * front_ + glm::vec3(0, 0, 0.1));
+	glm::vec3 front(cos(render_alpha_), sin(render_alpha_), 0);
+	glm::vec3 pivot = render_position_ + glm::vec3(0, 0, 0.1);
+	float boom = boom_length_;
+	RayHit hit;
+	if (scene_ && scene_->SphereCast(pivot, boom_radius_, -front, boom_length_, hit))
+		boom = hit.t;
+	camera_.set_position(pivot - boom * front);
 	// camera_.set_position(position_ - 0.1f * front_);
 }
 
 void Car::Move(MoveDirectionType direction, float time) {
-	static MoveDirectionType last_dir;
-	if (!this->motion_ && direction == last_dir) {
-		return;
-	}
-
 	using namespace std;
 	auto left = glm::cross(up_, front_);
 	auto right = -left;
+	glm::vec3 motion;
 	switch (direction) {
 		case MoveDirectionType::FRONT:
-			position_ += front_ * time;
+			motion = front_ * time;
 			break;
 		case MoveDirectionType::BACK:
-			position_ -= front_ * time;
+			motion = -front_ * time;
 			break;
 		case MoveDirectionType::LEFT:
-			position_ += left * time;
+			motion = left * time;
 			break;
 		case MoveDirectionType::RIGHT:
-			position_ += right * time;
+			motion = right * time;
 			break;
 	}
-	CameraAccompany();
+	Slide(motion);
+}
 
-	last_dir = direction;
+void Car::Slide(glm::vec3 motion) {
+	if (!collision_) {
+		position_ += motion;
+		return;
+	}
+	// up to the first contact, then on with what is left of the motion along
+	// the surface that was hit
+	for (int i = 0; i < kMaxSlides && glm::dot(motion, motion) > 1e-12f; i++) {
+		collision_->MoveBody(body_, model_matrix());
+		glm::vec3 normal;
+		float t = collision_->Sweep(body_, motion, normal);
+		position_ += motion * t;
+		if (t >= 1) break;
+		motion *= 1 - t;
+		// the height belongs to the ground, so slide along the wall as seen
+		// from above; a sloped normal would leave the motion still pressing
+		// into a contact the next sweep starts in
+		glm::vec3 wall(normal.x, normal.y, 0);
+		if (glm::dot(wall, wall) > 1e-12f) wall = glm::normalize(wall);
+		motion.z = 0;
+		motion -= wall * std::min(glm::dot(motion, wall), 0.0f);
+	}
+}
+
+void Car::Depenetrate(const std::vector<Contact> &contacts) {
+	// what the sweeps let through, e.g. by turning into a wall
+	glm::vec3 push(0);
+	for (const Contact &contact : contacts)
+		push += contact.normal * contact.depth;
+	push.z = 0;
+	float length = glm::length(push);
+	if (length > kMaxPush) push *= kMaxPush / length;
+	position_ += push;
 }
 
 void Car::Rotate(double delta_alpha) {
+	// steering comes from the mouse at frame rate, so it turns every state
+	// at once instead of waiting for the next step
 	this->alpha_ += delta_alpha;
+	this->previous_alpha_ += delta_alpha;
+	this->render_alpha_ += delta_alpha;
 	this->front_ = glm::vec3(cos(this->alpha_), sin(this->alpha_), 0);
 }
 
-void Car::Enable()
+void Car::Place(const glm::vec3 &position, double alpha) {
+	position_ = previous_position_ = render_position_ = position;
+	alpha_ = previous_alpha_ = render_alpha_ = alpha;
+	front_ = glm::vec3(cos(alpha_), sin(alpha_), 0);
+	z_velocity_ = 0.0f;
+	fall_ = true;
+}
+
+void Car::set_ground(const HeightField *ground)
 {
-	this->motion_ = true;
+	this->ground_ = ground;
 }
 
-void Car::Disable()
+void Car::set_scene(const TriangleBvh *scene)
 {
-	this->motion_ = false;
+	this->scene_ = scene;
 }
 
-void Car::Update(float time)
+void Car::set_collision(CollisionWorld *collision, uint32_t body)
+{
+	this->collision_ = collision;
+	this->body_ = body;
+}
+
+void Car::SaveState()
+{
+	this->previous_position_ = position_;
+	this->previous_alpha_ = alpha_;
+}
+
+void Car::Interpolate(float blend)
 {
-	this->ConflictZ();
-	if (fall_) {
-		this->position_.z -= time * this->z_velocity_;
-		this->z_velocity_ += time * this->gravity_;
+	this->render_position_ = glm::mix(previous_position_, position_, blend);
+	this->render_alpha_ = previous_alpha_ + (alpha_ - previous_alpha_) * blend;
+	CameraAccompany();
+}
 
-		this->ConflictZ();
+void Car::Update(float time)
+{
+	float ground;
+	bool supported = ground_ && ground_->Query(position_, step_, ground);
+	if (supported && position_.z <= ground + step_) {
+		// stick to the surface, up small steps and down gentle slopes
+		this->position_.z = ground;
+		this->z_velocity_ = 0.0f;
+		fall_ = false;
+		return;
+	}
 
-		if (!fall_) {
-			this->position_.z += time * this->z_velocity_ - 0.01f;
-			this->z_velocity_ = 0.0f;
-		}
+	fall_ = true;
+	this->position_.z -= time * this->z_velocity_;
+	this->z_velocity_ += time * this->gravity_;
+	if (supported && this->position_.z <= ground) {
+		this->position_.z = ground;
+		this->z_velocity_ = 0.0f;
+		fall_ = false;
 	}
 }
 
@@ -165,22 +305,22 @@ void Car::Update(float time)
 // 	this->z_velocity_ = 0.0f;
 // }
 
-void Car::ConflictZ()
+const std::vector<AABB> &Car::DrivableRegions()
 {
 	using glm::vec3;
 
-	const BoundingBox boxes[] = {
-		BoundingBox(vec3(-8.9, -3, 4.5), vec3(-2, 9.6, 4.845)),
-		BoundingBox(vec3(-2.2, 0, 4.5), vec3(1.8, 12.25, 4.845)),
-		BoundingBox(vec3(-2.2, 12.3, 4.2), vec3(1.8, 13.6, 4.62)),
-		BoundingBox(vec3(-3.26, 13.7, 2.7), vec3(1.8, 21.9, 3.16))
+	static const std::vector<AABB> boxes = {
+		AABB(vec3(-8.9, -3, 4.5), vec3(-2, 9.6, 4.845)),
+		AABB(vec3(-2.2, 0, 4.5), vec3(1.8, 12.25, 4.845)),
+		AABB(vec3(-2.2, 12.3, 4.2), vec3(1.8, 13.6, 4.62)),
+		AABB(vec3(-3.26, 13.7, 2.7), vec3(1.8, 21.9, 3.16))
 	};
+	return boxes;
+}
 
-	glm::vec3 pos_rotate = glm::rotate(glm::mat4(1), (float)M_PI / 4, glm::vec3(0, 0, 1)) * glm::vec4(position_, 0.0f);
-	fall_ = true;
-	for (const auto & box: boxes) {
-		fall_ = fall_ &&  !box.InBox(pos_rotate);
-	}
+glm::mat4 Car::DrivableFrame()
+{
+	return glm::rotate(glm::mat4(1), (float)M_PI / 4, glm::vec3(0, 0, 1));
 }
 
 #ifdef DEBUG
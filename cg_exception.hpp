@@ -1,5 +1,8 @@
 #pragma once
 
+#include <cerrno>
+#include <cstring>
+
 class FileNotExistsError: public std::exception {
 public:
     FileNotExistsError() = delete;
@@ -76,4 +79,17 @@ public:
 	}
 private:
 	std::string error_message;
-};
\ No newline at end of file
+};
+
+class SocketError: public std::exception {
+public:
+	SocketError() = delete;
+	SocketError(const std::string &action) {
+		error_message = "[socket error] Fail to " + action + ": " + strerror(errno);
+	}
+	const char *what() const noexcept {
+		return error_message.c_str();
+	}
+private:
+	std::string error_message;
+};
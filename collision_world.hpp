@@ -0,0 +1,381 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+#include <cmath>
+
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+
+#include "aabb.hpp"
+#include "bvh.hpp"
+#include "dynamic_aabb_tree.hpp"
+#include "box_store.hpp"
+#include "gjk.hpp"
+#include "model.hpp"
+
+struct BroadphaseStats {
+	// box pairs an all-pairs test would check, and the ones that reached narrowphase
+	uint64_t all_pairs, candidate_pairs;
+	// narrowphase outcome: blocking contacts, and ground the body rests on
+	uint64_t contacts, supports;
+};
+
+// The world's side of collision: the hulls of its convex pieces, and their
+// boxes in a static BVH. It never changes, so any number of CollisionWorlds
+// can share one.
+class StaticCollision {
+public:
+	StaticCollision() = delete;
+	StaticCollision(const Model &world, const glm::mat4 &world_matrix);
+
+	const std::vector<ConvexHull> &hulls() const;
+	const glm::mat4 &matrix() const;
+	// world space box of every hull
+	const std::vector<AABB> &boxes() const;
+	const Bvh &bvh() const;
+
+private:
+	const Model &world_;
+	glm::mat4 matrix_;
+	std::vector<AABB> boxes_;
+	Bvh bvh_;
+};
+
+// Collision of moving bodies against the world and each other. The world
+// never moves, so its boxes go into a static BVH once, possibly shared with
+// other CollisionWorlds; bodies live in a dynamic tree. Pairs that pass are
+// tested on their convex hulls with GJK, started from the axis that
+// separated them last time, and EPA gives the contact normal of the ones
+// that intersect.
+class CollisionWorld {
+public:
+	CollisionWorld() = delete;
+	CollisionWorld(const Model &world, const glm::mat4 &world_matrix);
+	// bodies of their own against a world shared with others
+	CollisionWorld(const StaticCollision &world);
+	CollisionWorld(const CollisionWorld &) = delete;
+	virtual ~CollisionWorld();
+
+	uint32_t AddBody(const Model &model, const glm::mat4 &model_matrix);
+	void MoveBody(uint32_t body, const glm::mat4 &model_matrix);
+	// true when the body is blocked by the world or another body; contacts
+	// whose normal is mostly up are ground support and do not block
+	bool Conflict(uint32_t body);
+	// fraction of motion the body travels before a blocking contact with the
+	// world, 1 when the way is free. A contact the body starts in stops it at
+	// 0 unless the motion leads out of it; ground support does not stop it.
+	// Long moves are sampled finer than the body, so it cannot pass through a
+	// wall however thin.
+	float Sweep(uint32_t body, const glm::vec3 &motion);
+	// normal receives the contact normal that stopped the body, if one did
+	float Sweep(uint32_t body, const glm::vec3 &motion, glm::vec3 &normal);
+	// blocking contacts of the last Conflict call
+	const std::vector<Contact> &contacts() const;
+	// counted over the last Conflict call
+	const BroadphaseStats &stats() const;
+
+private:
+	struct Body {
+		const Model *model;
+		glm::mat4 matrix;
+		AABB box;
+		// world space boxes of the model's hulls, refreshed on every move
+		BoxStore boxes;
+		uint32_t proxy;
+	};
+
+	static constexpr float kMargin = 0.05f;
+	static const int kSweepBisections = 10;
+	// cosine of the steepest slope that still counts as ground
+	static constexpr float kGroundNormal = 0.7f;
+
+	// owned_world_ is the world when it is not shared
+	StaticCollision *owned_world_;
+	const StaticCollision *world_;
+	DynamicAabbTree dynamic_tree_;
+	std::vector<Body> bodies_;
+	BroadphaseStats stats_;
+	std::vector<Contact> contacts_;
+	// last search direction of a pair, the warm start of its next GJK run
+	struct AxisSlot {
+		uint64_t key;
+		glm::vec3 axis;
+		// narrowphase call that last used it, 0 when the slot is free
+		uint64_t used;
+	};
+
+	// a power of two; pairs that stop touching are evicted by the ones that
+	// need their slots, so the cache never grows
+	static const uint32_t kAxisSlots = 512;
+	static const uint32_t kAxisProbes = 8;
+
+	std::vector<AxisSlot> separating_axes_;
+	uint64_t narrowphase_calls_;
+
+	static void UpdateBoxes(Body &body);
+	glm::vec3 &SeparatingAxis(uint64_t key);
+	void Narrowphase(const ConvexShape &a, const ConvexShape &b, uint64_t key, bool &conflict);
+	static bool Blocks(const ConvexShape &a, const ConvexShape &b, Contact &contact);
+	static bool SweepInterval(const AABB &moving, const glm::vec3 &motion, const AABB &target, float &t0, float &t1);
+};
+
+constexpr float CollisionWorld::kMargin;
+constexpr float CollisionWorld::kGroundNormal;
+
+StaticCollision::StaticCollision(const Model &world, const glm::mat4 &world_matrix):
+	world_(world),
+	matrix_(world_matrix) {
+	for (const ConvexHull &hull : world.hulls())
+		boxes_.push_back(hull.box().Transform(world_matrix));
+	bvh_.Build(boxes_);
+}
+
+const std::vector<ConvexHull> &StaticCollision::hulls() const {
+	return world_.hulls();
+}
+
+const glm::mat4 &StaticCollision::matrix() const {
+	return matrix_;
+}
+
+const std::vector<AABB> &StaticCollision::boxes() const {
+	return boxes_;
+}
+
+const Bvh &StaticCollision::bvh() const {
+	return bvh_;
+}
+
+CollisionWorld::CollisionWorld(const Model &world, const glm::mat4 &world_matrix):
+	owned_world_(new StaticCollision(world, world_matrix)),
+	world_(owned_world_),
+	dynamic_tree_(kMargin),
+	stats_(),
+	separating_axes_(kAxisSlots, AxisSlot()),
+	narrowphase_calls_(0) {
+}
+
+CollisionWorld::CollisionWorld(const StaticCollision &world):
+	owned_world_(nullptr),
+	world_(&world),
+	dynamic_tree_(kMargin),
+	stats_(),
+	separating_axes_(kAxisSlots, AxisSlot()),
+	narrowphase_calls_(0) {
+}
+
+CollisionWorld::~CollisionWorld() {
+	delete owned_world_;
+}
+
+void CollisionWorld::UpdateBoxes(Body &body) {
+	const std::vector<ConvexHull> &hulls = body.model->hulls();
+	body.box = AABB();
+	for (uint32_t i = 0; i < hulls.size(); i++) {
+		AABB box = hulls[i].box().Transform(body.matrix);
+		body.box.Merge(box);
+		if (i < body.boxes.size())
+			body.boxes.Set(i, box);
+		else
+			body.boxes.Add(box);
+	}
+}
+
+uint32_t CollisionWorld::AddBody(const Model &model, const glm::mat4 &model_matrix) {
+	Body body;
+	body.model = &model;
+	body.matrix = model_matrix;
+	UpdateBoxes(body);
+	body.proxy = dynamic_tree_.Insert(body.box, bodies_.size());
+	bodies_.push_back(body);
+	return bodies_.size() - 1;
+}
+
+void CollisionWorld::MoveBody(uint32_t id, const glm::mat4 &model_matrix) {
+	Body &body = bodies_[id];
+	body.matrix = model_matrix;
+	UpdateBoxes(body);
+	dynamic_tree_.Move(body.proxy, body.box);
+}
+
+const BroadphaseStats &CollisionWorld::stats() const {
+	return stats_;
+}
+
+const std::vector<Contact> &CollisionWorld::contacts() const {
+	return contacts_;
+}
+
+glm::vec3 &CollisionWorld::SeparatingAxis(uint64_t key) {
+	narrowphase_calls_++;
+	uint32_t first = (uint32_t)(key * 0x9e3779b97f4a7c15ull >> 32) & (kAxisSlots - 1);
+	AxisSlot *oldest = nullptr;
+	for (uint32_t i = 0; i < kAxisProbes; i++) {
+		AxisSlot &slot = separating_axes_[(first + i) & (kAxisSlots - 1)];
+		if (slot.used && slot.key == key) {
+			slot.used = narrowphase_calls_;
+			return slot.axis;
+		}
+		if (!oldest || slot.used < oldest->used) oldest = &slot;
+	}
+	oldest->key = key;
+	oldest->axis = glm::vec3(0);
+	oldest->used = narrowphase_calls_;
+	return oldest->axis;
+}
+
+void CollisionWorld::Narrowphase(const ConvexShape &a, const ConvexShape &b, uint64_t key, bool &conflict) {
+	stats_.candidate_pairs++;
+	if (a.hull->empty() || b.hull->empty()) return;
+	glm::vec3 &axis = SeparatingAxis(key);
+	glm::vec3 direction = axis;
+	GjkSimplex simplex;
+	bool intersect = GjkIntersect(a, b, direction, simplex);
+	axis = direction;
+	if (!intersect) return;
+
+	Contact contact = EpaPenetration(a, b, simplex);
+	if (contact.normal.z >= kGroundNormal) {
+		stats_.supports++;
+		return;
+	}
+	stats_.contacts++;
+	contacts_.push_back(contact);
+	conflict = true;
+}
+
+bool CollisionWorld::Blocks(const ConvexShape &a, const ConvexShape &b, Contact &contact) {
+	glm::vec3 direction(0);
+	GjkSimplex simplex;
+	if (!GjkIntersect(a, b, direction, simplex)) return false;
+	contact = EpaPenetration(a, b, simplex);
+	return contact.normal.z < kGroundNormal;
+}
+
+bool CollisionWorld::SweepInterval(const AABB &moving, const glm::vec3 &motion, const AABB &target, float &t0, float &t1) {
+	// slabs of the target grown by the moving box, against its origin
+	t0 = 0;
+	t1 = 1;
+	for (int i = 0; i < 3; i++) {
+		float lo = target.small[i] - moving.big[i], hi = target.big[i] - moving.small[i];
+		if (std::fabs(motion[i]) < 1e-12f) {
+			if (lo > 0 || hi < 0) return false;
+			continue;
+		}
+		float a = lo / motion[i], b = hi / motion[i];
+		if (a > b) std::swap(a, b);
+		t0 = std::max(t0, a);
+		t1 = std::min(t1, b);
+		if (t0 > t1) return false;
+	}
+	return true;
+}
+
+float CollisionWorld::Sweep(uint32_t id, const glm::vec3 &motion) {
+	glm::vec3 normal;
+	return Sweep(id, motion, normal);
+}
+
+float CollisionWorld::Sweep(uint32_t id, const glm::vec3 &motion, glm::vec3 &normal) {
+	using namespace glm;
+	float length2 = dot(motion, motion);
+	if (length2 < 1e-20f) return 1;
+	vec3 direction = motion / std::sqrt(length2);
+	const Body &body = bodies_[id];
+	const std::vector<ConvexHull> &hulls = body.model->hulls();
+	const std::vector<ConvexHull> &world_hulls = world_->hulls();
+	auto moved = [&body, &motion](float t) {
+		return translate(mat4(1), motion * t) * body.matrix;
+	};
+
+	float best = 1;
+	for (uint32_t i = 0; i < hulls.size(); i++) {
+		if (hulls[i].empty()) continue;
+		ConvexShape shape(hulls[i], body.matrix);
+		// samples closer than the hull is thick along the motion
+		float thickness = dot(shape.Support(direction) - shape.Support(-direction), direction);
+		float sample = 0.5f * std::max(thickness, 1e-4f) / std::sqrt(length2);
+		AABB box = body.boxes.Get(i), swept = box;
+		swept.Merge(AABB(box.small + motion, box.big + motion));
+
+		world_->bvh().Query(swept, [&](uint32_t index) {
+			float t0, t1;
+			if (world_hulls[index].empty() || !SweepInterval(box, motion, world_->boxes()[index], t0, t1) || t0 >= best) return;
+			ConvexShape other(world_hulls[index], world_->matrix());
+			Contact contact;
+			// touching from the start: moving out or along it is free, further in is not
+			if (Blocks(ConvexShape(hulls[i], moved(0)), other, contact)) {
+				if (dot(direction, contact.normal) >= -1e-4f) return;
+				best = 0;
+				normal = contact.normal;
+				return;
+			}
+			float free = t0, t = t0;
+			t1 = std::min(t1, best);
+			while (true) {
+				if (Blocks(ConvexShape(hulls[i], moved(t)), other, contact)) {
+					Contact closest = contact;
+					for (int k = 0; k < kSweepBisections; k++) {
+						float mid = 0.5f * (free + t);
+						if (Blocks(ConvexShape(hulls[i], moved(mid)), other, contact)) {
+							t = mid;
+							closest = contact;
+						} else {
+							free = mid;
+						}
+					}
+					if (free < best) {
+						best = free;
+						normal = closest.normal;
+					}
+					return;
+				}
+				free = t;
+				if (t >= t1) return;
+				t = std::min(t + sample, t1);
+			}
+		});
+	}
+	return best;
+}
+
+bool CollisionWorld::Conflict(uint32_t id) {
+	stats_ = BroadphaseStats();
+	contacts_.clear();
+	const Body &body = bodies_[id];
+	const std::vector<ConvexHull> &hulls = body.model->hulls();
+	const std::vector<ConvexHull> &world_hulls = world_->hulls();
+	bool conflict = false;
+
+	// against the world, only the boxes the static tree reports
+	stats_.all_pairs += (uint64_t)hulls.size() * world_hulls.size();
+	for (uint32_t i = 0; i < hulls.size(); i++) {
+		ConvexShape shape(hulls[i], body.matrix);
+		world_->bvh().Query(body.boxes.Get(i), [&](uint32_t index) {
+			uint64_t key = ((uint64_t)id << 44) | ((uint64_t)i << 24) | index;
+			Narrowphase(shape, ConvexShape(world_hulls[index], world_->matrix()), key, conflict);
+		});
+	}
+
+	// against other bodies whose fat boxes overlap this one
+	for (uint32_t other_id = 0; other_id < bodies_.size(); other_id++)
+		if (other_id != id)
+			stats_.all_pairs += (uint64_t)hulls.size() * bodies_[other_id].model->hulls().size();
+	dynamic_tree_.Query(body.box, [&](uint32_t proxy) {
+		uint32_t other_id = dynamic_tree_.user(proxy);
+		if (other_id == id) return;
+		const Body &other = bodies_[other_id];
+		const std::vector<ConvexHull> &other_hulls = other.model->hulls();
+		for (uint32_t i = 0; i < hulls.size(); i++) {
+			ConvexShape shape(hulls[i], body.matrix);
+			other.boxes.Overlap(body.boxes.Get(i), [&](uint32_t j) {
+				// the top bit keeps body pairs apart from world pairs
+				uint64_t key = (1ull << 63) | ((uint64_t)id << 44) | ((uint64_t)other_id << 24) | ((uint64_t)i << 12) | j;
+				Narrowphase(shape, ConvexShape(other_hulls[j], other.matrix), key, conflict);
+			});
+		}
+	});
+	return conflict;
+}
@@ -0,0 +1,165 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <numeric>
+#include <utility>
+#include <cstdint>
+#include <cmath>
+
+#include <glm/glm.hpp>
+
+#include "aabb.hpp"
+#include "bvh.hpp"
+
+// Splits a triangle mesh into convex pieces, each given by its points, so
+// that a hull per piece keeps concave parts open: the road under a bridge,
+// the yard of a building, the foot of a ramp. Triangles are welded by
+// position and grown into pieces across shared edges. A triangle joins a
+// piece when it lies behind the planes of the piece and the piece behind
+// its own, up to kConcavity of the piece's size, and when no other triangle
+// of the mesh would then lie inside the piece: behind all its planes, within
+// its box. The last test catches the notch of a flat face cut around a
+// concave corner, which the planes alone do not see. Faces have to wind
+// outwards; where they do not, the pieces only come out smaller.
+std::vector<std::vector<glm::vec3> > ConvexPieces(const std::vector<glm::vec3> &positions, const std::vector<uint32_t> &indices);
+
+namespace convex_internal {
+
+// how deep a fold may be and still count as flat, of the diagonal of the piece
+const float kConcavity = 0.01f;
+// a piece stops growing here, which keeps growing them linear in the mesh
+const uint32_t kMaxTriangles = 256;
+
+struct Plane {
+	glm::vec3 normal;
+	float offset;
+	// false for triangles without area, which no point is in front of
+	bool valid;
+};
+
+inline Plane TrianglePlane(const glm::vec3 &a, const glm::vec3 &b, const glm::vec3 &c) {
+	Plane plane = { glm::cross(b - a, c - a), 0, false };
+	float len = glm::length(plane.normal);
+	if (len < 1e-20f) return plane;
+	plane.normal /= len;
+	plane.offset = glm::dot(plane.normal, a);
+	plane.valid = true;
+	return plane;
+}
+
+}
+
+std::vector<std::vector<glm::vec3> > ConvexPieces(const std::vector<glm::vec3> &positions, const std::vector<uint32_t> &indices) {
+	using namespace glm;
+	using namespace convex_internal;
+	const uint32_t kUnset = 0xffffffff;
+	uint32_t triangle_count = indices.size() / 3;
+	std::vector<std::vector<vec3> > pieces;
+	if (triangle_count == 0) return pieces;
+
+	// vertices at the same position share the id of the first in sorted order
+	std::vector<uint32_t> order(positions.size()), weld(positions.size());
+	std::iota(order.begin(), order.end(), 0);
+	std::sort(order.begin(), order.end(), [&positions](uint32_t l, uint32_t r) {
+		const vec3 &a = positions[l], &b = positions[r];
+		return a.x < b.x || (a.x == b.x && (a.y < b.y || (a.y == b.y && a.z < b.z)));
+	});
+	for (uint32_t i = 0; i < order.size(); i++)
+		weld[order[i]] = i > 0 && positions[order[i]] == positions[order[i - 1]] ? weld[order[i - 1]] : order[i];
+
+	// triangles across each welded edge, and from them the neighbours of
+	// every triangle, those of t at links[first[t]] up to links[first[t + 1]]
+	std::vector<std::pair<uint64_t, uint32_t> > edges;
+	for (uint32_t t = 0; t < triangle_count; t++)
+		for (int e = 0; e < 3; e++) {
+			uint64_t a = weld[indices[t * 3 + e]], b = weld[indices[t * 3 + (e + 1) % 3]];
+			if (a != b) edges.push_back(std::make_pair(std::min(a, b) << 32 | std::max(a, b), t));
+		}
+	std::sort(edges.begin(), edges.end());
+	std::vector<std::pair<uint32_t, uint32_t> > pairs;
+	for (uint32_t i = 0, j; i < edges.size(); i = j) {
+		for (j = i + 1; j < edges.size() && edges[j].first == edges[i].first; j++) {}
+		for (uint32_t k = i; k < j; k++)
+			for (uint32_t l = i; l < j; l++)
+				if (edges[k].second != edges[l].second) pairs.push_back(std::make_pair(edges[k].second, edges[l].second));
+	}
+	std::sort(pairs.begin(), pairs.end());
+	std::vector<uint32_t> first(triangle_count + 1, 0), links(pairs.size());
+	for (uint32_t i = 0; i < pairs.size(); i++) {
+		first[pairs[i].first + 1]++;
+		links[i] = pairs[i].second;
+	}
+	for (uint32_t t = 0; t < triangle_count; t++)
+		first[t + 1] += first[t];
+
+	std::vector<Plane> triangle_planes(triangle_count);
+	std::vector<vec3> centers(triangle_count);
+	std::vector<AABB> center_boxes(triangle_count);
+	for (uint32_t t = 0; t < triangle_count; t++) {
+		const vec3 &a = positions[indices[t * 3]], &b = positions[indices[t * 3 + 1]], &c = positions[indices[t * 3 + 2]];
+		triangle_planes[t] = TrianglePlane(a, b, c);
+		centers[t] = (a + b + c) / 3.0f;
+		center_boxes[t] = AABB(centers[t], centers[t]);
+	}
+	Bvh center_tree;
+	center_tree.Build(center_boxes);
+
+	// the piece grown: its distinct planes, its welded vertices and their box
+	std::vector<bool> assigned(triangle_count, false);
+	std::vector<uint32_t> piece_of_vertex(positions.size(), kUnset), queue;
+	std::vector<Plane> planes;
+	std::vector<vec3> points;
+	for (uint32_t seed = 0; seed < triangle_count; seed++) {
+		if (assigned[seed]) continue;
+		uint32_t piece = pieces.size(), size = 0;
+		planes.clear();
+		points.clear();
+		AABB box;
+		queue.assign(1, seed);
+		for (uint32_t head = 0; head < queue.size() && size < kMaxTriangles; head++) {
+			uint32_t t = queue[head];
+			if (assigned[t]) continue;
+			const vec3 corners[3] = { positions[indices[t * 3]], positions[indices[t * 3 + 1]], positions[indices[t * 3 + 2]] };
+			AABB grown = box;
+			for (const vec3 &corner : corners)
+				grown.Merge(corner);
+			float tolerance = kConcavity * length(grown.big - grown.small);
+			const Plane &own = triangle_planes[t];
+			bool convex = true;
+			for (uint32_t p = 0; convex && p < planes.size(); p++)
+				for (const vec3 &corner : corners)
+					if (dot(planes[p].normal, corner) - planes[p].offset > tolerance) convex = false;
+			for (uint32_t p = 0; convex && own.valid && p < points.size(); p++)
+				if (dot(own.normal, points[p]) - own.offset > tolerance) convex = false;
+			AABB inner(grown.small + tolerance, grown.big - tolerance);
+			if (convex && !inner.Empty())
+				center_tree.Query(inner, [&](uint32_t other) {
+					const vec3 &center = centers[other];
+					if (!convex || (own.valid && dot(own.normal, center) - own.offset >= -tolerance)) return;
+					for (const Plane &plane : planes)
+						if (dot(plane.normal, center) - plane.offset >= -tolerance) return;
+					convex = false;
+				});
+			if (!convex) continue;
+
+			assigned[t] = true;
+			size++;
+			box = grown;
+			bool known = !own.valid;
+			for (uint32_t p = 0; !known && p < planes.size(); p++)
+				known = dot(planes[p].normal, own.normal) > 1 - 1e-6f && std::fabs(planes[p].offset - own.offset) <= tolerance;
+			if (!known) planes.push_back(own);
+			for (int k = 0; k < 3; k++) {
+				uint32_t vertex = weld[indices[t * 3 + k]];
+				if (piece_of_vertex[vertex] == piece) continue;
+				piece_of_vertex[vertex] = piece;
+				points.push_back(corners[k]);
+			}
+			for (uint32_t l = first[t]; l < first[t + 1]; l++)
+				if (!assigned[links[l]]) queue.push_back(links[l]);
+		}
+		pieces.push_back(points);
+	}
+	return pieces;
+}
@@ -0,0 +1,235 @@
+#pragma once
+
+#include <vector>
+#include <utility>
+#include <algorithm>
+#include <cstdint>
+
+#include <glm/glm.hpp>
+
+#include "aabb.hpp"
+
+// Convex hull of a point cloud, kept as its vertices only: that is all the
+// support mapping used by GJK needs. Flat and degenerate clouds are handled
+// (a planar hull, a segment or a single point).
+class ConvexHull {
+public:
+	ConvexHull();
+	ConvexHull(const std::vector<glm::vec3> &points);
+
+	const std::vector<glm::vec3> &vertices() const;
+	const AABB &box() const;
+	bool empty() const;
+	// farthest hull vertex along direction
+	glm::vec3 Support(const glm::vec3 &direction) const;
+
+private:
+	struct Face {
+		uint32_t a, b, c;
+		glm::vec3 normal;
+		float offset;
+	};
+
+	std::vector<glm::vec3> vertices_;
+	AABB box_;
+
+	void BuildPlanar(const std::vector<glm::vec3> &points, const glm::vec3 &normal);
+	void BuildSolid(const std::vector<glm::vec3> &points, const uint32_t initial[4], float eps);
+	static Face MakeFace(const std::vector<glm::vec3> &points, uint32_t a, uint32_t b, uint32_t c, const glm::vec3 &inside);
+};
+
+ConvexHull::ConvexHull() {
+}
+
+const std::vector<glm::vec3> &ConvexHull::vertices() const {
+	return vertices_;
+}
+
+const AABB &ConvexHull::box() const {
+	return box_;
+}
+
+bool ConvexHull::empty() const {
+	return vertices_.empty();
+}
+
+glm::vec3 ConvexHull::Support(const glm::vec3 &direction) const {
+	uint32_t best = 0;
+	float best_dot = glm::dot(vertices_[0], direction);
+	for (uint32_t i = 1; i < vertices_.size(); i++) {
+		float d = glm::dot(vertices_[i], direction);
+		if (d > best_dot) {
+			best_dot = d;
+			best = i;
+		}
+	}
+	return vertices_[best];
+}
+
+ConvexHull::Face ConvexHull::MakeFace(const std::vector<glm::vec3> &points, uint32_t a, uint32_t b, uint32_t c, const glm::vec3 &inside) {
+	Face face = { a, b, c, glm::vec3(0), 0 };
+	glm::vec3 normal = glm::cross(points[b] - points[a], points[c] - points[a]);
+	float len = glm::length(normal);
+	// a sliver face never sees any point, which keeps it harmless
+	if (len < 1e-30f) return face;
+	face.normal = normal / len;
+	face.offset = glm::dot(face.normal, points[a]);
+	// faces point away from an interior point
+	if (glm::dot(face.normal, inside) - face.offset > 0) {
+		std::swap(face.b, face.c);
+		face.normal = -face.normal;
+		face.offset = -face.offset;
+	}
+	return face;
+}
+
+ConvexHull::ConvexHull(const std::vector<glm::vec3> &points) {
+	using namespace glm;
+	if (points.empty()) return;
+	for (const vec3 &p : points)
+		box_.Merge(p);
+	float eps = 1e-5f * std::max(length(box_.big - box_.small), 1e-20f);
+
+	// the two points farthest apart among the axis extremes
+	uint32_t extremes[6] = { 0, 0, 0, 0, 0, 0 };
+	for (uint32_t i = 0; i < points.size(); i++) {
+		for (int axis = 0; axis < 3; axis++) {
+			if (points[i][axis] < points[extremes[axis * 2]][axis]) extremes[axis * 2] = i;
+			if (points[i][axis] > points[extremes[axis * 2 + 1]][axis]) extremes[axis * 2 + 1] = i;
+		}
+	}
+	uint32_t initial[4] = { 0, 0, 0, 0 };
+	float best = -1;
+	for (int i = 0; i < 6; i++)
+		for (int j = i + 1; j < 6; j++) {
+			vec3 d = points[extremes[i]] - points[extremes[j]];
+			if (dot(d, d) > best) {
+				best = dot(d, d);
+				initial[0] = extremes[i];
+				initial[1] = extremes[j];
+			}
+		}
+	if (best <= eps * eps) {
+		vertices_.push_back(points[initial[0]]);
+		return;
+	}
+
+	// farthest from the line, then farthest from the plane
+	vec3 a = points[initial[0]], ab = normalize(points[initial[1]] - a);
+	best = -1;
+	for (uint32_t i = 0; i < points.size(); i++) {
+		vec3 d = points[i] - a;
+		float dist = length(d - ab * dot(d, ab));
+		if (dist > best) {
+			best = dist;
+			initial[2] = i;
+		}
+	}
+	if (best <= eps) {
+		vertices_.push_back(points[initial[0]]);
+		vertices_.push_back(points[initial[1]]);
+		return;
+	}
+	vec3 normal = normalize(cross(points[initial[1]] - a, points[initial[2]] - a));
+	best = -1;
+	for (uint32_t i = 0; i < points.size(); i++) {
+		float dist = std::fabs(dot(points[i] - a, normal));
+		if (dist > best) {
+			best = dist;
+			initial[3] = i;
+		}
+	}
+	if (best <= eps)
+		BuildPlanar(points, normal);
+	else
+		BuildSolid(points, initial, eps);
+}
+
+void ConvexHull::BuildPlanar(const std::vector<glm::vec3> &points, const glm::vec3 &normal) {
+	using namespace glm;
+	// monotone chain in a basis of the plane
+	vec3 u = normalize(std::fabs(normal.x) < 0.9f ? cross(normal, vec3(1, 0, 0)) : cross(normal, vec3(0, 1, 0)));
+	vec3 v = cross(normal, u);
+	std::vector<std::pair<vec2, uint32_t> > projected(points.size());
+	for (uint32_t i = 0; i < points.size(); i++)
+		projected[i] = std::make_pair(vec2(dot(points[i], u), dot(points[i], v)), i);
+	std::sort(projected.begin(), projected.end(), [](const std::pair<vec2, uint32_t> &l, const std::pair<vec2, uint32_t> &r) {
+		return l.first.x < r.first.x || (l.first.x == r.first.x && l.first.y < r.first.y);
+	});
+	auto turn = [](const vec2 &o, const vec2 &p, const vec2 &q) {
+		return (p.x - o.x) * (q.y - o.y) - (p.y - o.y) * (q.x - o.x);
+	};
+	std::vector<std::pair<vec2, uint32_t> > chain(2 * projected.size());
+	uint32_t k = 0;
+	for (uint32_t i = 0; i < projected.size(); i++) {
+		while (k >= 2 && turn(chain[k - 2].first, chain[k - 1].first, projected[i].first) <= 0) k--;
+		chain[k++] = projected[i];
+	}
+	for (int i = (int)projected.size() - 2, lower = k + 1; i >= 0; i--) {
+		while ((int)k >= lower && turn(chain[k - 2].first, chain[k - 1].first, projected[i].first) <= 0) k--;
+		chain[k++] = projected[i];
+	}
+	for (uint32_t i = 0; i + 1 < k; i++)
+		vertices_.push_back(points[chain[i].second]);
+}
+
+void ConvexHull::BuildSolid(const std::vector<glm::vec3> &points, const uint32_t initial[4], float eps) {
+	using namespace glm;
+	vec3 inside = (points[initial[0]] + points[initial[1]] + points[initial[2]] + points[initial[3]]) * 0.25f;
+	std::vector<Face> faces;
+	faces.push_back(MakeFace(points, initial[0], initial[1], initial[2], inside));
+	faces.push_back(MakeFace(points, initial[0], initial[3], initial[1], inside));
+	faces.push_back(MakeFace(points, initial[1], initial[3], initial[2], inside));
+	faces.push_back(MakeFace(points, initial[2], initial[3], initial[0], inside));
+
+	// incremental: every point outside the current hull replaces the faces it
+	// sees with a fan over their horizon
+	std::vector<Face> kept;
+	// the horizon, kept across points so that it stops allocating once grown;
+	// an edge shared by two visible faces is interior to the hole
+	std::vector<std::pair<uint32_t, uint32_t> > edges;
+	for (uint32_t i = 0; i < points.size(); i++) {
+		const vec3 &p = points[i];
+		bool outside = false;
+		for (const Face &face : faces)
+			if (dot(face.normal, p) - face.offset > eps) {
+				outside = true;
+				break;
+			}
+		if (!outside) continue;
+
+		kept.clear();
+		edges.clear();
+		for (const Face &face : faces) {
+			if (dot(face.normal, p) - face.offset > eps) {
+				uint32_t corners[3] = { face.a, face.b, face.c };
+				for (int e = 0; e < 3; e++) {
+					std::pair<uint32_t, uint32_t> twin(corners[(e + 1) % 3], corners[e]);
+					auto it = std::find(edges.begin(), edges.end(), twin);
+					if (it != edges.end()) {
+						*it = edges.back();
+						edges.pop_back();
+					} else {
+						edges.push_back(std::make_pair(corners[e], corners[(e + 1) % 3]));
+					}
+				}
+			} else {
+				kept.push_back(face);
+			}
+		}
+		for (const std::pair<uint32_t, uint32_t> &edge : edges)
+			kept.push_back(MakeFace(points, edge.first, edge.second, i, inside));
+		faces.swap(kept);
+	}
+
+	std::vector<uint32_t> used;
+	for (const Face &face : faces) {
+		used.push_back(face.a);
+		used.push_back(face.b);
+		used.push_back(face.c);
+	}
+	std::sort(used.begin(), used.end());
+	used.erase(std::unique(used.begin(), used.end()), used.end());
+	for (uint32_t index : used)
+		vertices_.push_back(points[index]);
+}
@@ -0,0 +1,648 @@
+#pragma once
+
+#include <vector>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <limits>
+#include <algorithm>
+#include <cstdint>
+#include <cmath>
+
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <xmmintrin.h>
+#endif
+
+#include "box_store.hpp"
+#include "nav_mesh.hpp"
+#include "path_service.hpp"
+#include "job_system.hpp"
+
+struct CrowdStats {
+	// errands: agents walking a path of the path service
+	uint32_t agents, overlapping, blocked, errands;
+	double update_ms;
+};
+
+// Pedestrians as structure of arrays, padded to whole blocks of kLanes,
+// walking between nearby nodes of the navigation grid. Avoidance is
+// sampled reciprocal velocity obstacles: every agent scores kSamples
+// candidate velocities, kLanes at a time, by how soon they run into one of
+// the closest kMaxNeighbors agents if those take half the avoiding, and by
+// how far they are from the velocity it wants. Like Traffic, an update
+// reads the state at its start, here through a grid over the navigation
+// grid sorted by cell, so chunks of agents run as separate jobs without
+// locks. Agents avoid in the order of the grid, which keeps the cells they
+// read close to the ones read just before. The crowd steps at kRate, below
+// the simulation rate; Update only collects time until a step is due.
+// Given a path service, up to kErrands agents at a time leave their
+// neighbourhood for a node anywhere in the city: an agent asks for a path,
+// stands until it comes and then walks it node by node.
+class Crowd {
+public:
+#if defined(__AVX__)
+	static const uint32_t kLanes = 8;
+#elif defined(__SSE2__)
+	static const uint32_t kLanes = 4;
+#else
+	static const uint32_t kLanes = 1;
+#endif
+
+	Crowd() = delete;
+	explicit Crowd(const NavMesh &nav_mesh);
+
+	// count agents on random nodes of the navigation grid
+	void Spawn(uint32_t count, uint32_t seed = 1);
+	// nullptr, the default, for no errands
+	void set_paths(PathService *paths);
+	void Update(float time);
+
+	uint32_t size() const;
+	const CrowdStats &stats() const;
+	// visit(previous, current) of every agent within distance of center at
+	// the last update: its matrices as of the update before and as of that
+	// one, blended between the last two crowd steps
+	template <typename Visitor> void ForEachMatrix(const glm::vec3 &center, float distance, Visitor visit) const;
+
+private:
+	typedef std::vector<float, AlignedAllocator<float, 32> > Lane;
+
+	static const uint32_t kSamples = 16;
+	static const uint32_t kMaxNeighbors = 10;
+	static const uint32_t kChunk = 512;
+	static const uint32_t kGoalAttempts = 4;
+	static const uint32_t kErrands = 64;
+	// nodes an errand's path holds from the start, a longer one grows it once
+	static const uint32_t kErrandPath = 1024;
+	static const uint32_t kNoErrand = 0xffffffff;
+	static constexpr float kRadius = 0.015f;
+	static constexpr float kCellSize = 0.15f;
+	static constexpr float kWalkSpeed = 0.12f;
+	static constexpr float kMaxSpeed = 0.18f;
+	static constexpr float kWander = 1.5f;
+	static constexpr float kArrival = 0.05f;
+	// weight of a collision one second ahead against one unit of speed
+	// away from the preferred velocity
+	static constexpr float kAvoidWeight = 0.05f;
+	static constexpr float kHorizon = 3.0f;
+	static constexpr float kRate = 30.0f;
+
+	enum class ErrandState { FREE, PENDING, WALKING, DONE };
+
+	struct Errand {
+		uint32_t agent, ticket;
+		// index in path of the node walked to
+		uint32_t next;
+		ErrandState state;
+		std::vector<glm::vec3> path;
+	};
+
+	const NavMesh &nav_mesh_;
+	PathService *paths_;
+	Lane x_, y_, z_, vx_, vy_, goal_x_, goal_y_;
+	Lane previous_x_, previous_y_, previous_z_;
+	std::vector<uint8_t> active_;
+	// the errand of each agent, kNoErrand for none; an update only touches
+	// the errand of the agent it moves
+	std::vector<uint32_t> errand_;
+	std::vector<Errand> errands_;
+	uint32_t errand_cursor_;
+	uint32_t size_, frame_;
+	// time since the last step, and the length of the last update
+	float pending_time_, update_time_;
+	// the candidates but the preferred and the current velocity, as fractions
+	// of kMaxSpeed; each agent turns them by its own angle every update
+	float pattern_x_[kSamples], pattern_y_[kSamples];
+	struct GridEntry {
+		float x, y, z, vx, vy;
+		uint32_t entity;
+	};
+	// over the bounds of the navigation grid, cells in rows; cell_start_ has
+	// one extra entry
+	glm::vec2 grid_origin_;
+	uint32_t grid_nx_, grid_ny_;
+	// cell_fill_ is scratch of the rebuild, kept so that a step allocates nothing
+	std::vector<uint32_t> cell_start_, entity_cell_, cell_fill_;
+	std::vector<GridEntry> cell_entities_;
+	std::atomic<uint32_t> overlapping_, blocked_;
+	CrowdStats stats_;
+
+	struct Neighborhood {
+		uint32_t count;
+		// relative to the agent
+		float x[kMaxNeighbors], y[kMaxNeighbors];
+		float vx[kMaxNeighbors], vy[kMaxNeighbors];
+		float distance2[kMaxNeighbors];
+	};
+
+	uint32_t Allocate();
+	uint32_t Cell(float x, float y) const;
+	void BuildHash();
+	// a uniform number in [0, 1) from the entity and the update
+	float Random(uint32_t entity, uint32_t salt) const;
+	void PickGoal(uint32_t i);
+	// once the agent reached its goal or was stopped from walking to it
+	void NextGoal(uint32_t i, bool blocked);
+	// polls the pending, frees the done and starts at most one
+	void UpdateErrands();
+	void Gather(uint32_t i, Neighborhood &neighborhood) const;
+	// penalty of every candidate velocity against the neighborhood, with
+	// the candidates and the own velocity relative to nothing
+	void Score(const Neighborhood &neighborhood, float vx, float vy, const float *candidate_x, const float *candidate_y, float *penalty) const;
+	// for the entries of cell_entities_ from begin to end; the step length
+	// is not used, only taken so that it runs as a pass like Integrate
+	void Avoid(uint32_t begin, uint32_t end, float);
+	void Integrate(uint32_t begin, uint32_t end, float time);
+	void Step(float time);
+};
+
+constexpr float Crowd::kRadius;
+constexpr float Crowd::kCellSize;
+constexpr float Crowd::kWalkSpeed;
+constexpr float Crowd::kMaxSpeed;
+constexpr float Crowd::kWander;
+constexpr float Crowd::kArrival;
+constexpr float Crowd::kAvoidWeight;
+constexpr float Crowd::kHorizon;
+constexpr float Crowd::kRate;
+const uint32_t Crowd::kNoErrand;
+
+Crowd::Crowd(const NavMesh &nav_mesh):
+	nav_mesh_(nav_mesh),
+	paths_(nullptr),
+	errands_(kErrands),
+	errand_cursor_(0),
+	size_(0),
+	frame_(0),
+	pending_time_(0),
+	update_time_(0),
+	grid_origin_(0),
+	grid_nx_(1),
+	grid_ny_(1),
+	overlapping_(0),
+	blocked_(0),
+	stats_() {
+	for (Errand &errand : errands_)
+		errand.path.reserve(kErrandPath);
+	if (!nav_mesh_.empty()) {
+		glm::vec2 small(std::numeric_limits<float>::max()), big(-std::numeric_limits<float>::max());
+		for (uint32_t i = 0; i < nav_mesh_.size(); i++) {
+			glm::vec2 p(nav_mesh_.position(i));
+			small = glm::min(small, p);
+			big = glm::max(big, p);
+		}
+		// agents stay within half a navigation cell of the nodes
+		grid_origin_ = small - glm::vec2(kCellSize);
+		grid_nx_ = (uint32_t)std::ceil((big.x - small.x) / kCellSize) + 3;
+		grid_ny_ = (uint32_t)std::ceil((big.y - small.y) / kCellSize) + 3;
+	}
+	// a standing sample, then rings at full and at half speed
+	pattern_x_[0] = pattern_y_[0] = pattern_x_[1] = pattern_y_[1] = 0;
+	const uint32_t ring = (kSamples - 2) / 2;
+	for (uint32_t k = 0; k < kSamples - 2; k++) {
+		float angle = 2 * (float)M_PI * (k % ring + 0.5f * (k / ring)) / ring;
+		float speed = k < ring ? 1.0f : 0.5f;
+		pattern_x_[k + 2] = speed * std::cos(angle);
+		pattern_y_[k + 2] = speed * std::sin(angle);
+	}
+}
+
+uint32_t Crowd::size() const {
+	return size_;
+}
+
+const CrowdStats &Crowd::stats() const {
+	return stats_;
+}
+
+void Crowd::set_paths(PathService *paths) {
+	paths_ = paths;
+}
+
+uint32_t Crowd::Allocate() {
+	if (size_ % kLanes == 0) {
+		uint32_t padded = size_ + kLanes;
+		for (Lane *lane : { &x_, &y_, &z_, &vx_, &vy_, &goal_x_, &goal_y_, &previous_x_, &previous_y_, &previous_z_ })
+			lane->resize(padded, 0);
+		active_.resize(padded, 0);
+		errand_.resize(padded, kNoErrand);
+	}
+	return size_++;
+}
+
+void Crowd::Spawn(uint32_t count, uint32_t seed) {
+	if (nav_mesh_.empty()) return;
+	std::mt19937 random(seed);
+	std::uniform_int_distribution<uint32_t> node(0, nav_mesh_.size() - 1);
+	std::uniform_real_distribution<float> offset(-0.08f, 0.08f);
+	for (uint32_t i = 0; i < count; i++) {
+		glm::vec3 p = nav_mesh_.position(node(random));
+		uint32_t entity = Allocate();
+		x_[entity] = previous_x_[entity] = p.x + offset(random);
+		y_[entity] = previous_y_[entity] = p.y + offset(random);
+		z_[entity] = previous_z_[entity] = p.z;
+		active_[entity] = 1;
+		goal_x_[entity] = x_[entity];
+		goal_y_[entity] = y_[entity];
+		PickGoal(entity);
+	}
+}
+
+float Crowd::Random(uint32_t entity, uint32_t salt) const {
+	uint32_t h = entity * 0x9e3779b9u ^ (frame_ + salt * 0x85ebca6bu) * 0xc2b2ae35u;
+	h ^= h >> 16;
+	h *= 0x7feb352du;
+	h ^= h >> 15;
+	h *= 0x846ca68bu;
+	h ^= h >> 16;
+	return (h >> 8) * (1.0f / (1 << 24));
+}
+
+void Crowd::PickGoal(uint32_t i) {
+	// somewhere near that the agent can stand on, or stay put until the
+	// next try
+	for (uint32_t attempt = 0; attempt < kGoalAttempts; attempt++) {
+		float angle = 2 * (float)M_PI * Random(i, 2 * attempt), distance = kWander * Random(i, 2 * attempt + 1);
+		glm::vec3 goal(x_[i] + distance * std::cos(angle), y_[i] + distance * std::sin(angle), z_[i]);
+		int32_t node = nav_mesh_.Locate(goal);
+		if (node == NavMesh::kNone || std::fabs(nav_mesh_.position(node).z - z_[i]) > kCellSize) continue;
+		goal_x_[i] = goal.x;
+		goal_y_[i] = goal.y;
+		return;
+	}
+	goal_x_[i] = x_[i];
+	goal_y_[i] = y_[i];
+}
+
+void Crowd::NextGoal(uint32_t i, bool blocked) {
+	uint32_t e = errand_[i];
+	if (e == kNoErrand) {
+		PickGoal(i);
+		return;
+	}
+	Errand &errand = errands_[e];
+	// still waiting for the path where it asked, or already given up
+	if (errand.state != ErrandState::WALKING) return;
+	if (!blocked && ++errand.next < errand.path.size()) {
+		goal_x_[i] = errand.path[errand.next].x;
+		goal_y_[i] = errand.path[errand.next].y;
+		return;
+	}
+	// at the end, or off the path so that the rest of it is no use
+	errand.state = ErrandState::DONE;
+	PickGoal(i);
+}
+
+void Crowd::UpdateErrands() {
+	stats_.errands = 0;
+	if (!paths_ || size_ == 0) return;
+	bool started = false;
+	for (uint32_t e = 0; e < kErrands; e++) {
+		Errand &errand = errands_[e];
+		bool found = false;
+		switch (errand.state) {
+			case ErrandState::PENDING:
+				if (!paths_->Poll(errand.ticket, errand.path, found)) break;
+				// the first node is the one the agent asked from
+				if (found && errand.path.size() > 1) {
+					errand.state = ErrandState::WALKING;
+					errand.next = 1;
+					goal_x_[errand.agent] = errand.path[1].x;
+					goal_y_[errand.agent] = errand.path[1].y;
+					stats_.errands++;
+					break;
+				}
+				errand_[errand.agent] = kNoErrand;
+				errand.state = ErrandState::FREE;
+				PickGoal(errand.agent);
+				break;
+			case ErrandState::WALKING:
+				stats_.errands++;
+				break;
+			case ErrandState::DONE:
+				errand_[errand.agent] = kNoErrand;
+				errand.state = ErrandState::FREE;
+				break;
+			case ErrandState::FREE: {
+				if (started) break;
+				started = true;
+				// the agents take turns, and one busy already lets this step pass
+				uint32_t i = errand_cursor_;
+				errand_cursor_ = (errand_cursor_ + 1) % size_;
+				if (!active_[i] || errand_[i] != kNoErrand) break;
+				uint32_t goal = std::min<uint32_t>(Random(i, 0x200) * nav_mesh_.size(), nav_mesh_.size() - 1);
+				errand.agent = i;
+				errand.ticket = paths_->Request(glm::vec3(x_[i], y_[i], z_[i]), nav_mesh_.position(goal));
+				errand.state = ErrandState::PENDING;
+				errand_[i] = e;
+				goal_x_[i] = x_[i];
+				goal_y_[i] = y_[i];
+				break;
+			}
+		}
+	}
+}
+
+uint32_t Crowd::Cell(float x, float y) const {
+	int32_t cx = (int32_t)std::floor((x - grid_origin_.x) / kCellSize), cy = (int32_t)std::floor((y - grid_origin_.y) / kCellSize);
+	cx = std::max(0, std::min(cx, (int32_t)grid_nx_ - 1));
+	cy = std::max(0, std::min(cy, (int32_t)grid_ny_ - 1));
+	return cy * grid_nx_ + cx;
+}
+
+void Crowd::BuildHash() {
+	uint32_t cells = grid_nx_ * grid_ny_;
+	cell_start_.assign(cells + 1, 0);
+	entity_cell_.resize(size_);
+	for (uint32_t i = 0; i < size_; i++) {
+		if (!active_[i]) continue;
+		entity_cell_[i] = Cell(previous_x_[i], previous_y_[i]);
+		cell_start_[entity_cell_[i] + 1]++;
+	}
+	for (uint32_t c = 0; c < cells; c++)
+		cell_start_[c + 1] += cell_start_[c];
+	cell_entities_.resize(cell_start_[cells]);
+	cell_fill_.assign(cell_start_.begin(), cell_start_.end() - 1);
+	for (uint32_t i = 0; i < size_; i++) {
+		if (!active_[i]) continue;
+		GridEntry entry = { previous_x_[i], previous_y_[i], previous_z_[i], vx_[i], vy_[i], i };
+		cell_entities_[cell_fill_[entity_cell_[i]]++] = entry;
+	}
+}
+
+void Crowd::Gather(uint32_t i, Neighborhood &neighborhood) const {
+	float px = previous_x_[i], py = previous_y_[i], pz = previous_z_[i];
+	float radius2 = kCellSize * kCellSize;
+	uint32_t cell = entity_cell_[i], cx = cell % grid_nx_, cy = cell / grid_nx_;
+	uint32_t x0 = cx > 0 ? cx - 1 : 0, x1 = std::min(cx + 1, grid_nx_ - 1);
+	neighborhood.count = 0;
+	for (uint32_t y = cy > 0 ? cy - 1 : 0; y <= std::min(cy + 1, grid_ny_ - 1); y++) {
+		// the three cells of a row are one run of entries
+		for (uint32_t k = cell_start_[y * grid_nx_ + x0]; k < cell_start_[y * grid_nx_ + x1 + 1]; k++) {
+			const GridEntry &entry = cell_entities_[k];
+			float dx = entry.x - px, dy = entry.y - py;
+			float distance2 = dx * dx + dy * dy;
+			// agents on another floor do not meet
+			if (entry.entity == i || distance2 > radius2 || std::fabs(entry.z - pz) > kCellSize) continue;
+			// keep the closest, by insertion into the sorted list
+			uint32_t slot = neighborhood.count;
+			if (slot == kMaxNeighbors) {
+				if (distance2 >= neighborhood.distance2[kMaxNeighbors - 1]) continue;
+				slot--;
+			} else {
+				neighborhood.count++;
+			}
+			for (; slot > 0 && neighborhood.distance2[slot - 1] > distance2; slot--) {
+				neighborhood.x[slot] = neighborhood.x[slot - 1];
+				neighborhood.y[slot] = neighborhood.y[slot - 1];
+				neighborhood.vx[slot] = neighborhood.vx[slot - 1];
+				neighborhood.vy[slot] = neighborhood.vy[slot - 1];
+				neighborhood.distance2[slot] = neighborhood.distance2[slot - 1];
+			}
+			neighborhood.x[slot] = dx;
+			neighborhood.y[slot] = dy;
+			neighborhood.vx[slot] = entry.vx;
+			neighborhood.vy[slot] = entry.vy;
+			neighborhood.distance2[slot] = distance2;
+		}
+	}
+}
+
+void Crowd::Score(const Neighborhood &neighborhood, float vx, float vy, const float *candidate_x, const float *candidate_y, float *penalty) const {
+	// the candidate c is reciprocal to neighbour j when the relative velocity
+	// is w = 2c - v - vj; the time to collision is the first root of
+	// |w t - p| = 2 kRadius, and the penalty is kAvoidWeight over it on top
+	// of the distance to the preferred velocity, already in penalty
+	const float combined2 = 4 * kRadius * kRadius;
+#if defined(__AVX__)
+	__m256 zero = _mm256_setzero_ps(), horizon = _mm256_set1_ps(kHorizon), weight = _mm256_set1_ps(kAvoidWeight);
+	__m256 floor = _mm256_set1_ps(1e-3f);
+	for (uint32_t first = 0; first < kSamples; first += 8) {
+		__m256 cx = _mm256_sub_ps(_mm256_add_ps(_mm256_load_ps(candidate_x + first), _mm256_load_ps(candidate_x + first)), _mm256_set1_ps(vx));
+		__m256 cy = _mm256_sub_ps(_mm256_add_ps(_mm256_load_ps(candidate_y + first), _mm256_load_ps(candidate_y + first)), _mm256_set1_ps(vy));
+		__m256 ttc = horizon;
+		for (uint32_t j = 0; j < neighborhood.count; j++) {
+			__m256 wx = _mm256_sub_ps(cx, _mm256_set1_ps(neighborhood.vx[j]));
+			__m256 wy = _mm256_sub_ps(cy, _mm256_set1_ps(neighborhood.vy[j]));
+			__m256 px = _mm256_set1_ps(neighborhood.x[j]), py = _mm256_set1_ps(neighborhood.y[j]);
+			__m256 a = _mm256_add_ps(_mm256_mul_ps(wx, wx), _mm256_mul_ps(wy, wy));
+			__m256 b = _mm256_add_ps(_mm256_mul_ps(wx, px), _mm256_mul_ps(wy, py));
+			float c = neighborhood.distance2[j] - combined2;
+			__m256 approaching = _mm256_cmp_ps(b, zero, _CMP_GT_OQ);
+			__m256 t;
+			if (c < 0) {
+				// overlapping already: only moving apart is free
+				t = _mm256_blendv_ps(horizon, zero, approaching);
+			} else {
+				__m256 discriminant = _mm256_sub_ps(_mm256_mul_ps(b, b), _mm256_mul_ps(a, _mm256_set1_ps(c)));
+				__m256 hit = _mm256_and_ps(approaching, _mm256_cmp_ps(discriminant, zero, _CMP_GT_OQ));
+				__m256 root = _mm256_div_ps(_mm256_sub_ps(b, _mm256_sqrt_ps(_mm256_max_ps(discriminant, zero))), _mm256_max_ps(a, floor));
+				t = _mm256_blendv_ps(horizon, root, hit);
+			}
+			ttc = _mm256_min_ps(ttc, t);
+		}
+		__m256 avoid = _mm256_div_ps(weight, _mm256_max_ps(ttc, floor));
+		avoid = _mm256_and_ps(avoid, _mm256_cmp_ps(ttc, horizon, _CMP_LT_OQ));
+		_mm256_store_ps(penalty + first, _mm256_add_ps(_mm256_load_ps(penalty + first), avoid));
+	}
+#elif defined(__SSE2__)
+	__m128 zero = _mm_setzero_ps(), horizon = _mm_set1_ps(kHorizon), weight = _mm_set1_ps(kAvoidWeight);
+	__m128 floor = _mm_set1_ps(1e-3f);
+	for (uint32_t first = 0; first < kSamples; first += 4) {
+		__m128 cx = _mm_sub_ps(_mm_add_ps(_mm_load_ps(candidate_x + first), _mm_load_ps(candidate_x + first)), _mm_set1_ps(vx));
+		__m128 cy = _mm_sub_ps(_mm_add_ps(_mm_load_ps(candidate_y + first), _mm_load_ps(candidate_y + first)), _mm_set1_ps(vy));
+		__m128 ttc = horizon;
+		for (uint32_t j = 0; j < neighborhood.count; j++) {
+			__m128 wx = _mm_sub_ps(cx, _mm_set1_ps(neighborhood.vx[j]));
+			__m128 wy = _mm_sub_ps(cy, _mm_set1_ps(neighborhood.vy[j]));
+			__m128 px = _mm_set1_ps(neighborhood.x[j]), py = _mm_set1_ps(neighborhood.y[j]);
+			__m128 a = _mm_add_ps(_mm_mul_ps(wx, wx), _mm_mul_ps(wy, wy));
+			__m128 b = _mm_add_ps(_mm_mul_ps(wx, px), _mm_mul_ps(wy, py));
+			float c = neighborhood.distance2[j] - combined2;
+			__m128 approaching = _mm_cmpgt_ps(b, zero);
+			__m128 t;
+			if (c < 0) {
+				t = _mm_andnot_ps(approaching, horizon);
+			} else {
+				__m128 discriminant = _mm_sub_ps(_mm_mul_ps(b, b), _mm_mul_ps(a, _mm_set1_ps(c)));
+				__m128 hit = _mm_and_ps(approaching, _mm_cmpgt_ps(discriminant, zero));
+				__m128 root = _mm_div_ps(_mm_sub_ps(b, _mm_sqrt_ps(_mm_max_ps(discriminant, zero))), _mm_max_ps(a, floor));
+				t = _mm_or_ps(_mm_and_ps(hit, root), _mm_andnot_ps(hit, horizon));
+			}
+			ttc = _mm_min_ps(ttc, t);
+		}
+		__m128 avoid = _mm_div_ps(weight, _mm_max_ps(ttc, floor));
+		avoid = _mm_and_ps(avoid, _mm_cmplt_ps(ttc, horizon));
+		_mm_store_ps(penalty + first, _mm_add_ps(_mm_load_ps(penalty + first), avoid));
+	}
+#else
+	for (uint32_t k = 0; k < kSamples; k++) {
+		float cx = 2 * candidate_x[k] - vx, cy = 2 * candidate_y[k] - vy;
+		float ttc = kHorizon;
+		for (uint32_t j = 0; j < neighborhood.count; j++) {
+			float wx = cx - neighborhood.vx[j], wy = cy - neighborhood.vy[j];
+			float a = wx * wx + wy * wy, b = wx * neighborhood.x[j] + wy * neighborhood.y[j];
+			float c = neighborhood.distance2[j] - combined2;
+			if (b <= 0) continue;
+			if (c < 0) {
+				ttc = 0;
+				continue;
+			}
+			float discriminant = b * b - a * c;
+			if (discriminant > 0)
+				ttc = std::min(ttc, (b - std::sqrt(discriminant)) / std::max(a, 1e-3f));
+		}
+		if (ttc < kHorizon) penalty[k] += kAvoidWeight / std::max(ttc, 1e-3f);
+	}
+#endif
+}
+
+void Crowd::Avoid(uint32_t begin, uint32_t end, float) {
+	alignas(32) float candidate_x[kSamples], candidate_y[kSamples], penalty[kSamples];
+	Neighborhood neighborhood;
+	uint32_t overlapping = 0;
+	for (uint32_t k = begin; k < end; k++) {
+		uint32_t i = cell_entities_[k].entity;
+		float dx = goal_x_[i] - previous_x_[i], dy = goal_y_[i] - previous_y_[i];
+		float distance = std::sqrt(dx * dx + dy * dy);
+		// slowing down over the last stretch
+		float speed = std::min(kWalkSpeed, distance);
+		float preferred_x = distance > 1e-6f ? dx / distance * speed : 0;
+		float preferred_y = distance > 1e-6f ? dy / distance * speed : 0;
+
+		Gather(i, neighborhood);
+		if (neighborhood.count == 0) {
+			vx_[i] = preferred_x;
+			vy_[i] = preferred_y;
+			continue;
+		}
+		overlapping += neighborhood.distance2[0] < 4 * kRadius * kRadius;
+
+		float angle = 2 * (float)M_PI * Random(i, 0x100);
+		float cos_angle = std::cos(angle) * kMaxSpeed, sin_angle = std::sin(angle) * kMaxSpeed;
+		for (uint32_t k = 0; k < kSamples; k++) {
+			candidate_x[k] = pattern_x_[k] * cos_angle - pattern_y_[k] * sin_angle;
+			candidate_y[k] = pattern_x_[k] * sin_angle + pattern_y_[k] * cos_angle;
+		}
+		candidate_x[0] = preferred_x;
+		candidate_y[0] = preferred_y;
+		candidate_x[1] = vx_[i];
+		candidate_y[1] = vy_[i];
+		for (uint32_t k = 0; k < kSamples; k++) {
+			float ex = candidate_x[k] - preferred_x, ey = candidate_y[k] - preferred_y;
+			penalty[k] = std::sqrt(ex * ex + ey * ey);
+		}
+		Score(neighborhood, vx_[i], vy_[i], candidate_x, candidate_y, penalty);
+		uint32_t best = std::min_element(penalty, penalty + kSamples) - penalty;
+		vx_[i] = candidate_x[best];
+		vy_[i] = candidate_y[best];
+	}
+	overlapping_ += overlapping;
+}
+
+void Crowd::Integrate(uint32_t begin, uint32_t end, float time) {
+	// begin and end are whole blocks, padding has no velocity
+#if defined(__AVX__)
+	__m256 dt = _mm256_set1_ps(time);
+	for (uint32_t i = begin; i < end; i += 8) {
+		_mm256_store_ps(&x_[i], _mm256_add_ps(_mm256_load_ps(&previous_x_[i]), _mm256_mul_ps(_mm256_load_ps(&vx_[i]), dt)));
+		_mm256_store_ps(&y_[i], _mm256_add_ps(_mm256_load_ps(&previous_y_[i]), _mm256_mul_ps(_mm256_load_ps(&vy_[i]), dt)));
+	}
+#elif defined(__SSE2__)
+	__m128 dt = _mm_set1_ps(time);
+	for (uint32_t i = begin; i < end; i += 4) {
+		_mm_store_ps(&x_[i], _mm_add_ps(_mm_load_ps(&previous_x_[i]), _mm_mul_ps(_mm_load_ps(&vx_[i]), dt)));
+		_mm_store_ps(&y_[i], _mm_add_ps(_mm_load_ps(&previous_y_[i]), _mm_mul_ps(_mm_load_ps(&vy_[i]), dt)));
+	}
+#else
+	for (uint32_t i = begin; i < end; i++) {
+		x_[i] = previous_x_[i] + vx_[i] * time;
+		y_[i] = previous_y_[i] + vy_[i] * time;
+	}
+#endif
+	// then onto the grid: a step off it or up a wall is undone, and the
+	// agent looks for somewhere else to go
+	uint32_t blocked = 0;
+	for (uint32_t i = begin; i < std::min(end, size_); i++) {
+		if (!active_[i]) continue;
+		int32_t node = nav_mesh_.Locate(glm::vec3(x_[i], y_[i], previous_z_[i]));
+		float z = node == NavMesh::kNone ? 0 : nav_mesh_.position(node).z;
+		if (node == NavMesh::kNone || std::fabs(z - previous_z_[i]) > nav_mesh_.step()) {
+			x_[i] = previous_x_[i];
+			y_[i] = previous_y_[i];
+			vx_[i] = vy_[i] = 0;
+			NextGoal(i, true);
+			blocked++;
+			continue;
+		}
+		z_[i] = z;
+		float dx = goal_x_[i] - x_[i], dy = goal_y_[i] - y_[i];
+		if (dx * dx + dy * dy < kArrival * kArrival) NextGoal(i, false);
+	}
+	blocked_ += blocked;
+}
+
+void Crowd::Update(float time) {
+	update_time_ = time;
+	pending_time_ += time;
+	// the simulation steps add up to a crowd step only up to rounding
+	if (pending_time_ * kRate < 1 - 1e-4f) return;
+	pending_time_ = std::max(pending_time_ - 1 / kRate, 0.0f);
+	Step(1 / kRate);
+}
+
+void Crowd::Step(float time) {
+	auto start = std::chrono::steady_clock::now();
+	uint32_t padded = x_.size();
+	std::copy(x_.begin(), x_.end(), previous_x_.begin());
+	std::copy(y_.begin(), y_.end(), previous_y_.begin());
+	std::copy(z_.begin(), z_.end(), previous_z_.begin());
+	UpdateErrands();
+	BuildHash();
+	overlapping_ = 0;
+	blocked_ = 0;
+
+	// avoiding over chunks of the sorted entries, then moving over chunks of
+	// whole blocks of agents
+	auto parallel = [this](uint32_t count, void (Crowd::*pass)(uint32_t, uint32_t, float), float time) {
+		uint32_t chunks = (count + kChunk - 1) / kChunk;
+		JobSystem::Shared().ParallelFor(chunks, 1, [&](uint32_t first, uint32_t last) {
+			for (uint32_t c = first; c < last; c++)
+				(this->*pass)(c * kChunk, std::min((c + 1) * kChunk, count), time);
+		});
+	};
+	parallel(cell_entities_.size(), &Crowd::Avoid, time);
+	parallel(padded, &Crowd::Integrate, time);
+	frame_++;
+
+	stats_.agents = size_;
+	stats_.overlapping = overlapping_;
+	stats_.blocked = blocked_;
+	std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+	stats_.update_ms = elapsed.count();
+}
+
+template <typename Visitor>
+void Crowd::ForEachMatrix(const glm::vec3 &center, float distance, Visitor visit) const {
+	using namespace glm;
+	float distance2 = distance * distance;
+	// where the last update left off in the crowd step, and where the one
+	// before did; pending_time_ starts over when a step runs
+	float current = std::min(pending_time_ * kRate, 1.0f);
+	float previous = std::max(current - update_time_ * kRate, 0.0f);
+	for (uint32_t i = 0; i < size_; i++) {
+		if (!active_[i]) continue;
+		vec3 from(previous_x_[i], previous_y_[i], previous_z_[i]), to(x_[i], y_[i], z_[i]);
+		vec3 position = mix(from, to, current);
+		vec3 offset = position - center;
+		if (dot(offset, offset) > distance2) continue;
+		float heading = vx_[i] * vx_[i] + vy_[i] * vy_[i] > 1e-8f ? std::atan2(vy_[i], vx_[i]) : 0;
+		mat4 turn = rotate(mat4(1), heading, vec3(0, 0, 1));
+		visit(translate(mat4(1), mix(from, to, previous)) * turn, translate(mat4(1), position) * turn);
+	}
+}
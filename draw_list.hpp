@@ -0,0 +1,201 @@
+#pragma once
+
+#include <vector>
+#include <chrono>
+#include <algorithm>
+#include <cstdint>
+
+#include <glad/glad.h>
+
+#include "mesh.hpp"
+#include "shader.hpp"
+#include "job_system.hpp"
+#include "frame_arena.hpp"
+
+// One recorded draw: program, vertex array, textures with the sampler
+// uniform of each, and a range of indices. Replaying it is all GL; making
+// it is not, so items can be recorded on any thread.
+struct DrawItem {
+	static const uint32_t kMaxTextures = 8;
+
+	// replay order, see DrawProgram::Record
+	uint64_t key;
+	uint32_t program, vao;
+	// in indices
+	uint32_t first, count;
+	uint32_t texture_count;
+	uint32_t textures[kMaxTextures];
+	// -1 when the program has no such sampler
+	int32_t samplers[kMaxTextures];
+	// what it was recorded for, a mesh index say
+	uint32_t object;
+};
+
+struct DrawStats {
+	uint32_t items, lists, draws, program_binds, texture_binds;
+	double record_ms;
+};
+
+// A shader as recorded draws need it: the program and the locations of the
+// material samplers Mesh::BindTextures would set, looked up once on the GL
+// thread.
+class DrawProgram {
+public:
+	DrawProgram() = delete;
+	explicit DrawProgram(const Shader &shader);
+
+	// touches no GL; key holds the program, the first texture and the
+	// vertex array from bit 47 down, and leaves the top 16 bits to the caller
+	DrawItem Record(const Mesh &mesh, uint32_t object) const;
+
+private:
+	static const uint32_t kTextureTypes = 4;
+
+	uint32_t program_;
+	int32_t samplers_[kTextureTypes][Mesh::kMaxSamplers];
+};
+
+// Records draw items on the job system into a command buffer per partition
+// of the work, merges the buffers and sorts the items by key on the GL
+// thread, which alone replays them. Replay binds only the program, textures
+// and samplers that differ from the item replayed before it. The command
+// buffers come from the frame's arena, the merged list is kept and reused.
+class DrawRecorder {
+public:
+	DrawRecorder();
+
+	// record(items, begin, end) writes at most one item for each element of
+	// [begin, end) to items and returns how many, on a worker thread; count
+	// is split so that every thread gets several parts
+	template <typename Function> void Record(uint32_t count, FrameArena &arena, const Function &record);
+	// merged in partition order, then sorted by key
+	const std::vector<DrawItem> &items() const;
+	void Replay(const DrawItem &item);
+	// forget what is bound, when other GL code may have changed it
+	void Invalidate();
+	const DrawStats &stats() const;
+
+private:
+	// at least this many per partition, below that splitting costs more
+	static const uint32_t kGrain = 32;
+	static const uint32_t kListsPerThread = 4;
+
+	// items recorded by each partition, in the arena
+	struct Part {
+		DrawItem *items;
+		uint32_t size;
+	};
+
+	std::vector<Part> parts_;
+	std::vector<DrawItem> items_;
+	uint32_t program_;
+	uint32_t textures_[DrawItem::kMaxTextures];
+	// texture unit of each sampler location of program_, -1 when unknown
+	std::vector<int32_t> sampler_units_;
+	DrawStats stats_;
+};
+
+DrawProgram::DrawProgram(const Shader &shader): program_(shader.program()) {
+	for (uint32_t type = 0; type < kTextureTypes; type++)
+		for (uint32_t i = 0; i < Mesh::kMaxSamplers; i++)
+			samplers_[type][i] = glGetUniformLocation(program_, Mesh::SamplerName((TextureType)type, i));
+}
+
+DrawItem DrawProgram::Record(const Mesh &mesh, uint32_t object) const {
+	DrawItem item;
+	item.program = program_;
+	item.vao = mesh.GetVertexArray();
+	item.first = 0;
+	item.count = mesh.GetIndices().size();
+	item.object = object;
+	// numbered per type in the order the mesh lists them, as BindTextures does
+	uint32_t totals[kTextureTypes] = {};
+	const std::vector<Texture> &textures = mesh.GetTextures();
+	item.texture_count = std::min<uint32_t>(textures.size(), DrawItem::kMaxTextures);
+	for (uint32_t i = 0; i < item.texture_count; i++) {
+		uint32_t type = (uint32_t)textures[i].type;
+		item.textures[i] = textures[i].id;
+		item.samplers[i] = totals[type] < Mesh::kMaxSamplers ? samplers_[type][totals[type]] : -1;
+		totals[type]++;
+	}
+	uint64_t texture = item.texture_count ? item.textures[0] : 0;
+	item.key = (uint64_t)(program_ & 0xFFFF) << 32 | (texture & 0xFFFF) << 16 | (item.vao & 0xFFFF);
+	return item;
+}
+
+DrawRecorder::DrawRecorder():
+	stats_() {
+	Invalidate();
+}
+
+template <typename Function>
+void DrawRecorder::Record(uint32_t count, FrameArena &arena, const Function &record) {
+	auto start = std::chrono::steady_clock::now();
+	JobSystem &jobs = JobSystem::Shared();
+	uint32_t lists = std::max(1u, std::min((count + kGrain - 1) / kGrain, jobs.size() * kListsPerThread));
+	uint32_t part = (count + lists - 1) / lists;
+	// each partition writes into its own slice of one block
+	DrawItem *room = arena.Allocate<DrawItem>(count);
+	if (parts_.size() < lists) parts_.resize(lists);
+	std::vector<Part> &parts = parts_;
+	jobs.ParallelFor(lists, 1, [&parts, &record, room, part, count](uint32_t begin, uint32_t end) {
+		for (uint32_t i = begin; i < end; i++) {
+			uint32_t first = std::min(i * part, count), last = std::min((i + 1) * part, count);
+			parts[i].items = room + first;
+			parts[i].size = record(room + first, first, last);
+		}
+	});
+
+	items_.clear();
+	for (uint32_t i = 0; i < lists; i++)
+		items_.insert(items_.end(), parts_[i].items, parts_[i].items + parts_[i].size);
+	std::sort(items_.begin(), items_.end(), [](const DrawItem &a, const DrawItem &b) { return a.key < b.key; });
+
+	std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+	stats_ = DrawStats();
+	stats_.items = items_.size();
+	stats_.lists = lists;
+	stats_.record_ms = elapsed.count();
+}
+
+const std::vector<DrawItem> &DrawRecorder::items() const {
+	return items_;
+}
+
+void DrawRecorder::Replay(const DrawItem &item) {
+	if (item.program != program_) {
+		glUseProgram(item.program);
+		program_ = item.program;
+		std::fill(sampler_units_.begin(), sampler_units_.end(), -1);
+		stats_.program_binds++;
+	}
+	for (uint32_t i = 0; i < item.texture_count; i++) {
+		if (textures_[i] != item.textures[i]) {
+			glActiveTexture(GL_TEXTURE0 + i);
+			glBindTexture(GL_TEXTURE_2D, item.textures[i]);
+			textures_[i] = item.textures[i];
+			stats_.texture_binds++;
+		}
+		int32_t location = item.samplers[i];
+		if (location < 0) continue;
+		if (location >= (int32_t)sampler_units_.size()) sampler_units_.resize(location + 1, -1);
+		if (sampler_units_[location] != (int32_t)i) {
+			glUniform1i(location, i);
+			sampler_units_[location] = i;
+		}
+	}
+	// every mesh has a vertex array of its own, so there is nothing to save
+	glBindVertexArray(item.vao);
+	glDrawElements(GL_TRIANGLES, item.count, GL_UNSIGNED_INT, (void *)(uintptr_t)(item.first * sizeof(uint32_t)));
+	stats_.draws++;
+}
+
+void DrawRecorder::Invalidate() {
+	program_ = 0;
+	std::fill(textures_, textures_ + DrawItem::kMaxTextures, 0);
+	std::fill(sampler_units_.begin(), sampler_units_.end(), -1);
+}
+
+const DrawStats &DrawRecorder::stats() const {
+	return stats_;
+}
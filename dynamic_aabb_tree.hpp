@@ -0,0 +1,222 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+
+#include "aabb.hpp"
+
+// Incrementally updated box tree for moving objects. Leaves store a box
+// enlarged by a margin, so small moves do not touch the tree at all and
+// larger ones remove and reinsert a single leaf.
+class DynamicAabbTree {
+public:
+	static const uint32_t kNull = 0xFFFFFFFF;
+
+	DynamicAabbTree() = delete;
+	DynamicAabbTree(float margin);
+
+	// returns a proxy that stays valid until it is removed
+	uint32_t Insert(const AABB &box, uint32_t user);
+	void Remove(uint32_t proxy);
+	// true when the leaf had to be reinserted
+	bool Move(uint32_t proxy, const AABB &box);
+	uint32_t user(uint32_t proxy) const;
+	const AABB &fat_box(uint32_t proxy) const;
+
+	// visit(proxy) for every leaf whose fat box overlaps box
+	template <typename Visitor> void Query(const AABB &box, Visitor visit) const;
+
+private:
+	struct Node {
+		AABB box;
+		// leaf when left is kNull, free nodes chain through parent
+		uint32_t parent, left, right, user;
+	};
+
+	float margin_;
+	uint32_t root_, free_;
+	std::vector<Node> nodes_;
+
+	uint32_t Allocate();
+	void Free(uint32_t index);
+	void InsertLeaf(uint32_t leaf);
+	void RemoveLeaf(uint32_t leaf);
+	void Refit(uint32_t index);
+	static AABB Union(const AABB &a, const AABB &b);
+};
+
+DynamicAabbTree::DynamicAabbTree(float margin):
+	margin_(margin),
+	root_(kNull),
+	free_(kNull) {
+}
+
+AABB DynamicAabbTree::Union(const AABB &a, const AABB &b) {
+	AABB box = a;
+	box.Merge(b);
+	return box;
+}
+
+uint32_t DynamicAabbTree::Allocate() {
+	uint32_t index;
+	if (free_ != kNull) {
+		index = free_;
+		free_ = nodes_[index].parent;
+	} else {
+		index = nodes_.size();
+		nodes_.push_back(Node());
+	}
+	Node &node = nodes_[index];
+	node.parent = node.left = node.right = node.user = kNull;
+	return index;
+}
+
+void DynamicAabbTree::Free(uint32_t index) {
+	nodes_[index].parent = free_;
+	free_ = index;
+}
+
+uint32_t DynamicAabbTree::Insert(const AABB &box, uint32_t user) {
+	uint32_t leaf = Allocate();
+	glm::vec3 margin(margin_);
+	nodes_[leaf].box = AABB(box.small - margin, box.big + margin);
+	nodes_[leaf].user = user;
+	InsertLeaf(leaf);
+	return leaf;
+}
+
+void DynamicAabbTree::Remove(uint32_t proxy) {
+	RemoveLeaf(proxy);
+	Free(proxy);
+}
+
+bool DynamicAabbTree::Move(uint32_t proxy, const AABB &box) {
+	const AABB &fat = nodes_[proxy].box;
+	if (fat.InBox(box.small) && fat.InBox(box.big)) return false;
+	RemoveLeaf(proxy);
+	glm::vec3 margin(margin_);
+	nodes_[proxy].box = AABB(box.small - margin, box.big + margin);
+	InsertLeaf(proxy);
+	return true;
+}
+
+uint32_t DynamicAabbTree::user(uint32_t proxy) const {
+	return nodes_[proxy].user;
+}
+
+const AABB &DynamicAabbTree::fat_box(uint32_t proxy) const {
+	return nodes_[proxy].box;
+}
+
+void DynamicAabbTree::InsertLeaf(uint32_t leaf) {
+	if (root_ == kNull) {
+		root_ = leaf;
+		nodes_[leaf].parent = kNull;
+		return;
+	}
+
+	// walk down towards the sibling that grows the total surface area least
+	const AABB box = nodes_[leaf].box;
+	uint32_t index = root_;
+	while (nodes_[index].left != kNull) {
+		const Node &node = nodes_[index];
+		float area = node.box.SurfaceArea();
+		float combined = Union(node.box, box).SurfaceArea();
+		// pairing with this node creates a parent of the combined area,
+		// descending further enlarges this node in any case
+		float cost = 2 * combined;
+		float inheritance = 2 * (combined - area);
+		float child_cost[2];
+		uint32_t children[2] = { node.left, node.right };
+		for (int i = 0; i < 2; i++) {
+			const Node &child = nodes_[children[i]];
+			float grown = Union(child.box, box).SurfaceArea();
+			if (child.left == kNull)
+				child_cost[i] = grown + inheritance;
+			else
+				child_cost[i] = grown - child.box.SurfaceArea() + inheritance;
+		}
+		if (cost < child_cost[0] && cost < child_cost[1]) break;
+		index = child_cost[0] < child_cost[1] ? children[0] : children[1];
+	}
+
+	uint32_t sibling = index;
+	uint32_t old_parent = nodes_[sibling].parent;
+	uint32_t parent = Allocate();
+	nodes_[parent].parent = old_parent;
+	nodes_[parent].left = sibling;
+	nodes_[parent].right = leaf;
+	nodes_[parent].box = Union(nodes_[sibling].box, box);
+	nodes_[sibling].parent = parent;
+	nodes_[leaf].parent = parent;
+	if (old_parent == kNull) {
+		root_ = parent;
+	} else if (nodes_[old_parent].left == sibling) {
+		nodes_[old_parent].left = parent;
+	} else {
+		nodes_[old_parent].right = parent;
+	}
+	Refit(nodes_[parent].parent);
+}
+
+void DynamicAabbTree::RemoveLeaf(uint32_t leaf) {
+	if (leaf == root_) {
+		root_ = kNull;
+		return;
+	}
+	uint32_t parent = nodes_[leaf].parent;
+	uint32_t grand_parent = nodes_[parent].parent;
+	uint32_t sibling = nodes_[parent].left == leaf ? nodes_[parent].right : nodes_[parent].left;
+	if (grand_parent == kNull) {
+		root_ = sibling;
+		nodes_[sibling].parent = kNull;
+	} else {
+		if (nodes_[grand_parent].left == parent)
+			nodes_[grand_parent].left = sibling;
+		else
+			nodes_[grand_parent].right = sibling;
+		nodes_[sibling].parent = grand_parent;
+		Refit(grand_parent);
+	}
+	Free(parent);
+}
+
+void DynamicAabbTree::Refit(uint32_t index) {
+	while (index != kNull) {
+		Node &node = nodes_[index];
+		node.box = Union(nodes_[node.left].box, nodes_[node.right].box);
+		index = node.parent;
+	}
+}
+
+template <typename Visitor>
+void DynamicAabbTree::Query(const AABB &box, Visitor visit) const {
+	if (root_ == kNull) return;
+	// the tree is not balanced, so a deep one spills past the fixed stack
+	// onto the heap; one of a few bodies never does
+	const uint32_t kStackSize = 64;
+	uint32_t stack[kStackSize], top = 0;
+	std::vector<uint32_t> spill;
+	stack[top++] = root_;
+	while (top > 0 || !spill.empty()) {
+		uint32_t index;
+		if (!spill.empty()) {
+			index = spill.back();
+			spill.pop_back();
+		} else {
+			index = stack[--top];
+		}
+		const Node &node = nodes_[index];
+		if (!node.box.Overlap(box)) continue;
+		if (node.left == kNull) {
+			visit(index);
+			continue;
+		}
+		for (uint32_t child : { node.left, node.right }) {
+			if (top < kStackSize)
+				stack[top++] = child;
+			else
+				spill.push_back(child);
+		}
+	}
+}
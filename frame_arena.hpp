@@ -0,0 +1,99 @@
+#pragma once
+
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <algorithm>
+#include <type_traits>
+#include <cstdint>
+#include <cstddef>
+
+struct ArenaStats {
+	// bytes asked for in the last frame, and the most in any frame so far
+	size_t used, peak;
+	// allocations of the last frame that did not fit and came from the heap
+	uint32_t overflows;
+};
+
+// Bump allocator for data that lives for one frame. Allocate only moves an
+// offset, from any thread, and Reset at the start of the next frame drops
+// everything at once without running destructors. What does not fit comes
+// from the heap, and the next Reset grows the block to what the frame asked
+// for, so that steady frames allocate nothing.
+class FrameArena {
+public:
+	FrameArena() = delete;
+	FrameArena(const FrameArena &) = delete;
+	explicit FrameArena(size_t capacity);
+	virtual ~FrameArena();
+
+	// room for count uninitialized T
+	template <typename T> T *Allocate(size_t count);
+	// alignment is a power of two, at most that of std::max_align_t
+	void *Allocate(size_t size, size_t alignment);
+	// nothing allocated before may be used after
+	void Reset();
+	const ArenaStats &stats() const;
+
+private:
+	char *block_;
+	size_t capacity_;
+	// runs on past capacity_ when the block is full, and then tells Reset how
+	// much the frame wanted
+	std::atomic<size_t> offset_;
+	std::mutex overflow_mutex_;
+	std::vector<char *> overflow_;
+	ArenaStats stats_;
+};
+
+FrameArena::FrameArena(size_t capacity):
+	block_(new char[std::max<size_t>(capacity, 1)]),
+	capacity_(std::max<size_t>(capacity, 1)),
+	offset_(0),
+	stats_() {}
+
+FrameArena::~FrameArena() {
+	Reset();
+	delete[] block_;
+}
+
+template <typename T>
+T *FrameArena::Allocate(size_t count) {
+	static_assert(std::is_trivially_destructible<T>::value, "the arena runs no destructors");
+	static_assert(alignof(T) <= alignof(std::max_align_t), "the arena does not over align");
+	return (T *)Allocate(count * sizeof(T), alignof(T));
+}
+
+void *FrameArena::Allocate(size_t size, size_t alignment) {
+	size_t offset = offset_.load(std::memory_order_relaxed), begin;
+	do {
+		begin = (offset + alignment - 1) & ~(alignment - 1);
+	} while (!offset_.compare_exchange_weak(offset, begin + size, std::memory_order_relaxed));
+	if (begin + size <= capacity_) return block_ + begin;
+	// new char[] is aligned for any fundamental type
+	char *memory = new char[std::max<size_t>(size, 1)];
+	std::lock_guard<std::mutex> lock(overflow_mutex_);
+	overflow_.push_back(memory);
+	return memory;
+}
+
+void FrameArena::Reset() {
+	size_t used = offset_.load(std::memory_order_relaxed);
+	stats_.used = used;
+	stats_.peak = std::max(stats_.peak, used);
+	stats_.overflows = overflow_.size();
+	for (char *memory : overflow_)
+		delete[] memory;
+	overflow_.clear();
+	if (used > capacity_) {
+		delete[] block_;
+		// with room to spare, so that a frame growing slowly does not grow it every time
+		capacity_ = used + used / 2;
+		block_ = new char[capacity_];
+	}
+	offset_.store(0, std::memory_order_relaxed);
+}
+
+const ArenaStats &FrameArena::stats() const {
+	return stats_;
+}
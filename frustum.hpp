@@ -0,0 +1,106 @@
+#pragma once
+
+#include <glm/glm.hpp>
+
+#if defined(__SSE2__)
+#include <xmmintrin.h>
+#endif
+
+#include "aabb.hpp"
+#include "camera.hpp"
+
+enum class FrustumTestType {
+	OUTSIDE, INTERSECT, INSIDE
+};
+
+class Frustum {
+public:
+	Frustum() = delete;
+	Frustum(const glm::mat4 &view_projection);
+	Frustum(const Camera &camera);
+	FrustumTestType Test(const AABB &box) const;
+	bool Intersects(const AABB &box) const;
+	// normalized plane i, inside where dot(plane.xyz, p) + plane.w >= 0
+	glm::vec4 plane(int i) const;
+
+private:
+	// six planes stored as structure of arrays, padded to eight with
+	// planes every point passes so that two SSE registers cover them all
+	alignas(16) float nx_[8], ny_[8], nz_[8], d_[8];
+
+	void ExtractPlanes(const glm::mat4 &view_projection);
+};
+
+Frustum::Frustum(const glm::mat4 &view_projection) {
+	ExtractPlanes(view_projection);
+}
+
+Frustum::Frustum(const Camera &camera) {
+	ExtractPlanes(camera.GetProjectionMatrix() * camera.GetViewMatrix());
+}
+
+void Frustum::ExtractPlanes(const glm::mat4 &m) {
+	using namespace glm;
+	// Gribb-Hartmann, rows of the column major matrix
+	vec4 row0(m[0][0], m[1][0], m[2][0], m[3][0]);
+	vec4 row1(m[0][1], m[1][1], m[2][1], m[3][1]);
+	vec4 row2(m[0][2], m[1][2], m[2][2], m[3][2]);
+	vec4 row3(m[0][3], m[1][3], m[2][3], m[3][3]);
+	const vec4 planes[6] = {
+		row3 + row0, row3 - row0,
+		row3 + row1, row3 - row1,
+		row3 + row2, row3 - row2
+	};
+	for (int i = 0; i < 8; i++) {
+		if (i < 6) {
+			float inv = 1.0f / length(vec3(planes[i]));
+			nx_[i] = planes[i].x * inv;
+			ny_[i] = planes[i].y * inv;
+			nz_[i] = planes[i].z * inv;
+			d_[i] = planes[i].w * inv;
+		} else {
+			nx_[i] = ny_[i] = nz_[i] = 0;
+			d_[i] = 1;
+		}
+	}
+}
+
+FrustumTestType Frustum::Test(const AABB &box) const {
+	glm::vec3 c = box.Center(), e = box.Extent();
+#if defined(__SSE2__)
+	const __m128 sign_mask = _mm_set1_ps(-0.0f);
+	const __m128 cx = _mm_set1_ps(c.x), cy = _mm_set1_ps(c.y), cz = _mm_set1_ps(c.z);
+	const __m128 ex = _mm_set1_ps(e.x), ey = _mm_set1_ps(e.y), ez = _mm_set1_ps(e.z);
+	int outside = 0, intersect = 0;
+	for (int i = 0; i < 8; i += 4) {
+		__m128 nx = _mm_load_ps(nx_ + i), ny = _mm_load_ps(ny_ + i), nz = _mm_load_ps(nz_ + i);
+		__m128 dist = _mm_add_ps(
+			_mm_add_ps(_mm_mul_ps(nx, cx), _mm_mul_ps(ny, cy)),
+			_mm_add_ps(_mm_mul_ps(nz, cz), _mm_load_ps(d_ + i)));
+		__m128 radius = _mm_add_ps(
+			_mm_add_ps(_mm_mul_ps(_mm_andnot_ps(sign_mask, nx), ex), _mm_mul_ps(_mm_andnot_ps(sign_mask, ny), ey)),
+			_mm_mul_ps(_mm_andnot_ps(sign_mask, nz), ez));
+		outside |= _mm_movemask_ps(_mm_cmplt_ps(_mm_add_ps(dist, radius), _mm_setzero_ps()));
+		intersect |= _mm_movemask_ps(_mm_cmplt_ps(_mm_sub_ps(dist, radius), _mm_setzero_ps()));
+	}
+	if (outside) return FrustumTestType::OUTSIDE;
+	return intersect ? FrustumTestType::INTERSECT : FrustumTestType::INSIDE;
+#else
+	bool intersect = false;
+	for (int i = 0; i < 6; i++) {
+		float dist = nx_[i] * c.x + ny_[i] * c.y + nz_[i] * c.z + d_[i];
+		float radius = std::fabs(nx_[i]) * e.x + std::fabs(ny_[i]) * e.y + std::fabs(nz_[i]) * e.z;
+		if (dist + radius < 0) return FrustumTestType::OUTSIDE;
+		if (dist - radius < 0) intersect = true;
+	}
+	return intersect ? FrustumTestType::INTERSECT : FrustumTestType::INSIDE;
+#endif
+}
+
+glm::vec4 Frustum::plane(int i) const {
+	return glm::vec4(nx_[i], ny_[i], nz_[i], d_[i]);
+}
+
+bool Frustum::Intersects(const AABB &box) const {
+	return Test(box) != FrustumTestType::OUTSIDE;
+}
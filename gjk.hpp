@@ -0,0 +1,261 @@
+#pragma once
+
+#include <limits>
+#include <utility>
+#include <algorithm>
+#include <cstdint>
+
+#include <glm/glm.hpp>
+
+#include "convex_hull.hpp"
+
+// a hull placed in the world by an affine transform
+struct ConvexShape {
+	const ConvexHull *hull;
+	glm::mat4 transform;
+	// transpose of the linear part, maps world directions to hull space
+	glm::mat3 to_local;
+
+	ConvexShape() = delete;
+	ConvexShape(const ConvexHull &hull, const glm::mat4 &transform);
+	glm::vec3 Support(const glm::vec3 &direction) const;
+};
+
+struct GjkSimplex {
+	// newest point first
+	glm::vec3 points[4];
+	int size;
+};
+
+struct Contact {
+	// the direction that moves the first shape out of the second, and how far
+	glm::vec3 normal;
+	float depth;
+};
+
+// direction is the warm start, e.g. the axis that separated the pair in the
+// previous frame, and receives the last search direction for the next call
+bool GjkIntersect(const ConvexShape &a, const ConvexShape &b, glm::vec3 &direction, GjkSimplex &simplex);
+// expanding polytope from the tetrahedron GjkIntersect ends with
+Contact EpaPenetration(const ConvexShape &a, const ConvexShape &b, const GjkSimplex &simplex);
+
+ConvexShape::ConvexShape(const ConvexHull &hull, const glm::mat4 &transform):
+	hull(&hull),
+	transform(transform),
+	to_local(glm::transpose(glm::mat3(transform))) {
+}
+
+glm::vec3 ConvexShape::Support(const glm::vec3 &direction) const {
+	return glm::vec3(transform * glm::vec4(hull->Support(to_local * direction), 1));
+}
+
+namespace gjk_internal {
+
+inline glm::vec3 Support(const ConvexShape &a, const ConvexShape &b, const glm::vec3 &direction) {
+	return a.Support(direction) - b.Support(-direction);
+}
+
+inline bool SameDirection(const glm::vec3 &u, const glm::vec3 &v) {
+	return glm::dot(u, v) > 0;
+}
+
+inline void Set(GjkSimplex &s, const glm::vec3 &a) {
+	s.points[0] = a; s.size = 1;
+}
+
+inline void Set(GjkSimplex &s, const glm::vec3 &a, const glm::vec3 &b) {
+	s.points[0] = a; s.points[1] = b; s.size = 2;
+}
+
+inline void Set(GjkSimplex &s, const glm::vec3 &a, const glm::vec3 &b, const glm::vec3 &c) {
+	s.points[0] = a; s.points[1] = b; s.points[2] = c; s.size = 3;
+}
+
+inline void Line(GjkSimplex &s, glm::vec3 &direction) {
+	using namespace glm;
+	vec3 a = s.points[0], b = s.points[1];
+	vec3 ab = b - a, ao = -a;
+	if (SameDirection(ab, ao)) {
+		direction = cross(cross(ab, ao), ab);
+	} else {
+		Set(s, a);
+		direction = ao;
+	}
+}
+
+inline void Triangle(GjkSimplex &s, glm::vec3 &direction) {
+	using namespace glm;
+	vec3 a = s.points[0], b = s.points[1], c = s.points[2];
+	vec3 ab = b - a, ac = c - a, ao = -a;
+	vec3 abc = cross(ab, ac);
+	if (SameDirection(cross(abc, ac), ao)) {
+		if (SameDirection(ac, ao)) {
+			Set(s, a, c);
+			direction = cross(cross(ac, ao), ac);
+		} else {
+			Set(s, a, b);
+			Line(s, direction);
+		}
+	} else if (SameDirection(cross(ab, abc), ao)) {
+		Set(s, a, b);
+		Line(s, direction);
+	} else if (SameDirection(abc, ao)) {
+		direction = abc;
+	} else {
+		Set(s, a, c, b);
+		direction = -abc;
+	}
+}
+
+// true when the tetrahedron encloses the origin
+inline bool Tetrahedron(GjkSimplex &s, glm::vec3 &direction) {
+	using namespace glm;
+	vec3 a = s.points[0], b = s.points[1], c = s.points[2], d = s.points[3];
+	vec3 ab = b - a, ac = c - a, ad = d - a, ao = -a;
+	if (SameDirection(cross(ab, ac), ao)) {
+		Set(s, a, b, c);
+		Triangle(s, direction);
+		return false;
+	}
+	if (SameDirection(cross(ac, ad), ao)) {
+		Set(s, a, c, d);
+		Triangle(s, direction);
+		return false;
+	}
+	if (SameDirection(cross(ad, ab), ao)) {
+		Set(s, a, d, b);
+		Triangle(s, direction);
+		return false;
+	}
+	return true;
+}
+
+}
+
+bool GjkIntersect(const ConvexShape &a, const ConvexShape &b, glm::vec3 &direction, GjkSimplex &simplex) {
+	using namespace glm;
+	using namespace gjk_internal;
+	const int kMaxIterations = 64;
+	vec3 d = direction;
+	if (dot(d, d) < 1e-20f) d = vec3(1, 0, 0);
+
+	vec3 p = Support(a, b, d);
+	// a cached separating axis usually ends the test right here
+	if (dot(p, d) <= 0) {
+		direction = d;
+		return false;
+	}
+	Set(simplex, p);
+	d = -p;
+	for (int i = 0; i < kMaxIterations; i++) {
+		p = Support(a, b, d);
+		// also catches d == 0, shapes that only touch
+		if (dot(p, d) <= 0) {
+			direction = d;
+			return false;
+		}
+		for (int k = simplex.size; k > 0; k--)
+			simplex.points[k] = simplex.points[k - 1];
+		simplex.points[0] = p;
+		simplex.size++;
+		bool enclosed = false;
+		switch (simplex.size) {
+			case 2: Line(simplex, d); break;
+			case 3: Triangle(simplex, d); break;
+			case 4: enclosed = Tetrahedron(simplex, d); break;
+		}
+		if (enclosed) {
+			direction = d;
+			return true;
+		}
+	}
+	// cycling only happens at grazing contact
+	direction = d;
+	return false;
+}
+
+Contact EpaPenetration(const ConvexShape &a, const ConvexShape &b, const GjkSimplex &simplex) {
+	using namespace glm;
+	using namespace gjk_internal;
+	const int kMaxIterations = 64;
+	const float kTolerance = 1e-5f;
+	// fixed, so that EPA allocates nothing; a polytope that would outgrow
+	// them stops expanding at the nearest face so far
+	const uint32_t kMaxPoints = 4 + kMaxIterations, kMaxFaces = 4 * kMaxPoints, kMaxEdges = kMaxFaces;
+
+	struct Face {
+		uint32_t a, b, c;
+		vec3 normal;
+		float distance;
+	};
+	struct Edge {
+		uint32_t from, to;
+	};
+	vec3 points[kMaxPoints];
+	Face faces[kMaxFaces];
+	Edge edges[kMaxEdges];
+	uint32_t point_count = 4, face_count = 0;
+	std::copy(simplex.points, simplex.points + 4, points);
+	// the centroid of the first tetrahedron stays inside the growing polytope
+	const vec3 inside = (points[0] + points[1] + points[2] + points[3]) * 0.25f;
+	auto add_face = [&points, &faces, &face_count, &inside](uint32_t i, uint32_t j, uint32_t k) {
+		Face face = { i, j, k, cross(points[j] - points[i], points[k] - points[i]), 0 };
+		float len = length(face.normal);
+		if (len < 1e-20f) return;
+		face.normal /= len;
+		if (dot(face.normal, points[i] - inside) < 0) {
+			std::swap(face.b, face.c);
+			face.normal = -face.normal;
+		}
+		// the origin is inside too, up to rounding
+		face.distance = std::max(dot(face.normal, points[i]), 0.0f);
+		faces[face_count++] = face;
+	};
+	add_face(0, 1, 2);
+	add_face(0, 3, 1);
+	add_face(0, 2, 3);
+	add_face(1, 3, 2);
+
+	Contact contact = { vec3(0, 0, 1), 0 };
+	for (int iteration = 0; iteration < kMaxIterations && face_count > 0; iteration++) {
+		uint32_t closest = 0;
+		for (uint32_t i = 1; i < face_count; i++)
+			if (faces[i].distance < faces[closest].distance) closest = i;
+		const Face nearest = faces[closest];
+		contact.normal = -nearest.normal;
+		contact.depth = nearest.distance;
+
+		vec3 p = Support(a, b, nearest.normal);
+		if (dot(p, nearest.normal) - nearest.distance < kTolerance) break;
+
+		// carve out the faces p sees, keeping the rest in place, and close
+		// the hole with a fan; an edge of two carved faces is inside the hole
+		uint32_t kept = 0, edge_count = 0;
+		bool full = false;
+		for (uint32_t f = 0; f < face_count; f++) {
+			const Face face = faces[f];
+			if (!SameDirection(face.normal, p - points[face.a])) {
+				faces[kept++] = face;
+				continue;
+			}
+			uint32_t corners[3] = { face.a, face.b, face.c };
+			for (int e = 0; e < 3; e++) {
+				uint32_t from = corners[e], to = corners[(e + 1) % 3], twin = 0;
+				while (twin < edge_count && !(edges[twin].from == to && edges[twin].to == from)) twin++;
+				if (twin < edge_count)
+					edges[twin] = edges[--edge_count];
+				else if (edge_count < kMaxEdges)
+					edges[edge_count++] = { from, to };
+				else
+					full = true;
+			}
+		}
+		if (full || kept + edge_count > kMaxFaces) break;
+		face_count = kept;
+		uint32_t index = point_count++;
+		points[index] = p;
+		for (uint32_t e = 0; e < edge_count; e++)
+			add_face(edges[e].from, edges[e].to, index);
+	}
+	return contact;
+}
@@ -0,0 +1,117 @@
+#pragma once
+
+#include <cstring>
+
+#include <glad/glad.h>
+#include <GLFW/glfw3.h>
+
+// The bundled glad loader only covers GL 3.3. Entry points of newer versions
+// are resolved at runtime, and every user has to check the flags first.
+
+#ifndef APIENTRY
+#define APIENTRY
+#endif
+
+#ifndef GL_COMPUTE_SHADER
+#define GL_COMPUTE_SHADER 0x91B9
+#endif
+#ifndef GL_SHADER_STORAGE_BUFFER
+#define GL_SHADER_STORAGE_BUFFER 0x90D2
+#endif
+#ifndef GL_DRAW_INDIRECT_BUFFER
+#define GL_DRAW_INDIRECT_BUFFER 0x8F3F
+#endif
+#ifndef GL_PARAMETER_BUFFER
+#define GL_PARAMETER_BUFFER 0x80EE
+#endif
+#ifndef GL_SHADER_STORAGE_BARRIER_BIT
+#define GL_SHADER_STORAGE_BARRIER_BIT 0x00002000
+#endif
+#ifndef GL_COMMAND_BARRIER_BIT
+#define GL_COMMAND_BARRIER_BIT 0x00000040
+#endif
+#ifndef GL_TEXTURE_FETCH_BARRIER_BIT
+#define GL_TEXTURE_FETCH_BARRIER_BIT 0x00000008
+#endif
+#ifndef GL_SHADER_IMAGE_ACCESS_BARRIER_BIT
+#define GL_SHADER_IMAGE_ACCESS_BARRIER_BIT 0x00000020
+#endif
+#ifndef GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT
+#define GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT 0x00000001
+#endif
+#ifndef GL_BUFFER_UPDATE_BARRIER_BIT
+#define GL_BUFFER_UPDATE_BARRIER_BIT 0x00000200
+#endif
+
+class GLExtensions {
+public:
+	typedef void (APIENTRY *DispatchComputeProc)(GLuint, GLuint, GLuint);
+	typedef void (APIENTRY *MemoryBarrierProc)(GLbitfield);
+	typedef void (APIENTRY *BindImageTextureProc)(GLuint, GLuint, GLint, GLboolean, GLint, GLenum, GLenum);
+	typedef void (APIENTRY *MultiDrawElementsIndirectProc)(GLenum, GLenum, const void *, GLsizei, GLsizei);
+	typedef void (APIENTRY *MultiDrawElementsIndirectCountProc)(GLenum, GLenum, const void *, GLintptr, GLsizei, GLsizei);
+
+	static GLExtensions shared;
+
+	// compute shaders, storage buffers, images and multi draw indirect (4.3)
+	bool compute;
+	// glMultiDrawElementsIndirectCount (4.6 or ARB_indirect_parameters)
+	bool indirect_count;
+
+	DispatchComputeProc dispatch_compute;
+	MemoryBarrierProc memory_barrier;
+	BindImageTextureProc bind_image_texture;
+	MultiDrawElementsIndirectProc multi_draw_elements_indirect;
+	MultiDrawElementsIndirectCountProc multi_draw_elements_indirect_count;
+
+	// needs a current context
+	void Load();
+
+private:
+	GLExtensions();
+	static bool HasExtension(const char *name);
+};
+
+GLExtensions GLExtensions::shared = GLExtensions();
+
+GLExtensions::GLExtensions():
+	compute(false),
+	indirect_count(false),
+	dispatch_compute(nullptr),
+	memory_barrier(nullptr),
+	bind_image_texture(nullptr),
+	multi_draw_elements_indirect(nullptr),
+	multi_draw_elements_indirect_count(nullptr) {
+}
+
+bool GLExtensions::HasExtension(const char *name) {
+	int count = 0;
+	glGetIntegerv(GL_NUM_EXTENSIONS, &count);
+	for (int i = 0; i < count; i++) {
+		const char *extension = (const char *)glGetStringi(GL_EXTENSIONS, i);
+		if (extension && strcmp(extension, name) == 0) return true;
+	}
+	return false;
+}
+
+void GLExtensions::Load() {
+	int major = 0, minor = 0;
+	glGetIntegerv(GL_MAJOR_VERSION, &major);
+	glGetIntegerv(GL_MINOR_VERSION, &minor);
+	int version = major * 10 + minor;
+
+	if (version >= 43) {
+		dispatch_compute = (DispatchComputeProc)glfwGetProcAddress("glDispatchCompute");
+		memory_barrier = (MemoryBarrierProc)glfwGetProcAddress("glMemoryBarrier");
+		bind_image_texture = (BindImageTextureProc)glfwGetProcAddress("glBindImageTexture");
+		multi_draw_elements_indirect = (MultiDrawElementsIndirectProc)glfwGetProcAddress("glMultiDrawElementsIndirect");
+		compute = dispatch_compute && memory_barrier && bind_image_texture && multi_draw_elements_indirect;
+	}
+	if (compute) {
+		if (version >= 46)
+			multi_draw_elements_indirect_count = (MultiDrawElementsIndirectCountProc)glfwGetProcAddress("glMultiDrawElementsIndirectCount");
+		else if (HasExtension("GL_ARB_indirect_parameters"))
+			multi_draw_elements_indirect_count = (MultiDrawElementsIndirectCountProc)glfwGetProcAddress("glMultiDrawElementsIndirectCountARB");
+		indirect_count = multi_draw_elements_indirect_count != nullptr;
+	}
+}
@@ -0,0 +1,326 @@
+#pragma once
+
+#include <map>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+#include <cstddef>
+
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+
+#include "gl_extensions.hpp"
+#include "model.hpp"
+#include "shader.hpp"
+#include "camera.hpp"
+#include "frustum.hpp"
+#include "hiz_buffer.hpp"
+
+struct GpuCullingStats {
+	uint32_t instances, meshes, dispatches, draw_calls;
+};
+
+// GPU driven drawing of every instance of one model. A compute pass tests
+// each (instance, mesh) pair against the frustum and the previous frame's
+// Hi-Z and appends the survivors to that mesh's indirect command; a second
+// pass packs the non-empty commands of each material group together. The
+// cpu then issues one multi draw per material group, whatever the number
+// of instances or visible meshes.
+class GpuCuller {
+public:
+	GpuCuller() = delete;
+	GpuCuller(const Model &model, const Shader &cull_shader, const Shader &compact_shader,
+	          const Shader &draw_shader, const Camera &camera, uint32_t capacity = 1);
+	virtual ~GpuCuller();
+
+	void Clear();
+	void Add(const glm::mat4 &model_matrix, const glm::vec3 &tint = glm::vec3(1));
+	// hiz may be null, e.g. on the first frame
+	void Draw(const HiZBuffer *hiz);
+	const GpuCullingStats &stats() const;
+
+private:
+	// work groups GL guarantees along each dimension of a dispatch
+	static const uint32_t kMaxGroups = 65535;
+
+	// std430 layouts shared with shaders/cull.cs and shaders/compact.cs
+	struct MeshInfo {
+		glm::vec4 small, big;
+		uint32_t group, group_first, pad0, pad1;
+	};
+	struct Command {
+		uint32_t count, instance_count, first_index;
+		int32_t base_vertex;
+		uint32_t base_instance;
+	};
+	struct Group {
+		uint32_t first, count, mesh;
+	};
+
+	const Model &model_;
+	const Shader &cull_shader_, &compact_shader_, &draw_shader_;
+	const Camera &camera_;
+
+	std::vector<InstanceData> instances_;
+	std::vector<Group> groups_;
+	// gpu mesh slot -> mesh index, slots are sorted by material group
+	std::vector<uint32_t> order_;
+	std::vector<Command> commands_;
+	std::vector<uint32_t> zero_counts_;
+	uint32_t capacity_;
+
+	uint32_t vao_, vbo_, ebo_;
+	uint32_t instance_buffer_, mesh_buffer_, command_template_, command_buffer_;
+	uint32_t compact_buffer_, count_buffer_, visible_buffer_;
+	GpuCullingStats stats_;
+
+	void Resize(uint32_t capacity);
+};
+
+GpuCuller::GpuCuller(const Model &model, const Shader &cull_shader, const Shader &compact_shader,
+                     const Shader &draw_shader, const Camera &camera, uint32_t capacity):
+	model_(model),
+	cull_shader_(cull_shader),
+	compact_shader_(compact_shader),
+	draw_shader_(draw_shader),
+	camera_(camera),
+	capacity_(0),
+	stats_() {
+	using namespace std;
+	const vector<Mesh> &meshes = model.meshes();
+
+	// meshes sharing a texture set can share one multi draw
+	map<vector<uint32_t>, uint32_t> group_of;
+	vector<uint32_t> mesh_group(meshes.size());
+	for (uint32_t i = 0; i < meshes.size(); i++) {
+		vector<uint32_t> key;
+		for (const Texture &texture : meshes[i].GetTextures())
+			key.push_back(texture.id);
+		auto it = group_of.find(key);
+		if (it == group_of.end()) {
+			it = group_of.insert(make_pair(key, (uint32_t)groups_.size())).first;
+			Group group = { 0, 0, i };
+			groups_.push_back(group);
+		}
+		mesh_group[i] = it->second;
+		groups_[it->second].count++;
+	}
+	for (uint32_t g = 1; g < groups_.size(); g++)
+		groups_[g].first = groups_[g - 1].first + groups_[g - 1].count;
+	for (uint32_t g = 0; g < groups_.size(); g++)
+		for (uint32_t i = 0; i < meshes.size(); i++)
+			if (mesh_group[i] == g) order_.push_back(i);
+
+	// one vertex and index buffer for the whole model
+	vector<Vertex> vertices;
+	vector<uint32_t> indices;
+	vector<MeshInfo> infos;
+	for (uint32_t slot = 0; slot < order_.size(); slot++) {
+		const Mesh &mesh = meshes[order_[slot]];
+		Command command;
+		command.count = mesh.GetIndices().size();
+		command.instance_count = 0;
+		command.first_index = indices.size();
+		command.base_vertex = vertices.size();
+		command.base_instance = 0;
+		commands_.push_back(command);
+		vertices.insert(vertices.end(), mesh.GetVertices().begin(), mesh.GetVertices().end());
+		indices.insert(indices.end(), mesh.GetIndices().begin(), mesh.GetIndices().end());
+
+		const AABB &box = model.mesh_aabbs()[order_[slot]];
+		MeshInfo info;
+		info.small = glm::vec4(box.small, 0);
+		info.big = glm::vec4(box.big, 0);
+		info.group = mesh_group[order_[slot]];
+		info.group_first = groups_[info.group].first;
+		info.pad0 = info.pad1 = 0;
+		infos.push_back(info);
+	}
+	zero_counts_.assign(groups_.size(), 0);
+
+	glGenVertexArrays(1, &vao_);
+	glGenBuffers(1, &vbo_);
+	glGenBuffers(1, &ebo_);
+	glGenBuffers(1, &instance_buffer_);
+	glGenBuffers(1, &mesh_buffer_);
+	glGenBuffers(1, &command_template_);
+	glGenBuffers(1, &command_buffer_);
+	glGenBuffers(1, &compact_buffer_);
+	glGenBuffers(1, &count_buffer_);
+	glGenBuffers(1, &visible_buffer_);
+
+	glBindVertexArray(vao_);
+	glBindBuffer(GL_ARRAY_BUFFER, vbo_);
+	glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(Vertex), vertices.data(), GL_STATIC_DRAW);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ebo_);
+	glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(uint32_t), indices.data(), GL_STATIC_DRAW);
+	glEnableVertexAttribArray(0);
+	glVertexAttribPointer(0, 3, GL_FLOAT, false, sizeof(Vertex), (void *)offsetof(Vertex, position));
+	glEnableVertexAttribArray(1);
+	glVertexAttribPointer(1, 3, GL_FLOAT, false, sizeof(Vertex), (void *)offsetof(Vertex, normal));
+	glEnableVertexAttribArray(2);
+	glVertexAttribPointer(2, 2, GL_FLOAT, false, sizeof(Vertex), (void *)offsetof(Vertex, tex_coordinate));
+	glEnableVertexAttribArray(3);
+	glVertexAttribPointer(3, 3, GL_FLOAT, false, sizeof(Vertex), (void *)offsetof(Vertex, tangent));
+	// instance index, read from the visible list at the command's base instance
+	glBindBuffer(GL_ARRAY_BUFFER, visible_buffer_);
+	glEnableVertexAttribArray(4);
+	glVertexAttribIPointer(4, 1, GL_UNSIGNED_INT, sizeof(uint32_t), (void *)0);
+	glVertexAttribDivisor(4, 1);
+	glBindVertexArray(0);
+
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, mesh_buffer_);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, infos.size() * sizeof(MeshInfo), infos.data(), GL_STATIC_DRAW);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, compact_buffer_);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, commands_.size() * sizeof(Command), nullptr, GL_DYNAMIC_DRAW);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, count_buffer_);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, zero_counts_.size() * sizeof(uint32_t), nullptr, GL_DYNAMIC_DRAW);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+	Resize(std::max(capacity, 1u));
+}
+
+GpuCuller::~GpuCuller() {
+	uint32_t buffers[] = {
+		vbo_, ebo_, instance_buffer_, mesh_buffer_, command_template_,
+		command_buffer_, compact_buffer_, count_buffer_, visible_buffer_
+	};
+	glDeleteBuffers(sizeof(buffers) / sizeof(buffers[0]), buffers);
+	glDeleteVertexArrays(1, &vao_);
+}
+
+// every mesh owns capacity slots of the visible list, starting at its base instance
+void GpuCuller::Resize(uint32_t capacity) {
+	capacity_ = capacity;
+	for (uint32_t slot = 0; slot < commands_.size(); slot++)
+		commands_[slot].base_instance = slot * capacity_;
+
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, command_template_);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, commands_.size() * sizeof(Command), commands_.data(), GL_STATIC_DRAW);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, command_buffer_);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, commands_.size() * sizeof(Command), nullptr, GL_DYNAMIC_DRAW);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, visible_buffer_);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, commands_.size() * capacity_ * sizeof(uint32_t), nullptr, GL_DYNAMIC_DRAW);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, instance_buffer_);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, capacity_ * sizeof(InstanceData), nullptr, GL_STREAM_DRAW);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+}
+
+void GpuCuller::Clear() {
+	instances_.clear();
+}
+
+void GpuCuller::Add(const glm::mat4 &model_matrix, const glm::vec3 &tint) {
+	InstanceData instance;
+	instance.model = model_matrix;
+	instance.tint = glm::vec4(tint, 1);
+	instances_.push_back(instance);
+}
+
+const GpuCullingStats &GpuCuller::stats() const {
+	return stats_;
+}
+
+void GpuCuller::Draw(const HiZBuffer *hiz) {
+	using namespace glm;
+	const GLExtensions &ext = GLExtensions::shared;
+	stats_ = GpuCullingStats();
+	if (instances_.empty() || commands_.empty()) return;
+
+	if (instances_.size() > capacity_) {
+		uint32_t capacity = capacity_;
+		while (capacity < instances_.size()) capacity *= 2;
+		Resize(capacity);
+	}
+	uint32_t mesh_count = commands_.size(), instance_count = instances_.size();
+	stats_.instances = instance_count;
+	stats_.meshes = mesh_count;
+
+	// orphan and refill the instances, reset commands and group counts
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, instance_buffer_);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, capacity_ * sizeof(InstanceData), nullptr, GL_STREAM_DRAW);
+	glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, instance_count * sizeof(InstanceData), instances_.data());
+	glBindBuffer(GL_COPY_READ_BUFFER, command_template_);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, command_buffer_);
+	glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, mesh_count * sizeof(Command));
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, count_buffer_);
+	glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, zero_counts_.size() * sizeof(uint32_t), zero_counts_.data());
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, instance_buffer_);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, mesh_buffer_);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, command_buffer_);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, visible_buffer_);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, compact_buffer_);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 5, count_buffer_);
+
+	Frustum frustum(camera_);
+	mat4 view_projection = camera_.GetProjectionMatrix() * camera_.GetViewMatrix();
+	cull_shader_.Use();
+	cull_shader_.SetUniform<uint32_t>("instance_count", instance_count);
+	cull_shader_.SetUniform<uint32_t>("mesh_count", mesh_count);
+	cull_shader_.SetUniform<mat4>("view_projection", view_projection);
+	static const char *kPlanes[6] = { "planes[0]", "planes[1]", "planes[2]", "planes[3]", "planes[4]", "planes[5]" };
+	for (int i = 0; i < 6; i++)
+		cull_shader_.SetUniform<vec4>(kPlanes[i], frustum.plane(i));
+	bool use_hiz = hiz && hiz->levels() > 0;
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_2D, use_hiz ? hiz->texture() : 0);
+	cull_shader_.SetUniform<int32_t>("hiz", 0);
+	cull_shader_.SetUniform<int32_t>("hiz_levels", use_hiz ? hiz->levels() : 0);
+	cull_shader_.SetUniform<vec2>("viewport", use_hiz ? hiz->size() : vec2(1));
+	// instances along x and meshes along y, so that neither the product nor
+	// a dimension runs past the 65535 groups GL promises; more instances
+	// than that go in slices
+	for (uint32_t first = 0; first < instance_count; first += kMaxGroups * 64) {
+		cull_shader_.SetUniform<uint32_t>("first_instance", first);
+		ext.dispatch_compute(std::min((instance_count - first + 63) / 64, kMaxGroups), mesh_count, 1);
+		stats_.dispatches++;
+	}
+
+	if (ext.indirect_count) {
+		ext.memory_barrier(GL_SHADER_STORAGE_BARRIER_BIT);
+		compact_shader_.Use();
+		compact_shader_.SetUniform<uint32_t>("mesh_count", mesh_count);
+		ext.dispatch_compute((mesh_count + 63) / 64, 1, 1);
+		stats_.dispatches++;
+	}
+	ext.memory_barrier(GL_COMMAND_BARRIER_BIT | GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT | GL_SHADER_STORAGE_BARRIER_BIT);
+
+	draw_shader_.Use();
+	draw_shader_.SetUniform<mat4>("view", camera_.GetViewMatrix());
+	draw_shader_.SetUniform<mat4>("projection", camera_.GetProjectionMatrix());
+
+	draw_shader_.SetUniform<vec3>("light.position", vec3(200, 200, 500));
+	draw_shader_.SetUniform<vec3>("light.ambient", vec3(0.6, 0.6, 0.6));
+	draw_shader_.SetUniform<vec3>("light.diffuse", vec3(1, 1, 1));
+	draw_shader_.SetUniform<vec3>("light.specular", vec3(1, 1, 1));
+
+	draw_shader_.SetUniform<vec3>("view_position", camera_.position());
+	draw_shader_.SetUniform<float>("material.shininess", 32);
+
+	glBindVertexArray(vao_);
+	if (ext.indirect_count) {
+		glBindBuffer(GL_DRAW_INDIRECT_BUFFER, compact_buffer_);
+		glBindBuffer(GL_PARAMETER_BUFFER, count_buffer_);
+	} else {
+		// without a gpu side count the uncompacted commands are drawn,
+		// the culled ones have no instances and cost nothing
+		glBindBuffer(GL_DRAW_INDIRECT_BUFFER, command_buffer_);
+	}
+	for (uint32_t g = 0; g < groups_.size(); g++) {
+		const Group &group = groups_[g];
+		model_.meshes()[group.mesh].BindTextures(draw_shader_);
+		const void *offset = (const void *)(group.first * sizeof(Command));
+		if (ext.indirect_count)
+			ext.multi_draw_elements_indirect_count(GL_TRIANGLES, GL_UNSIGNED_INT, offset, g * sizeof(uint32_t), group.count, sizeof(Command));
+		else
+			ext.multi_draw_elements_indirect(GL_TRIANGLES, GL_UNSIGNED_INT, offset, group.count, sizeof(Command));
+		stats_.draw_calls++;
+	}
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+	if (ext.indirect_count)
+		glBindBuffer(GL_PARAMETER_BUFFER, 0);
+	glBindVertexArray(0);
+}
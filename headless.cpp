@@ -0,0 +1,344 @@
+#include <iostream>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <random>
+
+#include "simulation.hpp"
+#include "batch_env.hpp"
+#include "net_server.hpp"
+#include "net_client.hpp"
+#include "box_store.hpp"
+// replaces operator new, and this is the only translation unit
+#include "allocation_counter.hpp"
+
+// every BoxStore kernel this cpu runs against AABB::InBox and AABB::Overlap,
+// on boxes and points snapped to a coarse grid so that points on faces,
+// shared faces and flat boxes come up all the time; non-zero on a mismatch
+int RunBoxCheck(uint32_t rounds) {
+	std::mt19937 random(7);
+	std::uniform_int_distribution<int> coordinate(-4, 4);
+	std::uniform_real_distribution<float> jitter(-0.5f, 0.5f);
+	auto point = [&](bool on_grid) {
+		glm::vec3 p(coordinate(random), coordinate(random), coordinate(random));
+		return on_grid ? p * 0.5f : p * 0.5f + glm::vec3(jitter(random), jitter(random), jitter(random));
+	};
+	const BoxStore::Kernel kernels[] = { BoxStore::Kernel::SCALAR, BoxStore::Kernel::SSE, BoxStore::Kernel::AVX };
+	const char *names[] = { "scalar", "sse", "avx" };
+	uint64_t checks = 0, mismatches = 0;
+	for (uint32_t round = 0; round < rounds; round++) {
+		// sizes that leave every number of padded lanes
+		std::vector<AABB> boxes;
+		for (uint32_t i = 0, size = 1 + round % 37; i < size; i++) {
+			glm::vec3 a = point(round % 2 == 0), b = point(round % 3 == 0);
+			// some flat, some a single point, some empty
+			if (i % 5 == 1) b.z = a.z;
+			if (i % 11 == 2) b = a;
+			boxes.push_back(i % 13 == 3 ? AABB(glm::max(a, b), glm::min(a, b) - 0.25f) : AABB(glm::min(a, b), glm::max(a, b)));
+		}
+		BoxStore store(boxes);
+		std::vector<glm::vec3> points;
+		std::vector<AABB> queries;
+		for (const AABB &box : boxes) {
+			// corners, face middles and the boxes themselves
+			points.push_back(box.small);
+			points.push_back(box.big);
+			points.push_back(glm::vec3(box.small.x, (box.small.y + box.big.y) / 2, box.big.z));
+			queries.push_back(box);
+			queries.push_back(AABB(box.big, box.big + 0.5f));
+		}
+		for (uint32_t i = 0; i < 16; i++) {
+			points.push_back(point(i % 2 == 0));
+			glm::vec3 a = point(i % 3 == 0), b = point(i % 4 == 0);
+			queries.push_back(AABB(glm::min(a, b), glm::max(a, b)));
+		}
+
+		uint32_t blocks = (boxes.size() + BoxStore::kLanes - 1) / BoxStore::kLanes;
+		for (uint32_t block = 0; block < blocks; block++) {
+			for (const glm::vec3 &p : points) {
+				uint32_t expected = 0;
+				for (uint32_t lane = 0; lane < BoxStore::kLanes && block * BoxStore::kLanes + lane < boxes.size(); lane++)
+					if (boxes[block * BoxStore::kLanes + lane].InBox(p)) expected |= 1u << lane;
+				for (uint32_t k = 0; k < 3; k++) {
+					if (!BoxStore::Supported(kernels[k])) continue;
+					uint32_t mask = store.ContainsMask(block, p, kernels[k]);
+					checks++;
+					if (mask == expected) continue;
+					if (mismatches++ < 8)
+						std::cout << names[k] << " contains mask " << mask << " instead of " << expected << " at ("
+						          << p.x << ", " << p.y << ", " << p.z << ")" << std::endl;
+				}
+			}
+			for (const AABB &query : queries) {
+				uint32_t expected = 0;
+				for (uint32_t lane = 0; lane < BoxStore::kLanes && block * BoxStore::kLanes + lane < boxes.size(); lane++)
+					if (boxes[block * BoxStore::kLanes + lane].Overlap(query)) expected |= 1u << lane;
+				for (uint32_t k = 0; k < 3; k++) {
+					if (!BoxStore::Supported(kernels[k])) continue;
+					uint32_t mask = store.OverlapMask(block, query, kernels[k]);
+					checks++;
+					if (mask == expected) continue;
+					if (mismatches++ < 8)
+						std::cout << names[k] << " overlap mask " << mask << " instead of " << expected << std::endl;
+				}
+			}
+		}
+	}
+	std::cout << "box kernels:";
+	for (uint32_t k = 0; k < 3; k++)
+		if (BoxStore::Supported(kernels[k])) std::cout << " " << names[k];
+	std::cout << ", " << checks << " masks, " << mismatches << " mismatches" << std::endl;
+	return mismatches ? 1 : 0;
+}
+
+// The player's car driven by a fixed script, forward, sideways and back
+// and turning a little every second, checked after every step: no ground
+// surface may be inside the car, it may not fall out of the world, and no
+// point of its hulls may be deeper in the world's triangles than the per
+// step depenetration lets through. Depth is measured on the triangle BVH,
+// not on the hulls collision uses, so that it also sees where those are
+// wrong: a point is inside when rays up from it cross the triangles an odd
+// number of times, and as deep as its shortest way out up or sideways, so
+// that the bottom face of a wall standing on the ground does not count.
+// Non-zero on any violation.
+int RunDriveCheck(const City &city, const Model &car_model, uint32_t steps) {
+	const float step = 1.0f / 120;
+	// ground this far above the wheels is inside the car
+	const float kSunk = 0.05f;
+	// a few steps of Car::Depenetrate
+	const float kWallDepth = 0.05f;
+	Simulation simulation(city, car_model, glm::vec3(8.31, 8.01, 4.88), 16, 0);
+	AABB world = city.world_model().aabb().Transform(City::WorldMatrix());
+	float bottom = world.small.z, reach = glm::length(world.big - world.small);
+	// up and sideways, tilted off the axes so that rays do not run along edges
+	const glm::vec3 rays[6] = {
+		glm::normalize(glm::vec3(0.013f, 0.021f, 1)), glm::normalize(glm::vec3(-0.017f, 0.011f, 1)),
+		glm::normalize(glm::vec3(1, 0.013f, 0.007f)), glm::normalize(glm::vec3(-1, 0.021f, 0.005f)),
+		glm::normalize(glm::vec3(0.017f, 1, 0.009f)), glm::normalize(glm::vec3(0.011f, -1, 0.003f))
+	};
+	// the corners of the car's hulls, their middles and halfway in between
+	std::vector<glm::vec3> probes;
+	for (const ConvexHull &hull : car_model.hulls()) {
+		if (hull.empty()) continue;
+		glm::vec3 middle(0);
+		for (const glm::vec3 &vertex : hull.vertices())
+			middle += vertex / (float)hull.vertices().size();
+		probes.push_back(middle);
+		for (const glm::vec3 &vertex : hull.vertices()) {
+			probes.push_back(vertex);
+			probes.push_back((vertex + middle) * 0.5f);
+		}
+	}
+
+	uint32_t violations = 0;
+	float deepest = 0, sunk = 0;
+	for (uint32_t i = 0; i < steps; i++) {
+		if (i % 120 == 0)
+			simulation.car().Rotate(0.25);
+		// three seconds ahead, then one back, sideways every other time
+		uint32_t phase = i / 120 % 4;
+		bool side = i / 480 % 2 == 1;
+		Controls controls = { phase != 3, phase == 3, phase == 1 && side, phase == 2 && side };
+		simulation.Step(step, controls);
+
+		const Car &car = simulation.car();
+		const glm::vec3 &position = car.position();
+		AABB box = car_model.aabb().Transform(car.model_matrix());
+		float ground;
+		bool below = false;
+		if (city.ground().Query(glm::vec3(position.x, position.y, box.big.z), 0, ground) && ground > position.z + kSunk) {
+			sunk = std::max(sunk, ground - position.z);
+			below = true;
+		}
+		below = below || position.z < bottom - kSunk;
+		float depth = 0;
+		for (const glm::vec3 &probe : probes) {
+			glm::vec3 point(car.model_matrix() * glm::vec4(probe, 1));
+			if (city.scene().Crossings(point, rays[0], reach) % 2 == 0 || city.scene().Crossings(point, rays[1], reach) % 2 == 0)
+				continue;
+			float out = reach;
+			for (int k = 0; k < 6; k++) {
+				RayHit hit;
+				if (city.scene().Raycast(point, rays[k], out, hit)) out = hit.t;
+			}
+			depth = std::max(depth, out);
+		}
+		deepest = std::max(deepest, depth);
+		if (!below && depth <= kWallDepth) continue;
+		if (violations++ < 8)
+			std::cout << "step " << i << ": car at (" << position.x << ", " << position.y << ", " << position.z << ")"
+			          << (below ? " below the ground" : "") << (depth > kWallDepth ? " inside a wall" : "") << std::endl;
+	}
+	std::cout << "drive: " << steps << " steps, ground up to " << sunk << " into the car, walls up to " << deepest
+	          << " deep, " << violations << " violations" << std::endl;
+	return violations ? 1 : 0;
+}
+
+// Steps and captures frames as the application does once a warm up has
+// grown every buffer, counting the allocations of all threads, the job
+// system's workers and the path service's drains included. Non-zero when
+// there is any.
+int RunAllocationCheck(const City &city, const Model &car_model, uint32_t frames) {
+	const float step = 1.0f / 120;
+	const uint32_t kWarmUp = 1200;
+	Simulation simulation(city, car_model, glm::vec3(8.31, 8.01, 4.88));
+	FrameState frame(simulation.camera());
+	uint64_t before = 0;
+	for (uint32_t i = 0; i < kWarmUp + frames; i++) {
+		if (i == kWarmUp)
+			before = AllocationCounter::total();
+		if (i % 120 == 0)
+			simulation.car().Rotate(0.2);
+		Controls controls = { true, false, false, false };
+		simulation.Step(step, controls);
+		simulation.Capture(frame, 3.0f);
+	}
+	uint64_t allocations = AllocationCounter::total() - before;
+	std::cout << "allocations: " << frames << " frames after " << kWarmUp << " to warm up, " << allocations
+	          << " allocations" << std::endl;
+	return allocations ? 1 : 0;
+}
+
+// envs cars driving in lockstep through the same city, each steering its own
+// way, as a training loop would drive them
+int RunBatch(const City &city, const Model &car_model, uint32_t envs, uint32_t steps) {
+	BatchEnv batch(city, car_model, envs);
+	for (uint32_t i = 0; i < envs; i++)
+		batch.Reset(i, glm::vec3(8.31, 8.01, 4.88), 2 * M_PI * i / envs);
+	std::vector<float> actions(envs * BatchEnv::kActionSize), observations(envs * BatchEnv::kObservationSize);
+	batch.Observe(observations.data());
+
+	for (uint32_t step = 0; step < steps; step++) {
+		for (uint32_t i = 0; i < envs; i++) {
+			float *action = &actions[i * BatchEnv::kActionSize];
+			const float *observation = &observations[i * BatchEnv::kObservationSize];
+			// drive on, and turn away from whatever is closest ahead
+			action[0] = 1;
+			action[1] = 0;
+			action[2] = observation[6 + 1] < observation[6 + BatchEnv::kSensors - 1] ? -1 : 1;
+		}
+		batch.Step(actions.data(), observations.data());
+	}
+
+	BatchStats stats = batch.stats();
+	double seconds = stats.step_ms * stats.batches / 1000;
+	std::cout << envs << " environments, " << stats.steps << " steps in " << seconds << " s, "
+	          << (uint64_t)(stats.steps / seconds) << " steps/s" << std::endl;
+	return 0;
+}
+
+// count AI vehicles over the drivable regions with the player parked among
+// them, updated back to back: what an update costs at that scale
+int RunTraffic(const City &city, uint32_t count, uint32_t steps) {
+	const float step = 1.0f / 120;
+	Traffic traffic(city.ground());
+	uint32_t player = traffic.AddPlayer();
+	traffic.Spawn(count, Car::DrivableRegions(), Car::DrivableFrame());
+	double total_ms = 0, max_ms = 0;
+	for (uint32_t i = 0; i < steps; i++) {
+		traffic.SetPlayer(player, glm::vec3(8.31, 8.01, 4.88), 0);
+		traffic.Update(step);
+		const TrafficStats &stats = traffic.stats();
+		total_ms += stats.update_ms;
+		max_ms = std::max(max_ms, stats.update_ms);
+	}
+	const TrafficStats &stats = traffic.stats();
+	std::cout << stats.vehicles << " vehicles, " << steps << " updates, " << total_ms / steps << " ms on average, "
+	          << max_ms << " ms at worst, " << stats.braking << " braking " << stats.turning << " turning at the end"
+	          << std::endl;
+	return 0;
+}
+
+// a server and that many players in one process over 127.0.0.1, stepped
+// back to back: what each client costs the server in bandwidth and time
+int RunLoopback(const City &city, const Model &car_model, uint32_t clients, uint32_t ticks) {
+	NetServer server(city, car_model, glm::vec3(8.31, 8.01, 4.88), "127.0.0.1", 0);
+	std::vector<NetClient *> players;
+	for (uint32_t i = 0; i < clients; i++)
+		players.push_back(new NetClient(city, car_model, server.address(), "127.0.0.1"));
+
+	float correction = 0, max_correction = 0;
+	uint64_t relevant = 0;
+	for (uint32_t tick = 0; tick < ticks; tick++) {
+		for (uint32_t i = 0; i < clients; i++) {
+			// on and off the throttle, weaving each its own way
+			float action[BatchEnv::kActionSize] = { (tick / 90 + i) % 4 ? 1.0f : 0.0f, 0, (float)sin(tick * 0.02 + i) };
+			players[i]->Tick(action);
+		}
+		server.Tick();
+		for (NetClient *player : players) {
+			player->Receive();
+			correction += player->stats().correction;
+			relevant += player->snapshot().states.size();
+		}
+	}
+
+	const ServerStats &stats = server.stats();
+	double seconds = (double)ticks / kNetTickRate;
+	uint64_t sent = 0;
+	for (NetClient *player : players) {
+		sent += player->stats().bytes_sent;
+		max_correction = std::max(max_correction, player->stats().max_correction);
+		delete player;
+	}
+	std::cout << clients << " clients, " << ticks << " ticks at " << kNetTickRate << " Hz" << std::endl;
+	std::cout << "server tick " << stats.tick_ms << " ms on average, " << stats.max_tick_ms << " ms at worst" << std::endl;
+	std::cout << "per client " << stats.bytes_sent * 8 / 1000.0 / clients / seconds << " kbit/s down, "
+	          << sent * 8 / 1000.0 / clients / seconds << " kbit/s up, "
+	          << (double)stats.bytes_sent / stats.packets_sent << " bytes and "
+	          << (double)relevant / clients / ticks << " cars a snapshot" << std::endl;
+	std::cout << "reconciliation moved cars " << correction / clients / ticks << " on average, "
+	          << max_correction << " at most" << std::endl;
+	return 0;
+}
+
+// The simulation without a window or a GL context, stepped as fast as it
+// goes while the car drives forward and turns a little every second. Built
+// by make headless; the first argument is the number of steps. Or batch
+// followed by the number of environments and of steps, traffic followed by
+// the number of vehicles and of updates, loopback followed by the number of
+// clients and of ticks, or serve followed by a port for a dedicated server.
+// Checks exit non-zero when they fail: boxes followed by a number of
+// rounds, drive followed by a number of steps, allocations followed by a
+// number of frames.
+int main(int argc, char **argv) {
+	const float step = 1.0f / 120;
+	if (argc > 1 && std::strcmp(argv[1], "boxes") == 0)
+		return RunBoxCheck(argc > 2 ? std::atoi(argv[2]) : 2000);
+
+	Model world_model("resources/models/world", "world.obj", false);
+	Model car_model("resources/models/car", "tank_tigher.obj", true);
+	City city(world_model, "resources/models/world/world");
+	if (argc > 1 && std::strcmp(argv[1], "batch") == 0)
+		return RunBatch(city, car_model, argc > 2 ? std::atoi(argv[2]) : 1024, argc > 3 ? std::atoi(argv[3]) : 1200);
+	if (argc > 1 && std::strcmp(argv[1], "traffic") == 0)
+		return RunTraffic(city, argc > 2 ? std::atoi(argv[2]) : 10000, argc > 3 ? std::atoi(argv[3]) : 1200);
+	if (argc > 1 && std::strcmp(argv[1], "loopback") == 0)
+		return RunLoopback(city, car_model, argc > 2 ? std::atoi(argv[2]) : 64, argc > 3 ? std::atoi(argv[3]) : 1200);
+	if (argc > 1 && std::strcmp(argv[1], "serve") == 0) {
+		NetServer server(city, car_model, glm::vec3(8.31, 8.01, 4.88), "0.0.0.0", argc > 2 ? std::atoi(argv[2]) : 27960);
+		server.Run(0);
+	}
+	if (argc > 1 && std::strcmp(argv[1], "drive") == 0)
+		return RunDriveCheck(city, car_model, argc > 2 ? std::atoi(argv[2]) : 6000);
+	if (argc > 1 && std::strcmp(argv[1], "allocations") == 0)
+		return RunAllocationCheck(city, car_model, argc > 2 ? std::atoi(argv[2]) : 1200);
+
+	uint32_t steps = argc > 1 ? std::atoi(argv[1]) : 12000;
+	Simulation simulation(city, car_model, glm::vec3(8.31, 8.01, 4.88));
+
+	auto start = std::chrono::steady_clock::now();
+	for (uint32_t i = 0; i < steps; i++) {
+		if (i % 120 == 0)
+			simulation.car().Rotate(0.2);
+		Controls controls = { true, false, false, false };
+		simulation.Step(step, controls);
+	}
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+	const glm::vec3 &position = simulation.car().position();
+	std::cout << steps << " steps, " << steps * step << " s simulated in " << elapsed.count() << " s, "
+	          << steps * step / elapsed.count() << "x real time" << std::endl;
+	std::cout << "car at (" << position.x << ", " << position.y << ", " << position.z << ")" << std::endl;
+}
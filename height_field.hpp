@@ -0,0 +1,166 @@
+#pragma once
+
+#include <vector>
+#include <limits>
+#include <algorithm>
+#include <cstdint>
+#include <cmath>
+
+#include <glm/glm.hpp>
+
+#include "aabb.hpp"
+#include "model.hpp"
+
+// Ground heights of the world on a regular xy grid. Every sample keeps up
+// to kMaxLevels surfaces sorted from the top down, so a road under a
+// bridge survives next to the bridge deck. Only triangles facing up
+// (within kMaxSlope of vertical) are rasterized.
+class HeightField {
+public:
+	HeightField();
+	void Bake(const Model &model, const glm::mat4 &model_matrix, float cell_size = 0.1f);
+
+	// height of the topmost surface under position that is not higher than
+	// position.z + step, bilinear between the four samples around it
+	bool Query(const glm::vec3 &position, float step, float &height) const;
+	bool empty() const;
+
+private:
+	static const uint32_t kMaxLevels = 4;
+	// surfaces closer than this in one sample are merged
+	static constexpr float kLevelMerge = 0.05f;
+	static constexpr float kMaxSlope = 0.7f;
+
+	glm::vec2 origin_;
+	float cell_size_;
+	uint32_t nx_, ny_;
+	// kMaxLevels heights per sample, unused levels hold -max
+	std::vector<float> levels_;
+
+	void Insert(uint32_t sample, float height);
+	bool SampleLevel(uint32_t x, uint32_t y, float top, float &height) const;
+};
+
+constexpr float HeightField::kLevelMerge;
+constexpr float HeightField::kMaxSlope;
+
+HeightField::HeightField():
+	origin_(0),
+	cell_size_(0.1f),
+	nx_(0),
+	ny_(0) {
+}
+
+bool HeightField::empty() const {
+	return levels_.empty();
+}
+
+void HeightField::Insert(uint32_t sample, float height) {
+	float *levels = &levels_[(size_t)sample * kMaxLevels];
+	for (uint32_t i = 0; i < kMaxLevels; i++) {
+		if (std::fabs(levels[i] - height) < kLevelMerge) {
+			levels[i] = std::max(levels[i], height);
+			return;
+		}
+	}
+	// keep the highest kMaxLevels surfaces, in descending order
+	if (height <= levels[kMaxLevels - 1]) return;
+	uint32_t i = kMaxLevels - 1;
+	while (i > 0 && levels[i - 1] < height) {
+		levels[i] = levels[i - 1];
+		i--;
+	}
+	levels[i] = height;
+}
+
+void HeightField::Bake(const Model &model, const glm::mat4 &model_matrix, float cell_size) {
+	using namespace glm;
+	cell_size_ = cell_size;
+	AABB bounds = model.aabb().Transform(model_matrix);
+	origin_ = vec2(bounds.small);
+	nx_ = (uint32_t)std::ceil((bounds.big.x - bounds.small.x) / cell_size_) + 2;
+	ny_ = (uint32_t)std::ceil((bounds.big.y - bounds.small.y) / cell_size_) + 2;
+	levels_.assign((size_t)nx_ * ny_ * kMaxLevels, -std::numeric_limits<float>::max());
+
+	for (const Mesh &mesh : model.meshes()) {
+		const std::vector<Vertex> &vertices = mesh.GetVertices();
+		const std::vector<uint32_t> &indices = mesh.GetIndices();
+		std::vector<vec3> positions(vertices.size());
+		for (uint32_t i = 0; i < vertices.size(); i++)
+			positions[i] = vec3(model_matrix * vec4(vertices[i].position, 1));
+
+		for (uint32_t t = 0; t + 2 < indices.size(); t += 3) {
+			vec3 a = positions[indices[t]], b = positions[indices[t + 1]], c = positions[indices[t + 2]];
+			vec3 normal = cross(b - a, c - a);
+			float len = length(normal);
+			// the winding of the world is not consistent, so either side may face up
+			if (len < 1e-12f || std::fabs(normal.z) < kMaxSlope * len) continue;
+
+			// samples inside the xy projection, barycentric height
+			float area = (b.x - a.x) * (c.y - a.y) - (b.y - a.y) * (c.x - a.x);
+			int x0 = std::max(0, (int)std::ceil((std::min(a.x, std::min(b.x, c.x)) - origin_.x) / cell_size_));
+			int x1 = std::min((int)nx_ - 1, (int)std::floor((std::max(a.x, std::max(b.x, c.x)) - origin_.x) / cell_size_));
+			int y0 = std::max(0, (int)std::ceil((std::min(a.y, std::min(b.y, c.y)) - origin_.y) / cell_size_));
+			int y1 = std::min((int)ny_ - 1, (int)std::floor((std::max(a.y, std::max(b.y, c.y)) - origin_.y) / cell_size_));
+			for (int y = y0; y <= y1; y++) {
+				for (int x = x0; x <= x1; x++) {
+					vec2 p = origin_ + vec2(x, y) * cell_size_;
+					float wa = ((b.x - p.x) * (c.y - p.y) - (b.y - p.y) * (c.x - p.x)) / area;
+					float wb = ((c.x - p.x) * (a.y - p.y) - (c.y - p.y) * (a.x - p.x)) / area;
+					float wc = 1 - wa - wb;
+					// a little slack so that shared edges leave no holes
+					const float slack = -1e-4f;
+					if (wa < slack || wb < slack || wc < slack) continue;
+					Insert(y * nx_ + x, wa * a.z + wb * b.z + wc * c.z);
+				}
+			}
+		}
+	}
+}
+
+bool HeightField::SampleLevel(uint32_t x, uint32_t y, float top, float &height) const {
+	const float *levels = &levels_[((size_t)y * nx_ + x) * kMaxLevels];
+	for (uint32_t i = 0; i < kMaxLevels; i++) {
+		if (levels[i] == -std::numeric_limits<float>::max()) return false;
+		if (levels[i] <= top) {
+			height = levels[i];
+			return true;
+		}
+	}
+	return false;
+}
+
+bool HeightField::Query(const glm::vec3 &position, float step, float &height) const {
+	if (levels_.empty()) return false;
+	float fx = (position.x - origin_.x) / cell_size_, fy = (position.y - origin_.y) / cell_size_;
+	if (fx < 0 || fy < 0 || fx > nx_ - 1 || fy > ny_ - 1) return false;
+	uint32_t x = std::min((uint32_t)fx, nx_ - 2), y = std::min((uint32_t)fy, ny_ - 2);
+	float tx = fx - x, ty = fy - y;
+
+	// samples without a surface drop out and the rest are renormalized, which
+	// keeps the edges of roofs and roads usable; so do samples more than a
+	// cell below the highest one, a 45 degree slope never drops that much
+	const float weights[4] = { (1 - tx) * (1 - ty), tx * (1 - ty), (1 - tx) * ty, tx * ty };
+	float heights[4];
+	bool found[4];
+	float highest = -std::numeric_limits<float>::max();
+	for (uint32_t i = 0; i < 4; i++) {
+		found[i] = SampleLevel(x + (i & 1), y + (i >> 1), position.z + step, heights[i]);
+		if (found[i]) highest = std::max(highest, heights[i]);
+	}
+	float sum = 0, total = 0;
+	for (uint32_t i = 0; i < 4; i++) {
+		if (found[i] && heights[i] >= highest - cell_size_) {
+			sum += weights[i] * heights[i];
+			total += weights[i];
+		}
+	}
+	if (total <= 0) {
+		// only zero weight samples have a surface, i.e. exactly on a grid line
+		if (highest == -std::numeric_limits<float>::max()) return false;
+		height = highest;
+		return true;
+	}
+	height = sum / total;
+	return true;
+}
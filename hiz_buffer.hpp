@@ -0,0 +1,135 @@
+#pragma once
+
+#include <algorithm>
+
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+
+#include "gl_extensions.hpp"
+#include "shader.hpp"
+
+// Hierarchical depth of the last frame: the default framebuffer's depth is
+// blitted into a texture and reduced to a farthest-depth mip chain.
+class HiZBuffer {
+public:
+	HiZBuffer() = delete;
+	HiZBuffer(const Shader &downsample_shader);
+	virtual ~HiZBuffer();
+
+	// call after the frame is drawn, before swapping buffers
+	void Build(int width, int height);
+	uint32_t texture() const;
+	int levels() const;
+	glm::vec2 size() const;
+
+private:
+	const Shader &shader_;
+	uint32_t fbo_, depth_texture_, hiz_texture_;
+	int width_, height_, levels_;
+
+	void Allocate(int width, int height);
+	void Release();
+};
+
+HiZBuffer::HiZBuffer(const Shader &downsample_shader):
+	shader_(downsample_shader),
+	fbo_(0),
+	depth_texture_(0),
+	hiz_texture_(0),
+	width_(0),
+	height_(0),
+	levels_(0) {
+}
+
+HiZBuffer::~HiZBuffer() {
+	Release();
+}
+
+uint32_t HiZBuffer::texture() const {
+	return hiz_texture_;
+}
+
+int HiZBuffer::levels() const {
+	return levels_;
+}
+
+glm::vec2 HiZBuffer::size() const {
+	return glm::vec2(width_, height_);
+}
+
+void HiZBuffer::Release() {
+	if (fbo_) glDeleteFramebuffers(1, &fbo_);
+	if (depth_texture_) glDeleteTextures(1, &depth_texture_);
+	if (hiz_texture_) glDeleteTextures(1, &hiz_texture_);
+	fbo_ = depth_texture_ = hiz_texture_ = 0;
+	levels_ = 0;
+}
+
+void HiZBuffer::Allocate(int width, int height) {
+	Release();
+	width_ = width;
+	height_ = height;
+
+	// same format as the default depth buffer, which the blit requires
+	glGenTextures(1, &depth_texture_);
+	glBindTexture(GL_TEXTURE_2D, depth_texture_);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH24_STENCIL8, width, height, 0, GL_DEPTH_STENCIL, GL_UNSIGNED_INT_24_8, nullptr);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+
+	glGenFramebuffers(1, &fbo_);
+	glBindFramebuffer(GL_FRAMEBUFFER, fbo_);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_TEXTURE_2D, depth_texture_, 0);
+	glDrawBuffer(GL_NONE);
+	glReadBuffer(GL_NONE);
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+	int levels = 1;
+	while ((std::max(width, height) >> levels) > 0) levels++;
+	glGenTextures(1, &hiz_texture_);
+	glBindTexture(GL_TEXTURE_2D, hiz_texture_);
+	for (int level = 0; level < levels; level++) {
+		glTexImage2D(GL_TEXTURE_2D, level, GL_R32F, std::max(1, width >> level), std::max(1, height >> level), 0, GL_RED, GL_FLOAT, nullptr);
+	}
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, 0);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, levels - 1);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glBindTexture(GL_TEXTURE_2D, 0);
+	// levels_ stays 0 until the first build, so nothing samples garbage
+}
+
+void HiZBuffer::Build(int width, int height) {
+	const GLExtensions &ext = GLExtensions::shared;
+	if (width <= 0 || height <= 0) return;
+	if (width != width_ || height != height_ || !hiz_texture_)
+		Allocate(width, height);
+
+	glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+	glBindFramebuffer(GL_DRAW_FRAMEBUFFER, fbo_);
+	glBlitFramebuffer(0, 0, width, height, 0, 0, width, height, GL_DEPTH_BUFFER_BIT, GL_NEAREST);
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+	shader_.Use();
+	shader_.SetUniform<int32_t>("source", 0);
+	glActiveTexture(GL_TEXTURE0);
+	int levels = 1;
+	while ((std::max(width, height) >> levels) > 0) levels++;
+	for (int level = 0; level < levels; level++) {
+		int w = std::max(1, width >> level), h = std::max(1, height >> level);
+		if (level == 0) {
+			glBindTexture(GL_TEXTURE_2D, depth_texture_);
+			shader_.SetUniform<int32_t>("source_level", -1);
+		} else {
+			glBindTexture(GL_TEXTURE_2D, hiz_texture_);
+			shader_.SetUniform<int32_t>("source_level", level - 1);
+		}
+		ext.bind_image_texture(0, hiz_texture_, level, GL_FALSE, 0, GL_WRITE_ONLY, GL_R32F);
+		ext.dispatch_compute((w + 7) / 8, (h + 7) / 8, 1);
+		ext.memory_barrier(GL_TEXTURE_FETCH_BARRIER_BIT | GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+	}
+	glBindTexture(GL_TEXTURE_2D, 0);
+	levels_ = levels;
+}
@@ -0,0 +1,158 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+
+#include "model.hpp"
+#include "shader.hpp"
+#include "camera.hpp"
+#include "frustum.hpp"
+
+struct InstanceStats {
+	uint32_t drawn_instances, culled_instances, draw_calls;
+};
+
+// Draws many copies of one model with one instanced call per mesh. Instances
+// outside the frustum are dropped before upload, and the survivors are
+// streamed through a ring of buffer regions fenced against the gpu.
+class InstanceBatch {
+public:
+	InstanceBatch() = delete;
+	InstanceBatch(const Model &model, const Shader &shader, const Camera &camera, uint32_t capacity = 256);
+	virtual ~InstanceBatch();
+
+	void Clear();
+	void Add(const glm::mat4 &model_matrix, const glm::vec3 &tint = glm::vec3(1));
+	void Draw();
+	const InstanceStats &stats() const;
+
+private:
+	static const uint32_t kRegions = 3;
+
+	const Model &model_;
+	const Shader &shader_;
+	const Camera &camera_;
+	AABB box_;
+	std::vector<InstanceData> instances_;
+	uint32_t buffer_, capacity_, region_;
+	GLsync fences_[kRegions];
+	InstanceStats stats_;
+
+	void Allocate(uint32_t capacity);
+	void WaitRegion(uint32_t region);
+};
+
+InstanceBatch::InstanceBatch(const Model &model, const Shader &shader, const Camera &camera, uint32_t capacity):
+	model_(model),
+	shader_(shader),
+	camera_(camera),
+	box_(model.aabb()),
+	buffer_(0),
+	capacity_(0),
+	region_(0),
+	stats_() {
+	for (uint32_t i = 0; i < kRegions; i++)
+		fences_[i] = nullptr;
+	glGenBuffers(1, &buffer_);
+	Allocate(capacity);
+}
+
+InstanceBatch::~InstanceBatch() {
+	for (uint32_t i = 0; i < kRegions; i++)
+		if (fences_[i]) glDeleteSync(fences_[i]);
+	glDeleteBuffers(1, &buffer_);
+}
+
+void InstanceBatch::Allocate(uint32_t capacity) {
+	// the old storage is orphaned, so the fences guarding it are meaningless
+	for (uint32_t i = 0; i < kRegions; i++) {
+		if (fences_[i]) glDeleteSync(fences_[i]);
+		fences_[i] = nullptr;
+	}
+	capacity_ = capacity;
+	glBindBuffer(GL_ARRAY_BUFFER, buffer_);
+	glBufferData(GL_ARRAY_BUFFER, kRegions * capacity_ * sizeof(InstanceData), nullptr, GL_STREAM_DRAW);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+void InstanceBatch::WaitRegion(uint32_t region) {
+	if (!fences_[region]) return;
+	// with three regions in flight this only spins when the gpu is far behind
+	GLenum result = glClientWaitSync(fences_[region], GL_SYNC_FLUSH_COMMANDS_BIT, 0);
+	while (result == GL_TIMEOUT_EXPIRED)
+		result = glClientWaitSync(fences_[region], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000);
+	glDeleteSync(fences_[region]);
+	fences_[region] = nullptr;
+}
+
+void InstanceBatch::Clear() {
+	instances_.clear();
+}
+
+void InstanceBatch::Add(const glm::mat4 &model_matrix, const glm::vec3 &tint) {
+	InstanceData instance;
+	instance.model = model_matrix;
+	instance.tint = glm::vec4(tint, 1);
+	instances_.push_back(instance);
+}
+
+const InstanceStats &InstanceBatch::stats() const {
+	return stats_;
+}
+
+void InstanceBatch::Draw() {
+	using namespace glm;
+	stats_ = InstanceStats();
+
+	// cull in place so that only visible instances are uploaded
+	Frustum frustum(camera_);
+	uint32_t visible = 0;
+	for (uint32_t i = 0; i < instances_.size(); i++) {
+		if (frustum.Intersects(box_.Transform(instances_[i].model)))
+			instances_[visible++] = instances_[i];
+	}
+	stats_.culled_instances = instances_.size() - visible;
+	stats_.drawn_instances = visible;
+	instances_.resize(visible);
+	if (visible == 0) return;
+
+	if (visible > capacity_) {
+		uint32_t capacity = std::max(capacity_, 1u);
+		while (capacity < visible) capacity *= 2;
+		Allocate(capacity);
+	}
+
+	region_ = (region_ + 1) % kRegions;
+	WaitRegion(region_);
+	size_t offset = (size_t)region_ * capacity_ * sizeof(InstanceData);
+	size_t size = visible * sizeof(InstanceData);
+	glBindBuffer(GL_ARRAY_BUFFER, buffer_);
+	void *data = glMapBufferRange(GL_ARRAY_BUFFER, offset, size,
+		GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+	memcpy(data, instances_.data(), size);
+	glUnmapBuffer(GL_ARRAY_BUFFER);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+	shader_.Use();
+	shader_.SetUniform<mat4>("view", camera_.GetViewMatrix());
+	shader_.SetUniform<mat4>("projection", camera_.GetProjectionMatrix());
+
+	shader_.SetUniform<vec3>("light.position", vec3(200, 200, 500));
+	shader_.SetUniform<vec3>("light.ambient", vec3(0.6, 0.6, 0.6));
+	shader_.SetUniform<vec3>("light.diffuse", vec3(1, 1, 1));
+	shader_.SetUniform<vec3>("light.specular", vec3(1, 1, 1));
+
+	shader_.SetUniform<vec3>("view_position", camera_.position());
+	shader_.SetUniform<float>("material.shininess", 32);
+
+	for (const Mesh &mesh : model_.meshes()) {
+		mesh.DrawInstanced(shader_, buffer_, offset, visible);
+		stats_.draw_calls++;
+	}
+	fences_[region_] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
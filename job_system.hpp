@@ -0,0 +1,337 @@
+#pragma once
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <algorithm>
+#include <cstdint>
+
+// jobs of one group still to run; the group is done at zero
+class JobCounter {
+public:
+	JobCounter();
+	JobCounter(const JobCounter &) = delete;
+	bool done() const;
+
+private:
+	friend class JobSystem;
+	std::atomic<uint32_t> pending_;
+};
+
+// One worker thread per core beside the thread that creates the system,
+// each with a Chase-Lev deque: a worker pushes and pops its own jobs at the
+// bottom, and an idle one steals from the top of another's. Threads that
+// are not workers hand their jobs in through a locked queue. Wait runs the
+// jobs of its counter nobody took yet, so the caller works while it waits.
+// The creating thread, the GL thread in the application, and threads outside
+// the system run nothing else there, so that a path drain cannot hold a
+// frame; they can only reach a deque at its ends, and rely on the workers to
+// uncover a job of theirs stuck under others. A worker that keeps missing
+// therefore takes any job. Jobs do not own their functions; a function has
+// to outlive the Wait on its counter.
+class JobSystem {
+public:
+	JobSystem() = delete;
+	JobSystem(const JobSystem &) = delete;
+	// threads in all, the creating thread counting as one
+	explicit JobSystem(uint32_t threads);
+	virtual ~JobSystem();
+
+	// one thread per core and at least one worker, so that jobs nobody waits
+	// for still run; created by the first caller
+	static JobSystem &Shared();
+	uint32_t size() const;
+
+	// function() as a job of counter
+	template <typename Function> void Run(const Function &function, JobCounter &counter);
+	// function(begin, end) over [0, count) in chunks of at least grain,
+	// returning when all are done
+	template <typename Function> void ParallelFor(uint32_t count, uint32_t grain, const Function &function);
+	void Wait(JobCounter &counter);
+	// one queued job of any counter if there is any, for a thread that waits
+	// on something else than a counter
+	bool RunOne();
+
+private:
+	// jobs a thread may have queued at once, past it Submit runs them itself
+	static const uint32_t kCapacity = 4096;
+	// chunks per thread in ParallelFor, so that stealing can even out
+	static const uint32_t kChunksPerThread = 4;
+	// tries for work before an idle worker sleeps, or a waiting one takes
+	// jobs of other counters
+	static const uint32_t kSpins = 64;
+
+	struct Job {
+		void (*run)(const void *function, uint32_t begin, uint32_t end);
+		const void *function;
+		uint32_t begin, end;
+		JobCounter *counter;
+	};
+
+	// Jobs are kept by value, so a slot is only written again once its
+	// position has been taken. A thief copies its job before claiming it;
+	// when the claim fails the copy may be torn, and it is dropped.
+	class Deque {
+	public:
+		Deque();
+		bool Push(const Job &job);
+		// only a job of counter, any job when it is null
+		bool Pop(Job &job, const JobCounter *counter);
+		bool Steal(Job &job, const JobCounter *counter);
+
+	private:
+		std::atomic<int64_t> top_, bottom_;
+		Job jobs_[kCapacity];
+	};
+
+	struct Worker {
+		JobSystem *system;
+		uint32_t index;
+		Deque deque;
+	};
+
+	static thread_local Worker *current_;
+
+	// workers_[0] belongs to the creating thread
+	std::vector<Worker *> workers_;
+	std::vector<std::thread> threads_;
+	std::mutex injected_mutex_;
+	// a vector, so that it keeps its capacity once it has grown
+	std::vector<Job> injected_;
+	std::atomic<int32_t> queued_;
+	std::mutex sleep_mutex_;
+	std::condition_variable wake_;
+	std::atomic<uint32_t> sleeping_;
+	std::atomic<bool> stop_;
+
+	template <typename Function> static void RunTask(const void *function, uint32_t begin, uint32_t end);
+	template <typename Function> static void RunRange(const void *function, uint32_t begin, uint32_t end);
+	Worker *Current() const;
+	bool RunOne(const JobCounter *counter);
+	void Submit(const Job &job);
+	void Execute(const Job &job);
+	void Work(uint32_t index);
+};
+
+thread_local JobSystem::Worker *JobSystem::current_ = nullptr;
+
+JobCounter::JobCounter(): pending_(0) {}
+
+bool JobCounter::done() const {
+	return pending_.load(std::memory_order_acquire) == 0;
+}
+
+JobSystem::Deque::Deque(): top_(0), bottom_(0) {}
+
+bool JobSystem::Deque::Push(const Job &job) {
+	int64_t bottom = bottom_.load(std::memory_order_relaxed), top = top_.load(std::memory_order_acquire);
+	if (bottom - top >= (int64_t)kCapacity) return false;
+	jobs_[bottom & (kCapacity - 1)] = job;
+	std::atomic_thread_fence(std::memory_order_release);
+	bottom_.store(bottom + 1, std::memory_order_relaxed);
+	return true;
+}
+
+bool JobSystem::Deque::Pop(Job &job, const JobCounter *counter) {
+	int64_t bottom = bottom_.load(std::memory_order_relaxed) - 1;
+	// only the owner writes slots, so the bottom one can be looked at first
+	if (counter && (top_.load(std::memory_order_acquire) > bottom || jobs_[bottom & (kCapacity - 1)].counter != counter))
+		return false;
+	bottom_.store(bottom, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	int64_t top = top_.load(std::memory_order_relaxed);
+	if (top > bottom) {
+		bottom_.store(bottom + 1, std::memory_order_relaxed);
+		return false;
+	}
+	job = jobs_[bottom & (kCapacity - 1)];
+	bool taken = true;
+	if (top == bottom) {
+		// the last job, a thief may be after it too
+		taken = top_.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+		bottom_.store(bottom + 1, std::memory_order_relaxed);
+	}
+	return taken;
+}
+
+bool JobSystem::Deque::Steal(Job &job, const JobCounter *counter) {
+	int64_t top = top_.load(std::memory_order_acquire);
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	int64_t bottom = bottom_.load(std::memory_order_acquire);
+	if (top >= bottom) return false;
+	job = jobs_[top & (kCapacity - 1)];
+	// a torn copy is told apart by the failing claim, whatever counter it shows
+	if (counter && job.counter != counter) return false;
+	return top_.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+}
+
+JobSystem::JobSystem(uint32_t threads):
+	queued_(0),
+	sleeping_(0),
+	stop_(false) {
+	for (uint32_t i = 0; i < std::max(threads, 1u); i++) {
+		Worker *worker = new Worker();
+		worker->system = this;
+		worker->index = i;
+		workers_.push_back(worker);
+	}
+	current_ = workers_[0];
+	for (uint32_t i = 1; i < workers_.size(); i++)
+		threads_.push_back(std::thread(&JobSystem::Work, this, i));
+}
+
+JobSystem::~JobSystem() {
+	{
+		std::lock_guard<std::mutex> lock(sleep_mutex_);
+		stop_ = true;
+	}
+	wake_.notify_all();
+	for (std::thread &thread : threads_)
+		thread.join();
+	if (current_ == workers_[0]) current_ = nullptr;
+	for (Worker *worker : workers_)
+		delete worker;
+}
+
+JobSystem &JobSystem::Shared() {
+	static JobSystem system(std::max(std::thread::hardware_concurrency(), 2u));
+	return system;
+}
+
+uint32_t JobSystem::size() const {
+	return workers_.size();
+}
+
+template <typename Function>
+void JobSystem::RunTask(const void *function, uint32_t, uint32_t) {
+	(*(const Function *)function)();
+}
+
+template <typename Function>
+void JobSystem::RunRange(const void *function, uint32_t begin, uint32_t end) {
+	(*(const Function *)function)(begin, end);
+}
+
+template <typename Function>
+void JobSystem::Run(const Function &function, JobCounter &counter) {
+	counter.pending_.fetch_add(1, std::memory_order_relaxed);
+	Job job = { &RunTask<Function>, &function, 0, 0, &counter };
+	Submit(job);
+}
+
+template <typename Function>
+void JobSystem::ParallelFor(uint32_t count, uint32_t grain, const Function &function) {
+	if (count == 0) return;
+	uint32_t chunks = size() * kChunksPerThread;
+	uint32_t chunk = std::max(std::max(grain, 1u), (count + chunks - 1) / chunks);
+	if (chunk >= count) {
+		function(0, count);
+		return;
+	}
+	JobCounter counter;
+	// the first chunk is the caller's, the rest go to whoever is free
+	for (uint32_t begin = chunk; begin < count; begin += chunk) {
+		counter.pending_.fetch_add(1, std::memory_order_relaxed);
+		Job job = { &RunRange<Function>, &function, begin, std::min(begin + chunk, count), &counter };
+		Submit(job);
+	}
+	function(0, chunk);
+	Wait(counter);
+}
+
+JobSystem::Worker *JobSystem::Current() const {
+	return current_ && current_->system == this ? current_ : nullptr;
+}
+
+void JobSystem::Submit(const Job &job) {
+	Worker *worker = Current();
+	if (worker) {
+		if (!worker->deque.Push(job)) {
+			Execute(job);
+			return;
+		}
+	} else {
+		std::lock_guard<std::mutex> lock(injected_mutex_);
+		injected_.push_back(job);
+	}
+	queued_.fetch_add(1);
+	if (sleeping_.load() > 0) {
+		// taken so that the wake up cannot fall between a sleeper's check and its wait
+		{ std::lock_guard<std::mutex> lock(sleep_mutex_); }
+		wake_.notify_one();
+	}
+}
+
+bool JobSystem::RunOne() {
+	return RunOne(nullptr);
+}
+
+bool JobSystem::RunOne(const JobCounter *counter) {
+	// nothing queued anywhere, no need to look
+	if (queued_.load() <= 0) return false;
+	Worker *self = Current();
+	Job job;
+	bool found = self && self->deque.Pop(job, counter);
+	// from the others, starting past this thread so thieves spread out; a
+	// waiter also looks at the top of its own, in case a job it ran queued
+	// something of another counter over the rest of its own
+	uint32_t start = self ? self->index + 1 : 0;
+	for (uint32_t i = 0; !found && i < workers_.size(); i++) {
+		Worker *victim = workers_[(start + i) % workers_.size()];
+		if (victim != self || counter) found = victim->deque.Steal(job, counter);
+	}
+	if (!found) {
+		std::lock_guard<std::mutex> lock(injected_mutex_);
+		auto it = std::find_if(injected_.begin(), injected_.end(),
+		                       [counter](const Job &job) { return !counter || job.counter == counter; });
+		if (it == injected_.end()) return false;
+		job = *it;
+		injected_.erase(it);
+	}
+	queued_.fetch_sub(1);
+	Execute(job);
+	return true;
+}
+
+void JobSystem::Execute(const Job &job) {
+	job.run(job.function, job.begin, job.end);
+	job.counter->pending_.fetch_sub(1, std::memory_order_release);
+}
+
+void JobSystem::Wait(JobCounter &counter) {
+	// a job of counter can sit in the middle of a deque, under jobs of other
+	// counters, where no filtered Pop or Steal finds it; a worker taking
+	// those in turn gets to it
+	Worker *self = Current();
+	bool any = self && self != workers_[0];
+	uint32_t misses = 0;
+	while (!counter.done()) {
+		if (RunOne(&counter) || (any && ++misses >= kSpins && RunOne())) {
+			misses = 0;
+			continue;
+		}
+		std::this_thread::yield();
+	}
+}
+
+void JobSystem::Work(uint32_t index) {
+	current_ = workers_[index];
+	uint32_t idle = 0;
+	while (!stop_) {
+		if (RunOne()) {
+			idle = 0;
+			continue;
+		}
+		if (++idle < kSpins) {
+			std::this_thread::yield();
+			continue;
+		}
+		std::unique_lock<std::mutex> lock(sleep_mutex_);
+		sleeping_.fetch_add(1);
+		wake_.wait(lock, [this]() { return stop_ || queued_.load() > 0; });
+		sleeping_.fetch_sub(1);
+		idle = 0;
+	}
+}
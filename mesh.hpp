@@ -2,8 +2,15 @@
 
 #include <vector>
 #include <string>
+#include <cstdint>
+#include <cstddef>
 
+#include <glm/glm.hpp>
+
+// HEADLESS builds keep the geometry on the cpu and never touch GL
+#ifndef HEADLESS
 #include "shader.hpp"
+#endif
 
 enum class TextureType {
 	DIFFUSE, SPECULAR, NORMALS, AMBIENT
@@ -21,12 +28,34 @@ struct Texture {
 	TextureType type;
 };
 
+struct InstanceData {
+	glm::mat4 model;
+	glm::vec4 tint;
+};
+
 class Mesh {
 public:
+	// of each texture type
+	static const uint32_t kMaxSamplers = 8;
+
 	Mesh() = delete;
-	Mesh(std::vector<Vertex> vertices, std::vector<uint32_t> indices, std::vector<Texture> textures);
-	void Draw(Shader shader) const;
+	// without upload the buffers wait for Upload, which may then come from
+	// another thread than the one that built the mesh
+	Mesh(std::vector<Vertex> vertices, std::vector<uint32_t> indices, std::vector<Texture> textures, bool upload = true);
+#ifndef HEADLESS
+	void Upload(const std::vector<Texture> &textures);
+	void Draw(const Shader &shader) const;
+	// per instance attributes are read from buffer at offset, see InstanceData
+	void DrawInstanced(const Shader &shader, uint32_t buffer, size_t offset, uint32_t count) const;
+	void BindTextures(const Shader &shader) const;
+#endif
+	// material.texture_<type>_<index>, made once; nullptr past kMaxSamplers
+	static const char *SamplerName(TextureType type, uint32_t index);
 	const std::vector<Vertex> & GetVertices() const;
+	const std::vector<uint32_t> & GetIndices() const;
+	const std::vector<Texture> & GetTextures() const;
+	uint32_t GetTriangleCount() const;
+	uint32_t GetVertexArray() const;
 
 private:
 	uint32_t vao, vbo, ebo;
@@ -34,13 +63,23 @@ private:
 	std::vector<uint32_t> indices;
 	std::vector<Texture> textures;
 
+#ifndef HEADLESS
 	void InitMesh();
+#endif
 };
 
-Mesh::Mesh(std::vector<Vertex> vertices, std::vector<uint32_t> indices, std::vector<Texture> textures) {
+Mesh::Mesh(std::vector<Vertex> vertices, std::vector<uint32_t> indices, std::vector<Texture> textures, [[maybe_unused]] bool upload) {
 	this->vertices = vertices;
 	this->indices = indices;
 	this->textures = textures;
+#ifndef HEADLESS
+	if (upload) InitMesh();
+#endif
+}
+
+#ifndef HEADLESS
+void Mesh::Upload(const std::vector<Texture> &textures) {
+	this->textures = textures;
 	InitMesh();
 }
 
@@ -72,36 +111,77 @@ void Mesh::InitMesh() {
 	glBindVertexArray(0);
 }
 
-void Mesh::Draw(Shader shader) const {
-	using namespace std;
-	uint32_t diffuse_total = 0, specular_total = 0, normals_total = 0, ambient_total = 0;
-	for (int i = 0; i < textures.size(); i++) {
-		glActiveTexture(GL_TEXTURE0 + i);
-		glBindTexture(GL_TEXTURE_2D, textures[i].id);
-		string identifier;
-		switch (textures[i].type) {
-			case TextureType::DIFFUSE:
-				identifier = "material.texture_diffuse_" + to_string(diffuse_total++);
-				break;
-			case TextureType::SPECULAR:
-				identifier = "material.texture_specular_" + to_string(specular_total++);
-				break;
-			case TextureType::NORMALS:
-				identifier = "material.texture_normals_" + to_string(normals_total++);
-				break;
-			case TextureType::AMBIENT:
-				identifier = "material.texture_ambient_" + to_string(ambient_total++);
-				break;
-		}
-		shader.SetUniform<int32_t>(identifier, i);
-	}
+void Mesh::Draw(const Shader &shader) const {
+	BindTextures(shader);
 
 	glBindVertexArray(vao);
 	glDrawElements(GL_TRIANGLES, indices.size(), GL_UNSIGNED_INT, 0);
 	glBindVertexArray(0);
 }
 
+void Mesh::DrawInstanced(const Shader &shader, uint32_t buffer, size_t offset, uint32_t count) const {
+	BindTextures(shader);
+
+	glBindVertexArray(vao);
+	glBindBuffer(GL_ARRAY_BUFFER, buffer);
+	// a mat4 takes four attribute slots, one column each
+	for (int i = 0; i < 4; i++) {
+		glEnableVertexAttribArray(4 + i);
+		glVertexAttribPointer(4 + i, 4, GL_FLOAT, false, sizeof(InstanceData), (void *)(offset + offsetof(InstanceData, model) + i * sizeof(glm::vec4)));
+		glVertexAttribDivisor(4 + i, 1);
+	}
+	glEnableVertexAttribArray(8);
+	glVertexAttribPointer(8, 4, GL_FLOAT, false, sizeof(InstanceData), (void *)(offset + offsetof(InstanceData, tint)));
+	glVertexAttribDivisor(8, 1);
+
+	glDrawElementsInstanced(GL_TRIANGLES, indices.size(), GL_UNSIGNED_INT, 0, count);
+	glBindVertexArray(0);
+}
+
+void Mesh::BindTextures(const Shader &shader) const {
+	uint32_t totals[4] = {};
+	for (int i = 0; i < textures.size(); i++) {
+		glActiveTexture(GL_TEXTURE0 + i);
+		glBindTexture(GL_TEXTURE_2D, textures[i].id);
+		const char *name = SamplerName(textures[i].type, totals[(int)textures[i].type]++);
+		if (name) shader.SetUniform<int32_t>(name, i);
+	}
+}
+#endif
+
+const char *Mesh::SamplerName(TextureType type, uint32_t index) {
+	static const std::vector<std::string> names = []() {
+		std::vector<std::string> names;
+		for (const char *type_name : { "diffuse", "specular", "normals", "ambient" })
+			for (uint32_t i = 0; i < kMaxSamplers; i++)
+				names.push_back(std::string("material.texture_") + type_name + "_" + std::to_string(i));
+		return names;
+	}();
+	return index < kMaxSamplers ? names[(uint32_t)type * kMaxSamplers + index].c_str() : nullptr;
+}
+
 const std::vector<Vertex> & Mesh::GetVertices() const
 {
 	return this->vertices;
 }
+
+
+const std::vector<uint32_t> & Mesh::GetIndices() const
+{
+	return this->indices;
+}
+
+const std::vector<Texture> & Mesh::GetTextures() const
+{
+	return this->textures;
+}
+
+uint32_t Mesh::GetTriangleCount() const
+{
+	return this->indices.size() / 3;
+}
+
+uint32_t Mesh::GetVertexArray() const
+{
+	return this->vao;
+}
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <vector>
+#include <chrono>
+#include <cstdint>
+
+#ifdef DEBUG
+#include <iostream>
+#endif
+
+#include "model.hpp"
+#include "bvh.hpp"
+#include "frustum.hpp"
+#include "pvs.hpp"
+
+struct CullingStats {
+	uint32_t drawn_meshes, culled_meshes;
+	uint64_t drawn_triangles, culled_triangles;
+};
+
+// frustum culling of the meshes of a model that never moves
+class MeshCuller {
+public:
+	MeshCuller() = delete;
+	MeshCuller(const Model &model, const glm::mat4 &model_matrix);
+	// pvs_cell, when given, drops every mesh the baked visibility rules out
+	void Cull(const Frustum &frustum, const uint64_t *pvs_cell = nullptr);
+	const std::vector<uint32_t> &visible() const;
+	const std::vector<AABB> &boxes() const;
+	const CullingStats &stats() const;
+
+private:
+	const Model &model_;
+	Bvh bvh_;
+	std::vector<AABB> boxes_;
+	std::vector<uint32_t> visible_;
+	uint64_t total_triangles_;
+	CullingStats stats_;
+};
+
+MeshCuller::MeshCuller(const Model &model, const glm::mat4 &model_matrix):
+	model_(model),
+	total_triangles_(0),
+	stats_() {
+	for (const AABB &box : model.mesh_aabbs())
+		boxes_.push_back(box.Transform(model_matrix));
+	for (const Mesh &mesh : model.meshes())
+		total_triangles_ += mesh.GetTriangleCount();
+
+	auto start = std::chrono::steady_clock::now();
+	bvh_.Build(boxes_);
+#ifdef DEBUG
+	std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+	std::cout << "[culling] bvh over " << boxes_.size() << " meshes built in "
+	          << elapsed.count() << " ms" << std::endl;
+#else
+	(void)start;
+#endif
+	visible_.reserve(boxes_.size());
+}
+
+void MeshCuller::Cull(const Frustum &frustum, const uint64_t *pvs_cell) {
+	visible_.clear();
+	uint64_t drawn_triangles = 0;
+	const std::vector<Mesh> &meshes = model_.meshes();
+	std::vector<uint32_t> &visible = visible_;
+	bvh_.Query(frustum, [&visible, &drawn_triangles, &meshes, pvs_cell](uint32_t index) {
+		if (pvs_cell && !Pvs::Visible(pvs_cell, index)) return;
+		visible.push_back(index);
+		drawn_triangles += meshes[index].GetTriangleCount();
+	});
+	stats_.drawn_meshes = visible_.size();
+	stats_.culled_meshes = meshes.size() - visible_.size();
+	stats_.drawn_triangles = drawn_triangles;
+	stats_.culled_triangles = total_triangles_ - drawn_triangles;
+}
+
+const std::vector<uint32_t> &MeshCuller::visible() const {
+	return visible_;
+}
+
+const std::vector<AABB> &MeshCuller::boxes() const {
+	return boxes_;
+}
+
+const CullingStats &MeshCuller::stats() const {
+	return stats_;
+}
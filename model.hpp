@@ -4,6 +4,7 @@
 #include <string>
 #include <vector>
 #include <algorithm>
+#include <cstdint>
 
 #include <assimp/Importer.hpp>
 #include <assimp/scene.h>
@@ -11,44 +12,115 @@
 
 #include "mesh.hpp"
 #include "cg_exception.hpp"
+#ifndef HEADLESS
 #include "opengl_util.hpp"
+#endif
 #include "bounding_box.hpp"
+#include "convex_hull.hpp"
+#include "convex_decomposition.hpp"
+#include "job_system.hpp"
 
 class Model {
 private:
 	std::string path;
 	std::vector<Mesh> meshes_;
 	std::vector<BoundingBox> boxes_;
+	// collision proxies: one hull of everything in a single bounding box,
+	// otherwise a hull per convex piece of every mesh
+	std::vector<ConvexHull> hulls_;
+	std::vector<AABB> mesh_aabbs_;
 	bool single_bounding_box_;
+	// until Upload, the images each mesh is waiting for
+	bool uploaded_;
+	std::vector<std::vector<std::pair<std::string, TextureType> > > mesh_texture_urls_;
+
+	// the triangles of a box
+	struct Surface {
+		std::vector<glm::vec3> positions;
+		std::vector<uint32_t> indices;
+	};
 
-	void DFSNode(aiNode *, const aiScene *);
-	Mesh DealMesh(aiMesh *, const aiScene *);
+	void DFSNode(aiNode *, const aiScene *, std::vector<Surface> &surfaces);
+	Mesh DealMesh(aiMesh *, const std::vector<Texture> &);
+#ifndef HEADLESS
+	// loaded now when uploaded_, otherwise only noted for Upload
+	std::vector<Texture> MeshTextures(aiMesh *, const aiScene *);
 	std::vector<Texture> LoadMaterialTextures(aiMaterial *, aiTextureType);
+	void MaterialTextureUrls(aiMaterial *, aiTextureType, TextureType, std::vector<std::pair<std::string, TextureType> > &) const;
+#endif
 
 public:
 	Model() = delete;
-	Model(const std::string &, const std::string &, bool);
+	// without upload nothing touches GL, so the model can be read on any
+	// thread; Upload then has to be called on the GL thread
+	Model(const std::string &, const std::string &, bool, bool upload = true);
 
-	void Draw(Shader) const;
+#ifndef HEADLESS
+	void Upload();
+	// every image the meshes use, each once, empty once uploaded
+	std::vector<std::string> texture_urls() const;
+	void Draw(const Shader &) const;
+	void Draw(const Shader &, const std::vector<uint32_t> &mesh_indices) const;
+	void DrawMesh(const Shader &, uint32_t mesh_index) const;
+#endif
 	const std::vector<Mesh> &meshes() const;
-	bool Conflict(const Model &model, glm::mat4 a_model_matrix, glm::mat4 b_model_matrix) const;
+	const std::vector<AABB> &mesh_aabbs() const;
+	const std::vector<BoundingBox> &boxes() const;
+	const std::vector<ConvexHull> &hulls() const;
+	AABB aabb() const;
+	// of the meshes' sizes and world space bounds, what caches baked from
+	// the model are keyed on
+	uint64_t Key(const glm::mat4 &model_matrix) const;
 };
 
-bool Model::Conflict(const Model &model, glm::mat4 a_model_matrix, glm::mat4 b_model_matrix) const {
-	glm::mat4 transform_from_b_to_a = inverse(a_model_matrix) * b_model_matrix;
-	glm::mat4 transform_from_a_to_b = inverse(b_model_matrix) * a_model_matrix;
-	for (const BoundingBox &a_box: this->boxes_)
-		for (const BoundingBox &b_box: model.boxes_)
-			if (a_box.Conflict(b_box, transform_from_b_to_a, transform_from_a_to_b))
-				return true;
-	return false;
-}
-
 const std::vector<Mesh> &Model::meshes() const {
 	return meshes_;
 }
 
-Model::Model(const std::string &path, const std::string &file, bool single_bounding_box): path(path), single_bounding_box_(single_bounding_box) {
+const std::vector<BoundingBox> &Model::boxes() const {
+	return boxes_;
+}
+
+const std::vector<ConvexHull> &Model::hulls() const {
+	return hulls_;
+}
+
+const std::vector<AABB> &Model::mesh_aabbs() const {
+	return mesh_aabbs_;
+}
+
+AABB Model::aabb() const {
+	AABB box;
+	for (const AABB &mesh_box : mesh_aabbs_)
+		box.Merge(mesh_box);
+	return box;
+}
+
+uint64_t Model::Key(const glm::mat4 &model_matrix) const {
+	// FNV-1a over the count, then every mesh's size and world space bounds
+	uint64_t hash = 0xcbf29ce484222325ull;
+	auto mix = [&hash](const void *data, size_t size) {
+		for (size_t i = 0; i < size; i++) {
+			hash ^= ((const uint8_t *)data)[i];
+			hash *= 0x100000001b3ull;
+		}
+	};
+	uint32_t mesh_count = meshes_.size();
+	mix(&mesh_count, sizeof(mesh_count));
+	for (const Mesh &mesh : meshes_) {
+		AABB box;
+		for (const Vertex &vertex : mesh.GetVertices())
+			box.Merge(glm::vec3(model_matrix * glm::vec4(vertex.position, 1)));
+		uint32_t sizes[] = { (uint32_t)mesh.GetVertices().size(), (uint32_t)mesh.GetIndices().size() };
+		mix(sizes, sizeof(sizes));
+		mix(&box.small.x, sizeof(glm::vec3));
+		mix(&box.big.x, sizeof(glm::vec3));
+	}
+	return hash;
+}
+
+Model::Model(const std::string &path, const std::string &file, bool single_bounding_box, bool upload):
+	path(path), single_bounding_box_(single_bounding_box), uploaded_(upload) {
 	using namespace Assimp;
 	using namespace std;
 	Importer importer;
@@ -60,10 +132,60 @@ Model::Model(const std::string &path, const std::string &file, bool single_bound
 	if (scene == nullptr || scene->mFlags & AI_SCENE_FLAGS_INCOMPLETE || scene->mRootNode == nullptr) {
 		throw AssimpError(importer.GetErrorString());
 	}
-	DFSNode(scene->mRootNode, scene);
+	// meshes own GL buffers and are made here, their pieces and hulls are
+	// the slow part and are built as jobs
+	vector<Surface> surfaces;
+	DFSNode(scene->mRootNode, scene, surfaces);
+	vector<vector<vector<glm::vec3> > > pieces(surfaces.size());
+	JobSystem::Shared().ParallelFor(surfaces.size(), 1, [this, &surfaces, &pieces](uint32_t begin, uint32_t end) {
+		for (uint32_t i = begin; i < end; i++) {
+			if (single_bounding_box_)
+				pieces[i].push_back(surfaces[i].positions);
+			else
+				pieces[i] = ConvexPieces(surfaces[i].positions, surfaces[i].indices);
+		}
+	});
+	vector<vector<glm::vec3> > hull_points;
+	for (vector<vector<glm::vec3> > &surface_pieces : pieces)
+		for (vector<glm::vec3> &piece : surface_pieces) {
+			hull_points.push_back(vector<glm::vec3>());
+			hull_points.back().swap(piece);
+		}
+	hulls_.resize(hull_points.size());
+	JobSystem::Shared().ParallelFor(hull_points.size(), 1, [this, &hull_points](uint32_t begin, uint32_t end) {
+		for (uint32_t i = begin; i < end; i++)
+			hulls_[i] = ConvexHull(hull_points[i]);
+	});
+}
+
+#ifndef HEADLESS
+void Model::Upload() {
+	using namespace std;
+	if (uploaded_) return;
+	for (int i = 0; i < meshes_.size(); i++) {
+		vector<Texture> textures;
+		for (const pair<string, TextureType> &url : mesh_texture_urls_[i])
+			textures.push_back({ LoadTexture(url.first), url.second });
+		meshes_[i].Upload(textures);
+	}
+#ifdef DEBUG
+	for (BoundingBox &box : boxes_)
+		box.InitDraw();
+#endif
+	mesh_texture_urls_.clear();
+	uploaded_ = true;
+}
+
+std::vector<std::string> Model::texture_urls() const {
+	using namespace std;
+	vector<string> urls;
+	for (const vector<pair<string, TextureType> > &mesh_urls : mesh_texture_urls_)
+		for (const pair<string, TextureType> &url : mesh_urls)
+			if (find(urls.begin(), urls.end(), url.first) == urls.end()) urls.push_back(url.first);
+	return urls;
 }
 
-void Model::Draw(Shader shader) const {
+void Model::Draw(const Shader &shader) const {
 	for (const Mesh &i : meshes_)
 		i.Draw(shader);
 
@@ -74,34 +196,55 @@ void Model::Draw(Shader shader) const {
 #endif
 }
 
-void Model::DFSNode(aiNode *node, const aiScene *scene) {
+void Model::Draw(const Shader &shader, const std::vector<uint32_t> &mesh_indices) const {
+	for (uint32_t i : mesh_indices)
+		meshes_[i].Draw(shader);
+}
+
+void Model::DrawMesh(const Shader &shader, uint32_t mesh_index) const {
+	meshes_[mesh_index].Draw(shader);
+}
+#endif
+
+void Model::DFSNode(aiNode *node, const aiScene *scene, std::vector<Surface> &surfaces) {
 	for (int i = 0; i < node->mNumMeshes; i++) {
 		aiMesh *mesh = scene->mMeshes[node->mMeshes[i]];
-		Mesh m = DealMesh(mesh, scene);
+		std::vector<Texture> textures;
+#ifndef HEADLESS
+		textures = MeshTextures(mesh, scene);
+#endif
+		Mesh m = DealMesh(mesh, textures);
 		meshes_.push_back(m);
 
 		// bounding box
 		BoundingBox box(m);
+		mesh_aabbs_.push_back(box.aabb());
 		if (boxes_.empty() || !single_bounding_box_) {
-#ifdef DEBUG
-			box.InitDraw();
+#if defined(DEBUG) && !defined(HEADLESS)
+			if (uploaded_) box.InitDraw();
 #endif
 			boxes_.push_back(box);
+			surfaces.push_back(Surface());
 		} else {
 			boxes_.back().Merge(box);
 		}
+		Surface &surface = surfaces.back();
+		uint32_t offset = surface.positions.size();
+		for (const Vertex &vertex : m.GetVertices())
+			surface.positions.push_back(vertex.position);
+		for (uint32_t index : m.GetIndices())
+			surface.indices.push_back(offset + index);
 	}
 	for (int i = 0; i < node->mNumChildren; i++) {
-		DFSNode(node->mChildren[i], scene);
+		DFSNode(node->mChildren[i], scene, surfaces);
 	}
 }
 
-Mesh Model::DealMesh(aiMesh *mesh, const aiScene *scene) {
+Mesh Model::DealMesh(aiMesh *mesh, const std::vector<Texture> &textures) {
 	using namespace std;
 	using namespace glm;
 	vector<Vertex> vertices;
 	vector<uint32_t> indices;
-	vector<Texture> textures;
 
 	for (int i = 0; i < mesh->mNumVertices; i++) {
 		Vertex vertex;
@@ -118,7 +261,25 @@ Mesh Model::DealMesh(aiMesh *mesh, const aiScene *scene) {
 			indices.push_back(mesh->mFaces[i].mIndices[j]);
 		}
 	}
-	if (mesh->mMaterialIndex >= 0) {
+	return Mesh(vertices, indices, textures, uploaded_);
+}
+
+#ifndef HEADLESS
+std::vector<Texture> Model::MeshTextures(aiMesh *mesh, const aiScene *scene) {
+	using namespace std;
+	vector<Texture> textures;
+	// textures only matter to drawing, and wait for Upload unless uploaded_
+	if (!uploaded_) {
+		vector<pair<string, TextureType> > urls;
+		if (mesh->mMaterialIndex >= 0) {
+			aiMaterial *material = scene->mMaterials[mesh->mMaterialIndex];
+			MaterialTextureUrls(material, aiTextureType_DIFFUSE, TextureType::DIFFUSE, urls);
+			MaterialTextureUrls(material, aiTextureType_SPECULAR, TextureType::SPECULAR, urls);
+			MaterialTextureUrls(material, aiTextureType_NORMALS, TextureType::NORMALS, urls);
+			MaterialTextureUrls(material, aiTextureType_AMBIENT, TextureType::AMBIENT, urls);
+		}
+		mesh_texture_urls_.push_back(urls);
+	} else if (mesh->mMaterialIndex >= 0) {
 		aiMaterial *material = scene->mMaterials[mesh->mMaterialIndex];
 		vector<Texture> diffuse_textures = LoadMaterialTextures(material, aiTextureType_DIFFUSE);
 		vector<Texture> specular_textures = LoadMaterialTextures(material, aiTextureType_SPECULAR);
@@ -129,7 +290,7 @@ Mesh Model::DealMesh(aiMesh *mesh, const aiScene *scene) {
 		copy(normals_textures.begin(), normals_textures.end(), back_inserter(textures));
 		copy(ambient_textures.begin(), ambient_textures.end(), back_inserter(textures));
 	}
-	return Mesh(vertices, indices, textures);
+	return textures;
 }
 
 std::vector<Texture> Model::LoadMaterialTextures(aiMaterial *material, aiTextureType type) {
@@ -160,3 +321,13 @@ std::vector<Texture> Model::LoadMaterialTextures(aiMaterial *material, aiTexture
 	}
 	return textures;
 }
+
+void Model::MaterialTextureUrls(aiMaterial *material, aiTextureType type, TextureType texture_type,
+                                std::vector<std::pair<std::string, TextureType> > &urls) const {
+	for (uint32_t i = 0; i < material->GetTextureCount(type); i++) {
+		aiString str;
+		material->GetTexture(type, i, &str);
+		urls.push_back({ TextureUrl(path + "/" + str.C_Str()), texture_type });
+	}
+}
+#endif
@@ -0,0 +1,537 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <functional>
+#include <fstream>
+#include <limits>
+#include <algorithm>
+#include <utility>
+#include <cstdint>
+#include <cmath>
+
+#include <glm/glm.hpp>
+
+#include "aabb.hpp"
+#include "model.hpp"
+
+// Walkable surfaces of the world on a grid of columns. Every triangle is
+// voxelized into the columns it covers; a surface facing up with nothing
+// above it for kClearance is a node, linked to the nodes of the eight
+// neighbouring columns it can step to. Nodes are grouped into regions,
+// the connected parts of kTile x kTile tiles, for the upper level of a two
+// level search: A* over regions gives a corridor, and A* over nodes only
+// expands the nodes inside it.
+class NavMesh {
+public:
+	static const int32_t kNone = -1;
+
+	typedef std::pair<float, uint32_t> Entry;
+	// Scratch of the searches, for one thread at a time. It grows to the
+	// mesh in the first searches and is reused after, so that searching
+	// allocates nothing; a search only reads what it marked itself.
+	struct Search {
+		std::vector<Entry> open;
+		// per node or region: cost so far, where it was reached from, and
+		// the search that did
+		std::vector<float> cost;
+		std::vector<uint32_t> from, visit;
+		uint32_t generation;
+		std::vector<uint32_t> allowed;
+
+		Search();
+	};
+
+	NavMesh();
+	void Bake(const Model &model, const glm::mat4 &model_matrix, float cell_size = 0.2f, float step = 0.05f);
+	// a cache baked for another Model::Key, or one that does not hold
+	// together, is refused
+	bool Load(const std::string &path, uint64_t key);
+	void Save(const std::string &path) const;
+	bool empty() const;
+
+	uint32_t size() const;
+	uint32_t region_count() const;
+	float step() const;
+	glm::vec3 position(uint32_t node) const;
+	uint32_t region(uint32_t node) const;
+	// the highest node under position it could step onto, kNone if there is none
+	int32_t Locate(const glm::vec3 &position) const;
+
+	// regions from the region of start to the region of goal
+	bool FindCorridor(uint32_t start_region, uint32_t goal_region, Search &search, std::vector<uint32_t> &corridor) const;
+	// nodes from start to goal, through the regions of corridor when given
+	bool FindPath(uint32_t start, uint32_t goal, const std::vector<uint32_t> *corridor, Search &search,
+	              std::vector<uint32_t> &path) const;
+
+private:
+	static const uint32_t kMagic = 0x3256414e;
+	static const uint32_t kTile = 16;
+	static const uint8_t kNoLink = 0xff;
+	static constexpr float kClearance = 0.15f;
+	static constexpr float kMaxSlope = 0.7f;
+	static constexpr float kBlockerLift = 0.01f;
+
+	struct Node {
+		float z;
+		uint32_t column, region;
+		// level of the neighbour in each direction, in the order of kDirections
+		uint8_t links[8];
+	};
+	struct Region {
+		glm::vec3 center;
+		uint32_t first_link, link_count;
+	};
+
+	uint64_t key_;
+	glm::vec2 origin_;
+	float cell_size_, step_;
+	uint32_t nx_, ny_;
+	// nodes of a column are contiguous and go from the top down
+	std::vector<uint32_t> column_start_;
+	std::vector<Node> nodes_;
+	std::vector<Region> regions_;
+	std::vector<uint32_t> region_links_;
+
+	int32_t Neighbor(uint32_t node, int direction) const;
+	void BuildRegions();
+	// every index stays inside the arrays it points into
+	bool Valid() const;
+	// a new search over count nodes or regions
+	static void Begin(Search &search, uint32_t count);
+	// reached earlier in this search, and no cheaper than cost
+	static bool Reached(const Search &search, uint32_t index, float cost);
+	static void Reach(Search &search, uint32_t index, float cost, uint32_t from);
+	template <typename T> static void WriteVector(std::ofstream &os, const std::vector<T> &v);
+	template <typename T> static bool ReadVector(std::ifstream &is, std::vector<T> &v);
+};
+
+namespace nav_internal {
+
+const int kDirections[8][2] = { { 1, 0 }, { 0, 1 }, { -1, 0 }, { 0, -1 }, { 1, 1 }, { -1, 1 }, { -1, -1 }, { 1, -1 } };
+
+}
+
+constexpr float NavMesh::kClearance;
+constexpr float NavMesh::kMaxSlope;
+constexpr float NavMesh::kBlockerLift;
+const uint8_t NavMesh::kNoLink;
+
+NavMesh::Search::Search(): generation(0) {}
+
+NavMesh::NavMesh():
+	key_(0),
+	origin_(0),
+	cell_size_(0.2f),
+	step_(0.05f),
+	nx_(0),
+	ny_(0) {
+}
+
+bool NavMesh::empty() const {
+	return nodes_.empty();
+}
+
+uint32_t NavMesh::size() const {
+	return nodes_.size();
+}
+
+uint32_t NavMesh::region_count() const {
+	return regions_.size();
+}
+
+float NavMesh::step() const {
+	return step_;
+}
+
+glm::vec3 NavMesh::position(uint32_t node) const {
+	uint32_t column = nodes_[node].column;
+	return glm::vec3(origin_ + (glm::vec2(column % nx_, column / nx_) + 0.5f) * cell_size_, nodes_[node].z);
+}
+
+uint32_t NavMesh::region(uint32_t node) const {
+	return nodes_[node].region;
+}
+
+int32_t NavMesh::Neighbor(uint32_t node, int direction) const {
+	const Node &n = nodes_[node];
+	if (n.links[direction] == kNoLink) return kNone;
+	int x = n.column % nx_ + nav_internal::kDirections[direction][0];
+	int y = n.column / nx_ + nav_internal::kDirections[direction][1];
+	return column_start_[y * nx_ + x] + n.links[direction];
+}
+
+int32_t NavMesh::Locate(const glm::vec3 &position) const {
+	if (nodes_.empty()) return kNone;
+	int x = (int)std::floor((position.x - origin_.x) / cell_size_), y = (int)std::floor((position.y - origin_.y) / cell_size_);
+	if (x < 0 || y < 0 || x >= (int)nx_ || y >= (int)ny_) return kNone;
+	uint32_t column = y * nx_ + x;
+	for (uint32_t i = column_start_[column]; i < column_start_[column + 1]; i++)
+		if (nodes_[i].z <= position.z + step_) return i;
+	return kNone;
+}
+
+void NavMesh::Bake(const Model &model, const glm::mat4 &model_matrix, float cell_size, float step) {
+	using namespace glm;
+	key_ = model.Key(model_matrix);
+	cell_size_ = cell_size;
+	step_ = step;
+	AABB bounds = model.aabb().Transform(model_matrix);
+	origin_ = vec2(bounds.small);
+	nx_ = (uint32_t)std::ceil((bounds.big.x - bounds.small.x) / cell_size_) + 1;
+	ny_ = (uint32_t)std::ceil((bounds.big.y - bounds.small.y) / cell_size_) + 1;
+
+	// every triangle at the centers of the columns under it: the height, and
+	// whether it is a floor
+	struct Voxel {
+		uint32_t column;
+		float z;
+		bool floor;
+		bool operator<(const Voxel &other) const {
+			return column != other.column ? column < other.column : z > other.z;
+		}
+	};
+	std::vector<Voxel> voxels;
+	for (const Mesh &mesh : model.meshes()) {
+		const std::vector<Vertex> &vertices = mesh.GetVertices();
+		const std::vector<uint32_t> &indices = mesh.GetIndices();
+		std::vector<vec3> positions(vertices.size());
+		for (uint32_t i = 0; i < vertices.size(); i++)
+			positions[i] = vec3(model_matrix * vec4(vertices[i].position, 1));
+		for (uint32_t t = 0; t + 2 < indices.size(); t += 3) {
+			vec3 a = positions[indices[t]], b = positions[indices[t + 1]], c = positions[indices[t + 2]];
+			vec3 normal = cross(b - a, c - a);
+			float len = length(normal);
+			if (len < 1e-12f) continue;
+			bool floor = std::fabs(normal.z) >= kMaxSlope * len;
+			float height = std::max(a.z, std::max(b.z, c.z)) - std::min(a.z, std::min(b.z, c.z));
+			if (!floor && height > step_) {
+				// walls cover few column centers or none, so their edges block
+				// too, lifted a little to block the floor they stand on; curbs
+				// low enough to step over do not
+				for (int e = 0; e < 3; e++) {
+					vec3 p = e == 0 ? a : e == 1 ? b : c, q = e == 0 ? b : e == 1 ? c : a;
+					int samples = (int)std::ceil(2 * length(vec2(q - p)) / cell_size_) + 1;
+					for (int k = 0; k <= samples; k++) {
+						vec3 r = mix(p, q, (float)k / samples);
+						int x = (int)std::floor((r.x - origin_.x) / cell_size_), y = (int)std::floor((r.y - origin_.y) / cell_size_);
+						if (x < 0 || y < 0 || x >= (int)nx_ || y >= (int)ny_) continue;
+						Voxel voxel = { (uint32_t)(y * nx_ + x), r.z + kBlockerLift, false };
+						voxels.push_back(voxel);
+					}
+				}
+			}
+			float area = (b.x - a.x) * (c.y - a.y) - (b.y - a.y) * (c.x - a.x);
+			if (std::fabs(area) < 1e-12f || (!floor && height <= step_)) continue;
+			int x0 = std::max(0, (int)std::ceil((std::min(a.x, std::min(b.x, c.x)) - origin_.x) / cell_size_ - 0.5f));
+			int x1 = std::min((int)nx_ - 1, (int)std::floor((std::max(a.x, std::max(b.x, c.x)) - origin_.x) / cell_size_ - 0.5f));
+			int y0 = std::max(0, (int)std::ceil((std::min(a.y, std::min(b.y, c.y)) - origin_.y) / cell_size_ - 0.5f));
+			int y1 = std::min((int)ny_ - 1, (int)std::floor((std::max(a.y, std::max(b.y, c.y)) - origin_.y) / cell_size_ - 0.5f));
+			for (int y = y0; y <= y1; y++) {
+				for (int x = x0; x <= x1; x++) {
+					vec2 p = origin_ + (vec2(x, y) + 0.5f) * cell_size_;
+					float wa = ((b.x - p.x) * (c.y - p.y) - (b.y - p.y) * (c.x - p.x)) / area;
+					float wb = ((c.x - p.x) * (a.y - p.y) - (c.y - p.y) * (a.x - p.x)) / area;
+					float wc = 1 - wa - wb;
+					const float slack = -1e-4f;
+					if (wa < slack || wb < slack || wc < slack) continue;
+					Voxel voxel = { (uint32_t)(y * nx_ + x), wa * a.z + wb * b.z + wc * c.z, floor };
+					voxels.push_back(voxel);
+				}
+			}
+		}
+	}
+	std::sort(voxels.begin(), voxels.end());
+
+	// floors with room above them, from the top of each column down
+	nodes_.clear();
+	column_start_.assign(nx_ * ny_ + 1, 0);
+	for (uint32_t v = 0, column = 0; column < nx_ * ny_; column++) {
+		column_start_[column] = nodes_.size();
+		float ceiling = std::numeric_limits<float>::max();
+		for (; v < voxels.size() && voxels[v].column == column; v++) {
+			const Voxel &voxel = voxels[v];
+			bool merged = !nodes_.empty() && nodes_.size() > column_start_[column] && nodes_.back().z - voxel.z < step_;
+			if (voxel.floor && !merged && ceiling - voxel.z >= kClearance) {
+				Node node;
+				node.z = voxel.z;
+				node.column = column;
+				node.region = 0;
+				std::fill(node.links, node.links + 8, kNoLink);
+				nodes_.push_back(node);
+			}
+			ceiling = voxel.z;
+		}
+	}
+	column_start_[nx_ * ny_] = nodes_.size();
+
+	// links to the closest level within a step; diagonals also need both
+	// sides, so paths do not cut corners
+	for (uint32_t i = 0; i < nodes_.size(); i++) {
+		Node &node = nodes_[i];
+		int x = node.column % nx_, y = node.column / nx_;
+		for (int d = 0; d < 8; d++) {
+			int tx = x + nav_internal::kDirections[d][0], ty = y + nav_internal::kDirections[d][1];
+			if (tx < 0 || ty < 0 || tx >= (int)nx_ || ty >= (int)ny_) continue;
+			uint32_t column = ty * nx_ + tx;
+			float best = step_;
+			for (uint32_t j = column_start_[column]; j < column_start_[column + 1] && j - column_start_[column] < kNoLink; j++) {
+				float dz = std::fabs(nodes_[j].z - node.z);
+				if (dz <= best) {
+					best = dz;
+					node.links[d] = j - column_start_[column];
+				}
+			}
+		}
+	}
+	for (Node &node : nodes_)
+		for (int d = 4; d < 8; d++)
+			if (node.links[d] != kNoLink && (node.links[d - 4] == kNoLink || node.links[(d - 3) % 4] == kNoLink))
+				node.links[d] = kNoLink;
+	BuildRegions();
+}
+
+void NavMesh::BuildRegions() {
+	using namespace glm;
+	const uint32_t kUnassigned = 0xffffffff;
+	for (Node &node : nodes_)
+		node.region = kUnassigned;
+	regions_.clear();
+	std::vector<uint32_t> stack;
+	std::vector<vec3> sums;
+	std::vector<uint32_t> counts;
+	for (uint32_t i = 0; i < nodes_.size(); i++) {
+		if (nodes_[i].region != kUnassigned) continue;
+		uint32_t region = regions_.size();
+		uint32_t tile = (nodes_[i].column % nx_) / kTile + (nodes_[i].column / nx_) / kTile * ((nx_ + kTile - 1) / kTile);
+		regions_.push_back(Region());
+		sums.push_back(vec3(0));
+		counts.push_back(0);
+		// flood fill, without leaving the tile
+		nodes_[i].region = region;
+		stack.push_back(i);
+		while (!stack.empty()) {
+			uint32_t n = stack.back();
+			stack.pop_back();
+			sums[region] += position(n);
+			counts[region]++;
+			for (int d = 0; d < 8; d++) {
+				int32_t m = Neighbor(n, d);
+				if (m == kNone || nodes_[m].region != kUnassigned) continue;
+				uint32_t m_tile = (nodes_[m].column % nx_) / kTile + (nodes_[m].column / nx_) / kTile * ((nx_ + kTile - 1) / kTile);
+				if (m_tile != tile) continue;
+				nodes_[m].region = region;
+				stack.push_back(m);
+			}
+		}
+	}
+
+	// regions touch where a link crosses between them
+	std::vector<std::pair<uint32_t, uint32_t> > pairs;
+	for (uint32_t n = 0; n < nodes_.size(); n++)
+		for (int d = 0; d < 8; d++) {
+			int32_t m = Neighbor(n, d);
+			if (m != kNone && nodes_[m].region != nodes_[n].region)
+				pairs.push_back(std::make_pair(nodes_[n].region, nodes_[m].region));
+		}
+	std::sort(pairs.begin(), pairs.end());
+	pairs.erase(std::unique(pairs.begin(), pairs.end()), pairs.end());
+	region_links_.clear();
+	for (uint32_t r = 0, p = 0; r < regions_.size(); r++) {
+		regions_[r].center = sums[r] / (float)counts[r];
+		regions_[r].first_link = region_links_.size();
+		for (; p < pairs.size() && pairs[p].first == r; p++)
+			region_links_.push_back(pairs[p].second);
+		regions_[r].link_count = region_links_.size() - regions_[r].first_link;
+	}
+}
+
+void NavMesh::Begin(Search &search, uint32_t count) {
+	if (search.visit.size() < count) {
+		search.cost.resize(count);
+		search.from.resize(count);
+		search.visit.resize(count, 0);
+	}
+	search.open.clear();
+	// once in four billion searches the marks of old ones could pass for new
+	if (++search.generation == 0) {
+		std::fill(search.visit.begin(), search.visit.end(), 0);
+		search.generation = 1;
+	}
+}
+
+bool NavMesh::Reached(const Search &search, uint32_t index, float cost) {
+	return search.visit[index] == search.generation && search.cost[index] <= cost;
+}
+
+void NavMesh::Reach(Search &search, uint32_t index, float cost, uint32_t from) {
+	search.visit[index] = search.generation;
+	search.cost[index] = cost;
+	search.from[index] = from;
+}
+
+bool NavMesh::FindCorridor(uint32_t start_region, uint32_t goal_region, Search &search, std::vector<uint32_t> &corridor) const {
+	using namespace glm;
+	corridor.clear();
+	Begin(search, regions_.size());
+	std::vector<Entry> &open = search.open;
+	const vec3 &goal = regions_[goal_region].center;
+	Reach(search, start_region, 0, start_region);
+	open.push_back(Entry(distance(regions_[start_region].center, goal), start_region));
+	while (!open.empty()) {
+		std::pop_heap(open.begin(), open.end(), std::greater<Entry>());
+		uint32_t r = open.back().second;
+		open.pop_back();
+		if (r == goal_region) {
+			for (uint32_t at = r; ; at = search.from[at]) {
+				corridor.push_back(at);
+				if (at == start_region) break;
+			}
+			std::reverse(corridor.begin(), corridor.end());
+			return true;
+		}
+		float cost = search.cost[r];
+		for (uint32_t k = regions_[r].first_link; k < regions_[r].first_link + regions_[r].link_count; k++) {
+			uint32_t next = region_links_[k];
+			float next_cost = cost + distance(regions_[r].center, regions_[next].center);
+			if (Reached(search, next, next_cost)) continue;
+			Reach(search, next, next_cost, r);
+			open.push_back(Entry(next_cost + distance(regions_[next].center, goal), next));
+			std::push_heap(open.begin(), open.end(), std::greater<Entry>());
+		}
+	}
+	return false;
+}
+
+bool NavMesh::FindPath(uint32_t start, uint32_t goal, const std::vector<uint32_t> *corridor, Search &search,
+                       std::vector<uint32_t> &path) const {
+	using namespace glm;
+	path.clear();
+	std::vector<uint32_t> &allowed = search.allowed;
+	if (corridor) {
+		allowed.assign(corridor->begin(), corridor->end());
+		std::sort(allowed.begin(), allowed.end());
+	}
+	Begin(search, nodes_.size());
+	std::vector<Entry> &open = search.open;
+	vec3 goal_position = position(goal);
+	Reach(search, start, 0, start);
+	open.push_back(Entry(distance(position(start), goal_position), start));
+	while (!open.empty()) {
+		std::pop_heap(open.begin(), open.end(), std::greater<Entry>());
+		float estimate = open.back().first;
+		uint32_t n = open.back().second;
+		open.pop_back();
+		float cost = search.cost[n];
+		// stale entry of a node that was reached cheaper since
+		if (estimate > cost + distance(position(n), goal_position) + 1e-4f) continue;
+		if (n == goal) {
+			for (uint32_t at = n; ; at = search.from[at]) {
+				path.push_back(at);
+				if (at == start) break;
+			}
+			std::reverse(path.begin(), path.end());
+			return true;
+		}
+		vec3 p = position(n);
+		for (int d = 0; d < 8; d++) {
+			int32_t m = Neighbor(n, d);
+			if (m == kNone) continue;
+			if (corridor && !std::binary_search(allowed.begin(), allowed.end(), nodes_[m].region)) continue;
+			vec3 q = position(m);
+			float next_cost = cost + distance(p, q);
+			if (Reached(search, m, next_cost)) continue;
+			Reach(search, m, next_cost, n);
+			open.push_back(Entry(next_cost + distance(q, goal_position), m));
+			std::push_heap(open.begin(), open.end(), std::greater<Entry>());
+		}
+	}
+	return false;
+}
+
+template <typename T>
+void NavMesh::WriteVector(std::ofstream &os, const std::vector<T> &v) {
+	uint64_t size = v.size();
+	os.write((const char *)&size, sizeof(size));
+	os.write((const char *)v.data(), v.size() * sizeof(T));
+}
+
+template <typename T>
+bool NavMesh::ReadVector(std::ifstream &is, std::vector<T> &v) {
+	uint64_t size = 0;
+	if (!is.read((char *)&size, sizeof(size))) return false;
+	// a broken size would otherwise ask for more than the file holds
+	std::streampos at = is.tellg();
+	is.seekg(0, std::ios::end);
+	uint64_t left = is.tellg() - at;
+	is.seekg(at);
+	if (size > left / sizeof(T)) return false;
+	v.resize(size);
+	return (bool)is.read((char *)v.data(), v.size() * sizeof(T));
+}
+
+void NavMesh::Save(const std::string &path) const {
+	std::ofstream os(path, std::ios::binary);
+	uint32_t header[] = { kMagic, nx_, ny_ };
+	os.write((const char *)header, sizeof(header));
+	os.write((const char *)&key_, sizeof(key_));
+	os.write((const char *)&origin_.x, sizeof(glm::vec2));
+	os.write((const char *)&cell_size_, sizeof(float));
+	os.write((const char *)&step_, sizeof(float));
+	WriteVector(os, column_start_);
+	WriteVector(os, nodes_);
+	WriteVector(os, regions_);
+	WriteVector(os, region_links_);
+}
+
+bool NavMesh::Load(const std::string &path, uint64_t key) {
+	std::ifstream is(path, std::ios::binary);
+	if (!is.is_open()) return false;
+	uint32_t header[3];
+	uint64_t baked_key = 0;
+	if (!is.read((char *)header, sizeof(header)) || header[0] != kMagic ||
+	    !is.read((char *)&baked_key, sizeof(baked_key)) || baked_key != key)
+		return false;
+	key_ = key;
+	nx_ = header[1];
+	ny_ = header[2];
+	is.read((char *)&origin_.x, sizeof(glm::vec2));
+	is.read((char *)&cell_size_, sizeof(float));
+	is.read((char *)&step_, sizeof(float));
+	if (!is || !ReadVector(is, column_start_) || !ReadVector(is, nodes_) || !ReadVector(is, regions_) || !ReadVector(is, region_links_)
+	    || !Valid()) {
+		column_start_.clear();
+		nodes_.clear();
+		regions_.clear();
+		region_links_.clear();
+		return false;
+	}
+	return true;
+}
+
+bool NavMesh::Valid() const {
+	uint64_t columns = (uint64_t)nx_ * ny_;
+	if (column_start_.size() != columns + 1 || column_start_[0] != 0 || column_start_[columns] != nodes_.size())
+		return false;
+	for (uint64_t c = 0; c < columns; c++)
+		if (column_start_[c] > column_start_[c + 1]) return false;
+	for (uint32_t i = 0; i < nodes_.size(); i++) {
+		const Node &node = nodes_[i];
+		if (node.column >= columns || i < column_start_[node.column] || i >= column_start_[node.column + 1]
+		    || node.region >= regions_.size())
+			return false;
+		for (int d = 0; d < 8; d++) {
+			if (node.links[d] == kNoLink) continue;
+			int64_t x = (int64_t)(node.column % nx_) + nav_internal::kDirections[d][0];
+			int64_t y = (int64_t)(node.column / nx_) + nav_internal::kDirections[d][1];
+			if (x < 0 || y < 0 || x >= nx_ || y >= ny_) return false;
+			uint64_t target = y * nx_ + x;
+			if ((uint64_t)column_start_[target] + node.links[d] >= column_start_[target + 1]) return false;
+		}
+	}
+	for (const Region &region : regions_)
+		if ((uint64_t)region.first_link + region.link_count > region_links_.size()) return false;
+	for (uint32_t link : region_links_)
+		if (link >= regions_.size()) return false;
+	return true;
+}
@@ -0,0 +1,237 @@
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <string>
+#include <algorithm>
+#include <cstdint>
+
+#include <glm/glm.hpp>
+
+#include "model.hpp"
+#include "camera.hpp"
+#include "car.hpp"
+#include "collision_world.hpp"
+#include "simulation.hpp"
+#include "batch_env.hpp"
+#include "udp_socket.hpp"
+#include "net_protocol.hpp"
+
+struct ClientStats {
+	uint64_t snapshots, dropped, packets_sent, bytes_sent, bytes_received;
+	// how far the last and the worst reconciliation moved the car
+	float correction, max_correction;
+};
+
+// One player of a NetServer session. Tick sends the player's action and
+// applies it to the local car straight away, at the server's tick rate.
+// When a snapshot arrives the car is put where the server had it after the
+// last applied input, and the inputs the server has not seen yet are driven
+// again on top, so the car stays responsive and still ends up where the
+// server says.
+class NetClient {
+public:
+	NetClient() = delete;
+	NetClient(const City &city, const Model &car_model, const UdpAddress &server, const std::string &host = "0.0.0.0");
+	virtual ~NetClient();
+
+	bool connected() const;
+	uint32_t entity() const;
+	void Tick(const float *action);
+	// everything that came in since the last call
+	void Receive();
+	const Car &car() const;
+	// the other cars in range as of the latest snapshot, this one included
+	const Snapshot &snapshot() const;
+	const ClientStats &stats() const;
+
+private:
+	// hello again after this many ticks without a welcome
+	static const uint32_t kHelloInterval = 30;
+	static const uint32_t kMaxPending = 256;
+
+	const City &city_;
+	UdpSocket socket_;
+	UdpAddress server_;
+	Camera *camera_ptr_;
+	Car *car_ptr_;
+	CollisionWorld *collision_ptr_;
+	uint32_t body_;
+
+	bool connected_;
+	uint32_t entity_, sequence_, ticks_, latest_;
+	// sent and not applied by the server as of the latest snapshot
+	std::deque<NetInput> pending_;
+	Snapshot received_[kSnapshotHistory];
+	ClientStats stats_;
+	std::vector<uint8_t> packet_;
+
+	void ReadSnapshot(ByteReader &reader);
+	void Reconcile(uint32_t applied);
+	void Send();
+};
+
+NetClient::NetClient(const City &city, const Model &car_model, const UdpAddress &server, const std::string &host):
+	city_(city),
+	socket_(host, 0),
+	server_(server),
+	connected_(false),
+	entity_(0),
+	sequence_(0),
+	ticks_(0),
+	latest_(kNoBaseline),
+	stats_() {
+	camera_ptr_ = new Camera(glm::vec3(0, 0, 3), 0, 0, 1);
+	car_ptr_ = new Car(car_model, *camera_ptr_, glm::vec3(0, 0, 0));
+	car_ptr_->set_ground(&city_.ground());
+	car_ptr_->set_scene(&city_.scene());
+	collision_ptr_ = new CollisionWorld(city_.collision());
+	body_ = collision_ptr_->AddBody(car_model, car_ptr_->model_matrix());
+	car_ptr_->set_collision(collision_ptr_, body_);
+	for (Snapshot &snapshot : received_)
+		snapshot.tick = kNoBaseline;
+}
+
+NetClient::~NetClient() {
+	packet_.clear();
+	ByteWriter writer(packet_);
+	writer.U8(kBye);
+	Send();
+	delete car_ptr_;
+	delete collision_ptr_;
+	delete camera_ptr_;
+}
+
+bool NetClient::connected() const {
+	return connected_;
+}
+
+uint32_t NetClient::entity() const {
+	return entity_;
+}
+
+const Car &NetClient::car() const {
+	return *car_ptr_;
+}
+
+const Snapshot &NetClient::snapshot() const {
+	static const Snapshot kEmpty = { kNoBaseline, std::vector<NetState>() };
+	return latest_ == kNoBaseline ? kEmpty : received_[latest_ % kSnapshotHistory];
+}
+
+const ClientStats &NetClient::stats() const {
+	return stats_;
+}
+
+void NetClient::Tick(const float *action) {
+	packet_.clear();
+	ByteWriter writer(packet_);
+	if (!connected_) {
+		if (ticks_++ % kHelloInterval == 0) {
+			writer.U8(kHello);
+			Send();
+		}
+		return;
+	}
+
+	NetInput input = NetInput::Quantize(++sequence_, action);
+	pending_.push_back(input);
+	if (pending_.size() > kMaxPending) pending_.pop_front();
+	// driven with what the server will see, not with the exact action
+	float quantized[BatchEnv::kActionSize];
+	input.ToAction(quantized);
+	if (latest_ != kNoBaseline)
+		BatchEnv::Drive(*car_ptr_, *collision_ptr_, body_, quantized, 1.0f / kNetTickRate);
+
+	uint32_t count = std::min<uint32_t>(pending_.size(), kRedundantInputs);
+	writer.U8(kInput);
+	writer.U32(latest_);
+	writer.U32(input.sequence);
+	writer.U8(count);
+	for (uint32_t i = 0; i < count; i++) {
+		const NetInput &sent = pending_[pending_.size() - 1 - i];
+		writer.U8(sent.throttle);
+		writer.U8(sent.strafe);
+		writer.U8(sent.steer);
+	}
+	Send();
+}
+
+void NetClient::Receive() {
+	uint8_t data[kMaxPacket];
+	uint32_t size;
+	UdpAddress from;
+	while (socket_.Receive(data, sizeof(data), size, from)) {
+		if (!(from == server_)) continue;
+		stats_.bytes_received += size;
+		ByteReader reader(data, size);
+		uint8_t type = reader.U8();
+		if (type == kWelcome) {
+			uint32_t entity = reader.U32();
+			if (reader.ok() && !connected_) {
+				connected_ = true;
+				entity_ = entity;
+			}
+		} else if (type == kSnapshot && connected_) {
+			ReadSnapshot(reader);
+		}
+	}
+}
+
+void NetClient::ReadSnapshot(ByteReader &reader) {
+	uint32_t tick = reader.U32(), baseline_tick = reader.U32(), applied = reader.U32();
+	if (!reader.ok() || (latest_ != kNoBaseline && tick <= latest_)) {
+		stats_.dropped++;
+		return;
+	}
+	const Snapshot *baseline = nullptr;
+	if (baseline_tick != kNoBaseline) {
+		baseline = &received_[baseline_tick % kSnapshotHistory];
+		// acknowledged, but since overwritten
+		if (baseline->tick != baseline_tick) {
+			stats_.dropped++;
+			return;
+		}
+	}
+	// decoded aside, the baseline may share the slot
+	Snapshot snapshot;
+	snapshot.tick = tick;
+	if (!DecodeStates(reader, baseline ? &baseline->states : nullptr, snapshot.states)) {
+		stats_.dropped++;
+		return;
+	}
+	std::swap(received_[tick % kSnapshotHistory], snapshot);
+	latest_ = tick;
+	stats_.snapshots++;
+	Reconcile(applied);
+}
+
+void NetClient::Reconcile(uint32_t applied) {
+	const std::vector<NetState> &states = received_[latest_ % kSnapshotHistory].states;
+	auto own = std::lower_bound(states.begin(), states.end(), entity_,
+	                            [](const NetState &state, uint32_t entity) { return state.entity < entity; });
+	if (own == states.end() || own->entity != entity_) return;
+
+	while (!pending_.empty() && pending_.front().sequence <= applied)
+		pending_.pop_front();
+	glm::vec3 predicted = car_ptr_->position();
+	car_ptr_->Place(own->position(), own->heading());
+	float action[BatchEnv::kActionSize];
+	for (const NetInput &input : pending_) {
+		input.ToAction(action);
+		BatchEnv::Drive(*car_ptr_, *collision_ptr_, body_, action, 1.0f / kNetTickRate);
+	}
+	collision_ptr_->MoveBody(body_, car_ptr_->model_matrix());
+
+	// the first snapshot places the car, there was nothing to correct
+	if (stats_.snapshots > 1) {
+		stats_.correction = glm::distance(predicted, car_ptr_->position());
+		stats_.max_correction = std::max(stats_.max_correction, stats_.correction);
+	}
+}
+
+void NetClient::Send() {
+	if (!socket_.Send(server_, packet_.data(), packet_.size())) return;
+	stats_.packets_sent++;
+	stats_.bytes_sent += packet_.size();
+}
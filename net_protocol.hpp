@@ -0,0 +1,260 @@
+#pragma once
+
+#include <vector>
+#include <cmath>
+#include <cstdint>
+
+#include <glm/glm.hpp>
+
+// What the server and its clients say to each other over UDP. Every packet
+// starts with its type byte.
+//
+//   hello:    client asks for a car
+//   welcome:  u32 entity of that car
+//   input:    u32 last snapshot tick received, u32 sequence of the newest
+//             input, u8 count, then count inputs newest first, 3 bytes each;
+//             older inputs ride along in case a packet is lost
+//   snapshot: u32 tick, u32 baseline tick or kNoBaseline, u32 sequence of the
+//             last input applied, then the relevant cars as deltas against
+//             the baseline (EncodeStates)
+//   bye:      client leaves
+enum PacketType : uint8_t {
+	kHello = 1,
+	kWelcome,
+	kInput,
+	kSnapshot,
+	kBye
+};
+
+// the server steps and sends snapshots at this rate, clients predict at it
+static const uint32_t kNetTickRate = 60;
+static const uint32_t kNoBaseline = 0xFFFFFFFF;
+static const uint32_t kMaxPacket = 1400;
+// snapshots either side keeps, for baselines still to be acknowledged
+static const uint32_t kSnapshotHistory = 32;
+static const uint32_t kRedundantInputs = 4;
+
+// throttle, strafe and steer as BatchEnv takes them, in 1/127 steps
+struct NetInput {
+	uint32_t sequence;
+	int8_t throttle, strafe, steer;
+
+	static NetInput Quantize(uint32_t sequence, const float *action);
+	void ToAction(float *action) const;
+};
+
+// a car on the wire: position in units of kPositionQuantum, heading in
+// 1/65536 turns
+struct NetState {
+	uint32_t entity;
+	int32_t x, y, z;
+	uint16_t alpha;
+
+	static constexpr float kPositionQuantum = 1.0f / 4096;
+	static NetState Quantize(uint32_t entity, const glm::vec3 &position, double alpha);
+	glm::vec3 position() const;
+	double heading() const;
+};
+
+constexpr float NetState::kPositionQuantum;
+
+// the cars of one snapshot, sorted by entity
+struct Snapshot {
+	uint32_t tick;
+	std::vector<NetState> states;
+};
+
+class ByteWriter {
+public:
+	ByteWriter() = delete;
+	explicit ByteWriter(std::vector<uint8_t> &bytes);
+
+	void U8(uint8_t value);
+	void U32(uint32_t value);
+	// seven bits a byte, small values first
+	void VarUint(uint32_t value);
+	// zig-zag, so small negative values stay short too
+	void VarInt(int32_t value);
+
+private:
+	std::vector<uint8_t> &bytes_;
+};
+
+// reads past the end yield zeros and clear ok()
+class ByteReader {
+public:
+	ByteReader() = delete;
+	ByteReader(const uint8_t *data, uint32_t size);
+
+	uint8_t U8();
+	uint32_t U32();
+	uint32_t VarUint();
+	int32_t VarInt();
+	bool ok() const;
+	bool done() const;
+
+private:
+	const uint8_t *data_;
+	uint32_t size_, offset_;
+	bool ok_;
+};
+
+// Each car is one varint of its entity gap from the previous car, shifted
+// left four bits to make room for a mask of the fields that changed from
+// the baseline, followed by the zig-zag delta of each of those fields. A car
+// the baseline lacks is a delta from zero; a car that stood still costs a
+// byte.
+void EncodeStates(const std::vector<NetState> &states, const std::vector<NetState> *baseline, ByteWriter &writer);
+bool DecodeStates(ByteReader &reader, const std::vector<NetState> *baseline, std::vector<NetState> &states);
+
+NetInput NetInput::Quantize(uint32_t sequence, const float *action) {
+	NetInput input;
+	input.sequence = sequence;
+	input.throttle = (int8_t)lroundf(glm::clamp(action[0], -1.0f, 1.0f) * 127);
+	input.strafe = (int8_t)lroundf(glm::clamp(action[1], -1.0f, 1.0f) * 127);
+	input.steer = (int8_t)lroundf(glm::clamp(action[2], -1.0f, 1.0f) * 127);
+	return input;
+}
+
+void NetInput::ToAction(float *action) const {
+	action[0] = throttle / 127.0f;
+	action[1] = strafe / 127.0f;
+	action[2] = steer / 127.0f;
+}
+
+NetState NetState::Quantize(uint32_t entity, const glm::vec3 &position, double alpha) {
+	NetState state;
+	state.entity = entity;
+	state.x = (int32_t)lroundf(position.x / kPositionQuantum);
+	state.y = (int32_t)lroundf(position.y / kPositionQuantum);
+	state.z = (int32_t)lroundf(position.z / kPositionQuantum);
+	double turns = alpha / (2 * M_PI);
+	state.alpha = (uint16_t)(int64_t)llround((turns - floor(turns)) * 65536);
+	return state;
+}
+
+glm::vec3 NetState::position() const {
+	return glm::vec3(x, y, z) * kPositionQuantum;
+}
+
+double NetState::heading() const {
+	return alpha * (2 * M_PI / 65536);
+}
+
+ByteWriter::ByteWriter(std::vector<uint8_t> &bytes): bytes_(bytes) {}
+
+void ByteWriter::U8(uint8_t value) {
+	bytes_.push_back(value);
+}
+
+void ByteWriter::U32(uint32_t value) {
+	for (int i = 0; i < 4; i++)
+		bytes_.push_back(value >> (8 * i));
+}
+
+void ByteWriter::VarUint(uint32_t value) {
+	while (value >= 0x80) {
+		bytes_.push_back((value & 0x7F) | 0x80);
+		value >>= 7;
+	}
+	bytes_.push_back(value);
+}
+
+void ByteWriter::VarInt(int32_t value) {
+	VarUint(((uint32_t)value << 1) ^ (uint32_t)(value >> 31));
+}
+
+ByteReader::ByteReader(const uint8_t *data, uint32_t size):
+	data_(data),
+	size_(size),
+	offset_(0),
+	ok_(true) {}
+
+uint8_t ByteReader::U8() {
+	if (offset_ >= size_) {
+		ok_ = false;
+		return 0;
+	}
+	return data_[offset_++];
+}
+
+uint32_t ByteReader::U32() {
+	uint32_t value = 0;
+	for (int i = 0; i < 4; i++)
+		value |= (uint32_t)U8() << (8 * i);
+	return value;
+}
+
+uint32_t ByteReader::VarUint() {
+	uint32_t value = 0;
+	for (int shift = 0; shift < 35; shift += 7) {
+		uint8_t byte = U8();
+		value |= (uint32_t)(byte & 0x7F) << shift;
+		if (!(byte & 0x80)) return value;
+	}
+	ok_ = false;
+	return 0;
+}
+
+int32_t ByteReader::VarInt() {
+	uint32_t value = VarUint();
+	return (int32_t)(value >> 1) ^ -(int32_t)(value & 1);
+}
+
+bool ByteReader::ok() const {
+	return ok_;
+}
+
+bool ByteReader::done() const {
+	return offset_ == size_;
+}
+
+void EncodeStates(const std::vector<NetState> &states, const std::vector<NetState> *baseline, ByteWriter &writer) {
+	static const NetState kZero = { 0, 0, 0, 0, 0 };
+	writer.VarUint(states.size());
+	uint32_t previous = 0, next_base = 0;
+	for (const NetState &state : states) {
+		// both lists are sorted, so the baseline is walked once
+		const NetState *base = &kZero;
+		if (baseline) {
+			while (next_base < baseline->size() && (*baseline)[next_base].entity < state.entity)
+				next_base++;
+			if (next_base < baseline->size() && (*baseline)[next_base].entity == state.entity)
+				base = &(*baseline)[next_base];
+		}
+		uint32_t mask = (state.x != base->x) | (state.y != base->y) << 1 | (state.z != base->z) << 2 |
+		                (state.alpha != base->alpha) << 3;
+		writer.VarUint((state.entity - previous) << 4 | mask);
+		previous = state.entity;
+		if (mask & 1) writer.VarInt(state.x - base->x);
+		if (mask & 2) writer.VarInt(state.y - base->y);
+		if (mask & 4) writer.VarInt(state.z - base->z);
+		// the short way round
+		if (mask & 8) writer.VarInt((int16_t)(uint16_t)(state.alpha - base->alpha));
+	}
+}
+
+bool DecodeStates(ByteReader &reader, const std::vector<NetState> *baseline, std::vector<NetState> &states) {
+	states.clear();
+	uint32_t count = reader.VarUint();
+	if (!reader.ok() || count > kMaxPacket) return false;
+	uint32_t previous = 0, next_base = 0;
+	for (uint32_t i = 0; i < count; i++) {
+		uint32_t head = reader.VarUint();
+		NetState state = { previous + (head >> 4), 0, 0, 0, 0 };
+		previous = state.entity;
+		if (baseline) {
+			while (next_base < baseline->size() && (*baseline)[next_base].entity < state.entity)
+				next_base++;
+			if (next_base < baseline->size() && (*baseline)[next_base].entity == state.entity)
+				state = (*baseline)[next_base];
+		}
+		if (head & 1) state.x += reader.VarInt();
+		if (head & 2) state.y += reader.VarInt();
+		if (head & 4) state.z += reader.VarInt();
+		if (head & 8) state.alpha += reader.VarInt();
+		if (!reader.ok()) return false;
+		states.push_back(state);
+	}
+	return true;
+}
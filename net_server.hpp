@@ -0,0 +1,294 @@
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+#include <cstdint>
+
+#include <glm/glm.hpp>
+
+#include "model.hpp"
+#include "camera.hpp"
+#include "car.hpp"
+#include "collision_world.hpp"
+#include "simulation.hpp"
+#include "batch_env.hpp"
+#include "udp_socket.hpp"
+#include "net_protocol.hpp"
+
+struct ServerStats {
+	uint64_t ticks, packets_sent, packets_received, bytes_sent, bytes_received, states_sent;
+	uint32_t players;
+	double tick_ms, max_tick_ms;
+};
+
+// The authoritative side of a multi-player session. Every tick it reads the
+// inputs that came in, drives each player's car one step with the next of
+// them, and sends every player a snapshot of the cars within
+// kRelevancyRadius of its own. A snapshot is a delta against the last one
+// the player acknowledged, or against nothing when that is too old. Cars
+// collide with the city but not with each other.
+class NetServer {
+public:
+	static constexpr float kRelevancyRadius = 3.0f;
+	// ticks without a packet before a player is dropped
+	static const uint32_t kTimeout = 5 * kNetTickRate;
+	// the nearest ones when more are in range, so a snapshot fits a packet
+	static const uint32_t kMaxRelevant = 64;
+
+	NetServer() = delete;
+	NetServer(const City &city, const Model &car_model, const glm::vec3 &spawn, const std::string &host, uint16_t port);
+	virtual ~NetServer();
+
+	const UdpAddress &address() const;
+	void Tick();
+	// at kNetTickRate in real time, forever when ticks is 0
+	void Run(uint64_t ticks);
+	const ServerStats &stats() const;
+
+private:
+	struct Player {
+		UdpAddress address;
+		uint32_t entity;
+		Camera *camera;
+		Car *car;
+		CollisionWorld *collision;
+		uint32_t body;
+		// received and not applied yet, by sequence, at most kSnapshotHistory
+		std::deque<NetInput> inputs;
+		NetInput last_input;
+		uint32_t acked_tick;
+		uint64_t last_heard;
+		Snapshot sent[kSnapshotHistory];
+	};
+
+	const City &city_;
+	const Model &car_model_;
+	glm::vec3 spawn_;
+	UdpSocket socket_;
+	uint32_t tick_, next_entity_;
+	std::vector<Player *> players_;
+	ServerStats stats_;
+	std::vector<uint8_t> packet_;
+
+	Player *Find(const UdpAddress &address);
+	void Receive();
+	Player *Join(const UdpAddress &address);
+	void Leave(Player *player);
+	void ReadInputs(Player *player, ByteReader &reader);
+	void SendSnapshot(Player *player, const std::vector<NetState> &states);
+	void Send(const UdpAddress &to);
+};
+
+constexpr float NetServer::kRelevancyRadius;
+
+NetServer::NetServer(const City &city, const Model &car_model, const glm::vec3 &spawn, const std::string &host,
+                     uint16_t port):
+	city_(city),
+	car_model_(car_model),
+	spawn_(spawn),
+	socket_(host, port),
+	tick_(0),
+	next_entity_(0),
+	stats_() {}
+
+NetServer::~NetServer() {
+	while (!players_.empty())
+		Leave(players_.back());
+}
+
+const UdpAddress &NetServer::address() const {
+	return socket_.address();
+}
+
+const ServerStats &NetServer::stats() const {
+	return stats_;
+}
+
+void NetServer::Run(uint64_t ticks) {
+	using namespace std::chrono;
+	auto next = steady_clock::now();
+	for (uint64_t i = 0; ticks == 0 || i < ticks; i++) {
+		Tick();
+		next += microseconds(1000000 / kNetTickRate);
+		std::this_thread::sleep_until(next);
+	}
+}
+
+void NetServer::Tick() {
+	auto start = std::chrono::steady_clock::now();
+	tick_++;
+	Receive();
+
+	for (uint32_t i = 0; i < players_.size(); i++) {
+		Player *player = players_[i];
+		if (tick_ - player->last_heard > kTimeout) {
+			Leave(player);
+			i--;
+			continue;
+		}
+		// a player short of inputs keeps doing what it did last
+		if (!player->inputs.empty()) {
+			player->last_input = player->inputs.front();
+			player->inputs.pop_front();
+		}
+		float action[BatchEnv::kActionSize];
+		player->last_input.ToAction(action);
+		BatchEnv::Drive(*player->car, *player->collision, player->body, action, 1.0f / kNetTickRate);
+	}
+
+	// players_ is in entity order, so every relevant set comes out sorted
+	std::vector<NetState> all, relevant;
+	std::vector<std::pair<float, uint32_t> > in_range;
+	for (Player *player : players_)
+		all.push_back(NetState::Quantize(player->entity, player->car->position(), player->car->alpha()));
+	for (uint32_t i = 0; i < players_.size(); i++) {
+		in_range.clear();
+		const glm::vec3 &center = players_[i]->car->position();
+		for (uint32_t j = 0; j < players_.size(); j++) {
+			float distance = glm::distance(center, players_[j]->car->position());
+			if (distance <= kRelevancyRadius) in_range.push_back(std::make_pair(distance, j));
+		}
+		if (in_range.size() > kMaxRelevant) {
+			std::nth_element(in_range.begin(), in_range.begin() + kMaxRelevant, in_range.end());
+			in_range.resize(kMaxRelevant);
+			std::sort(in_range.begin(), in_range.end(),
+			          [](const std::pair<float, uint32_t> &a, const std::pair<float, uint32_t> &b) { return a.second < b.second; });
+		}
+		relevant.clear();
+		for (const std::pair<float, uint32_t> &entry : in_range)
+			relevant.push_back(all[entry.second]);
+		SendSnapshot(players_[i], relevant);
+	}
+
+	std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+	stats_.tick_ms = (stats_.tick_ms * stats_.ticks + elapsed.count()) / (stats_.ticks + 1);
+	stats_.max_tick_ms = std::max(stats_.max_tick_ms, elapsed.count());
+	stats_.ticks++;
+	stats_.players = players_.size();
+}
+
+NetServer::Player *NetServer::Find(const UdpAddress &address) {
+	for (Player *player : players_)
+		if (player->address == address) return player;
+	return nullptr;
+}
+
+void NetServer::Receive() {
+	uint8_t data[kMaxPacket];
+	uint32_t size;
+	UdpAddress from;
+	while (socket_.Receive(data, sizeof(data), size, from)) {
+		stats_.packets_received++;
+		stats_.bytes_received += size;
+		ByteReader reader(data, size);
+		uint8_t type = reader.U8();
+		Player *player = Find(from);
+		if (type == kHello) {
+			// the welcome may have been lost, so a known player is welcomed again
+			if (!player) player = Join(from);
+			packet_.clear();
+			ByteWriter writer(packet_);
+			writer.U8(kWelcome);
+			writer.U32(player->entity);
+			Send(from);
+		} else if (!player) {
+			continue;
+		} else if (type == kInput) {
+			ReadInputs(player, reader);
+		} else if (type == kBye) {
+			Leave(player);
+			continue;
+		}
+		player->last_heard = tick_;
+	}
+}
+
+NetServer::Player *NetServer::Join(const UdpAddress &address) {
+	Player *player = new Player();
+	player->address = address;
+	player->entity = next_entity_++;
+	player->camera = new Camera(glm::vec3(0, 0, 3), 0, 0, 1);
+	player->car = new Car(car_model_, *player->camera, glm::vec3(0, 0, 0));
+	player->car->set_ground(&city_.ground());
+	player->car->set_scene(&city_.scene());
+	player->collision = new CollisionWorld(city_.collision());
+	player->body = player->collision->AddBody(car_model_, player->car->model_matrix());
+	player->car->set_collision(player->collision, player->body);
+	// around the spawn point, facing away from it
+	double alpha = player->entity * 2.39996;
+	player->car->Place(spawn_ + 0.3f * glm::vec3(cos(alpha), sin(alpha), 0), alpha);
+	player->collision->MoveBody(player->body, player->car->model_matrix());
+	player->last_input = { 0, 0, 0, 0 };
+	player->acked_tick = kNoBaseline;
+	player->last_heard = tick_;
+	for (Snapshot &snapshot : player->sent)
+		snapshot.tick = kNoBaseline;
+	players_.push_back(player);
+	return player;
+}
+
+void NetServer::Leave(Player *player) {
+	players_.erase(std::find(players_.begin(), players_.end(), player));
+	delete player->car;
+	delete player->collision;
+	delete player->camera;
+	delete player;
+}
+
+void NetServer::ReadInputs(Player *player, ByteReader &reader) {
+	uint32_t acked = reader.U32(), newest = reader.U32();
+	uint32_t count = std::min<uint32_t>(reader.U8(), kRedundantInputs);
+	if (!reader.ok()) return;
+	if (acked != kNoBaseline && (player->acked_tick == kNoBaseline || acked > player->acked_tick))
+		player->acked_tick = acked;
+
+	uint32_t latest = player->inputs.empty() ? player->last_input.sequence : player->inputs.back().sequence;
+	NetInput fresh[kRedundantInputs];
+	uint32_t fresh_count = 0;
+	for (uint32_t i = 0; i < count && i <= newest; i++) {
+		NetInput input;
+		input.sequence = newest - i;
+		input.throttle = reader.U8();
+		input.strafe = reader.U8();
+		input.steer = reader.U8();
+		if (!reader.ok()) return;
+		if (input.sequence > latest) fresh[fresh_count++] = input;
+	}
+	// oldest first; a client running ahead of the ticks loses its oldest
+	// ones rather than growing the queue and its lag without end
+	for (uint32_t i = fresh_count; i > 0; i--)
+		player->inputs.push_back(fresh[i - 1]);
+	while (player->inputs.size() > kSnapshotHistory)
+		player->inputs.pop_front();
+}
+
+void NetServer::SendSnapshot(Player *player, const std::vector<NetState> &states) {
+	const Snapshot *baseline = nullptr;
+	if (player->acked_tick != kNoBaseline && tick_ - player->acked_tick < kSnapshotHistory) {
+		const Snapshot &candidate = player->sent[player->acked_tick % kSnapshotHistory];
+		if (candidate.tick == player->acked_tick) baseline = &candidate;
+	}
+
+	packet_.clear();
+	ByteWriter writer(packet_);
+	writer.U8(kSnapshot);
+	writer.U32(tick_);
+	writer.U32(baseline ? baseline->tick : kNoBaseline);
+	writer.U32(player->last_input.sequence);
+	EncodeStates(states, baseline ? &baseline->states : nullptr, writer);
+	Send(player->address);
+	stats_.states_sent += states.size();
+
+	Snapshot &sent = player->sent[tick_ % kSnapshotHistory];
+	sent.tick = tick_;
+	sent.states = states;
+}
+
+void NetServer::Send(const UdpAddress &to) {
+	if (!socket_.Send(to, packet_.data(), packet_.size())) return;
+	stats_.packets_sent++;
+	stats_.bytes_sent += packet_.size();
+}
@@ -0,0 +1,282 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+
+#include "aabb.hpp"
+#include "box_store.hpp"
+#include "camera.hpp"
+#include "shader.hpp"
+
+struct OcclusionStats {
+	uint32_t drawn_visible, drawn_conditional, queries_issued, queries_in_flight;
+};
+
+// Hardware occlusion culling with temporal coherence in the spirit of CHC++.
+// Objects visible last frame are drawn at once and only re-queried every few
+// frames; objects occluded last frame get their proxy box queried (in batches
+// once they stay hidden) and are drawn under conditional rendering, so the
+// cpu never waits for a query result.
+class OcclusionCuller {
+public:
+	OcclusionCuller() = delete;
+	OcclusionCuller(const std::vector<AABB> &boxes, const Shader &proxy_shader);
+	virtual ~OcclusionCuller();
+
+	// candidates are drawn in the order given, best front to back so that
+	// visible objects fill the depth buffer early
+	template <typename DrawFunction>
+	void Render(const std::vector<uint32_t> &candidates, const Camera &camera, const Shader &draw_shader, DrawFunction draw);
+	const OcclusionStats &stats() const;
+
+private:
+	struct ObjectState {
+		bool visible;
+		uint32_t hidden_frames;
+		uint32_t next_check_frame;
+		uint32_t pending_query;
+	};
+
+	static const uint32_t kVisibleCheckInterval = 8;
+	static const uint32_t kBatchAfterFrames = 4;
+	static const uint32_t kBatchSize = 8;
+	static constexpr float kNearMargin = 0.2f;
+
+	// objects by value, so that issuing queries allocates nothing
+	struct QueryRecord {
+		uint32_t id;
+		bool proxy;
+		uint32_t objects[kBatchSize];
+		uint32_t count;
+	};
+
+	std::vector<AABB> boxes_;
+	// boxes grown by kNearMargin, the camera inside one never queries it
+	BoxStore near_boxes_;
+	std::vector<uint8_t> near_;
+	std::vector<ObjectState> objects_;
+	std::vector<QueryRecord> pending_;
+	std::vector<uint32_t> free_queries_;
+	const Shader &proxy_shader_;
+	uint32_t vao_, vbo_, ebo_;
+	uint32_t frame_;
+	OcclusionStats stats_;
+
+	std::vector<uint32_t> hidden_, cover_;
+
+	void PollQueries();
+	uint32_t AcquireQuery();
+	void DrawProxy(uint32_t object) const;
+	void MarkNear(const glm::vec3 &position);
+};
+
+constexpr float OcclusionCuller::kNearMargin;
+
+OcclusionCuller::OcclusionCuller(const std::vector<AABB> &boxes, const Shader &proxy_shader):
+	boxes_(boxes),
+	proxy_shader_(proxy_shader),
+	frame_(0),
+	stats_() {
+	ObjectState initial = { true, 0, 0, 0 };
+	objects_.assign(boxes.size(), initial);
+	// spread the periodic checks of visible objects over the interval
+	for (uint32_t i = 0; i < objects_.size(); i++)
+		objects_[i].next_check_frame = i % kVisibleCheckInterval;
+	cover_.assign(boxes.size(), 0);
+	near_.assign(boxes.size(), 0);
+	for (const AABB &box : boxes)
+		near_boxes_.Add(AABB(box.small - glm::vec3(kNearMargin), box.big + glm::vec3(kNearMargin)));
+
+	const float vertices[] = {
+		0, 0, 0,  1, 0, 0,  0, 1, 0,  1, 1, 0,
+		0, 0, 1,  1, 0, 1,  0, 1, 1,  1, 1, 1
+	};
+	const GLushort indices[] = {
+		0, 2, 1, 1, 2, 3,  4, 5, 6, 5, 7, 6,
+		0, 1, 4, 1, 5, 4,  2, 6, 3, 3, 6, 7,
+		0, 4, 2, 2, 4, 6,  1, 3, 5, 3, 7, 5
+	};
+
+	glGenVertexArrays(1, &vao_);
+	glGenBuffers(1, &vbo_);
+	glGenBuffers(1, &ebo_);
+
+	glBindVertexArray(vao_);
+	glBindBuffer(GL_ARRAY_BUFFER, vbo_);
+	glBufferData(GL_ARRAY_BUFFER, sizeof(vertices), vertices, GL_STATIC_DRAW);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ebo_);
+	glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(indices), indices, GL_STATIC_DRAW);
+	glEnableVertexAttribArray(0);
+	glVertexAttribPointer(0, 3, GL_FLOAT, false, 3 * sizeof(float), (void *)0);
+	glBindVertexArray(0);
+}
+
+OcclusionCuller::~OcclusionCuller() {
+	for (const QueryRecord &record : pending_)
+		glDeleteQueries(1, &record.id);
+	if (!free_queries_.empty())
+		glDeleteQueries(free_queries_.size(), free_queries_.data());
+	glDeleteBuffers(1, &ebo_);
+	glDeleteBuffers(1, &vbo_);
+	glDeleteVertexArrays(1, &vao_);
+}
+
+const OcclusionStats &OcclusionCuller::stats() const {
+	return stats_;
+}
+
+uint32_t OcclusionCuller::AcquireQuery() {
+	if (free_queries_.empty()) {
+		uint32_t id;
+		glGenQueries(1, &id);
+		return id;
+	}
+	uint32_t id = free_queries_.back();
+	free_queries_.pop_back();
+	return id;
+}
+
+// reads back whatever results are ready, never blocks on the others
+void OcclusionCuller::PollQueries() {
+	uint32_t kept = 0;
+	for (uint32_t i = 0; i < pending_.size(); i++) {
+		QueryRecord &record = pending_[i];
+		uint32_t available = 0;
+		glGetQueryObjectuiv(record.id, GL_QUERY_RESULT_AVAILABLE, &available);
+		if (!available) {
+			if (kept != i) std::swap(pending_[kept], record);
+			kept++;
+			continue;
+		}
+		uint32_t any_samples = 0;
+		glGetQueryObjectuiv(record.id, GL_QUERY_RESULT, &any_samples);
+		for (uint32_t j = 0; j < record.count; j++) {
+			ObjectState &state = objects_[record.objects[j]];
+			state.pending_query = 0;
+			if (any_samples) {
+				// a visible batch is split up: every member is drawn and
+				// checked on its own soon after
+				if (!state.visible || record.count > 1)
+					state.next_check_frame = frame_ + 1;
+				state.visible = true;
+				state.hidden_frames = 0;
+			} else {
+				state.visible = false;
+				state.hidden_frames++;
+			}
+		}
+		free_queries_.push_back(record.id);
+	}
+	pending_.resize(kept);
+}
+
+void OcclusionCuller::MarkNear(const glm::vec3 &position) {
+	// the near plane clips proxies the camera is in, so those are never queried
+	std::fill(near_.begin(), near_.end(), 0);
+	std::vector<uint8_t> &near_flags = near_;
+	near_boxes_.Contains(position, [&near_flags](uint32_t object) {
+		near_flags[object] = 1;
+	});
+}
+
+void OcclusionCuller::DrawProxy(uint32_t object) const {
+	proxy_shader_.SetUniform<glm::vec3>("box_small", boxes_[object].small);
+	proxy_shader_.SetUniform<glm::vec3>("box_big", boxes_[object].big);
+	glDrawElements(GL_TRIANGLES, 36, GL_UNSIGNED_SHORT, 0);
+}
+
+template <typename DrawFunction>
+void OcclusionCuller::Render(const std::vector<uint32_t> &candidates, const Camera &camera, const Shader &draw_shader, DrawFunction draw) {
+	using namespace glm;
+	frame_++;
+	stats_ = OcclusionStats();
+	PollQueries();
+
+	vec3 position = camera.position();
+
+	// visible last frame: draw now, wrapping a query around the real draw
+	// whenever the periodic check is due
+	hidden_.clear();
+	MarkNear(position);
+	draw_shader.Use();
+	for (uint32_t object : candidates) {
+		ObjectState &state = objects_[object];
+		bool camera_near = near_[object];
+		if (!state.visible && !camera_near) {
+			hidden_.push_back(object);
+			continue;
+		}
+		if (camera_near || state.pending_query || frame_ < state.next_check_frame) {
+			draw(object);
+			stats_.drawn_visible++;
+			continue;
+		}
+		QueryRecord record;
+		record.id = AcquireQuery();
+		record.proxy = false;
+		record.objects[0] = object;
+		record.count = 1;
+		glBeginQuery(GL_ANY_SAMPLES_PASSED, record.id);
+		draw(object);
+		glEndQuery(GL_ANY_SAMPLES_PASSED);
+		state.pending_query = record.id;
+		state.next_check_frame = frame_ + kVisibleCheckInterval;
+		pending_.push_back(record);
+		stats_.drawn_visible++;
+		stats_.queries_issued++;
+	}
+
+	if (!hidden_.empty()) {
+		// occluded last frame: query the proxy boxes against the depth
+		// buffer, objects hidden for a while share one query per batch
+		proxy_shader_.Use();
+		proxy_shader_.SetUniform<mat4>("view_projection", camera.GetProjectionMatrix() * camera.GetViewMatrix());
+		glColorMask(false, false, false, false);
+		glDepthMask(false);
+		glBindVertexArray(vao_);
+		for (uint32_t i = 0; i < hidden_.size(); ) {
+			uint32_t object = hidden_[i];
+			if (objects_[object].pending_query) {
+				cover_[object] = objects_[object].pending_query;
+				i++;
+				continue;
+			}
+			QueryRecord record;
+			record.id = AcquireQuery();
+			record.proxy = true;
+			record.count = 0;
+			glBeginQuery(GL_ANY_SAMPLES_PASSED, record.id);
+			do {
+				object = hidden_[i++];
+				DrawProxy(object);
+				record.objects[record.count++] = object;
+				cover_[object] = record.id;
+				objects_[object].pending_query = record.id;
+			} while (i < hidden_.size() && record.count < kBatchSize &&
+			         objects_[object].hidden_frames >= kBatchAfterFrames &&
+			         !objects_[hidden_[i]].pending_query &&
+			         objects_[hidden_[i]].hidden_frames >= kBatchAfterFrames);
+			glEndQuery(GL_ANY_SAMPLES_PASSED);
+			pending_.push_back(record);
+			stats_.queries_issued++;
+		}
+		glBindVertexArray(0);
+		glDepthMask(true);
+		glColorMask(true, true, true, true);
+
+		// the gpu skips these draws when their query found no samples, and
+		// draws them when the result is not in yet
+		draw_shader.Use();
+		for (uint32_t object : hidden_) {
+			glBeginConditionalRender(cover_[object], GL_QUERY_NO_WAIT);
+			draw(object);
+			glEndConditionalRender();
+			stats_.drawn_conditional++;
+		}
+	}
+	stats_.queries_in_flight = pending_.size();
+}
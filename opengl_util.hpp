@@ -11,6 +11,7 @@
 
 #include "stb/stb_image.h"
 #include "cg_exception.hpp"
+#include "job_system.hpp"
 
 void FilpImageDataDiagonally(unsigned char *image, int w, int h, int comp) {
     auto swap_color = [&comp, &w, &image](int x, int y) {
@@ -27,17 +28,26 @@ void FilpImageDataDiagonally(unsigned char *image, int w, int h, int comp) {
     }
 }
 
-uint32_t LoadTexture(std::string url) {
-    using namespace std;
+// textures already uploaded, by url; only touched on the GL thread
+std::map<std::string, uint32_t> &TextureCache() {
+    static std::map<std::string, uint32_t> mem;
+    return mem;
+}
+
+std::string TextureUrl(std::string url) {
     for (int i = 0; i < url.length(); i++) if (url[i] == '\\') url[i] = '/';
-    GLuint texture;
-    static map<string, GLuint> mem;
-    if (mem.count(url)) return mem[url];
-    int w, h, comp;
-    unsigned char* image = stbi_load(url.c_str(), &w, &h, &comp, 0);
+    return url;
+}
 
-    if (image == nullptr) throw LoadPictureError(url);
-    
+// takes image, which is freed
+uint32_t UploadTexture(const std::string &url, unsigned char *image, int w, int h, int comp) {
+    using namespace std;
+    map<string, uint32_t> &mem = TextureCache();
+    if (mem.count(url)) {
+        stbi_image_free(image);
+        return mem[url];
+    }
+    GLuint texture;
     glGenTextures(1, &texture);
 
     glBindTexture(GL_TEXTURE_2D, texture);
@@ -60,24 +70,34 @@ uint32_t LoadTexture(std::string url) {
     return texture;
 }
 
-uint32_t LoadCubeMap(const std::vector<std::string> &urls) {
+uint32_t LoadTexture(std::string url) {
+    url = TextureUrl(url);
+    if (TextureCache().count(url)) return TextureCache()[url];
+    int w, h, comp;
+    unsigned char* image = stbi_load(url.c_str(), &w, &h, &comp, 0);
+
+    if (image == nullptr) throw LoadPictureError(url);
+    return UploadTexture(url, image, w, h, comp);
+}
+
+struct CubeFace {
+    unsigned char *data;
+    int width, height, channels;
+};
+
+// the top and bottom faces come upside down
+bool CubeFaceFlipped(uint32_t index) {
+    return index == 2 || index == 3;
+}
+
+// takes the faces, which are freed
+uint32_t UploadCubeMap(const std::vector<CubeFace> &faces) {
     uint32_t texture;
     glGenTextures(1, &texture);
     glBindTexture(GL_TEXTURE_CUBE_MAP, texture);
-
-    int width, height, channels;
-    for (int i = 0; i < urls.size(); i++) {
-        auto url = urls[i];
-        unsigned char *data = stbi_load(url.c_str(), &width, &height, &channels, 0);
-        if (i == 2 || i == 3) {
-            FilpImageDataDiagonally(data, width, height, channels);
-        }
-        if (data) {
-            glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, 0, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, data);
-            stbi_image_free(data);
-        } else {
-            throw LoadPictureError(url);
-        }
+    for (int i = 0; i < faces.size(); i++) {
+        glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, 0, GL_RGB, faces[i].width, faces[i].height, 0, GL_RGB, GL_UNSIGNED_BYTE, faces[i].data);
+        stbi_image_free(faces[i].data);
     }
 
     glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
@@ -88,4 +108,24 @@ uint32_t LoadCubeMap(const std::vector<std::string> &urls) {
     glBindTexture(GL_TEXTURE_CUBE_MAP, 0);
 
     return texture;
+}
+
+uint32_t LoadCubeMap(const std::vector<std::string> &urls) {
+    // the faces are decoded as jobs, only the upload needs the GL thread
+    std::vector<CubeFace> faces(urls.size());
+    JobSystem::Shared().ParallelFor(urls.size(), 1, [&urls, &faces](uint32_t begin, uint32_t end) {
+        for (uint32_t i = begin; i < end; i++) {
+            CubeFace &face = faces[i];
+            face.data = stbi_load(urls[i].c_str(), &face.width, &face.height, &face.channels, 0);
+            if (face.data && CubeFaceFlipped(i))
+                FilpImageDataDiagonally(face.data, face.width, face.height, face.channels);
+        }
+    });
+    for (int i = 0; i < urls.size(); i++) {
+        if (faces[i].data) continue;
+        for (const CubeFace &face : faces)
+            stbi_image_free(face.data);
+        throw LoadPictureError(urls[i]);
+    }
+    return UploadCubeMap(faces);
 }
\ No newline at end of file
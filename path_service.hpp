@@ -0,0 +1,309 @@
+#pragma once
+
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <algorithm>
+#include <cstdint>
+
+#ifdef DEBUG
+#include <iostream>
+#include <chrono>
+#include <random>
+#endif
+
+#include <glm/glm.hpp>
+
+#include "nav_mesh.hpp"
+#include "job_system.hpp"
+
+struct PathStats {
+	uint64_t requests, completed, failed, cache_hits;
+};
+
+// Path requests answered off the frame as jobs. Requests queue up and up
+// to one drain job per thread takes them in batches until the queue is
+// empty; a ticket fetches the result once it is ready. Region corridors are
+// cached by their end regions, so repeated trips between the same parts of
+// the city only pay for the search over nodes. Tickets, queue, cache and the
+// drains' scratch are all kept, so that once they have grown a request
+// allocates nothing.
+class PathService {
+public:
+	PathService() = delete;
+	explicit PathService(const NavMesh &nav_mesh);
+	virtual ~PathService();
+
+	uint32_t Request(const glm::vec3 &from, const glm::vec3 &to);
+	// false while the path is pending; found tells whether there is one. A
+	// ticket is handed out again once it was polled ready.
+	bool Poll(uint32_t ticket, std::vector<glm::vec3> &path, bool &found);
+	// until every request so far is answered, running jobs meanwhile
+	void Wait();
+	PathStats stats() const;
+
+private:
+	static const uint32_t kBatch = 32;
+	// corridors cached before the cache starts over, in a table twice as
+	// large, and their regions in all
+	static const uint32_t kCacheCapacity = 1 << 16;
+	static const uint32_t kCacheSlots = 2 * kCacheCapacity;
+	static const uint32_t kCacheRegions = 1 << 20;
+	static const uint64_t kNoKey = ~0ull;
+
+	struct Job {
+		uint32_t ticket;
+		glm::vec3 from, to;
+	};
+	enum class TicketState { FREE, PENDING, READY };
+	struct Ticket {
+		TicketState state;
+		bool found;
+		std::vector<glm::vec3> path;
+	};
+	// what one drain works in, handed to the next drain when it is done
+	struct Scratch {
+		std::vector<Job> batch;
+		bool found[kBatch];
+		std::vector<glm::vec3> paths[kBatch];
+		std::vector<uint32_t> corridor, nodes;
+		NavMesh::Search search;
+	};
+	// the regions of a corridor, at first in cache_regions_
+	struct CachedCorridor {
+		uint64_t key;
+		uint32_t first, count;
+	};
+
+	// the job a drain runs, kept here because jobs do not own their functions
+	struct Drainer {
+		PathService *service;
+		void operator()() const;
+	};
+
+	const NavMesh &nav_mesh_;
+	std::mutex mutex_;
+	std::vector<Job> jobs_;
+	// indexed by ticket
+	std::vector<Ticket> tickets_;
+	std::vector<uint32_t> free_tickets_;
+	std::vector<Scratch *> free_scratch_;
+	uint32_t draining_;
+	bool stop_;
+	Drainer drainer_;
+	JobCounter drains_;
+
+	std::mutex cache_mutex_;
+	std::vector<CachedCorridor> cache_;
+	std::vector<uint32_t> cache_regions_;
+	uint32_t cached_;
+	std::atomic<uint64_t> requests_, completed_, failed_, cache_hits_;
+
+	void Drain();
+	bool Solve(const Job &job, Scratch &scratch, std::vector<glm::vec3> &path);
+	bool FindCached(uint64_t key, std::vector<uint32_t> &corridor);
+	void Cache(uint64_t key, const std::vector<uint32_t> &corridor);
+	static uint32_t CacheSlot(uint64_t key);
+};
+
+#ifdef DEBUG
+void BenchmarkPaths(PathService &service, const NavMesh &nav_mesh);
+#endif
+
+const uint64_t PathService::kNoKey;
+
+PathService::PathService(const NavMesh &nav_mesh):
+	nav_mesh_(nav_mesh),
+	draining_(0),
+	stop_(false),
+	cache_(kCacheSlots),
+	cached_(0),
+	requests_(0),
+	completed_(0),
+	failed_(0),
+	cache_hits_(0) {
+	drainer_.service = this;
+	// one for each drain there can be at once
+	for (uint32_t i = 0; i < JobSystem::Shared().size(); i++)
+		free_scratch_.push_back(new Scratch());
+	for (CachedCorridor &cached : cache_)
+		cached.key = kNoKey;
+	cache_regions_.reserve(kCacheRegions);
+}
+
+PathService::~PathService() {
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		stop_ = true;
+	}
+	// the drains stop after their current batch, but they still use this
+	JobSystem::Shared().Wait(drains_);
+	for (Scratch *scratch : free_scratch_)
+		delete scratch;
+}
+
+uint32_t PathService::Request(const glm::vec3 &from, const glm::vec3 &to) {
+	Job job = { 0, from, to };
+	bool drain;
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		if (free_tickets_.empty()) {
+			job.ticket = tickets_.size();
+			tickets_.push_back(Ticket());
+		} else {
+			job.ticket = free_tickets_.back();
+			free_tickets_.pop_back();
+		}
+		tickets_[job.ticket].state = TicketState::PENDING;
+		jobs_.push_back(job);
+		drain = draining_ < JobSystem::Shared().size();
+		if (drain) draining_++;
+	}
+	requests_++;
+	if (drain) JobSystem::Shared().Run(drainer_, drains_);
+	return job.ticket;
+}
+
+bool PathService::Poll(uint32_t ticket, std::vector<glm::vec3> &path, bool &found) {
+	std::lock_guard<std::mutex> lock(mutex_);
+	if (ticket >= tickets_.size() || tickets_[ticket].state != TicketState::READY) return false;
+	found = tickets_[ticket].found;
+	// copied, so that both sides keep their capacity
+	path.assign(tickets_[ticket].path.begin(), tickets_[ticket].path.end());
+	tickets_[ticket].state = TicketState::FREE;
+	free_tickets_.push_back(ticket);
+	return true;
+}
+
+void PathService::Wait() {
+	// a drain only ends on an empty queue, so none left means none pending
+	JobSystem::Shared().Wait(drains_);
+}
+
+PathStats PathService::stats() const {
+	PathStats stats = { requests_, completed_, failed_, cache_hits_ };
+	return stats;
+}
+
+uint32_t PathService::CacheSlot(uint64_t key) {
+	return (key * 0x9e3779b97f4a7c15ull >> 32) & (kCacheSlots - 1);
+}
+
+bool PathService::FindCached(uint64_t key, std::vector<uint32_t> &corridor) {
+	std::lock_guard<std::mutex> lock(cache_mutex_);
+	// at most half full, so an empty slot ends every probe
+	for (uint32_t slot = CacheSlot(key); cache_[slot].key != kNoKey; slot = (slot + 1) & (kCacheSlots - 1)) {
+		const CachedCorridor &cached = cache_[slot];
+		if (cached.key != key) continue;
+		corridor.assign(cache_regions_.begin() + cached.first, cache_regions_.begin() + cached.first + cached.count);
+		return true;
+	}
+	return false;
+}
+
+void PathService::Cache(uint64_t key, const std::vector<uint32_t> &corridor) {
+	if (corridor.size() > kCacheRegions) return;
+	std::lock_guard<std::mutex> lock(cache_mutex_);
+	// the city does not change, so a full cache simply starts over
+	if (cached_ >= kCacheCapacity || cache_regions_.size() + corridor.size() > kCacheRegions) {
+		for (CachedCorridor &cached : cache_)
+			cached.key = kNoKey;
+		cache_regions_.clear();
+		cached_ = 0;
+	}
+	uint32_t slot = CacheSlot(key);
+	for (; cache_[slot].key != kNoKey; slot = (slot + 1) & (kCacheSlots - 1))
+		// another drain found the same corridor meanwhile
+		if (cache_[slot].key == key) return;
+	CachedCorridor cached = { key, (uint32_t)cache_regions_.size(), (uint32_t)corridor.size() };
+	cache_[slot] = cached;
+	cache_regions_.insert(cache_regions_.end(), corridor.begin(), corridor.end());
+	cached_++;
+}
+
+bool PathService::Solve(const Job &job, Scratch &scratch, std::vector<glm::vec3> &path) {
+	int32_t start = nav_mesh_.Locate(job.from), goal = nav_mesh_.Locate(job.to);
+	if (start == NavMesh::kNone || goal == NavMesh::kNone) return false;
+	uint32_t start_region = nav_mesh_.region(start), goal_region = nav_mesh_.region(goal);
+
+	std::vector<uint32_t> &corridor = scratch.corridor;
+	uint64_t key = (uint64_t)start_region << 32 | goal_region;
+	if (FindCached(key, corridor)) {
+		cache_hits_++;
+	} else {
+		if (!nav_mesh_.FindCorridor(start_region, goal_region, scratch.search, corridor)) return false;
+		Cache(key, corridor);
+	}
+
+	if (!nav_mesh_.FindPath(start, goal, &corridor, scratch.search, scratch.nodes)) return false;
+	path.clear();
+	for (uint32_t node : scratch.nodes)
+		path.push_back(nav_mesh_.position(node));
+	return true;
+}
+
+void PathService::Drainer::operator()() const {
+	service->Drain();
+}
+
+void PathService::Drain() {
+	Scratch *scratch;
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		scratch = free_scratch_.back();
+		free_scratch_.pop_back();
+	}
+	std::vector<Job> &batch = scratch->batch;
+	while (true) {
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			if (stop_ || jobs_.empty()) {
+				free_scratch_.push_back(scratch);
+				draining_--;
+				return;
+			}
+			uint32_t count = std::min<size_t>(kBatch, jobs_.size());
+			batch.assign(jobs_.begin(), jobs_.begin() + count);
+			jobs_.erase(jobs_.begin(), jobs_.begin() + count);
+		}
+		for (uint32_t i = 0; i < batch.size(); i++) {
+			scratch->found[i] = Solve(batch[i], *scratch, scratch->paths[i]);
+			if (!scratch->found[i]) failed_++;
+			completed_++;
+		}
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			for (uint32_t i = 0; i < batch.size(); i++) {
+				Ticket &ticket = tickets_[batch[i].ticket];
+				ticket.state = TicketState::READY;
+				ticket.found = scratch->found[i];
+				ticket.path.assign(scratch->paths[i].begin(), scratch->paths[i].end());
+			}
+		}
+	}
+}
+
+#ifdef DEBUG
+void BenchmarkPaths(PathService &service, const NavMesh &nav_mesh) {
+	using namespace std::chrono;
+	const uint32_t kRequests = 4096;
+	if (nav_mesh.size() == 0) return;
+	std::mt19937 random(11);
+	std::uniform_int_distribution<uint32_t> node(0, nav_mesh.size() - 1);
+	PathStats before = service.stats();
+	auto start = steady_clock::now();
+	std::vector<uint32_t> tickets;
+	for (uint32_t i = 0; i < kRequests; i++)
+		tickets.push_back(service.Request(nav_mesh.position(node(random)), nav_mesh.position(node(random))));
+	service.Wait();
+	duration<double> elapsed = steady_clock::now() - start;
+	std::vector<glm::vec3> path;
+	bool found;
+	for (uint32_t ticket : tickets)
+		service.Poll(ticket, path, found);
+	PathStats after = service.stats();
+	std::cout << "[paths] " << (uint64_t)(kRequests / elapsed.count()) << " paths/s, "
+	          << after.failed - before.failed << " of " << kRequests << " unreachable, "
+	          << after.cache_hits - before.cache_hits << " corridor cache hits" << std::endl;
+}
+#endif
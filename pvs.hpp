@@ -0,0 +1,256 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <random>
+#include <fstream>
+#include <cstdint>
+#include <cmath>
+
+#include <glm/glm.hpp>
+
+#include "aabb.hpp"
+#include "triangle_bvh.hpp"
+#include "model.hpp"
+#include "job_system.hpp"
+
+// Potentially visible set: the drivable regions are divided into square
+// columns, and every column stores one bit per world mesh telling whether
+// the mesh can be seen from anywhere inside it. Baking errs on the side of
+// visible: rays go to a grid of points over each mesh's box as well as to
+// its triangles, and a column then takes in what its neighbours see.
+class Pvs {
+public:
+	Pvs();
+	void Bake(const Model &model, const glm::mat4 &model_matrix,
+	          const std::vector<AABB> &regions, const glm::mat4 &region_frame);
+	// a cache baked for another Model::Key is stale
+	bool Load(const std::string &path, uint64_t key);
+	void Save(const std::string &path) const;
+
+	// bits of the cell containing position, nullptr outside every cell
+	const uint64_t *Lookup(const glm::vec3 &position) const;
+	static bool Visible(const uint64_t *cell, uint32_t mesh);
+
+private:
+	static const uint32_t kMagic = 0x32535650;
+	// origins on a kOriginGrid^2 grid over the column, jittered in each square
+	static const uint32_t kOriginGrid = 4;
+	static const uint32_t kOriginSamples = kOriginGrid * kOriginGrid;
+	// points on a kFaceGrid^2 grid over each face of a mesh's box
+	static const uint32_t kFaceGrid = 4;
+	static const uint32_t kTargetSamples = 12;
+
+	uint64_t key_;
+	glm::mat4 region_frame_;
+	glm::vec2 grid_small_;
+	float cell_size_;
+	uint32_t nx_, ny_, mesh_count_, words_per_cell_;
+	// grid column -> slot in bits_, -1 when not drivable
+	std::vector<int32_t> cells_;
+	std::vector<uint64_t> bits_;
+};
+
+Pvs::Pvs():
+	key_(0),
+	region_frame_(1),
+	cell_size_(0.5f),
+	nx_(0),
+	ny_(0),
+	mesh_count_(0),
+	words_per_cell_(0) {
+}
+
+bool Pvs::Visible(const uint64_t *cell, uint32_t mesh) {
+	return (cell[mesh >> 6] >> (mesh & 63)) & 1;
+}
+
+const uint64_t *Pvs::Lookup(const glm::vec3 &position) const {
+	if (cells_.empty()) return nullptr;
+	glm::vec3 p = region_frame_ * glm::vec4(position, 1);
+	int x = (int)std::floor((p.x - grid_small_.x) / cell_size_);
+	int y = (int)std::floor((p.y - grid_small_.y) / cell_size_);
+	if (x < 0 || y < 0 || x >= (int)nx_ || y >= (int)ny_) return nullptr;
+	int32_t slot = cells_[y * nx_ + x];
+	return slot < 0 ? nullptr : bits_.data() + (size_t)slot * words_per_cell_;
+}
+
+void Pvs::Bake(const Model &model, const glm::mat4 &model_matrix,
+               const std::vector<AABB> &regions, const glm::mat4 &region_frame) {
+	using namespace glm;
+	using namespace std;
+
+	key_ = model.Key(model_matrix);
+	region_frame_ = region_frame;
+	mat4 region_to_world = inverse(region_frame);
+	const vector<Mesh> &meshes = model.meshes();
+	mesh_count_ = meshes.size();
+	words_per_cell_ = (mesh_count_ + 63) / 64;
+
+	// world space triangles to aim at, grouped by mesh, and the boxes
+	vector<vec3> triangles;
+	vector<uint32_t> mesh_first_triangle;
+	vector<AABB> mesh_boxes(meshes.size());
+	for (uint32_t m = 0; m < meshes.size(); m++) {
+		mesh_first_triangle.push_back(triangles.size() / 3);
+		const vector<Vertex> &vertices = meshes[m].GetVertices();
+		const vector<uint32_t> &indices = meshes[m].GetIndices();
+		for (uint32_t i = 0; i + 2 < indices.size(); i += 3)
+			for (int k = 0; k < 3; k++) {
+				triangles.push_back(vec3(model_matrix * vec4(vertices[indices[i + k]].position, 1)));
+				mesh_boxes[m].Merge(triangles.back());
+			}
+	}
+	mesh_first_triangle.push_back(triangles.size() / 3);
+	TriangleBvh scene;
+	scene.Build(model, model_matrix);
+
+	// the grid covers the regions with one cell of margin, because the
+	// camera trails the car slightly
+	AABB bounds;
+	for (const AABB &region : regions)
+		bounds.Merge(region);
+	grid_small_ = vec2(bounds.small.x - cell_size_, bounds.small.y - cell_size_);
+	nx_ = (uint32_t)std::ceil((bounds.big.x - bounds.small.x) / cell_size_) + 2;
+	ny_ = (uint32_t)std::ceil((bounds.big.y - bounds.small.y) / cell_size_) + 2;
+
+	cells_.assign(nx_ * ny_, -1);
+	vector<AABB> cell_boxes;
+	for (uint32_t y = 0; y < ny_; y++) {
+		for (uint32_t x = 0; x < nx_; x++) {
+			vec2 lo = grid_small_ + vec2(x, y) * cell_size_;
+			AABB cell(vec3(lo - vec2(cell_size_), bounds.small.z), vec3(lo + vec2(2 * cell_size_), bounds.big.z));
+			// origins span the heights of the regions under the cell,
+			// from the road surface up to a little above the camera
+			AABB heights;
+			for (const AABB &region : regions) {
+				if (!cell.Overlap(region)) continue;
+				heights.Merge(vec3(lo, region.big.z));
+				heights.Merge(vec3(lo + vec2(cell_size_), region.big.z + 0.25f));
+			}
+			if (heights.Empty()) continue;
+			cells_[y * nx_ + x] = cell_boxes.size();
+			cell_boxes.push_back(heights);
+		}
+	}
+	bits_.assign(cell_boxes.size() * words_per_cell_, 0);
+
+	auto visible_from = [&](const vec3 &origin, const vec3 &target, uint32_t mesh) {
+		vec3 direction = target - origin;
+		float distance = length(direction);
+		if (distance < 1e-6f) return true;
+		direction /= distance;
+		RayHit hit;
+		return !scene.Raycast(origin, direction, distance * 0.999f, hit) || hit.mesh == mesh;
+	};
+
+	auto bake_cells = [&](uint32_t begin, uint32_t end) {
+		for (uint32_t cell = begin; cell < end; cell++) {
+			mt19937 random(cell);
+			uniform_real_distribution<float> unit(0, 1);
+			const AABB &box = cell_boxes[cell];
+			vec3 origins[kOriginSamples];
+			for (uint32_t i = 0; i < kOriginSamples; i++) {
+				vec3 f((i % kOriginGrid + unit(random)) / kOriginGrid, (i / kOriginGrid + unit(random)) / kOriginGrid, unit(random));
+				vec3 p = box.small + (box.big - box.small) * f;
+				origins[i] = vec3(region_to_world * vec4(p, 1));
+			}
+			uint64_t *bits = bits_.data() + (size_t)cell * words_per_cell_;
+			for (uint32_t m = 0; m < mesh_count_; m++) {
+				uint32_t first = mesh_first_triangle[m], count = mesh_first_triangle[m + 1] - first;
+				if (count == 0) continue;
+				// the middles of a grid over every face of the box, each from
+				// another origin; a large mesh seen only in part still has
+				// points of its box in sight
+				const AABB &target_box = mesh_boxes[m];
+				bool seen = false;
+				for (uint32_t s = 0; !seen && s < 6 * kFaceGrid * kFaceGrid; s++) {
+					uint32_t face = s / (kFaceGrid * kFaceGrid), axis = face % 3, cell_index = s % (kFaceGrid * kFaceGrid);
+					vec3 f;
+					f[axis] = face < 3 ? 0 : 1;
+					f[(axis + 1) % 3] = (cell_index % kFaceGrid + 0.5f) / kFaceGrid;
+					f[(axis + 2) % 3] = (cell_index / kFaceGrid + 0.5f) / kFaceGrid;
+					vec3 target = target_box.small + (target_box.big - target_box.small) * f;
+					seen = visible_from(origins[(s + cell) % kOriginSamples], target, m);
+				}
+				for (uint32_t s = 0; !seen && s < kTargetSamples; s++) {
+					// a random point on a random triangle of the mesh
+					uint32_t t = first + random() % count;
+					float u = unit(random), v = unit(random);
+					if (u + v > 1) {
+						u = 1 - u;
+						v = 1 - v;
+					}
+					vec3 target = triangles[3 * t] + u * (triangles[3 * t + 1] - triangles[3 * t]) + v * (triangles[3 * t + 2] - triangles[3 * t]);
+					seen = visible_from(origins[random() % kOriginSamples], target, m);
+				}
+				if (seen) bits[m >> 6] |= (uint64_t)1 << (m & 63);
+			}
+		}
+	};
+	JobSystem::Shared().ParallelFor(cell_boxes.size(), 1, bake_cells);
+
+	// what a column sees it also gives its neighbours, which covers rays
+	// that missed and a camera a little past the column it is counted in
+	vector<uint64_t> own = bits_;
+	for (int32_t y = 0; y < (int32_t)ny_; y++)
+		for (int32_t x = 0; x < (int32_t)nx_; x++) {
+			int32_t slot = cells_[y * nx_ + x];
+			if (slot < 0) continue;
+			uint64_t *bits = bits_.data() + (size_t)slot * words_per_cell_;
+			for (int32_t dy = -1; dy <= 1; dy++)
+				for (int32_t dx = -1; dx <= 1; dx++) {
+					int32_t nx = x + dx, ny = y + dy;
+					if ((dx == 0 && dy == 0) || nx < 0 || ny < 0 || nx >= (int32_t)nx_ || ny >= (int32_t)ny_) continue;
+					int32_t neighbour = cells_[ny * nx_ + nx];
+					if (neighbour < 0) continue;
+					const uint64_t *other = own.data() + (size_t)neighbour * words_per_cell_;
+					for (uint32_t w = 0; w < words_per_cell_; w++)
+						bits[w] |= other[w];
+				}
+		}
+}
+
+void Pvs::Save(const std::string &path) const {
+	std::ofstream os(path, std::ios::binary);
+	uint32_t header[] = { kMagic, mesh_count_, words_per_cell_, nx_, ny_ };
+	os.write((const char *)header, sizeof(header));
+	os.write((const char *)&key_, sizeof(key_));
+	os.write((const char *)&region_frame_[0][0], sizeof(glm::mat4));
+	os.write((const char *)&grid_small_.x, sizeof(glm::vec2));
+	os.write((const char *)&cell_size_, sizeof(float));
+	os.write((const char *)cells_.data(), cells_.size() * sizeof(int32_t));
+	uint64_t words = bits_.size();
+	os.write((const char *)&words, sizeof(words));
+	os.write((const char *)bits_.data(), bits_.size() * sizeof(uint64_t));
+}
+
+bool Pvs::Load(const std::string &path, uint64_t key) {
+	std::ifstream is(path, std::ios::binary);
+	if (!is.is_open()) return false;
+	uint32_t header[5];
+	uint64_t baked_key = 0;
+	if (!is.read((char *)header, sizeof(header)) || header[0] != kMagic ||
+	    !is.read((char *)&baked_key, sizeof(baked_key)) || baked_key != key)
+		return false;
+	key_ = key;
+	mesh_count_ = header[1];
+	words_per_cell_ = header[2];
+	nx_ = header[3];
+	ny_ = header[4];
+	is.read((char *)&region_frame_[0][0], sizeof(glm::mat4));
+	is.read((char *)&grid_small_.x, sizeof(glm::vec2));
+	is.read((char *)&cell_size_, sizeof(float));
+	cells_.resize(nx_ * ny_);
+	is.read((char *)cells_.data(), cells_.size() * sizeof(int32_t));
+	uint64_t words = 0;
+	is.read((char *)&words, sizeof(words));
+	bits_.resize(words);
+	is.read((char *)bits_.data(), bits_.size() * sizeof(uint64_t));
+	if (!is) {
+		cells_.clear();
+		bits_.clear();
+		return false;
+	}
+	return true;
+}
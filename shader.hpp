@@ -10,31 +10,55 @@
 #include <glm/gtc/type_ptr.hpp>
 
 #include "file_manager.hpp"
+#include "gl_extensions.hpp"
+
+// a stage already read, path only names it in errors
+struct ShaderSource {
+	std::string path, text;
+};
 
 class Shader {
 public:
 	Shader() = delete;
 	Shader(const std::string &vs_path, const std::string &fs_path);
+	// compute program, needs GLExtensions::shared.compute
+	Shader(const std::string &cs_path);
+	Shader(const ShaderSource &vs, const ShaderSource &fs);
+	explicit Shader(const ShaderSource &cs);
 	void Use() const;
-	template <typename T> void SetUniform(const std::string &, T) const;
+	uint32_t program() const;
+	// a literal or a name kept elsewhere, so that setting one builds no string
+	template <typename T> void SetUniform(const char *, T) const;
 
 private:
 	const FileManager &file_manager = FileManager::shared;
 
 	static uint32_t Compile(GLenum type, const std::string &source, const std::string &path);
 	static uint32_t Link(uint32_t vs_id, uint32_t fs_id);
+	static uint32_t Link(uint32_t cs_id);
+	static uint32_t CheckLink(uint32_t program_id);
 
 	uint32_t id;
 };
 
-Shader::Shader(const std::string &vs_path, const std::string &fs_path) {
-	auto vs_source = file_manager.FileContentAt(vs_path);
-	auto fs_source = file_manager.FileContentAt(fs_path);
-	auto vs_id = Compile(GL_VERTEX_SHADER, vs_source, vs_path);
-	auto fs_id = Compile(GL_FRAGMENT_SHADER, fs_source, fs_path);
+Shader::Shader(const std::string &vs_path, const std::string &fs_path):
+	Shader(ShaderSource { vs_path, FileManager::shared.FileContentAt(vs_path) },
+	       ShaderSource { fs_path, FileManager::shared.FileContentAt(fs_path) }) {}
+
+Shader::Shader(const std::string &cs_path):
+	Shader(ShaderSource { cs_path, FileManager::shared.FileContentAt(cs_path) }) {}
+
+Shader::Shader(const ShaderSource &vs, const ShaderSource &fs) {
+	auto vs_id = Compile(GL_VERTEX_SHADER, vs.text, vs.path);
+	auto fs_id = Compile(GL_FRAGMENT_SHADER, fs.text, fs.path);
 	id = Link(vs_id, fs_id);
 }
 
+Shader::Shader(const ShaderSource &cs) {
+	auto cs_id = Compile(GL_COMPUTE_SHADER, cs.text, cs.path);
+	id = Link(cs_id);
+}
+
 uint32_t Shader::Compile(GLenum type, const std::string &source, const std::string &path) {
 	uint32_t shader_id = glCreateShader(type);
 	const char *temp = source.c_str();
@@ -59,6 +83,18 @@ uint32_t Shader::Link(uint32_t vs_id, uint32_t fs_id) {
 	glLinkProgram(program_id);
 	glDeleteShader(vs_id);
 	glDeleteShader(fs_id);
+	return CheckLink(program_id);
+}
+
+uint32_t Shader::Link(uint32_t cs_id) {
+	uint32_t program_id = glCreateProgram();
+	glAttachShader(program_id, cs_id);
+	glLinkProgram(program_id);
+	glDeleteShader(cs_id);
+	return CheckLink(program_id);
+}
+
+uint32_t Shader::CheckLink(uint32_t program_id) {
 	int success;
 	glGetProgramiv(program_id, GL_LINK_STATUS, &success);
 	if (success) return program_id;
@@ -75,9 +111,13 @@ void Shader::Use() const {
 	glUseProgram(id);
 }
 
+uint32_t Shader::program() const {
+	return id;
+}
+
 template <> 
-void Shader::SetUniform(const std::string &identifier, glm::vec3 value) const {
-	auto location = glGetUniformLocation(id, identifier.c_str());
+void Shader::SetUniform(const char *identifier, glm::vec3 value) const {
+	auto location = glGetUniformLocation(id, identifier);
 #ifdef DEBUG
 	if (location < 0) throw ShaderSettingError(identifier);	
 #endif
@@ -85,8 +125,8 @@ void Shader::SetUniform(const std::string &identifier, glm::vec3 value) const {
 }
 
 template <> 
-void Shader::SetUniform(const std::string &identifier, glm::mat4 value) const {
-	auto location = glGetUniformLocation(id, identifier.c_str());
+void Shader::SetUniform(const char *identifier, glm::mat4 value) const {
+	auto location = glGetUniformLocation(id, identifier);
 #ifdef DEBUG
 	if (location < 0) throw ShaderSettingError(identifier);	
 #endif
@@ -94,8 +134,8 @@ void Shader::SetUniform(const std::string &identifier, glm::mat4 value) const {
 }
 
 template <> 
-void Shader::SetUniform(const std::string &identifier, int32_t value) const {
-	auto location = glGetUniformLocation(id, identifier.c_str());
+void Shader::SetUniform(const char *identifier, int32_t value) const {
+	auto location = glGetUniformLocation(id, identifier);
 #ifdef DEBUG
 	if (location < 0) throw ShaderSettingError(identifier);	
 #endif
@@ -103,10 +143,37 @@ void Shader::SetUniform(const std::string &identifier, int32_t value) const {
 }
 
 template <> 
-void Shader::SetUniform(const std::string &identifier, float value) const {
-	auto location = glGetUniformLocation(id, identifier.c_str());
+void Shader::SetUniform(const char *identifier, float value) const {
+	auto location = glGetUniformLocation(id, identifier);
 #ifdef DEBUG
 	if (location < 0) throw ShaderSettingError(identifier);	
 #endif
 	glUniform1f(location, value);
 }
+
+template <> 
+void Shader::SetUniform(const char *identifier, glm::vec2 value) const {
+	auto location = glGetUniformLocation(id, identifier);
+#ifdef DEBUG
+	if (location < 0) throw ShaderSettingError(identifier);	
+#endif
+	glUniform2fv(location, 1, value_ptr(value));
+}
+
+template <> 
+void Shader::SetUniform(const char *identifier, glm::vec4 value) const {
+	auto location = glGetUniformLocation(id, identifier);
+#ifdef DEBUG
+	if (location < 0) throw ShaderSettingError(identifier);	
+#endif
+	glUniform4fv(location, 1, value_ptr(value));
+}
+
+template <> 
+void Shader::SetUniform(const char *identifier, uint32_t value) const {
+	auto location = glGetUniformLocation(id, identifier);
+#ifdef DEBUG
+	if (location < 0) throw ShaderSettingError(identifier);	
+#endif
+	glUniform1ui(location, value);
+}
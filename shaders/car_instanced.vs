@@ -0,0 +1,23 @@
+#version 330 core
+
+layout (location = 0) in vec3 positions;
+layout (location = 1) in vec3 normals;
+layout (location = 2) in vec2 tex_coordinates;
+layout (location = 4) in mat4 model;
+layout (location = 8) in vec4 tint;
+
+uniform mat4 view;
+uniform mat4 projection;
+
+out vec3 Position;
+out vec3 Normal;
+out vec2 TexCoord;
+out vec3 Tint;
+
+void main() {
+	gl_Position = projection * view * model * vec4(positions, 1);
+	Position = vec3(model * vec4(positions, 1));
+	Normal = normalize(mat3(transpose(inverse(model))) * normals);
+	TexCoord = tex_coordinates;
+	Tint = tint.rgb;
+}
\ No newline at end of file
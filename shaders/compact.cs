@@ -0,0 +1,36 @@
+#version 430 core
+
+layout (local_size_x = 64) in;
+
+struct MeshInfo {
+	vec4 small;
+	vec4 big;
+	uint group;
+	uint group_first;
+	uint pad0;
+	uint pad1;
+};
+
+struct Command {
+	uint count;
+	uint instance_count;
+	uint first_index;
+	int base_vertex;
+	uint base_instance;
+};
+
+layout (std430, binding = 1) readonly buffer Meshes { MeshInfo meshes[]; };
+layout (std430, binding = 2) readonly buffer Commands { Command commands[]; };
+layout (std430, binding = 4) writeonly buffer Compact { Command compact[]; };
+layout (std430, binding = 5) buffer Counts { uint counts[]; };
+
+uniform uint mesh_count;
+
+// packs the commands that kept an instance to the front of their group
+void main() {
+	uint mesh = gl_GlobalInvocationID.x;
+	if (mesh >= mesh_count || commands[mesh].instance_count == 0) return;
+	uint group = meshes[mesh].group;
+	uint slot = atomicAdd(counts[group], 1);
+	compact[meshes[mesh].group_first + slot] = commands[mesh];
+}
\ No newline at end of file
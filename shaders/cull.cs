@@ -0,0 +1,93 @@
+#version 430 core
+
+layout (local_size_x = 64) in;
+
+struct Instance {
+	mat4 model;
+	vec4 tint;
+};
+
+struct MeshInfo {
+	vec4 small;
+	vec4 big;
+	uint group;
+	uint group_first;
+	uint pad0;
+	uint pad1;
+};
+
+struct Command {
+	uint count;
+	uint instance_count;
+	uint first_index;
+	int base_vertex;
+	uint base_instance;
+};
+
+layout (std430, binding = 0) readonly buffer Instances { Instance instances[]; };
+layout (std430, binding = 1) readonly buffer Meshes { MeshInfo meshes[]; };
+layout (std430, binding = 2) buffer Commands { Command commands[]; };
+layout (std430, binding = 3) writeonly buffer Visible { uint visible[]; };
+
+uniform uint instance_count;
+// of this dispatch, instances go along x in slices
+uniform uint first_instance;
+uniform uint mesh_count;
+uniform mat4 view_projection;
+uniform vec4 planes[6];
+
+uniform sampler2D hiz;
+uniform int hiz_levels;
+uniform vec2 viewport;
+
+bool InFrustum(vec3 center, vec3 extent) {
+	for (int i = 0; i < 6; i++) {
+		if (dot(planes[i].xyz, center) + planes[i].w + dot(abs(planes[i].xyz), extent) < 0)
+			return false;
+	}
+	return true;
+}
+
+// tests the screen rectangle of the box against the farthest depth of the
+// previous frame, at the level where the rectangle spans two texels at most
+bool Occluded(vec3 small, vec3 big) {
+	vec2 lo = vec2(1), hi = vec2(0);
+	float nearest = 1;
+	for (int i = 0; i < 8; i++) {
+		vec3 corner = mix(small, big, vec3(i & 1, (i >> 1) & 1, (i >> 2) & 1));
+		vec4 clip = view_projection * vec4(corner, 1);
+		if (clip.w <= 0) return false;
+		vec3 ndc = clip.xyz / clip.w;
+		lo = min(lo, ndc.xy * 0.5 + 0.5);
+		hi = max(hi, ndc.xy * 0.5 + 0.5);
+		nearest = min(nearest, ndc.z * 0.5 + 0.5);
+	}
+	lo = clamp(lo, 0.0, 1.0);
+	hi = clamp(hi, 0.0, 1.0);
+	vec2 extent = (hi - lo) * viewport;
+	float level = min(ceil(log2(max(max(extent.x, extent.y), 1.0))), float(hiz_levels - 1));
+	float farthest = max(
+		max(textureLod(hiz, lo, level).r, textureLod(hiz, vec2(hi.x, lo.y), level).r),
+		max(textureLod(hiz, vec2(lo.x, hi.y), level).r, textureLod(hiz, hi, level).r));
+	return nearest > farthest;
+}
+
+void main() {
+	uint instance = first_instance + gl_GlobalInvocationID.x;
+	uint mesh = gl_GlobalInvocationID.y;
+	if (instance >= instance_count || mesh >= mesh_count) return;
+
+	// world space box of the mesh under the instance transform (Arvo)
+	mat4 model = instances[instance].model;
+	vec3 local_center = (meshes[mesh].small.xyz + meshes[mesh].big.xyz) * 0.5;
+	vec3 local_extent = (meshes[mesh].big.xyz - meshes[mesh].small.xyz) * 0.5;
+	vec3 center = vec3(model * vec4(local_center, 1));
+	mat3 rotation = mat3(model);
+	vec3 extent = mat3(abs(rotation[0]), abs(rotation[1]), abs(rotation[2])) * local_extent;
+
+	if (!InFrustum(center, extent)) return;
+	if (hiz_levels > 0 && Occluded(center - extent, center + extent)) return;
+
+	uint slot = atomicAdd(commands[mesh].instance_count, 1);
+	visible[commands[mesh].base_instance + slot] = instance;
+}
\ No newline at end of file
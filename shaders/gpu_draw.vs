@@ -0,0 +1,30 @@
+#version 430 core
+
+layout (location = 0) in vec3 positions;
+layout (location = 1) in vec3 normals;
+layout (location = 2) in vec2 tex_coordinates;
+layout (location = 4) in uint instance_index;
+
+struct Instance {
+	mat4 model;
+	vec4 tint;
+};
+
+layout (std430, binding = 0) readonly buffer Instances { Instance instances[]; };
+
+uniform mat4 view;
+uniform mat4 projection;
+
+out vec3 Position;
+out vec3 Normal;
+out vec2 TexCoord;
+out vec3 Tint;
+
+void main() {
+	mat4 model = instances[instance_index].model;
+	gl_Position = projection * view * model * vec4(positions, 1);
+	Position = vec3(model * vec4(positions, 1));
+	Normal = normalize(mat3(transpose(inverse(model))) * normals);
+	TexCoord = tex_coordinates;
+	Tint = instances[instance_index].tint.rgb;
+}
\ No newline at end of file
@@ -0,0 +1,40 @@
+#version 430 core
+
+layout (local_size_x = 8, local_size_y = 8) in;
+
+layout (r32f, binding = 0) uniform writeonly image2D destination;
+
+uniform sampler2D source;
+uniform int source_level;
+
+// level 0 copies the depth buffer, every further level keeps the farthest
+// depth of the texels it covers, odd edges included
+void main() {
+	ivec2 p = ivec2(gl_GlobalInvocationID.xy);
+	if (any(greaterThanEqual(p, imageSize(destination)))) return;
+
+	if (source_level < 0) {
+		imageStore(destination, p, vec4(texelFetch(source, p, 0).r));
+		return;
+	}
+
+	ivec2 source_size = textureSize(source, source_level);
+	ivec2 q = 2 * p;
+	ivec2 last = source_size - 1;
+	float depth = max(
+		max(texelFetch(source, min(q, last), source_level).r, texelFetch(source, min(q + ivec2(1, 0), last), source_level).r),
+		max(texelFetch(source, min(q + ivec2(0, 1), last), source_level).r, texelFetch(source, min(q + ivec2(1, 1), last), source_level).r));
+	bool odd_x = (source_size.x & 1) != 0 && q.x + 2 == last.x;
+	bool odd_y = (source_size.y & 1) != 0 && q.y + 2 == last.y;
+	if (odd_x) {
+		depth = max(depth, texelFetch(source, min(q + ivec2(2, 0), last), source_level).r);
+		depth = max(depth, texelFetch(source, min(q + ivec2(2, 1), last), source_level).r);
+	}
+	if (odd_y) {
+		depth = max(depth, texelFetch(source, min(q + ivec2(0, 2), last), source_level).r);
+		depth = max(depth, texelFetch(source, min(q + ivec2(1, 2), last), source_level).r);
+	}
+	if (odd_x && odd_y)
+		depth = max(depth, texelFetch(source, min(q + ivec2(2, 2), last), source_level).r);
+	imageStore(destination, p, vec4(depth));
+}
\ No newline at end of file
@@ -0,0 +1,11 @@
+#version 330 core
+
+layout (location = 0) in vec3 positions;
+
+uniform mat4 view_projection;
+uniform vec3 box_small;
+uniform vec3 box_big;
+
+void main() {
+	gl_Position = view_projection * vec4(mix(box_small, box_big, positions), 1);
+}
\ No newline at end of file
@@ -0,0 +1,289 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <fstream>
+#include <functional>
+#include <limits>
+#include <algorithm>
+#include <cstdint>
+#include <cmath>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <glm/glm.hpp>
+
+#include "aabb.hpp"
+#include "model.hpp"
+#include "triangle_bvh.hpp"
+#include "job_system.hpp"
+
+// Signed distance to the world, negative inside solid geometry. Space is cut
+// into bricks of kBrickCells^3 cells; only bricks near a surface store their
+// kBrickSamples^3 corner samples, as 16 bit fractions of the band. The others
+// keep a single conservative distance. Samples on brick faces are duplicated
+// so a lookup never leaves its brick. The baked file is mapped as is.
+class SignedDistanceField {
+public:
+	SignedDistanceField();
+	SignedDistanceField(const SignedDistanceField &) = delete;
+	SignedDistanceField &operator=(const SignedDistanceField &) = delete;
+	virtual ~SignedDistanceField();
+
+	void Bake(const Model &model, const glm::mat4 &model_matrix, float cell_size = 0.05f, float band = 0.2f);
+	// a cache baked for another Model::Key is stale
+	bool Load(const std::string &path, uint64_t key);
+	void Save(const std::string &path) const;
+	bool empty() const;
+	// distances are exact up to the band, past it they are lower bounds
+	float band() const;
+
+	// trilinear between the samples around position
+	float Distance(const glm::vec3 &position) const;
+	// also the gradient of the trilinear distance, zero far from surfaces
+	float Distance(const glm::vec3 &position, glm::vec3 &gradient) const;
+
+private:
+	static const uint32_t kMagic = 0x32464453;
+	static const uint32_t kBrickCells = 7;
+	static const uint32_t kBrickSamples = kBrickCells + 1;
+	static const uint32_t kSamplesPerBrick = kBrickSamples * kBrickSamples * kBrickSamples;
+	static const uint32_t kNoBrick = 0xffffffff;
+
+	struct Header {
+		uint32_t magic, nx, ny, nz, bricks;
+		float origin[3], cell_size, band;
+		uint64_t key;
+	};
+
+	Header header_;
+	// point into the vectors after a bake, into the mapping after a load
+	const float *coarse_;
+	const uint32_t *bricks_;
+	const int16_t *samples_;
+	std::vector<float> coarse_storage_;
+	std::vector<uint32_t> brick_storage_;
+	std::vector<int16_t> sample_storage_;
+	void *mapping_;
+	size_t mapping_size_;
+
+	void Unmap();
+	float Lookup(const glm::vec3 &position, glm::vec3 *gradient) const;
+	static float Sign(const TriangleBvh &scene, const glm::vec3 &position, float reach);
+};
+
+const uint32_t SignedDistanceField::kNoBrick;
+
+SignedDistanceField::SignedDistanceField():
+	header_(),
+	coarse_(nullptr),
+	bricks_(nullptr),
+	samples_(nullptr),
+	mapping_(nullptr),
+	mapping_size_(0) {
+}
+
+SignedDistanceField::~SignedDistanceField() {
+	Unmap();
+}
+
+void SignedDistanceField::Unmap() {
+	if (mapping_) munmap(mapping_, mapping_size_);
+	mapping_ = nullptr;
+	mapping_size_ = 0;
+}
+
+bool SignedDistanceField::empty() const {
+	return coarse_ == nullptr;
+}
+
+float SignedDistanceField::band() const {
+	return header_.band;
+}
+
+float SignedDistanceField::Sign(const TriangleBvh &scene, const glm::vec3 &position, float reach) {
+	// parity of three rays, by majority: the world is not closed everywhere,
+	// and a road plane alone is crossed by the vertical ray only. The rays are
+	// tilted so they do not run along the axis aligned walls of the city.
+	static const glm::vec3 directions[3] = {
+		glm::normalize(glm::vec3(1, 0.0131f, 0.0217f)),
+		glm::normalize(glm::vec3(0.0173f, 1, 0.0119f)),
+		glm::normalize(glm::vec3(0.0151f, 0.0193f, 1))
+	};
+	int inside = 0;
+	for (int i = 0; i < 3; i++)
+		inside += scene.Crossings(position, directions[i], reach) & 1;
+	return inside >= 2 ? -1.0f : 1.0f;
+}
+
+void SignedDistanceField::Bake(const Model &model, const glm::mat4 &model_matrix, float cell_size, float band) {
+	using namespace glm;
+	using namespace std;
+	Unmap();
+	TriangleBvh scene;
+	scene.Build(model, model_matrix);
+
+	AABB bounds = model.aabb().Transform(model_matrix);
+	bounds.small -= vec3(band);
+	bounds.big += vec3(band);
+	float brick_size = kBrickCells * cell_size;
+	float half_diagonal = 0.5f * std::sqrt(3.0f) * brick_size;
+	float reach = length(bounds.big - bounds.small);
+	header_.magic = kMagic;
+	header_.key = model.Key(model_matrix);
+	header_.nx = (uint32_t)std::ceil((bounds.big.x - bounds.small.x) / brick_size);
+	header_.ny = (uint32_t)std::ceil((bounds.big.y - bounds.small.y) / brick_size);
+	header_.nz = (uint32_t)std::ceil((bounds.big.z - bounds.small.z) / brick_size);
+	for (int i = 0; i < 3; i++)
+		header_.origin[i] = bounds.small[i];
+	header_.cell_size = cell_size;
+	header_.band = band;
+	vec3 origin = bounds.small;
+	uint32_t count = header_.nx * header_.ny * header_.nz;
+	coarse_storage_.assign(count, band);
+	brick_storage_.assign(count, kNoBrick);
+
+	auto parallel = [](uint32_t n, const function<void(uint32_t)> &task) {
+		JobSystem::Shared().ParallelFor(n, 16, [&task](uint32_t begin, uint32_t end) {
+			for (uint32_t i = begin; i < end; i++)
+				task(i);
+		});
+	};
+	auto brick_corner = [&](uint32_t brick) {
+		uint32_t x = brick % header_.nx, y = brick / header_.nx % header_.ny, z = brick / (header_.nx * header_.ny);
+		return origin + vec3(x, y, z) * brick_size;
+	};
+
+	// every brick by the distance from its center, which bounds the rest of it
+	vector<uint8_t> near(count, 0);
+	parallel(count, [&](uint32_t brick) {
+		vec3 center = brick_corner(brick) + vec3(0.5f * brick_size);
+		float distance;
+		if (!scene.Nearest(center, half_diagonal + band, distance)) {
+			// all of the brick is past the band, the center only tells the side
+			coarse_storage_[brick] = Sign(scene, center, reach) * band;
+			return;
+		}
+		near[brick] = 1;
+	});
+	uint32_t bricks = 0;
+	for (uint32_t i = 0; i < count; i++)
+		if (near[i]) brick_storage_[i] = bricks++;
+	header_.bricks = bricks;
+	sample_storage_.assign((size_t)bricks * kSamplesPerBrick, 0);
+
+	vector<uint32_t> near_bricks;
+	for (uint32_t i = 0; i < count; i++)
+		if (near[i]) near_bricks.push_back(i);
+	parallel(near_bricks.size(), [&](uint32_t i) {
+		uint32_t brick = near_bricks[i];
+		vec3 corner = brick_corner(brick);
+		int16_t *samples = sample_storage_.data() + (size_t)brick_storage_[brick] * kSamplesPerBrick;
+		float sign_sum = 0;
+		for (uint32_t s = 0; s < kSamplesPerBrick; s++) {
+			vec3 p = corner + vec3(s % kBrickSamples, s / kBrickSamples % kBrickSamples, s / (kBrickSamples * kBrickSamples)) * cell_size;
+			float distance = band;
+			scene.Nearest(p, band, distance);
+			float sign = Sign(scene, p, reach);
+			sign_sum += sign;
+			samples[s] = (int16_t)std::round(sign * std::min(distance / band, 1.0f) * 32767);
+		}
+		coarse_storage_[brick] = (sign_sum < 0 ? -1.0f : 1.0f) * band;
+	});
+
+	coarse_ = coarse_storage_.data();
+	bricks_ = brick_storage_.data();
+	samples_ = sample_storage_.data();
+}
+
+void SignedDistanceField::Save(const std::string &path) const {
+	if (empty()) return;
+	uint32_t count = header_.nx * header_.ny * header_.nz;
+	std::ofstream os(path, std::ios::binary);
+	os.write((const char *)&header_, sizeof(header_));
+	os.write((const char *)coarse_, count * sizeof(float));
+	os.write((const char *)bricks_, count * sizeof(uint32_t));
+	os.write((const char *)samples_, (size_t)header_.bricks * kSamplesPerBrick * sizeof(int16_t));
+}
+
+bool SignedDistanceField::Load(const std::string &path, uint64_t key) {
+	int fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0) return false;
+	struct stat info;
+	if (fstat(fd, &info) != 0 || (size_t)info.st_size < sizeof(Header)) {
+		close(fd);
+		return false;
+	}
+	void *mapping = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	// the mapping stays valid after the descriptor is closed
+	close(fd);
+	if (mapping == MAP_FAILED) return false;
+
+	const Header &header = *(const Header *)mapping;
+	size_t count = (size_t)header.nx * header.ny * header.nz;
+	size_t expected = sizeof(Header) + count * (sizeof(float) + sizeof(uint32_t))
+	                  + (size_t)header.bricks * kSamplesPerBrick * sizeof(int16_t);
+	if (header.magic != kMagic || header.key != key || expected != (size_t)info.st_size) {
+		munmap(mapping, info.st_size);
+		return false;
+	}
+	Unmap();
+	coarse_storage_.clear();
+	brick_storage_.clear();
+	sample_storage_.clear();
+	mapping_ = mapping;
+	mapping_size_ = info.st_size;
+	header_ = header;
+	const char *data = (const char *)mapping + sizeof(Header);
+	coarse_ = (const float *)data;
+	bricks_ = (const uint32_t *)(data + count * sizeof(float));
+	samples_ = (const int16_t *)(data + count * (sizeof(float) + sizeof(uint32_t)));
+	return true;
+}
+
+float SignedDistanceField::Lookup(const glm::vec3 &position, glm::vec3 *gradient) const {
+	using namespace glm;
+	if (gradient) *gradient = vec3(0);
+	if (empty()) return std::numeric_limits<float>::max();
+	vec3 local = (position - vec3(header_.origin[0], header_.origin[1], header_.origin[2])) / header_.cell_size;
+	if (local.x < 0 || local.y < 0 || local.z < 0) return header_.band;
+	uint32_t bx = (uint32_t)local.x / kBrickCells, by = (uint32_t)local.y / kBrickCells, bz = (uint32_t)local.z / kBrickCells;
+	// everything around the world is open
+	if (bx >= header_.nx || by >= header_.ny || bz >= header_.nz) return header_.band;
+	uint32_t brick = (bz * header_.ny + by) * header_.nx + bx;
+	uint32_t slot = bricks_[brick];
+	if (slot == kNoBrick) return coarse_[brick];
+
+	vec3 f = local - vec3(bx, by, bz) * (float)kBrickCells;
+	uint32_t x = std::min((uint32_t)f.x, kBrickCells - 1), y = std::min((uint32_t)f.y, kBrickCells - 1), z = std::min((uint32_t)f.z, kBrickCells - 1);
+	vec3 t = f - vec3(x, y, z);
+	const int16_t *s = samples_ + (size_t)slot * kSamplesPerBrick + (z * kBrickSamples + y) * kBrickSamples + x;
+	const uint32_t dy = kBrickSamples, dz = kBrickSamples * kBrickSamples;
+	float c000 = s[0], c100 = s[1], c010 = s[dy], c110 = s[dy + 1];
+	float c001 = s[dz], c101 = s[dz + 1], c011 = s[dz + dy], c111 = s[dz + dy + 1];
+
+	float c00 = c000 + (c100 - c000) * t.x, c10 = c010 + (c110 - c010) * t.x;
+	float c01 = c001 + (c101 - c001) * t.x, c11 = c011 + (c111 - c011) * t.x;
+	float c0 = c00 + (c10 - c00) * t.y, c1 = c01 + (c11 - c01) * t.y;
+	float scale = header_.band / 32767;
+	if (gradient) {
+		float gx0 = (c100 - c000) + ((c110 - c010) - (c100 - c000)) * t.y;
+		float gx1 = (c101 - c001) + ((c111 - c011) - (c101 - c001)) * t.y;
+		gradient->x = gx0 + (gx1 - gx0) * t.z;
+		gradient->y = (c10 - c00) + ((c11 - c01) - (c10 - c00)) * t.z;
+		gradient->z = c1 - c0;
+		*gradient *= scale / header_.cell_size;
+	}
+	return (c0 + (c1 - c0) * t.z) * scale;
+}
+
+float SignedDistanceField::Distance(const glm::vec3 &position) const {
+	return Lookup(position, nullptr);
+}
+
+float SignedDistanceField::Distance(const glm::vec3 &position, glm::vec3 &gradient) const {
+	return Lookup(position, &gradient);
+}
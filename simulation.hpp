@@ -0,0 +1,281 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+
+#include "model.hpp"
+#include "camera.hpp"
+#include "car.hpp"
+#include "height_field.hpp"
+#include "triangle_bvh.hpp"
+#include "collision_world.hpp"
+#include "signed_distance_field.hpp"
+#include "nav_mesh.hpp"
+#include "path_service.hpp"
+#include "traffic.hpp"
+#include "crowd.hpp"
+
+// what the player holds down during a step
+struct Controls {
+	bool front, back, left, right;
+};
+
+// What a frame draws, copied out between steps, so that a renderer on
+// another thread never reads the simulation itself. It holds the last two
+// steps and when the last one was due, and the renderer blends them by its
+// own clock. Pedestrians are only those near the camera.
+struct FrameState {
+	// as of the last step; only its position moves between steps
+	Camera camera;
+	glm::vec3 previous_camera_position;
+	glm::mat4 previous_car, car;
+	// the previous_ vectors list the same entities in the same order
+	std::vector<glm::mat4> previous_traffic, traffic, previous_pedestrians, pedestrians;
+	// in steady clock seconds, and the length of a step
+	double time, step;
+
+	// still, at the camera, until the first Capture
+	explicit FrameState(const Camera &camera);
+};
+
+FrameState::FrameState(const Camera &camera):
+	camera(camera),
+	previous_camera_position(camera.position()),
+	previous_car(1),
+	car(1),
+	time(0),
+	step(0) {
+}
+
+// of two matrices a step apart, which differ by a small turn at most, so
+// that blending them entry by entry stays close to rigid
+inline glm::mat4 Blend(const glm::mat4 &previous, const glm::mat4 &current, float blend) {
+	return previous * (1 - blend) + current * blend;
+}
+
+// Everything baked from the world model that the simulation reads and never
+// changes: ground, triangles, the world's collision, distance field and
+// navigation grid. The last two are cached at cache_prefix plus .sdf and
+// .nav, and baked when the cache is missing.
+class City {
+public:
+	City() = delete;
+	City(const Model &world_model, const std::string &cache_prefix);
+	virtual ~City();
+
+	// of the world model, into the frame everything else lives in
+	static glm::mat4 WorldMatrix();
+
+	const Model &world_model() const;
+	const HeightField &ground() const;
+	const TriangleBvh &scene() const;
+	const StaticCollision &collision() const;
+	const SignedDistanceField &sdf() const;
+	const NavMesh &nav_mesh() const;
+
+private:
+	const Model &world_model_;
+	HeightField *ground_ptr_;
+	TriangleBvh *scene_ptr_;
+	StaticCollision *collision_ptr_;
+	SignedDistanceField *sdf_ptr_;
+	NavMesh *nav_ptr_;
+};
+
+// The player's car with its camera, the traffic around it and the crowd
+// with the path service its errands ask, stepped at whatever rate the
+// caller likes. Nothing here needs a GL context: rendering reads the state
+// between steps, and a headless run steps it as fast as it can.
+class Simulation {
+public:
+	Simulation() = delete;
+	Simulation(const City &city, const Model &car_model, const glm::vec3 &car_position, uint32_t traffic_count = 256,
+	           uint32_t crowd_count = 50000);
+	virtual ~Simulation();
+
+	void Step(float time, const Controls &controls);
+	// the last two steps, but time and step; frame's vectors keep their
+	// capacity. Leaves the car and its camera as of the last step.
+	void Capture(FrameState &frame, float crowd_draw_distance);
+
+	Camera &camera();
+	Car &car();
+	const CollisionWorld &collision_world() const;
+	const Traffic &traffic() const;
+	const Crowd &crowd() const;
+	PathService &paths();
+	const City &city() const;
+
+private:
+	const City &city_;
+	Camera *camera_ptr_;
+	Car *car_ptr_;
+	CollisionWorld *collision_world_ptr_;
+	uint32_t car_body_;
+	Traffic *traffic_ptr_;
+	uint32_t player_entity_;
+	PathService *paths_ptr_;
+	Crowd *crowd_ptr_;
+};
+
+City::City(const Model &world_model, const std::string &cache_prefix):
+	world_model_(world_model) {
+	ground_ptr_ = new HeightField();
+	ground_ptr_->Bake(world_model_, WorldMatrix());
+	scene_ptr_ = new TriangleBvh();
+	scene_ptr_->Build(world_model_, WorldMatrix());
+	collision_ptr_ = new StaticCollision(world_model_, WorldMatrix());
+	// mapped straight from the cache, baked on the first run and again
+	// whenever the world no longer matches it
+	uint64_t key = world_model_.Key(WorldMatrix());
+	sdf_ptr_ = new SignedDistanceField();
+	if (!sdf_ptr_->Load(cache_prefix + ".sdf", key)) {
+		sdf_ptr_->Bake(world_model_, WorldMatrix());
+		sdf_ptr_->Save(cache_prefix + ".sdf");
+	}
+	nav_ptr_ = new NavMesh();
+	if (!nav_ptr_->Load(cache_prefix + ".nav", key)) {
+		nav_ptr_->Bake(world_model_, WorldMatrix());
+		nav_ptr_->Save(cache_prefix + ".nav");
+	}
+}
+
+City::~City() {
+	delete ground_ptr_;
+	delete scene_ptr_;
+	delete collision_ptr_;
+	delete sdf_ptr_;
+	delete nav_ptr_;
+}
+
+glm::mat4 City::WorldMatrix() {
+	using namespace glm;
+	return scale(mat4(1), vec3(50, 50, 50)) * rotate(mat4(1), (float)M_PI / 2, vec3(1, 0, 0));
+}
+
+const Model &City::world_model() const {
+	return world_model_;
+}
+
+const HeightField &City::ground() const {
+	return *ground_ptr_;
+}
+
+const TriangleBvh &City::scene() const {
+	return *scene_ptr_;
+}
+
+const StaticCollision &City::collision() const {
+	return *collision_ptr_;
+}
+
+const SignedDistanceField &City::sdf() const {
+	return *sdf_ptr_;
+}
+
+const NavMesh &City::nav_mesh() const {
+	return *nav_ptr_;
+}
+
+Simulation::Simulation(const City &city, const Model &car_model, const glm::vec3 &car_position, uint32_t traffic_count,
+                       uint32_t crowd_count):
+	city_(city) {
+	camera_ptr_ = new Camera(glm::vec3(0, 0, 3), 0, 0, 1);
+	car_ptr_ = new Car(car_model, *camera_ptr_, car_position);
+	car_ptr_->set_ground(&city_.ground());
+	car_ptr_->set_scene(&city_.scene());
+	collision_world_ptr_ = new CollisionWorld(city_.collision());
+	car_body_ = collision_world_ptr_->AddBody(car_model, car_ptr_->model_matrix());
+	car_ptr_->set_collision(collision_world_ptr_, car_body_);
+	traffic_ptr_ = new Traffic(city_.ground());
+	player_entity_ = traffic_ptr_->AddPlayer();
+	traffic_ptr_->Spawn(traffic_count, Car::DrivableRegions(), Car::DrivableFrame());
+	paths_ptr_ = new PathService(city_.nav_mesh());
+	crowd_ptr_ = new Crowd(city_.nav_mesh());
+	crowd_ptr_->set_paths(paths_ptr_);
+	crowd_ptr_->Spawn(crowd_count);
+}
+
+Simulation::~Simulation() {
+	delete crowd_ptr_;
+	delete paths_ptr_;
+	delete traffic_ptr_;
+	delete car_ptr_;
+	delete collision_world_ptr_;
+	delete camera_ptr_;
+}
+
+void Simulation::Step(float time, const Controls &controls) {
+	car_ptr_->SaveState();
+	if (controls.front)
+		car_ptr_->Move(MoveDirectionType::FRONT, time);
+	if (controls.back)
+		car_ptr_->Move(MoveDirectionType::BACK, time);
+	if (controls.left)
+		car_ptr_->Move(MoveDirectionType::LEFT, time);
+	if (controls.right)
+		car_ptr_->Move(MoveDirectionType::RIGHT, time);
+	car_ptr_->Update(time);
+	traffic_ptr_->SetPlayer(player_entity_, car_ptr_->position(), car_ptr_->alpha());
+	traffic_ptr_->Update(time);
+	crowd_ptr_->Update(time);
+
+	collision_world_ptr_->MoveBody(car_body_, car_ptr_->model_matrix());
+	if (collision_world_ptr_->Conflict(car_body_))
+		car_ptr_->Depenetrate(collision_world_ptr_->contacts());
+}
+
+void Simulation::Capture(FrameState &frame, float crowd_draw_distance) {
+	car_ptr_->Interpolate(0);
+	frame.previous_camera_position = camera_ptr_->position();
+	frame.previous_car = car_ptr_->render_matrix();
+	car_ptr_->Interpolate(1);
+	frame.camera = *camera_ptr_;
+	frame.car = car_ptr_->render_matrix();
+	frame.previous_traffic.clear();
+	traffic_ptr_->ForEachMatrix(0, [&frame](const glm::mat4 &matrix) {
+		frame.previous_traffic.push_back(matrix);
+	});
+	frame.traffic.clear();
+	traffic_ptr_->ForEachMatrix(1, [&frame](const glm::mat4 &matrix) {
+		frame.traffic.push_back(matrix);
+	});
+	frame.previous_pedestrians.clear();
+	frame.pedestrians.clear();
+	crowd_ptr_->ForEachMatrix(camera_ptr_->position(), crowd_draw_distance, [&frame](const glm::mat4 &previous, const glm::mat4 &current) {
+		frame.previous_pedestrians.push_back(previous);
+		frame.pedestrians.push_back(current);
+	});
+}
+
+Camera &Simulation::camera() {
+	return *camera_ptr_;
+}
+
+Car &Simulation::car() {
+	return *car_ptr_;
+}
+
+const CollisionWorld &Simulation::collision_world() const {
+	return *collision_world_ptr_;
+}
+
+const Traffic &Simulation::traffic() const {
+	return *traffic_ptr_;
+}
+
+const Crowd &Simulation::crowd() const {
+	return *crowd_ptr_;
+}
+
+PathService &Simulation::paths() {
+	return *paths_ptr_;
+}
+
+const City &Simulation::city() const {
+	return city_;
+}
@@ -11,6 +11,8 @@ class Skybox {
 public:
 	Skybox() = delete;
 	Skybox(const std::vector<std::string> &urls, const Shader &shader, const Camera &camera);
+	// a cube map already loaded, see LoadCubeMapAsync
+	Skybox(uint32_t texture, const Shader &shader, const Camera &camera);
 	void Draw() const;
 
 private:
@@ -20,10 +22,13 @@ private:
 	uint32_t texture_, vao, vbo;
 };
 
-Skybox::Skybox(const std::vector<std::string> &urls, const Shader &shader, const Camera &camera): 
+Skybox::Skybox(const std::vector<std::string> &urls, const Shader &shader, const Camera &camera):
+	Skybox(LoadCubeMap(urls), shader, camera) {}
+
+Skybox::Skybox(uint32_t texture, const Shader &shader, const Camera &camera):
     shader_(shader),
     camera_(camera) {
-	texture_ = LoadCubeMap(urls);
+	texture_ = texture;
 	glGenVertexArrays(1, &vao);
 	glGenBuffers(1, &vbo);
 
@@ -0,0 +1,344 @@
+#pragma once
+
+#include <vector>
+#include <chrono>
+#include <random>
+#include <algorithm>
+#include <cstdint>
+#include <cmath>
+
+#include <glm/glm.hpp>
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <xmmintrin.h>
+#endif
+
+#include "aabb.hpp"
+#include "box_store.hpp"
+#include "height_field.hpp"
+#include "car.hpp"
+#include "job_system.hpp"
+
+struct TrafficStats {
+	uint32_t vehicles, braking, turning;
+	double update_ms;
+};
+
+// Vehicles as entities in structure of arrays, padded to whole blocks of
+// kLanes. AI vehicles cruise along their heading, brake for anything in
+// their lane ahead and turn where the road ends; the player is an entity
+// too, placed by SetPlayer, so traffic stops for it. Every update senses
+// from the positions at its start, through a spatial hash, and integrates
+// into the current ones, so chunks of vehicles run as separate jobs
+// without locks.
+class Traffic {
+public:
+	static const uint32_t kLanes = 8;
+
+	Traffic() = delete;
+	explicit Traffic(const HeightField &ground);
+
+	// count AI vehicles at random spots of the regions, along their axes
+	void Spawn(uint32_t count, const std::vector<AABB> &regions, const glm::mat4 &region_frame, uint32_t seed = 1);
+	uint32_t AddPlayer();
+	void SetPlayer(uint32_t entity, const glm::vec3 &position, double alpha);
+	void Update(float time);
+
+	uint32_t size() const;
+	const TrafficStats &stats() const;
+	// visit(matrix) of every AI vehicle, blended between the last two updates
+	template <typename Visitor> void ForEachMatrix(float blend, Visitor visit) const;
+	// visit(entity) for every entity within radius, at most the hash cell size
+	template <typename Visitor> void Neighbors(const glm::vec3 &position, float radius, Visitor visit) const;
+
+private:
+	typedef std::vector<float, AlignedAllocator<float, 32> > Lane;
+	enum Flag : uint8_t {
+		kActive = 1,
+		kPlayer = 2,
+		kBraking = 4,
+		kTurning = 8
+	};
+
+	static constexpr float kCellSize = 0.5f;
+	static constexpr float kLookAhead = 0.4f;
+	static constexpr float kLaneWidth = 0.12f;
+	static constexpr float kCruiseSpeed = 0.6f;
+	static constexpr float kAcceleration = 0.8f;
+	static constexpr float kDeceleration = 3.0f;
+	static constexpr float kStep = 0.05f;
+	static const uint32_t kChunk = 256;
+
+	const HeightField &ground_;
+	// heading is kept as a unit vector, integration needs no trigonometry
+	Lane x_, y_, z_, dir_x_, dir_y_, speed_;
+	// positions at the start of the last update
+	Lane previous_x_, previous_y_, previous_z_;
+	std::vector<uint8_t> flags_;
+	uint32_t size_;
+	// entities sorted by hashed cell with their positions, so a cell is read
+	// in one go; cell_start_ has one extra entry
+	struct HashEntry {
+		float x, y, z;
+		uint32_t entity;
+	};
+	// cell_fill_ is scratch of the rebuild, kept so that a step allocates nothing
+	std::vector<uint32_t> cell_start_, entity_cell_, cell_fill_;
+	std::vector<HashEntry> cell_entities_;
+	uint32_t cell_mask_;
+	TrafficStats stats_;
+
+	uint32_t Allocate();
+	uint32_t Cell(float x, float y) const;
+	void BuildHash();
+	void Sense(uint32_t begin, uint32_t end, float time);
+	void Integrate(uint32_t begin, uint32_t end, float time);
+	// visit(entry) for the hash entries within radius
+	template <typename Visitor> void NearEntries(const glm::vec3 &position, float radius, Visitor visit) const;
+};
+
+constexpr float Traffic::kCellSize;
+constexpr float Traffic::kLookAhead;
+constexpr float Traffic::kLaneWidth;
+constexpr float Traffic::kCruiseSpeed;
+constexpr float Traffic::kAcceleration;
+constexpr float Traffic::kDeceleration;
+constexpr float Traffic::kStep;
+
+Traffic::Traffic(const HeightField &ground):
+	ground_(ground),
+	size_(0),
+	cell_mask_(0),
+	stats_() {
+}
+
+uint32_t Traffic::size() const {
+	return size_;
+}
+
+const TrafficStats &Traffic::stats() const {
+	return stats_;
+}
+
+uint32_t Traffic::Allocate() {
+	if (size_ % kLanes == 0) {
+		// a new block of parked, inactive padding
+		uint32_t padded = size_ + kLanes;
+		for (Lane *lane : { &x_, &y_, &z_, &dir_x_, &dir_y_, &speed_, &previous_x_, &previous_y_, &previous_z_ })
+			lane->resize(padded, 0);
+		flags_.resize(padded, 0);
+	}
+	return size_++;
+}
+
+uint32_t Traffic::AddPlayer() {
+	uint32_t entity = Allocate();
+	flags_[entity] = kActive | kPlayer;
+	dir_x_[entity] = 1;
+	return entity;
+}
+
+void Traffic::SetPlayer(uint32_t entity, const glm::vec3 &position, double alpha) {
+	x_[entity] = previous_x_[entity] = position.x;
+	y_[entity] = previous_y_[entity] = position.y;
+	z_[entity] = previous_z_[entity] = position.z;
+	dir_x_[entity] = std::cos(alpha);
+	dir_y_[entity] = std::sin(alpha);
+}
+
+void Traffic::Spawn(uint32_t count, const std::vector<AABB> &regions, const glm::mat4 &region_frame, uint32_t seed) {
+	using namespace glm;
+	if (regions.empty()) return;
+	mat4 region_to_world = inverse(region_frame);
+	std::mt19937 random(seed);
+	std::uniform_real_distribution<float> unit(0, 1);
+	// roads run along the axes of the region frame
+	vec3 axes[4] = {
+		normalize(vec3(region_to_world * vec4(1, 0, 0, 0))),
+		normalize(vec3(region_to_world * vec4(0, 1, 0, 0))),
+		normalize(vec3(region_to_world * vec4(-1, 0, 0, 0))),
+		normalize(vec3(region_to_world * vec4(0, -1, 0, 0)))
+	};
+	for (uint32_t i = 0, attempts = 0; i < count && attempts < count * 8; attempts++) {
+		const AABB &region = regions[random() % regions.size()];
+		vec3 p = region.small + (region.big - region.small) * vec3(unit(random), unit(random), 1);
+		p = vec3(region_to_world * vec4(p, 1));
+		float height;
+		if (!ground_.Query(p, kStep, height)) continue;
+		uint32_t entity = Allocate();
+		const vec3 &axis = axes[random() % 4];
+		x_[entity] = previous_x_[entity] = p.x;
+		y_[entity] = previous_y_[entity] = p.y;
+		z_[entity] = previous_z_[entity] = height;
+		dir_x_[entity] = axis.x;
+		dir_y_[entity] = axis.y;
+		speed_[entity] = kCruiseSpeed * unit(random);
+		flags_[entity] = kActive;
+		i++;
+	}
+}
+
+uint32_t Traffic::Cell(float x, float y) const {
+	int32_t cx = (int32_t)std::floor(x / kCellSize), cy = (int32_t)std::floor(y / kCellSize);
+	return ((uint32_t)cx * 73856093u ^ (uint32_t)cy * 19349663u) & cell_mask_;
+}
+
+void Traffic::BuildHash() {
+	// counting sort of the entities by cell
+	uint32_t cells = 1;
+	while (cells < 2 * size_) cells <<= 1;
+	cell_mask_ = cells - 1;
+	cell_start_.assign(cells + 1, 0);
+	entity_cell_.resize(size_);
+	for (uint32_t i = 0; i < size_; i++) {
+		if (!(flags_[i] & kActive)) continue;
+		entity_cell_[i] = Cell(previous_x_[i], previous_y_[i]);
+		cell_start_[entity_cell_[i] + 1]++;
+	}
+	for (uint32_t c = 0; c < cells; c++)
+		cell_start_[c + 1] += cell_start_[c];
+	cell_entities_.resize(cell_start_[cells]);
+	cell_fill_.assign(cell_start_.begin(), cell_start_.end() - 1);
+	for (uint32_t i = 0; i < size_; i++) {
+		if (!(flags_[i] & kActive)) continue;
+		HashEntry entry = { previous_x_[i], previous_y_[i], previous_z_[i], i };
+		cell_entities_[cell_fill_[entity_cell_[i]]++] = entry;
+	}
+}
+
+template <typename Visitor>
+void Traffic::Neighbors(const glm::vec3 &position, float radius, Visitor visit) const {
+	NearEntries(position, radius, [&visit](const HashEntry &entry) {
+		visit(entry.entity);
+	});
+}
+
+template <typename Visitor>
+void Traffic::NearEntries(const glm::vec3 &position, float radius, Visitor visit) const {
+	if (cell_entities_.empty()) return;
+	float radius2 = radius * radius;
+	int32_t cx = (int32_t)std::floor(position.x / kCellSize), cy = (int32_t)std::floor(position.y / kCellSize);
+	uint32_t visited[9], count = 0;
+	for (int32_t y = cy - 1; y <= cy + 1; y++) {
+		for (int32_t x = cx - 1; x <= cx + 1; x++) {
+			uint32_t cell = ((uint32_t)x * 73856093u ^ (uint32_t)y * 19349663u) & cell_mask_;
+			// two of the nine cells may share a slot
+			if (std::find(visited, visited + count, cell) != visited + count) continue;
+			visited[count++] = cell;
+			for (uint32_t k = cell_start_[cell]; k < cell_start_[cell + 1]; k++) {
+				const HashEntry &entry = cell_entities_[k];
+				// and so may far away cells
+				float dx = entry.x - position.x, dy = entry.y - position.y, dz = entry.z - position.z;
+				if (dx * dx + dy * dy + dz * dz <= radius2) visit(entry);
+			}
+		}
+	}
+}
+
+void Traffic::Sense(uint32_t begin, uint32_t end, float time) {
+	using namespace glm;
+	for (uint32_t i = begin; i < end; i++) {
+		uint8_t flags = flags_[i];
+		if (!(flags & kActive) || (flags & kPlayer)) continue;
+		vec3 p(previous_x_[i], previous_y_[i], previous_z_[i]);
+		vec2 dir(dir_x_[i], dir_y_[i]);
+		flags &= ~(kBraking | kTurning);
+
+		bool blocked = false;
+		NearEntries(p, kLookAhead, [&](const HashEntry &entry) {
+			if (entry.entity == i || blocked) return;
+			vec2 d(entry.x - p.x, entry.y - p.y);
+			float along = dot(d, dir), across = std::fabs(d.x * dir.y - d.y * dir.x);
+			if (along > 0 && across < kLaneWidth) blocked = true;
+		});
+		float height;
+		vec3 ahead = p + vec3(dir * kLookAhead, 0);
+		if (!ground_.Query(ahead, kStep, height) || std::fabs(height - p.z) > kStep) {
+			// end of the road, turn a quarter, left or right by entity
+			dir = (i & 1) ? vec2(-dir.y, dir.x) : vec2(dir.y, -dir.x);
+			dir_x_[i] = dir.x;
+			dir_y_[i] = dir.y;
+			flags |= kTurning;
+			blocked = true;
+		}
+
+		float target = blocked ? 0 : kCruiseSpeed;
+		float change = std::max(-kDeceleration * time, std::min(target - speed_[i], kAcceleration * time));
+		speed_[i] += change;
+		if (change < 0) flags |= kBraking;
+		flags_[i] = flags;
+	}
+}
+
+void Traffic::Integrate(uint32_t begin, uint32_t end, float time) {
+	// begin and end are whole blocks; padding and the player have no speed
+#if defined(__AVX__)
+	__m256 dt = _mm256_set1_ps(time);
+	for (uint32_t i = begin; i < end; i += 8) {
+		__m256 step = _mm256_mul_ps(_mm256_load_ps(&speed_[i]), dt);
+		_mm256_store_ps(&x_[i], _mm256_add_ps(_mm256_load_ps(&previous_x_[i]), _mm256_mul_ps(_mm256_load_ps(&dir_x_[i]), step)));
+		_mm256_store_ps(&y_[i], _mm256_add_ps(_mm256_load_ps(&previous_y_[i]), _mm256_mul_ps(_mm256_load_ps(&dir_y_[i]), step)));
+	}
+#elif defined(__SSE2__)
+	__m128 dt = _mm_set1_ps(time);
+	for (uint32_t i = begin; i < end; i += 4) {
+		__m128 step = _mm_mul_ps(_mm_load_ps(&speed_[i]), dt);
+		_mm_store_ps(&x_[i], _mm_add_ps(_mm_load_ps(&previous_x_[i]), _mm_mul_ps(_mm_load_ps(&dir_x_[i]), step)));
+		_mm_store_ps(&y_[i], _mm_add_ps(_mm_load_ps(&previous_y_[i]), _mm_mul_ps(_mm_load_ps(&dir_y_[i]), step)));
+	}
+#else
+	for (uint32_t i = begin; i < end; i++) {
+		x_[i] = previous_x_[i] + dir_x_[i] * speed_[i] * time;
+		y_[i] = previous_y_[i] + dir_y_[i] * speed_[i] * time;
+	}
+#endif
+	// then onto the ground, which has no vector form
+	for (uint32_t i = begin; i < end; i++) {
+		if ((flags_[i] & (kActive | kPlayer)) != kActive) continue;
+		float height;
+		if (ground_.Query(glm::vec3(x_[i], y_[i], previous_z_[i]), kStep, height))
+			z_[i] = height;
+	}
+}
+
+void Traffic::Update(float time) {
+	auto start = std::chrono::steady_clock::now();
+	uint32_t padded = x_.size();
+	std::copy(x_.begin(), x_.end(), previous_x_.begin());
+	std::copy(y_.begin(), y_.end(), previous_y_.begin());
+	std::copy(z_.begin(), z_.end(), previous_z_.begin());
+	BuildHash();
+
+	// chunks are whole blocks, handed out as jobs
+	uint32_t chunks = (padded + kChunk - 1) / kChunk;
+	JobSystem::Shared().ParallelFor(chunks, 1, [&](uint32_t first, uint32_t last) {
+		for (uint32_t c = first; c < last; c++) {
+			uint32_t begin = c * kChunk, end = std::min(begin + kChunk, padded);
+			Sense(begin, end, time);
+			Integrate(begin, end, time);
+		}
+	});
+
+	stats_ = TrafficStats();
+	for (uint32_t i = 0; i < size_; i++) {
+		if ((flags_[i] & (kActive | kPlayer)) != kActive) continue;
+		stats_.vehicles++;
+		stats_.braking += (flags_[i] & kBraking) != 0;
+		stats_.turning += (flags_[i] & kTurning) != 0;
+	}
+	std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+	stats_.update_ms = elapsed.count();
+}
+
+template <typename Visitor>
+void Traffic::ForEachMatrix(float blend, Visitor visit) const {
+	for (uint32_t i = 0; i < size_; i++) {
+		if ((flags_[i] & (kActive | kPlayer)) != kActive) continue;
+		glm::vec3 position(previous_x_[i] + (x_[i] - previous_x_[i]) * blend,
+		                   previous_y_[i] + (y_[i] - previous_y_[i]) * blend,
+		                   previous_z_[i] + (z_[i] - previous_z_[i]) * blend);
+		visit(Car::Matrix(position, std::atan2(dir_y_[i], dir_x_[i])));
+	}
+}
@@ -0,0 +1,652 @@
+#pragma once
+
+#include <vector>
+#include <chrono>
+#include <random>
+#include <limits>
+#include <algorithm>
+#include <cstdint>
+#include <cmath>
+
+#ifdef DEBUG
+#include <iostream>
+#endif
+
+#include <glm/glm.hpp>
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <xmmintrin.h>
+#endif
+
+#include "aabb.hpp"
+#include "bvh.hpp"
+#include "model.hpp"
+
+struct RayHit {
+	bool hit;
+	// distance along the direction, in units of its length
+	float t;
+	uint32_t mesh, triangle;
+	// geometric normal, facing against the query
+	glm::vec3 normal;
+};
+
+// Triangle level BVH of a static model for ray and shape queries. The tree is
+// built by Bvh (binned SAH, split into jobs) and flattened depth first
+// into 32 byte nodes: the left child of an interior node is the next node,
+// so only the right child is stored. Leaf triangles are copied in leaf order.
+class TriangleBvh {
+public:
+	static const uint32_t kPacketSize = 8;
+
+	TriangleBvh();
+	void Build(const Model &model, const glm::mat4 &model_matrix);
+	bool empty() const;
+	uint32_t size() const;
+
+	// closest hit of origin + t * direction, t in [0, t_max]
+	bool Raycast(const glm::vec3 &origin, const glm::vec3 &direction, float t_max, RayHit &hit) const;
+	// any hit, for line of sight
+	bool Occluded(const glm::vec3 &origin, const glm::vec3 &direction, float t_max) const;
+	// count rays at once, traversed kPacketSize at a time with SIMD box tests
+	void RaycastPacket(const glm::vec3 *origins, const glm::vec3 *directions, uint32_t count, float t_max, RayHit *hits) const;
+	// first contact of a sphere of radius moving from center along direction
+	bool SphereCast(const glm::vec3 &center, float radius, const glm::vec3 &direction, float t_max, RayHit &hit) const;
+	// distance to the closest triangle, false when none is within max_distance
+	bool Nearest(const glm::vec3 &position, float max_distance, float &distance) const;
+	// number of triangles the segment passes through, for inside tests
+	uint32_t Crossings(const glm::vec3 &origin, const glm::vec3 &direction, float t_max) const;
+
+private:
+	struct Node {
+		glm::vec3 small;
+		// interior: the right child, leaf: the first triangle
+		uint32_t right_or_first;
+		glm::vec3 big;
+		// 0 for interior nodes
+		uint32_t count;
+	};
+	static_assert(sizeof(Node) == 32, "bvh nodes should stay at half a cache line");
+
+	struct Triangle {
+		glm::vec3 v0, e1, e2;
+		uint32_t mesh, index;
+	};
+
+	struct Packet {
+		alignas(32) float origin[3][kPacketSize];
+		alignas(32) float inv_direction[3][kPacketSize];
+		alignas(32) float t_max[kPacketSize];
+	};
+
+	std::vector<Node> nodes_;
+	std::vector<Triangle> triangles_;
+
+	uint32_t Flatten(const Bvh &bvh, const std::vector<Triangle> &triangles, uint32_t node);
+	static bool RayHitsBox(const Node &node, const glm::vec3 &origin, const glm::vec3 &inv_direction, float t_max, float &t_enter);
+	static bool IntersectTriangle(const Triangle &triangle, const glm::vec3 &origin, const glm::vec3 &direction, float t_max, float &t);
+	static glm::vec3 ClosestPoint(const Triangle &triangle, const glm::vec3 &position);
+	static float BoxDistance2(const Node &node, const glm::vec3 &position);
+	static bool SweepTriangle(const Triangle &triangle, const glm::vec3 &center, float radius, const glm::vec3 &direction, float t_max, float &t, glm::vec3 &normal);
+	uint32_t PacketHitsBox(const Node &node, const Packet &packet) const;
+	void TracePacket(const glm::vec3 *origins, const glm::vec3 *directions, uint32_t count, float t_max, RayHit *hits) const;
+};
+
+const uint32_t TriangleBvh::kPacketSize;
+
+#ifdef DEBUG
+// rays per second of the query kinds from origin into random directions
+void BenchmarkRaycasts(const TriangleBvh &bvh, const glm::vec3 &origin);
+#endif
+
+TriangleBvh::TriangleBvh() {
+}
+
+bool TriangleBvh::empty() const {
+	return nodes_.empty();
+}
+
+uint32_t TriangleBvh::size() const {
+	return triangles_.size();
+}
+
+void TriangleBvh::Build(const Model &model, const glm::mat4 &model_matrix) {
+	using namespace glm;
+	auto start = std::chrono::steady_clock::now();
+	std::vector<Triangle> triangles;
+	std::vector<AABB> boxes;
+	const std::vector<Mesh> &meshes = model.meshes();
+	for (uint32_t m = 0; m < meshes.size(); m++) {
+		const std::vector<Vertex> &vertices = meshes[m].GetVertices();
+		const std::vector<uint32_t> &indices = meshes[m].GetIndices();
+		for (uint32_t i = 0; i + 2 < indices.size(); i += 3) {
+			vec3 a = vec3(model_matrix * vec4(vertices[indices[i]].position, 1));
+			vec3 b = vec3(model_matrix * vec4(vertices[indices[i + 1]].position, 1));
+			vec3 c = vec3(model_matrix * vec4(vertices[indices[i + 2]].position, 1));
+			Triangle triangle = { a, b - a, c - a, m, i / 3 };
+			triangles.push_back(triangle);
+			AABB box(a, a);
+			box.Merge(b);
+			box.Merge(c);
+			boxes.push_back(box);
+		}
+	}
+
+	Bvh bvh;
+	bvh.Build(boxes);
+	nodes_.clear();
+	triangles_.clear();
+	if (!bvh.empty()) {
+		nodes_.reserve(bvh.nodes().size());
+		triangles_.reserve(triangles.size());
+		Flatten(bvh, triangles, 0);
+	}
+#ifdef DEBUG
+	std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+	std::cout << "[raycast] bvh over " << triangles_.size() << " triangles, " << nodes_.size()
+	          << " nodes built in " << elapsed.count() << " ms" << std::endl;
+#else
+	(void)start;
+#endif
+}
+
+uint32_t TriangleBvh::Flatten(const Bvh &bvh, const std::vector<Triangle> &triangles, uint32_t node) {
+	const Bvh::Node &source = bvh.nodes()[node];
+	uint32_t index = nodes_.size();
+	nodes_.push_back(Node());
+	nodes_[index].small = source.box.small;
+	nodes_[index].big = source.box.big;
+	if (source.count > 0) {
+		nodes_[index].right_or_first = triangles_.size();
+		nodes_[index].count = source.count;
+		for (uint32_t i = 0; i < source.count; i++)
+			triangles_.push_back(triangles[bvh.indices()[source.first + i]]);
+		return index;
+	}
+	Flatten(bvh, triangles, source.left);
+	uint32_t right = Flatten(bvh, triangles, source.right);
+	nodes_[index].right_or_first = right;
+	nodes_[index].count = 0;
+	return index;
+}
+
+bool TriangleBvh::RayHitsBox(const Node &node, const glm::vec3 &origin, const glm::vec3 &inv_direction, float t_max, float &t_enter) {
+	float t0 = 0, t1 = t_max;
+	for (int i = 0; i < 3; i++) {
+		float t_near = (node.small[i] - origin[i]) * inv_direction[i];
+		float t_far = (node.big[i] - origin[i]) * inv_direction[i];
+		if (t_near > t_far) std::swap(t_near, t_far);
+		t0 = t_near > t0 ? t_near : t0;
+		t1 = t_far < t1 ? t_far : t1;
+		if (t0 > t1) return false;
+	}
+	t_enter = t0;
+	return true;
+}
+
+bool TriangleBvh::IntersectTriangle(const Triangle &triangle, const glm::vec3 &origin, const glm::vec3 &direction, float t_max, float &t) {
+	// Moller-Trumbore
+	using namespace glm;
+	vec3 p = cross(direction, triangle.e2);
+	float det = dot(triangle.e1, p);
+	if (std::fabs(det) < 1e-12f) return false;
+	float inv = 1.0f / det;
+	vec3 s = origin - triangle.v0;
+	float u = dot(s, p) * inv;
+	if (u < 0 || u > 1) return false;
+	vec3 q = cross(s, triangle.e1);
+	float v = dot(direction, q) * inv;
+	if (v < 0 || u + v > 1) return false;
+	float d = dot(triangle.e2, q) * inv;
+	if (d < 0 || d > t_max) return false;
+	t = d;
+	return true;
+}
+
+bool TriangleBvh::Raycast(const glm::vec3 &origin, const glm::vec3 &direction, float t_max, RayHit &hit) const {
+	using namespace glm;
+	hit.hit = false;
+	hit.t = t_max;
+	if (nodes_.empty()) return false;
+	vec3 inv_direction(1.0f / direction.x, 1.0f / direction.y, 1.0f / direction.z);
+	uint32_t stack[64], closest = 0;
+	int top = 0;
+	stack[top++] = 0;
+	float t_enter;
+	while (top > 0) {
+		uint32_t index = stack[--top];
+		const Node &node = nodes_[index];
+		if (!RayHitsBox(node, origin, inv_direction, hit.t, t_enter)) continue;
+		if (node.count > 0) {
+			for (uint32_t i = node.right_or_first; i < node.right_or_first + node.count; i++) {
+				float t;
+				if (IntersectTriangle(triangles_[i], origin, direction, hit.t, t)) {
+					hit.hit = true;
+					hit.t = t;
+					closest = i;
+				}
+			}
+			continue;
+		}
+		// nearer child on top, the far one is usually pruned by then
+		uint32_t left = index + 1, right = node.right_or_first;
+		float t_left, t_right;
+		bool hit_left = RayHitsBox(nodes_[left], origin, inv_direction, hit.t, t_left);
+		bool hit_right = RayHitsBox(nodes_[right], origin, inv_direction, hit.t, t_right);
+		if (hit_left && hit_right) {
+			stack[top++] = t_left <= t_right ? right : left;
+			stack[top++] = t_left <= t_right ? left : right;
+		} else if (hit_left) {
+			stack[top++] = left;
+		} else if (hit_right) {
+			stack[top++] = right;
+		}
+	}
+	if (hit.hit) {
+		const Triangle &triangle = triangles_[closest];
+		hit.mesh = triangle.mesh;
+		hit.triangle = triangle.index;
+		hit.normal = normalize(cross(triangle.e1, triangle.e2));
+		if (dot(hit.normal, direction) > 0) hit.normal = -hit.normal;
+	}
+	return hit.hit;
+}
+
+bool TriangleBvh::Occluded(const glm::vec3 &origin, const glm::vec3 &direction, float t_max) const {
+	using namespace glm;
+	if (nodes_.empty()) return false;
+	vec3 inv_direction(1.0f / direction.x, 1.0f / direction.y, 1.0f / direction.z);
+	uint32_t stack[64];
+	int top = 0;
+	stack[top++] = 0;
+	float t_enter, t;
+	while (top > 0) {
+		uint32_t index = stack[--top];
+		const Node &node = nodes_[index];
+		if (!RayHitsBox(node, origin, inv_direction, t_max, t_enter)) continue;
+		if (node.count > 0) {
+			for (uint32_t i = node.right_or_first; i < node.right_or_first + node.count; i++)
+				if (IntersectTriangle(triangles_[i], origin, direction, t_max, t)) return true;
+			continue;
+		}
+		stack[top++] = node.right_or_first;
+		stack[top++] = index + 1;
+	}
+	return false;
+}
+
+uint32_t TriangleBvh::PacketHitsBox(const Node &node, const Packet &packet) const {
+#if defined(__AVX__)
+	__m256 t0 = _mm256_setzero_ps(), t1 = _mm256_load_ps(packet.t_max);
+	for (int axis = 0; axis < 3; axis++) {
+		__m256 origin = _mm256_load_ps(packet.origin[axis]), inv = _mm256_load_ps(packet.inv_direction[axis]);
+		__m256 lo = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(node.small[axis]), origin), inv);
+		__m256 hi = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(node.big[axis]), origin), inv);
+		t0 = _mm256_max_ps(t0, _mm256_min_ps(lo, hi));
+		t1 = _mm256_min_ps(t1, _mm256_max_ps(lo, hi));
+	}
+	return _mm256_movemask_ps(_mm256_cmp_ps(t0, t1, _CMP_LE_OQ));
+#elif defined(__SSE2__)
+	uint32_t mask = 0;
+	for (uint32_t half = 0; half < kPacketSize; half += 4) {
+		__m128 t0 = _mm_setzero_ps(), t1 = _mm_load_ps(packet.t_max + half);
+		for (int axis = 0; axis < 3; axis++) {
+			__m128 origin = _mm_load_ps(packet.origin[axis] + half), inv = _mm_load_ps(packet.inv_direction[axis] + half);
+			__m128 lo = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.small[axis]), origin), inv);
+			__m128 hi = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.big[axis]), origin), inv);
+			t0 = _mm_max_ps(t0, _mm_min_ps(lo, hi));
+			t1 = _mm_min_ps(t1, _mm_max_ps(lo, hi));
+		}
+		mask |= _mm_movemask_ps(_mm_cmple_ps(t0, t1)) << half;
+	}
+	return mask;
+#else
+	uint32_t mask = 0;
+	for (uint32_t lane = 0; lane < kPacketSize; lane++) {
+		float t0 = 0, t1 = packet.t_max[lane];
+		for (int axis = 0; axis < 3; axis++) {
+			float lo = (node.small[axis] - packet.origin[axis][lane]) * packet.inv_direction[axis][lane];
+			float hi = (node.big[axis] - packet.origin[axis][lane]) * packet.inv_direction[axis][lane];
+			t0 = std::max(t0, std::min(lo, hi));
+			t1 = std::min(t1, std::max(lo, hi));
+		}
+		if (t0 <= t1) mask |= 1u << lane;
+	}
+	return mask;
+#endif
+}
+
+void TriangleBvh::TracePacket(const glm::vec3 *origins, const glm::vec3 *directions, uint32_t count, float t_max, RayHit *hits) const {
+	using namespace glm;
+	Packet packet;
+	uint32_t closest[kPacketSize];
+	for (uint32_t lane = 0; lane < kPacketSize; lane++) {
+		bool used = lane < count;
+		for (int axis = 0; axis < 3; axis++) {
+			packet.origin[axis][lane] = used ? origins[lane][axis] : 0;
+			packet.inv_direction[axis][lane] = used ? 1.0f / directions[lane][axis] : 1;
+		}
+		// unused lanes can never enter a box
+		packet.t_max[lane] = used ? t_max : -1;
+		if (used) {
+			hits[lane].hit = false;
+			hits[lane].t = t_max;
+		}
+	}
+
+	uint32_t stack[64];
+	int top = 0;
+	stack[top++] = 0;
+	while (top > 0) {
+		uint32_t index = stack[--top];
+		const Node &node = nodes_[index];
+		uint32_t mask = PacketHitsBox(node, packet);
+		if (!mask) continue;
+		if (node.count == 0) {
+			stack[top++] = node.right_or_first;
+			stack[top++] = index + 1;
+			continue;
+		}
+		for (uint32_t lane = 0; lane < count; lane++) {
+			if (!(mask >> lane & 1)) continue;
+			for (uint32_t i = node.right_or_first; i < node.right_or_first + node.count; i++) {
+				float t;
+				if (IntersectTriangle(triangles_[i], origins[lane], directions[lane], packet.t_max[lane], t)) {
+					packet.t_max[lane] = t;
+					hits[lane].hit = true;
+					hits[lane].t = t;
+					closest[lane] = i;
+				}
+			}
+		}
+	}
+
+	for (uint32_t lane = 0; lane < count; lane++) {
+		if (!hits[lane].hit) continue;
+		const Triangle &triangle = triangles_[closest[lane]];
+		hits[lane].mesh = triangle.mesh;
+		hits[lane].triangle = triangle.index;
+		hits[lane].normal = normalize(cross(triangle.e1, triangle.e2));
+		if (dot(hits[lane].normal, directions[lane]) > 0) hits[lane].normal = -hits[lane].normal;
+	}
+}
+
+void TriangleBvh::RaycastPacket(const glm::vec3 *origins, const glm::vec3 *directions, uint32_t count, float t_max, RayHit *hits) const {
+	for (uint32_t first = 0; first < count; first += kPacketSize) {
+		uint32_t n = std::min(kPacketSize, count - first);
+		if (nodes_.empty()) {
+			for (uint32_t i = 0; i < n; i++) {
+				hits[first + i].hit = false;
+				hits[first + i].t = t_max;
+			}
+			continue;
+		}
+		TracePacket(origins + first, directions + first, n, t_max, hits + first);
+	}
+}
+
+bool TriangleBvh::SweepTriangle(const Triangle &triangle, const glm::vec3 &center, float radius, const glm::vec3 &direction, float t_max, float &t, glm::vec3 &normal) {
+	using namespace glm;
+	vec3 n = cross(triangle.e1, triangle.e2);
+	float len = length(n);
+	if (len < 1e-12f) return false;
+	n /= len;
+
+	float best = t_max;
+	bool found = false;
+	// first the face: when the sphere reaches the plane inside the triangle
+	// nothing on the border can be hit earlier
+	float distance = dot(n, center - triangle.v0);
+	float side = distance >= 0 ? 1.0f : -1.0f;
+	float speed = dot(n, direction) * side;
+	float t_plane = -1;
+	if (std::fabs(distance) <= radius)
+		t_plane = 0;
+	else if (speed < 0)
+		t_plane = (std::fabs(distance) - radius) / -speed;
+	if (t_plane >= 0 && t_plane <= best) {
+		vec3 p = center + direction * t_plane - n * (side * radius);
+		// barycentric inside test
+		vec3 w = p - triangle.v0;
+		float d00 = dot(triangle.e1, triangle.e1), d01 = dot(triangle.e1, triangle.e2), d11 = dot(triangle.e2, triangle.e2);
+		float d20 = dot(w, triangle.e1), d21 = dot(w, triangle.e2);
+		float denominator = d00 * d11 - d01 * d01;
+		float v = (d11 * d20 - d01 * d21) / denominator;
+		float u = (d00 * d21 - d01 * d20) / denominator;
+		if (v >= 0 && u >= 0 && u + v <= 1) {
+			t = t_plane;
+			normal = n * side;
+			return true;
+		}
+	} else if (speed >= 0 && std::fabs(distance) > radius) {
+		// moving away from the plane and not touching it
+		return false;
+	}
+
+	// then the corners, as ray against sphere
+	float a = dot(direction, direction);
+	if (a < 1e-20f) return false;
+	vec3 corners[3] = { triangle.v0, triangle.v0 + triangle.e1, triangle.v0 + triangle.e2 };
+	vec3 contact;
+	for (int i = 0; i < 3; i++) {
+		vec3 m = center - corners[i];
+		float b = dot(direction, m), c = dot(m, m) - radius * radius;
+		float root;
+		if (c <= 0) {
+			root = 0;
+		} else {
+			float discriminant = b * b - a * c;
+			if (b >= 0 || discriminant < 0) continue;
+			root = (-b - std::sqrt(discriminant)) / a;
+		}
+		if (root <= best) {
+			best = root;
+			contact = corners[i];
+			found = true;
+		}
+	}
+
+	// and the edges, as ray against an infinite cylinder clipped to the edge
+	for (int i = 0; i < 3; i++) {
+		vec3 p = corners[i], e = corners[(i + 1) % 3] - p;
+		vec3 m = center - p;
+		float ee = dot(e, e), ed = dot(e, direction), em = dot(e, m);
+		float qa = ee * a - ed * ed;
+		float qb = ee * dot(direction, m) - ed * em;
+		float qc = ee * (dot(m, m) - radius * radius) - em * em;
+		if (std::fabs(qa) < 1e-20f) continue;
+		float root;
+		if (qc <= 0) {
+			root = 0;
+		} else {
+			float discriminant = qb * qb - qa * qc;
+			if (qb >= 0 || discriminant < 0) continue;
+			root = (-qb - std::sqrt(discriminant)) / qa;
+		}
+		float f = (em + ed * root) / ee;
+		if (f < 0 || f > 1 || root > best) continue;
+		best = root;
+		contact = p + e * f;
+		found = true;
+	}
+	if (!found) return false;
+	t = best;
+	normal = center + direction * t - contact;
+	float normal_length = length(normal);
+	normal = normal_length > 1e-12f ? normal / normal_length : -normalize(direction);
+	return true;
+}
+
+bool TriangleBvh::SphereCast(const glm::vec3 &center, float radius, const glm::vec3 &direction, float t_max, RayHit &hit) const {
+	using namespace glm;
+	hit.hit = false;
+	hit.t = t_max;
+	if (nodes_.empty()) return false;
+	vec3 inv_direction(1.0f / direction.x, 1.0f / direction.y, 1.0f / direction.z);
+	uint32_t stack[64], closest = 0;
+	int top = 0;
+	stack[top++] = 0;
+	float t_enter;
+	while (top > 0) {
+		uint32_t index = stack[--top];
+		// the center against the box grown by the radius
+		Node node = nodes_[index];
+		node.small -= vec3(radius);
+		node.big += vec3(radius);
+		if (!RayHitsBox(node, center, inv_direction, hit.t, t_enter)) continue;
+		if (node.count == 0) {
+			stack[top++] = node.right_or_first;
+			stack[top++] = index + 1;
+			continue;
+		}
+		for (uint32_t i = node.right_or_first; i < node.right_or_first + node.count; i++) {
+			float t;
+			vec3 normal;
+			if (SweepTriangle(triangles_[i], center, radius, direction, hit.t, t, normal)) {
+				hit.hit = true;
+				hit.t = t;
+				hit.normal = normal;
+				closest = i;
+			}
+		}
+	}
+	if (hit.hit) {
+		hit.mesh = triangles_[closest].mesh;
+		hit.triangle = triangles_[closest].index;
+	}
+	return hit.hit;
+}
+
+glm::vec3 TriangleBvh::ClosestPoint(const Triangle &triangle, const glm::vec3 &position) {
+	// by the voronoi regions of the corners, edges and face
+	using namespace glm;
+	const vec3 &a = triangle.v0, &ab = triangle.e1, &ac = triangle.e2;
+	vec3 ap = position - a;
+	float d1 = dot(ab, ap), d2 = dot(ac, ap);
+	if (d1 <= 0 && d2 <= 0) return a;
+	vec3 b = a + ab, bp = position - b;
+	float d3 = dot(ab, bp), d4 = dot(ac, bp);
+	if (d3 >= 0 && d4 <= d3) return b;
+	float vc = d1 * d4 - d3 * d2;
+	if (vc <= 0 && d1 >= 0 && d3 <= 0) return a + ab * (d1 / (d1 - d3));
+	vec3 c = a + ac, cp = position - c;
+	float d5 = dot(ab, cp), d6 = dot(ac, cp);
+	if (d6 >= 0 && d5 <= d6) return c;
+	float vb = d5 * d2 - d1 * d6;
+	if (vb <= 0 && d2 >= 0 && d6 <= 0) return a + ac * (d2 / (d2 - d6));
+	float va = d3 * d6 - d5 * d4;
+	if (va <= 0 && d4 - d3 >= 0 && d5 - d6 >= 0) return b + (c - b) * ((d4 - d3) / ((d4 - d3) + (d5 - d6)));
+	float denominator = 1 / (va + vb + vc);
+	return a + ab * (vb * denominator) + ac * (vc * denominator);
+}
+
+float TriangleBvh::BoxDistance2(const Node &node, const glm::vec3 &position) {
+	glm::vec3 d = glm::max(glm::max(node.small - position, position - node.big), glm::vec3(0));
+	return glm::dot(d, d);
+}
+
+bool TriangleBvh::Nearest(const glm::vec3 &position, float max_distance, float &distance) const {
+	using namespace glm;
+	if (nodes_.empty()) return false;
+	float best = max_distance * max_distance;
+	bool found = false;
+	uint32_t stack[64];
+	int top = 0;
+	stack[top++] = 0;
+	while (top > 0) {
+		uint32_t index = stack[--top];
+		const Node &node = nodes_[index];
+		if (BoxDistance2(node, position) > best) continue;
+		if (node.count > 0) {
+			for (uint32_t i = node.right_or_first; i < node.right_or_first + node.count; i++) {
+				vec3 d = position - ClosestPoint(triangles_[i], position);
+				if (dot(d, d) <= best) {
+					best = dot(d, d);
+					found = true;
+				}
+			}
+			continue;
+		}
+		// nearer child on top so that best shrinks early
+		uint32_t left = index + 1, right = node.right_or_first;
+		bool left_first = BoxDistance2(nodes_[left], position) <= BoxDistance2(nodes_[right], position);
+		stack[top++] = left_first ? right : left;
+		stack[top++] = left_first ? left : right;
+	}
+	if (found) distance = std::sqrt(best);
+	return found;
+}
+
+uint32_t TriangleBvh::Crossings(const glm::vec3 &origin, const glm::vec3 &direction, float t_max) const {
+	using namespace glm;
+	if (nodes_.empty()) return 0;
+	vec3 inv_direction(1.0f / direction.x, 1.0f / direction.y, 1.0f / direction.z);
+	uint32_t stack[64], crossings = 0;
+	int top = 0;
+	stack[top++] = 0;
+	float t_enter, t;
+	while (top > 0) {
+		uint32_t index = stack[--top];
+		const Node &node = nodes_[index];
+		if (!RayHitsBox(node, origin, inv_direction, t_max, t_enter)) continue;
+		if (node.count > 0) {
+			for (uint32_t i = node.right_or_first; i < node.right_or_first + node.count; i++)
+				crossings += IntersectTriangle(triangles_[i], origin, direction, t_max, t);
+			continue;
+		}
+		stack[top++] = node.right_or_first;
+		stack[top++] = index + 1;
+	}
+	return crossings;
+}
+
+#ifdef DEBUG
+void BenchmarkRaycasts(const TriangleBvh &bvh, const glm::vec3 &origin) {
+	using namespace glm;
+	using namespace std::chrono;
+	const uint32_t kRays = 1 << 16;
+	const float kDistance = 50;
+	std::mt19937 random(7);
+	std::normal_distribution<float> gaussian(0, 1);
+	std::vector<vec3> origins(kRays, origin), directions(kRays);
+	for (vec3 &direction : directions)
+		direction = normalize(vec3(gaussian(random), gaussian(random), gaussian(random)) + vec3(0, 0, 1e-4f));
+	std::vector<RayHit> hits(kRays);
+
+	auto report = [](const char *name, steady_clock::time_point start, uint32_t hit_count) {
+		duration<double> elapsed = steady_clock::now() - start;
+		std::cout << "[raycast] " << name << ": " << (uint64_t)(kRays / elapsed.count()) << " rays/s, "
+		          << hit_count << " of " << kRays << " hit" << std::endl;
+	};
+	uint32_t hit_count = 0;
+	auto start = steady_clock::now();
+	for (uint32_t i = 0; i < kRays; i++)
+		hit_count += bvh.Raycast(origins[i], directions[i], kDistance, hits[i]);
+	report("closest", start, hit_count);
+
+	hit_count = 0;
+	start = steady_clock::now();
+	for (uint32_t i = 0; i < kRays; i++)
+		hit_count += bvh.Occluded(origins[i], directions[i], kDistance);
+	report("occluded", start, hit_count);
+
+	// coherent packets: neighbouring rays in the same direction cone
+	std::sort(directions.begin(), directions.end(), [](const vec3 &a, const vec3 &b) {
+		return std::atan2(a.y, a.x) < std::atan2(b.y, b.x);
+	});
+	hit_count = 0;
+	start = steady_clock::now();
+	bvh.RaycastPacket(origins.data(), directions.data(), kRays, kDistance, hits.data());
+	for (const RayHit &hit : hits)
+		hit_count += hit.hit;
+	report("packet", start, hit_count);
+
+	hit_count = 0;
+	start = steady_clock::now();
+	for (uint32_t i = 0; i < kRays; i++)
+		hit_count += bvh.SphereCast(origins[i], 0.05f, directions[i], kDistance, hits[i]);
+	report("sphere", start, hit_count);
+}
+#endif
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <vector>
+#include <atomic>
+#include <cstdint>
+
+// Hands whole states from one writer thread to one reader thread without
+// either waiting. The writer fills back() and publishes it by swapping it
+// with the middle slot; the reader swaps the middle slot for front() when it
+// holds something newer. The reader always gets the latest complete state,
+// and states it was too slow for are skipped.
+template <typename T>
+class TripleBuffer {
+public:
+	TripleBuffer() = delete;
+	TripleBuffer(const TripleBuffer &) = delete;
+	// every slot starts as initial
+	explicit TripleBuffer(const T &initial);
+
+	// the writer's
+	T &back();
+	void Publish();
+	// the reader's; false when nothing was published since the last call,
+	// and front() stays what it was
+	bool Acquire();
+	const T &front() const;
+
+private:
+	// set in middle_ when it holds a state the reader has not taken
+	static const uint8_t kFresh = 4;
+
+	std::vector<T> slots_;
+	std::atomic<uint8_t> middle_;
+	uint8_t back_, front_;
+};
+
+template <typename T>
+TripleBuffer<T>::TripleBuffer(const T &initial):
+	slots_(3, initial),
+	middle_(1),
+	back_(0),
+	front_(2) {}
+
+template <typename T>
+T &TripleBuffer<T>::back() {
+	return slots_[back_];
+}
+
+template <typename T>
+void TripleBuffer<T>::Publish() {
+	back_ = middle_.exchange(back_ | kFresh, std::memory_order_acq_rel) & ~kFresh;
+}
+
+template <typename T>
+bool TripleBuffer<T>::Acquire() {
+	if (!(middle_.load(std::memory_order_relaxed) & kFresh)) return false;
+	front_ = middle_.exchange(front_, std::memory_order_acq_rel) & ~kFresh;
+	return true;
+}
+
+template <typename T>
+const T &TripleBuffer<T>::front() const {
+	return slots_[front_];
+}
@@ -0,0 +1,110 @@
+#pragma once
+
+#include <string>
+#include <cstdint>
+#include <cerrno>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "cg_exception.hpp"
+
+// IPv4 host and port, both in network order
+struct UdpAddress {
+	uint32_t host;
+	uint16_t port;
+
+	bool operator==(const UdpAddress &other) const;
+	// from a dotted address such as 127.0.0.1
+	static UdpAddress Make(const std::string &host, uint16_t port);
+};
+
+// A non-blocking IPv4 datagram socket. Receive returns straight away when
+// nothing is waiting, and Send drops what the kernel will not take, which is
+// what a lost datagram looks like anyway.
+class UdpSocket {
+public:
+	UdpSocket() = delete;
+	UdpSocket(const UdpSocket &) = delete;
+	// port 0 picks a free one
+	UdpSocket(const std::string &host, uint16_t port);
+	virtual ~UdpSocket();
+
+	const UdpAddress &address() const;
+	bool Send(const UdpAddress &to, const uint8_t *data, uint32_t size);
+	bool Receive(uint8_t *data, uint32_t capacity, uint32_t &size, UdpAddress &from);
+
+private:
+	int fd_;
+	UdpAddress address_;
+};
+
+bool UdpAddress::operator==(const UdpAddress &other) const {
+	return host == other.host && port == other.port;
+}
+
+UdpAddress UdpAddress::Make(const std::string &host, uint16_t port) {
+	UdpAddress address;
+	in_addr parsed;
+	if (inet_pton(AF_INET, host.c_str(), &parsed) != 1) {
+		errno = EINVAL;
+		throw SocketError("parse address " + host);
+	}
+	address.host = parsed.s_addr;
+	address.port = htons(port);
+	return address;
+}
+
+UdpSocket::UdpSocket(const std::string &host, uint16_t port) {
+	fd_ = socket(AF_INET, SOCK_DGRAM, 0);
+	if (fd_ < 0) throw SocketError("open a socket");
+
+	sockaddr_in bound = {};
+	bound.sin_family = AF_INET;
+	bound.sin_addr.s_addr = UdpAddress::Make(host, port).host;
+	bound.sin_port = htons(port);
+	// a server sends a snapshot to every client in one burst per tick
+	int buffer = 1 << 20;
+	setsockopt(fd_, SOL_SOCKET, SO_SNDBUF, &buffer, sizeof(buffer));
+	setsockopt(fd_, SOL_SOCKET, SO_RCVBUF, &buffer, sizeof(buffer));
+	if (bind(fd_, (const sockaddr *)&bound, sizeof(bound)) != 0 ||
+	    fcntl(fd_, F_SETFL, fcntl(fd_, F_GETFL) | O_NONBLOCK) != 0) {
+		close(fd_);
+		throw SocketError("bind " + host + ":" + std::to_string(port));
+	}
+
+	socklen_t length = sizeof(bound);
+	getsockname(fd_, (sockaddr *)&bound, &length);
+	address_.host = bound.sin_addr.s_addr;
+	address_.port = bound.sin_port;
+}
+
+UdpSocket::~UdpSocket() {
+	close(fd_);
+}
+
+const UdpAddress &UdpSocket::address() const {
+	return address_;
+}
+
+bool UdpSocket::Send(const UdpAddress &to, const uint8_t *data, uint32_t size) {
+	sockaddr_in target = {};
+	target.sin_family = AF_INET;
+	target.sin_addr.s_addr = to.host;
+	target.sin_port = to.port;
+	return sendto(fd_, data, size, 0, (const sockaddr *)&target, sizeof(target)) == (ssize_t)size;
+}
+
+bool UdpSocket::Receive(uint8_t *data, uint32_t capacity, uint32_t &size, UdpAddress &from) {
+	sockaddr_in source;
+	socklen_t length = sizeof(source);
+	ssize_t received = recvfrom(fd_, data, capacity, 0, (sockaddr *)&source, &length);
+	if (received < 0) return false;
+	size = received;
+	from.host = source.sin_addr.s_addr;
+	from.port = source.sin_port;
+	return true;
+}
@@ -1,34 +1,78 @@
 #pragma once
 
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+
 #include "model.hpp"
 #include "camera.hpp"
 #include "shader.hpp"
+#include "frustum.hpp"
+#include "mesh_culler.hpp"
+#include "occlusion_culler.hpp"
+#include "draw_list.hpp"
+#include "simulation.hpp"
 
 class World {
 public:
 	World() = delete;
-	World(const Model &model, const Shader &shader, const Camera &camera);
-	void Draw() const;
+	World(const Model &model, const Shader &shader, const Shader &proxy_shader, const Camera &camera);
+	// transient data of the frame goes to arena
+	void Draw(FrameArena &arena);
 	glm::mat4 model_matrix() const;
+	const CullingStats &culling_stats() const;
+	const OcclusionStats &occlusion_stats() const;
+	const DrawStats &draw_stats() const;
+	void set_pvs(const Pvs *pvs);
 
 private:
+	// sort keys put meshes this far apart in distance into separate steps
+	static constexpr float kDepthStep = 0.5f;
+
 	const Model &model_;
 	const Shader &shader_;
 	const Camera &camera_;
+	MeshCuller culler_;
+	OcclusionCuller occlusion_culler_;
+	const Pvs *pvs_;
+	DrawProgram program_;
+	DrawRecorder recorder_;
+	// visible meshes in replay order, and where each one's item is
+	std::vector<uint32_t> order_, slots_;
 };
 
 glm::mat4 World::model_matrix() const {
-	using namespace glm;
-	return scale(mat4(1), vec3(50, 50, 50)) * rotate(mat4(1), (float)M_PI / 2, vec3(1, 0, 0));
+	return City::WorldMatrix();
 }
 
-World::World(const Model &model, const Shader &shader, const Camera &camera):
+World::World(const Model &model, const Shader &shader, const Shader &proxy_shader, const Camera &camera):
 	model_(model),
 	shader_(shader),
-	camera_(camera) {
+	camera_(camera),
+	culler_(model, model_matrix()),
+	occlusion_culler_(culler_.boxes(), proxy_shader),
+	pvs_(nullptr),
+	program_(shader),
+	slots_(model.meshes().size()) {
+}
+
+void World::set_pvs(const Pvs *pvs) {
+	pvs_ = pvs;
+}
+
+const CullingStats &World::culling_stats() const {
+	return culler_.stats();
 }
 
-void World::Draw() const {
+const OcclusionStats &World::occlusion_stats() const {
+	return occlusion_culler_.stats();
+}
+
+const DrawStats &World::draw_stats() const {
+	return recorder_.stats();
+}
+
+void World::Draw(FrameArena &arena) {
 	using namespace glm;
 	shader_.Use();
 	shader_.SetUniform<mat4>("model", model_matrix());
@@ -40,5 +84,41 @@ void World::Draw() const {
 	shader_.SetUniform<vec3>("light.specular", vec3(1, 1, 1));
 	shader_.SetUniform<vec3>("view_position", camera_.position());
 	shader_.SetUniform<float>("material.shininess", 32);
-	model_.Draw(shader_);	
+	culler_.Cull(Frustum(camera_), pvs_ ? pvs_->Lookup(camera_.position()) : nullptr);
+
+	// recorded on the workers a part of the visible meshes each; keys order
+	// them front to back in coarse steps, and by program and textures within
+	// a step so that replay binds less
+	const std::vector<uint32_t> &visible = culler_.visible();
+	const std::vector<Mesh> &meshes = model_.meshes();
+	const std::vector<AABB> &boxes = culler_.boxes();
+	const DrawProgram &program = program_;
+	vec3 eye = camera_.position();
+	recorder_.Record(visible.size(), arena, [&](DrawItem *items, uint32_t begin, uint32_t end) {
+		for (uint32_t i = begin; i < end; i++) {
+			uint32_t mesh = visible[i];
+			DrawItem &item = items[i - begin];
+			item = program.Record(meshes[mesh], mesh);
+			float step = std::min(distance(boxes[mesh].Center(), eye) / kDepthStep, 65535.0f);
+			item.key |= (uint64_t)step << 48;
+		}
+		return end - begin;
+	});
+	const std::vector<DrawItem> &items = recorder_.items();
+	order_.clear();
+	for (uint32_t i = 0; i < items.size(); i++) {
+		order_.push_back(items[i].object);
+		slots_[items[i].object] = i;
+	}
+
+	// the proxies the culler draws in between leave textures alone and
+	// restore the program, so only other code since the last frame matters
+	recorder_.Invalidate();
+	DrawRecorder &recorder = recorder_;
+	const std::vector<uint32_t> &slots = slots_;
+	occlusion_culler_.Render(order_, camera_, shader_, [&recorder, &items, &slots](uint32_t mesh) {
+		recorder.Replay(items[slots[mesh]]);
+	});
+	// replay leaves the last vertex array bound
+	glBindVertexArray(0);
 }
\ No newline at end of file